@@ -50,6 +50,7 @@ Copyright (C) 1985-1986, 1988, 1993-1995, 1997-2022 Free Software
 #include TERM_HEADER
 #endif /* HAVE_WINDOW_SYSTEM */
 
+#include <count-one-bits.h>
 #include <flexmember.h>
 #include <verify.h>
 #include <execinfo.h>           /* For backtrace.  */
@@ -84,6 +85,17 @@ Copyright (C) 1985-1986, 1988, 1993-1995, 1997-2022 Free Software
 # define GC_CHECK_MARKED_OBJECTS 1
 #endif
 
+/* GC_PARALLEL_MARK means that several threads can mark the heap at
+   once, see gc-mark-threads.  Only the main thread does the sanity
+   checks of GC_CHECK_MARKED_OBJECTS, so that turns it off.  */
+
+#if (defined HAVE_PTHREAD && !defined WINDOWSNT && !GC_CHECK_MARKED_OBJECTS \
+     && (defined __GNUC__ || defined __clang__))
+# define GC_PARALLEL_MARK true
+#else
+# define GC_PARALLEL_MARK false
+#endif
+
 /* GC_MALLOC_CHECK defined means perform validity checks of malloc'd
    memory.  Can do this only if using gmalloc.c and if not checking
    marked objects.  */
@@ -434,6 +446,18 @@ no_sanitize_memcpy (void *dest, void const *src, size_t size)
 static void unchain_finalizer (struct Lisp_Finalizer *);
 static void mark_terminals (void);
 static void gc_sweep (void);
+static void finish_lazy_sweep (void);
+static void garbage_collect_1 (bool);
+#ifdef HAVE_GC_NURSERY
+static void sweep_conses (void);
+static void sweep_floats (void);
+#endif
+#if defined HAVE_GC_NURSERY || defined HAVE_GC_INCREMENTAL
+static void unmark_conses_and_floats (void);
+#endif
+#ifdef HAVE_GC_INCREMENTAL
+static bool sweep_lazily_step (void);
+#endif
 static Lisp_Object make_pure_vector (ptrdiff_t);
 static void mark_buffer (struct buffer *);
 
@@ -2569,6 +2593,14 @@ #define XFLOAT_UNMARK(fptr) \
 
 static struct Lisp_Float *float_free_list;
 
+/* The float blocks not swept yet since the last GC run from
+   *float_sweep_prev to the end of the chain, or there are none if
+   this is NULL.  Blocks allocated since then go in before them.  */
+
+static struct float_block **float_sweep_prev;
+
+static void sweep_some_floats (void);
+
 /* Return a new float object with value FLOAT_VALUE.  */
 
 Lisp_Object
@@ -2578,6 +2610,8 @@ make_float (double float_value)
 
   MALLOC_BLOCK_INPUT;
 
+  if (!float_free_list)
+    sweep_some_floats ();
   if (float_free_list)
     {
       XSETFLOAT (val, float_free_list);
@@ -2665,11 +2699,328 @@ #define XUNMARK_CONS(fptr) \
 
 static struct Lisp_Cons *cons_free_list;
 
+/* The cons blocks not swept yet since the last GC, like
+   float_sweep_prev.  */
+
+static struct cons_block **cons_sweep_prev;
+
+static void sweep_some_conses (void);
+
+#ifdef HAVE_GC_NURSERY
+
+/* The generational collector.  Conses and floats are young until
+   they survive a collection, and then old: a collection leaves them
+   marked, and only a full one clears their mark bits before marking.
+   A minor collection marks the young conses and floats still in use
+   and frees the others, without looking into the old ones.
+
+   Every other object counts as old, and a minor collection scans
+   all of them for references to young objects, as nothing records
+   which of them changed.  It does not scan the old conses; instead,
+   XSETCAR and XSETCDR remember those made to refer to a cons or
+   float, which may be young.  */
+
+/* True during a minor collection.  */
+static bool minor_gc;
+
+/* Number of minor collections since the last full one, and bytes of
+   conses and floats they made old.  */
+static EMACS_INT minor_gcs_since_full;
+static EMACS_INT promoted_since_full;
+
+/* Return true if the cons PTR is old.  */
+
+static bool
+old_cons_p (struct Lisp_Cons *ptr)
+{
+  return (pdumper_object_p (ptr)
+	  || (!PURE_P (ptr) && XCONS_MARKED_P (ptr)));
+}
+
+#else
+
+enum { minor_gc = false };
+
+#endif /* HAVE_GC_NURSERY */
+
+#ifdef HAVE_GC_INCREMENTAL
+
+/* The incremental collector.  Once consing reaches the threshold,
+   maybe_gc does not collect garbage all at once, but marks the heap
+   a slice of gc-incremental-slice seconds at a time.  It spaces the
+   slices so that marking is done by the time another
+   gc-cons-threshold bytes have been consed, and read_char runs more
+   of them while Emacs waits for input.  A final pause then marks
+   what Lisp code changed in the meantime, and sweeps as usual.
+
+   Marking is tri-color: white objects are not marked yet, grey ones
+   are marked or on the mark stack but their contents may not be
+   marked, and black ones are marked along with their contents.  When
+   marking is over no black object may refer to a white one, which
+   Lisp code running between slices can break.  The final pause
+   repairs that:
+
+   - Conses keep their mark bits between slices, and XSETCAR and
+     XSETCDR remember the marked conses they change, whose contents
+     are then marked again.
+
+   - Other objects are stored into through too many raw paths in C
+     to have a write barrier.  Slices mark vectors, strings and
+     symbols in a hash set rather than in the objects, where the mark
+     bits of vectors and strings are part of their size, and the
+     final pause marks all of them again.  Roots other than
+     staticpro'd variables, such as the stacks, are only marked then,
+     and so are intervals, face caches, glyph matrices and the
+     contents of weak hash tables.
+
+   So the final pause saves the marking of the conses and floats over
+   a full collection, and not much more.
+
+   Objects allocated during marking are white, and survive if the
+   final pause finds them in use.  */
+
+/* True from the first slice that marks to the final pause.  */
+bool gc_incremental_marking;
+
+/* True if an incremental collection has begun, but its slices are
+   still sweeping the conses and floats left from the last one.  */
+static bool incremental_sweeping;
+
+/* True during a slice.  */
+static bool incremental_slice;
+
+/* The vectors, strings and symbols marked in slices, as a hash set
+   with open addressing like remembered_conses, except that empty
+   slots hold a fixnum.  */
+static Lisp_Object *incremental_marks;
+static ptrdiff_t incremental_marks_count, incremental_marks_size;
+
+/* True if an object could not be added to incremental_marks for lack
+   of memory.  The collection is then abandoned, and a full one takes
+   its place.  */
+static bool incremental_marks_lost;
+
+/* When the current slice is to end.  */
+static struct timespec incremental_deadline;
+
+/* Number of values popped from the mark stack in slices so far.  */
+static intmax_t incremental_work;
+
+/* Return true if the current slice is over.  This is called for each
+   value popped from the mark stack, and only looks at the clock every
+   so often.  */
+
+static bool
+incremental_slice_over (void)
+{
+  if (incremental_marks_lost)
+    return true;
+  if (++incremental_work % 1024 != 0)
+    return false;
+  return timespec_cmp (incremental_deadline, current_timespec ()) <= 0;
+}
+
+/* Add OBJ to the hash set of SIZE slots SET, which must have room for
+   it, and return true, or return false if it is already there.  */
+
+static bool
+incremental_marks_add (Lisp_Object *set, ptrdiff_t size, Lisp_Object obj)
+{
+  ptrdiff_t i = ((EMACS_UINT) XLI (obj) / GCALIGNMENT) & (size - 1);
+  for (; !FIXNUMP (set[i]); i = (i + 1) & (size - 1))
+    if (EQ (set[i], obj))
+      return false;
+  set[i] = obj;
+  return true;
+}
+
+static bool
+incremental_marked_p (Lisp_Object obj)
+{
+  if (incremental_marks_count == 0)
+    return false;
+  ptrdiff_t size = incremental_marks_size;
+  ptrdiff_t i = ((EMACS_UINT) XLI (obj) / GCALIGNMENT) & (size - 1);
+  for (; !FIXNUMP (incremental_marks[i]); i = (i + 1) & (size - 1))
+    if (EQ (incremental_marks[i], obj))
+      return true;
+  return false;
+}
+
+/* Make incremental_marks twice as large.  Return false if out of
+   memory.  */
+
+static bool
+grow_incremental_marks (void)
+{
+  ptrdiff_t size = incremental_marks_size ? 2 * incremental_marks_size : 4096;
+  Lisp_Object *set = (size <= PTRDIFF_MAX / sizeof *set
+		      ? malloc (size * sizeof *set) : NULL);
+  if (set == NULL)
+    return false;
+  for (ptrdiff_t i = 0; i < size; i++)
+    set[i] = make_fixnum (0);
+  for (ptrdiff_t i = 0; i < incremental_marks_size; i++)
+    if (!FIXNUMP (incremental_marks[i]))
+      incremental_marks_add (set, size, incremental_marks[i]);
+  free (incremental_marks);
+  incremental_marks = set;
+  incremental_marks_size = size;
+  return true;
+}
+
+static void
+set_incremental_marked (Lisp_Object obj)
+{
+  if (incremental_marks_lost)
+    return;
+  if (2 * (incremental_marks_count + 1) > incremental_marks_size
+      && !grow_incremental_marks ())
+    {
+      incremental_marks_lost = true;
+      return;
+    }
+  if (incremental_marks_add (incremental_marks, incremental_marks_size, obj))
+    incremental_marks_count++;
+}
+
+#else
+
+enum { gc_incremental_marking = false, incremental_slice = false };
+
+static bool
+incremental_marked_p (Lisp_Object obj)
+{
+  return false;
+}
+
+static void
+set_incremental_marked (Lisp_Object obj)
+{
+}
+
+#endif /* HAVE_GC_INCREMENTAL */
+
+#if defined HAVE_GC_NURSERY || defined HAVE_GC_INCREMENTAL
+
+/* The conses that XSETCAR and XSETCDR changed and that the next
+   collection must look into: the old ones changed since the last
+   collection in a generational one, or the marked ones changed since
+   marking began in an incremental one.  This is a hash set with open
+   addressing of REMEMBERED_CONSES_SIZE slots, a power of 2 or 0, of
+   which REMEMBERED_CONSES_COUNT are used.  */
+static struct Lisp_Cons **remembered_conses;
+static ptrdiff_t remembered_conses_count, remembered_conses_size;
+
+/* True if a cons could not be remembered for lack of memory, in which
+   case the next collection must be a full one.  */
+static bool remembered_conses_lost;
+
+/* Add PTR to the hash set of SIZE slots SET, which must have room for
+   it, and return true, or return false if it is already there.  */
+
+static bool
+remembered_conses_add (struct Lisp_Cons **set, ptrdiff_t size,
+		       struct Lisp_Cons *ptr)
+{
+  /* Conses are allocated next to one another, so their addresses
+     spread well enough over the slots as they are.  */
+  ptrdiff_t i = ((uintptr_t) ptr / sizeof *ptr) & (size - 1);
+  for (; set[i]; i = (i + 1) & (size - 1))
+    if (set[i] == ptr)
+      return false;
+  set[i] = ptr;
+  return true;
+}
+
+/* Make remembered_conses twice as large.  Return false if out of
+   memory.  */
+
+static bool
+grow_remembered_conses (void)
+{
+  ptrdiff_t size = remembered_conses_size ? 2 * remembered_conses_size : 1024;
+  struct Lisp_Cons **set = calloc (size, sizeof *set);
+  if (set == NULL)
+    return false;
+  for (ptrdiff_t i = 0; i < remembered_conses_size; i++)
+    if (remembered_conses[i])
+      remembered_conses_add (set, size, remembered_conses[i]);
+  free (remembered_conses);
+  remembered_conses = set;
+  remembered_conses_size = size;
+  return true;
+}
+
+/* Empty remembered_conses, keeping the room it took unless that was
+   a lot more than usual.  */
+
+static void
+clear_remembered_conses (void)
+{
+  if (remembered_conses_size > 4 * max (remembered_conses_count, 1024))
+    {
+      free (remembered_conses);
+      remembered_conses = NULL;
+      remembered_conses_size = 0;
+    }
+  else if (remembered_conses_count > 0)
+    memset (remembered_conses, 0,
+	    remembered_conses_size * sizeof *remembered_conses);
+  remembered_conses_count = 0;
+  remembered_conses_lost = false;
+}
+
+/* Remember the cons C, about to be changed, if the next collection
+   needs to look into it.  This is called from XSETCAR and XSETCDR,
+   and must not signal.  */
+
+void
+gc_remember_cons (Lisp_Object c)
+{
+  struct Lisp_Cons *ptr = XCONS (c);
+#ifdef HAVE_GC_NURSERY
+  if (remembered_conses_lost || !old_cons_p (ptr))
+    return;
+#else
+  if (remembered_conses_lost || PURE_P (ptr) || !cons_marked_p (ptr))
+    return;
+#endif
+  if (2 * (remembered_conses_count + 1) > remembered_conses_size
+      && !grow_remembered_conses ())
+    {
+      remembered_conses_lost = true;
+      return;
+    }
+  if (remembered_conses_add (remembered_conses, remembered_conses_size, ptr))
+    {
+      remembered_conses_count++;
+      /* Each entry takes up to two slots.  Counting them brings the
+	 next collection closer, which empties the set.  */
+      consing_until_gc -= 2 * sizeof *remembered_conses;
+    }
+}
+
+#endif /* HAVE_GC_NURSERY || HAVE_GC_INCREMENTAL */
+
 /* Explicitly free a cons cell by putting it on the free-list.  */
 
 void
 free_cons (struct Lisp_Cons *ptr)
 {
+#ifdef HAVE_GC_NURSERY
+  /* An old cons stays marked on the free list and would be allocated
+     as an old cons.  Unmarking it is no good either, as the lazy
+     sweep would then free it a second time if its block is not swept
+     yet.  Leave it to the next full collection.  */
+  if (old_cons_p (ptr))
+    return;
+#endif
+  /* During incremental marking, a marked cons would be reused without
+     the write barrier, and an unmarked one may still be on the mark
+     stack.  Leave it to the sweep.  */
+  if (gc_incremental_marking)
+    return;
   ptr->u.s.u.chain = cons_free_list;
   ptr->u.s.car = dead_object ();
   cons_free_list = ptr;
@@ -2685,6 +3036,8 @@ DEFUN ("cons", Fcons, Scons, 2, 2, 0,
 
   MALLOC_BLOCK_INPUT;
 
+  if (!cons_free_list)
+    sweep_some_conses ();
   if (cons_free_list)
     {
       XSETCONS (val, cons_free_list);
@@ -2707,9 +3060,12 @@ DEFUN ("cons", Fcons, Scons, 2, 2, 0,
 
   MALLOC_UNBLOCK_INPUT;
 
-  XSETCAR (val, car);
-  XSETCDR (val, cdr);
-  eassert (!XCONS_MARKED_P (XCONS (val)));
+  /* VAL is new, so there is no need for the write barrier of
+     XSETCAR and XSETCDR.  */
+  XCONS (val)->u.s.car = car;
+  XCONS (val)->u.s.u.cdr = cdr;
+  /* VAL may still be marked if free_cons freed it before its block
+     was swept; the sweep will unmark it.  */
   consing_until_gc -= sizeof (struct Lisp_Cons);
   cons_cells_consed++;
   return val;
@@ -3910,15 +4266,20 @@ vector_marked_p (const struct Lisp_Vector *v)
           eassert (PSEUDOVECTOR_TYPE (v) == PVEC_BOOL_VECTOR);
           return true;
         }
-      return pdumper_marked_p (v);
+      if (!incremental_slice)
+	return pdumper_marked_p (v);
     }
-  return XVECTOR_MARKED_P (v);
+  else if (!incremental_slice)
+    return XVECTOR_MARKED_P (v);
+  return incremental_marked_p (make_lisp_ptr ((void *) v, Lisp_Vectorlike));
 }
 
 static void
 set_vector_marked (struct Lisp_Vector *v)
 {
-  if (pdumper_object_p (v))
+  if (incremental_slice)
+    set_incremental_marked (make_lisp_ptr (v, Lisp_Vectorlike));
+  else if (pdumper_object_p (v))
     {
       eassert (PSEUDOVECTOR_TYPE (v) != PVEC_BOOL_VECTOR);
       pdumper_set_marked (v);
@@ -3959,6 +4320,8 @@ set_cons_marked (struct Lisp_Cons *c)
 static bool
 string_marked_p (const struct Lisp_String *s)
 {
+  if (incremental_slice)
+    return incremental_marked_p (make_lisp_ptr ((void *) s, Lisp_String));
   return pdumper_object_p (s)
     ? pdumper_marked_p (s)
     : XSTRING_MARKED_P (s);
@@ -3967,7 +4330,9 @@ string_marked_p (const struct Lisp_String *s)
 static void
 set_string_marked (struct Lisp_String *s)
 {
-  if (pdumper_object_p (s))
+  if (incremental_slice)
+    set_incremental_marked (make_lisp_ptr (s, Lisp_String));
+  else if (pdumper_object_p (s))
     pdumper_set_marked (s);
   else
     XMARK_STRING (s);
@@ -3976,6 +4341,8 @@ set_string_marked (struct Lisp_String *s)
 static bool
 symbol_marked_p (const struct Lisp_Symbol *s)
 {
+  if (incremental_slice)
+    return incremental_marked_p (make_lisp_symbol ((struct Lisp_Symbol *) s));
   return pdumper_object_p (s)
     ? pdumper_marked_p (s)
     : s->u.s.gcmarkbit;
@@ -3984,7 +4351,9 @@ symbol_marked_p (const struct Lisp_Symbol *s)
 static void
 set_symbol_marked (struct Lisp_Symbol *s)
 {
-  if (pdumper_object_p (s))
+  if (incremental_slice)
+    set_incremental_marked (make_lisp_symbol (s));
+  else if (pdumper_object_p (s))
     pdumper_set_marked (s);
   else
     s->u.s.gcmarkbit = true;
@@ -5846,160 +6215,1107 @@ compact_undo_list (Lisp_Object list)
   return list;
 }
 
-static void
-mark_pinned_objects (void)
+/* The mark stack.  Instead of recursing on the C stack, mark_object
+   and friends push the objects still to be visited here and
+   process_mark_stack pops them until the stack is back where it
+   started.  An entry is either a single object or a run of objects
+   in memory, such as the slots of a vector, which are popped left to
+   right; runs are only pushed for memory that stays put until GC is
+   over.  */
+
+struct mark_entry
 {
-  for (struct pinned_object *pobj = pinned_objects; pobj; pobj = pobj->next)
-    mark_object (pobj->object);
-}
+  ptrdiff_t n;			/* Number of values, or 0 for one value.  */
+  union
+  {
+    Lisp_Object value;		/* When N is 0.  */
+    Lisp_Object *values;	/* When N is positive.  */
+  } u;
+};
 
-static void
-mark_pinned_symbols (void)
+struct mark_stack
 {
-  struct symbol_block *sblk;
-  int lim = (symbol_block_pinned == symbol_block
-	     ? symbol_block_index : SYMBOL_BLOCK_SIZE);
+  struct mark_entry *stack;	/* Base of the stack.  */
+  ptrdiff_t size;		/* Number of entries allocated.  */
+  ptrdiff_t sp;			/* Index of the first free entry.  */
+};
 
-  for (sblk = symbol_block_pinned; sblk; sblk = sblk->next)
-    {
-      struct Lisp_Symbol *sym = sblk->symbols, *end = sym + lim;
-      for (; sym < end; ++sym)
-	if (sym->u.s.pinned)
-	  mark_object (make_lisp_symbol (sym));
+static struct mark_stack mark_stk;
 
-      lim = SYMBOL_BLOCK_SIZE;
-    }
-}
+/* Keep at most this many entries of the mark stack between GCs.  */
+enum { MARK_STACK_KEEP = 1 << 14 };
 
-static void
-visit_vectorlike_root (struct gc_root_visitor visitor,
-                       struct Lisp_Vector *ptr,
-                       enum gc_root_type type)
-{
-  ptrdiff_t size = ptr->header.size;
-  ptrdiff_t i;
+static void process_mark_stack (ptrdiff_t);
 
-  if (size & PSEUDOVECTOR_FLAG)
-    size &= PSEUDOVECTOR_SIZE_MASK;
-  for (i = 0; i < size; i++)
-    visitor.visit (&ptr->contents[i], type, visitor.data);
-}
+/* Start fetching the object OBJ points to into the cache, as it is
+   about to be visited.  */
 
 static void
-visit_buffer_root (struct gc_root_visitor visitor,
-                   struct buffer *buffer,
-                   enum gc_root_type type)
+mark_prefetch (Lisp_Object obj)
 {
-  /* Buffers that are roots don't have intervals, an undo list, or
-     other constructs that real buffers have.  */
-  eassert (buffer->base_buffer == NULL);
-  eassert (buffer->overlays_before == NULL);
-  eassert (buffer->overlays_after == NULL);
+#if defined __GNUC__ || defined __clang__
+  if (!FIXNUMP (obj))
+    __builtin_prefetch (XPNTR (obj));
+#endif
+}
 
-  /* Visit the buffer-locals.  */
-  visit_vectorlike_root (visitor, (struct Lisp_Vector *) buffer, type);
+static bool
+mark_stack_empty_p (void)
+{
+  return mark_stk.sp <= 0;
 }
 
-/* Visit GC roots stored in the Emacs data section.  Used by both core
-   GC and by the portable dumping code.
+/* Return the next entry to push to on STACK, growing it if need be.  */
 
-   There are other GC roots of course, but these roots are dynamic
-   runtime data structures that pdump doesn't care about and so we can
-   continue to mark those directly in garbage_collect.  */
-void
-visit_static_gc_roots (struct gc_root_visitor visitor)
+static struct mark_entry *
+mark_entry_push (struct mark_stack *stack)
 {
-  visit_buffer_root (visitor,
-                     &buffer_defaults,
-                     GC_ROOT_BUFFER_LOCAL_DEFAULT);
-  visit_buffer_root (visitor,
-                     &buffer_local_symbols,
-                     GC_ROOT_BUFFER_LOCAL_NAME);
+  if (stack->sp >= stack->size)
+    stack->stack = xpalloc (stack->stack, &stack->size, 1, -1,
+			    sizeof *stack->stack);
+  return &stack->stack[stack->sp++];
+}
 
-  for (int i = 0; i < ARRAYELTS (lispsym); i++)
+/* Pop the next value to visit from STACK, which must not be empty,
+   and start fetching the one after it.  */
+
+static Lisp_Object
+mark_entry_pop (struct mark_stack *stack)
+{
+  struct mark_entry *e = &stack->stack[stack->sp - 1];
+  Lisp_Object value;
+  if (e->n == 0)
     {
-      Lisp_Object sptr = builtin_lisp_symbol (i);
-      visitor.visit (&sptr, GC_ROOT_C_SYMBOL, visitor.data);
+      value = e->u.value;
+      stack->sp--;
     }
-
-  for (int i = 0; i < staticidx; i++)
-    visitor.visit (staticvec[i], GC_ROOT_STATICPRO, visitor.data);
+  else
+    {
+      value = *e->u.values++;
+      if (--e->n == 0)
+	stack->sp--;
+    }
+  if (stack->sp > 0)
+    {
+      e = &stack->stack[stack->sp - 1];
+      mark_prefetch (e->n == 0 ? e->u.value : e->u.values[0]);
+    }
+  return value;
 }
 
+/* Push VALUE onto the mark stack.  */
+
 static void
-mark_object_root_visitor (Lisp_Object const *root_ptr,
-                          enum gc_root_type type,
-                          void *data)
+mark_stack_push_value (Lisp_Object value)
 {
-  mark_object (*root_ptr);
+  struct mark_entry *e = mark_entry_push (&mark_stk);
+  e->n = 0;
+  e->u.value = value;
 }
 
-/* List of weak hash tables we found during marking the Lisp heap.
-   NULL on entry to garbage_collect and after it returns.  */
-static struct Lisp_Hash_Table *weak_hash_tables;
+/* Push the N values at VALUES onto the mark stack.  */
 
-NO_INLINE /* For better stack traces */
 static void
-mark_and_sweep_weak_table_contents (void)
+mark_stack_push_values (Lisp_Object *values, ptrdiff_t n)
 {
-  struct Lisp_Hash_Table *h;
-  bool marked;
-
-  /* Mark all keys and values that are in use.  Keep on marking until
-     there is no more change.  This is necessary for cases like
-     value-weak table A containing an entry X -> Y, where Y is used in a
-     key-weak table B, Z -> Y.  If B comes after A in the list of weak
-     tables, X -> Y might be removed from A, although when looking at B
-     one finds that it shouldn't.  */
-  do
+  if (n > 0)
     {
-      marked = false;
-      for (h = weak_hash_tables; h; h = h->next_weak)
-        marked |= sweep_weak_table (h, false);
+      struct mark_entry *e = mark_entry_push (&mark_stk);
+      e->n = n;
+      e->u.values = values;
     }
-  while (marked);
+}
 
-  /* Remove hash table entries that aren't used.  */
-  while (weak_hash_tables)
-    {
-      h = weak_hash_tables;
-      weak_hash_tables = h->next_weak;
-      h->next_weak = NULL;
-      sweep_weak_table (h, true);
-    }
+static Lisp_Object
+mark_stack_pop (void)
+{
+  eassume (!mark_stack_empty_p ());
+  return mark_entry_pop (&mark_stk);
 }
 
-/* Return the number of bytes to cons between GCs, given THRESHOLD and
-   PERCENTAGE.  When calculating a threshold based on PERCENTAGE,
-   assume SINCE_GC bytes have been allocated since the most recent GC.
-   The returned value is positive and no greater than HI_THRESHOLD.  */
-static EMACS_INT
-consing_threshold (intmax_t threshold, Lisp_Object percentage,
-		   intmax_t since_gc)
+/* Free the mark stack if it grew big during the GC that just ended.  */
+
+static void
+mark_stack_trim (void)
 {
-  if (!NILP (Vmemory_full))
-    return memory_full_cons_threshold;
-  else
+  eassert (mark_stack_empty_p ());
+  if (mark_stk.size > MARK_STACK_KEEP)
     {
-      threshold = max (threshold, GC_DEFAULT_THRESHOLD / 10);
-      if (FLOATP (percentage))
-	{
-	  double tot = (XFLOAT_DATA (percentage)
-			* (total_bytes_of_live_objects () + since_gc));
-	  if (threshold < tot)
-	    {
-	      if (tot < HI_THRESHOLD)
-		return tot;
-	      else
-		return HI_THRESHOLD;
-	    }
-	}
-      return min (threshold, HI_THRESHOLD);
+      xfree (mark_stk.stack);
+      mark_stk.stack = NULL;
+      mark_stk.size = 0;
     }
 }
 
-/* Adjust consing_until_gc and gc_threshold, given THRESHOLD and PERCENTAGE.
-   Return the updated consing_until_gc.  */
+#if GC_PARALLEL_MARK
+
+/* Parallel marking.  While the roots are being marked, the main
+   thread sets aside the unmarked conses and plain vectors it comes
+   across instead of marking them, and threads from a small pool then
+   mark everything reachable from those.  Objects that need more than
+   setting a mark bit and visiting their slots -- symbols, buffers,
+   weak hash tables, strings with intervals, objects in the dump and so
+   on -- are handed back to the main thread, which marks them on its
+   own and sets aside what it finds in turn, until nothing is left.
+
+   The marking threads set mark bits with atomic operations and never
+   run at the same time as the main thread marks, so the rest of the
+   collector is none the wiser.  Work is shared through a pool of
+   fixed-size chunks of mark entries: a thread that has plenty of
+   work while others are idle moves a chunk of it to the pool, and
+   idle threads take chunks from there.  */
+
+/* Number of entries in a chunk of shared work.  */
+enum { MARK_CHUNK_SIZE = 256 };
+
+/* The marking threads push the slots of big vectors in runs of at
+   most this many, so that they can be shared.  */
+enum { MARK_RUN_MAX = 1024 };
+
+/* Upper bound on gc-mark-threads.  */
+enum { MARK_THREADS_MAX = 64 };
+
+struct mark_chunk
+{
+  struct mark_chunk *next;
+  int n;
+  struct mark_entry entries[MARK_CHUNK_SIZE];
+};
+
+/* A thread taking part in parallel marking.  */
+
+struct mark_worker
+{
+  /* Objects to visit.  */
+  struct mark_stack stack;
+
+  /* Objects left to the main thread, as single-value entries.  */
+  struct mark_stack deferred;
+
+  pthread_t thread;
+};
+
+static struct
+{
+  pthread_mutex_t lock;
+
+  /* Signaled when a round of marking starts.  */
+  pthread_cond_t start;
+
+  /* Signaled when there are chunks to take or the round is over.  */
+  pthread_cond_t work;
+
+  /* Signaled when the last marking thread leaves a round.  */
+  pthread_cond_t done;
+
+  /* Chunks of work to take, and chunks to reuse.  */
+  struct mark_chunk *chunks, *free_chunks;
+
+  /* The threads marking.  workers[0] is the main thread, the others
+     are started on demand and never exit.  */
+  struct mark_worker workers[MARK_THREADS_MAX];
+  int nthreads;
+
+  /* Number of the current round, and number of threads taking part
+     in it.  */
+  EMACS_INT round;
+  int nround;
+
+  /* Number of threads of the round that may still have work, number
+     of them waiting for a chunk, and number of started threads that
+     have not left the round yet.  */
+  int active, waiting, running;
+
+  bool round_over;
+} mark_pool = { .lock = PTHREAD_MUTEX_INITIALIZER,
+		.start = PTHREAD_COND_INITIALIZER,
+		.work = PTHREAD_COND_INITIALIZER,
+		.done = PTHREAD_COND_INITIALIZER };
+
+/* True while the main thread sets objects aside.  */
+static bool mark_parallel_p;
+
+/* The objects the main thread set aside.  */
+static struct mark_stack mark_parallel_stk;
+
+/* Set the mark bit BIT in *WORD and return true if it was clear.  */
+
+static bool
+mark_bit_atomic (bits_word *word, int bit)
+{
+  bits_word mask = (bits_word) 1 << bit;
+  return (!(__atomic_load_n (word, __ATOMIC_RELAXED) & mask)
+	  && !(__atomic_fetch_or (word, mask, __ATOMIC_RELAXED) & mask));
+}
+
+/* Set the mark flag in the size field *SIZE of a vector or string,
+   and return true if it was clear.  */
+
+static bool
+mark_size_atomic (ptrdiff_t *size)
+{
+  return (!(__atomic_load_n (size, __ATOMIC_RELAXED) & ARRAY_MARK_FLAG)
+	  && !(__atomic_fetch_or (size, ARRAY_MARK_FLAG, __ATOMIC_RELAXED)
+	       & ARRAY_MARK_FLAG));
+}
+
+/* Return true if OBJ, a vector-like object not in the dump, is of
+   a type the marking threads can handle themselves.  */
+
+static bool
+mark_parallel_vector_p (struct Lisp_Vector *ptr)
+{
+  ptrdiff_t size = __atomic_load_n (&ptr->header.size, __ATOMIC_RELAXED);
+  if (!(size & PSEUDOVECTOR_FLAG))
+    return true;
+  switch ((size & PVEC_TYPE_MASK) >> PSEUDOVECTOR_AREA_BITS)
+    {
+    case PVEC_RECORD:
+    case PVEC_COMPILED:
+    case PVEC_BOOL_VECTOR:
+      return true;
+    case PVEC_HASH_TABLE:
+      return NILP (((struct Lisp_Hash_Table *) ptr)->weak);
+    default:
+      return false;
+    }
+}
+
+/* Set OBJ aside for the marking threads if they can handle it and it
+   is not marked yet, and return true if so.  Called by the main
+   thread only.  */
+
+static bool
+mark_parallel_divert (Lisp_Object obj)
+{
+  void *po = XPNTR (obj);
+  if (pdumper_object_p (po))
+    return false;
+  if (CONSP (obj))
+    {
+      if (XCONS_MARKED_P (XCONS (obj)))
+	return false;
+    }
+  else if (VECTORLIKEP (obj) && !SUBRP (obj) && !main_thread_p (po))
+    {
+      if (XVECTOR_MARKED_P (XVECTOR (obj))
+	  || !mark_parallel_vector_p (XVECTOR (obj)))
+	return false;
+    }
+  else
+    return false;
+  struct mark_entry *e = mark_entry_push (&mark_parallel_stk);
+  e->n = 0;
+  e->u.value = obj;
+  return true;
+}
+
+/* Return the next entry to push to on STACK, which belongs to a
+   marking thread.  Such threads must not signal, so they cannot use
+   xpalloc.  */
+
+static struct mark_entry *
+mark_worker_push (struct mark_stack *stack)
+{
+  if (stack->sp >= stack->size)
+    {
+      ptrdiff_t size = max (2 * stack->size, MARK_CHUNK_SIZE);
+      struct mark_entry *entries
+	= realloc (stack->stack, size * sizeof *entries);
+      if (!entries)
+	emacs_abort ();
+      stack->stack = entries;
+      stack->size = size;
+    }
+  return &stack->stack[stack->sp++];
+}
+
+/* Free STACK, which belongs to a marking thread, if it grew big.  */
+
+static void
+mark_worker_trim (struct mark_stack *stack)
+{
+  if (stack->size > MARK_STACK_KEEP)
+    {
+      free (stack->stack);
+      stack->stack = NULL;
+      stack->size = 0;
+    }
+}
+
+static void
+mark_worker_push_value (struct mark_worker *w, Lisp_Object value)
+{
+  struct mark_entry *e = mark_worker_push (&w->stack);
+  e->n = 0;
+  e->u.value = value;
+}
+
+static void
+mark_worker_push_values (struct mark_worker *w, Lisp_Object *values,
+			 ptrdiff_t n)
+{
+  for (; n > 0; values += MARK_RUN_MAX, n -= MARK_RUN_MAX)
+    {
+      struct mark_entry *e = mark_worker_push (&w->stack);
+      e->n = min (n, MARK_RUN_MAX);
+      e->u.values = values;
+    }
+}
+
+/* Leave OBJ to the main thread.  */
+
+static void
+mark_worker_defer (struct mark_worker *w, Lisp_Object obj)
+{
+  struct mark_entry *e = mark_worker_push (&w->deferred);
+  e->n = 0;
+  e->u.value = obj;
+}
+
+/* Mark OBJ in a marking thread W, and push the objects it refers to
+   onto W's stack.  This is the part of process_mark_stack that the
+   marking threads can do.  */
+
+static void
+mark_worker_object (struct mark_worker *w, Lisp_Object obj)
+{
+  for (;;)
+    {
+      void *po = XPNTR (obj);
+      if (PURE_P (po))
+	return;
+
+      switch (XTYPE (obj))
+	{
+	case Lisp_Cons:
+	  {
+	    struct Lisp_Cons *ptr = XCONS (obj);
+	    if (pdumper_object_p (po))
+	      break;
+	    ptrdiff_t i = CONS_INDEX (ptr);
+	    if (!mark_bit_atomic (&CONS_BLOCK (ptr)->gcmarkbits
+				  [i / BITS_PER_BITS_WORD],
+				  i % BITS_PER_BITS_WORD))
+	      return;
+	    if (!NILP (ptr->u.s.u.cdr))
+	      mark_worker_push_value (w, ptr->u.s.u.cdr);
+	    obj = ptr->u.s.car;
+	    continue;
+	  }
+
+	case Lisp_Float:
+	  {
+	    /* Floats in the dump have no mark bits.  */
+	    if (!pdumper_object_p (po))
+	      {
+		ptrdiff_t i = FLOAT_INDEX (po);
+		mark_bit_atomic (&FLOAT_BLOCK (po)->gcmarkbits
+				 [i / BITS_PER_BITS_WORD],
+				 i % BITS_PER_BITS_WORD);
+	      }
+	    return;
+	  }
+
+	case Lisp_String:
+	  {
+	    struct Lisp_String *ptr = XSTRING (obj);
+	    if (pdumper_object_p (po) || ptr->u.s.intervals)
+	      break;
+	    mark_size_atomic (&ptr->u.s.size);
+	    return;
+	  }
+
+	case Lisp_Vectorlike:
+	  {
+	    struct Lisp_Vector *ptr = XVECTOR (obj);
+	    if (pdumper_object_p (po) || SUBRP (obj) || main_thread_p (po)
+		|| !mark_parallel_vector_p (ptr))
+	      break;
+	    if (!mark_size_atomic (&ptr->header.size))
+	      return;
+	    ptrdiff_t size = ptr->header.size & ~ARRAY_MARK_FLAG;
+	    if (size & PSEUDOVECTOR_FLAG)
+	      {
+		if (PSEUDOVECTOR_TYPE (ptr) == PVEC_BOOL_VECTOR)
+		  return;
+		if (PSEUDOVECTOR_TYPE (ptr) == PVEC_HASH_TABLE)
+		  {
+		    struct Lisp_Hash_Table *h = (struct Lisp_Hash_Table *) ptr;
+		    mark_worker_push_value (w, h->test.name);
+		    mark_worker_push_value (w, h->test.user_hash_function);
+		    mark_worker_push_value (w, h->test.user_cmp_function);
+		    mark_worker_push_value (w, h->key_and_value);
+		  }
+		size &= PSEUDOVECTOR_SIZE_MASK;
+	      }
+	    mark_worker_push_values (w, ptr->contents, size);
+	    return;
+	  }
+
+	case_Lisp_Int:
+	  return;
+
+	default:
+	  break;
+	}
+
+      /* Anything else is for the main thread, unless it is already
+	 marked; such objects are not marked while threads run.  */
+      if (!survives_gc_p (obj))
+	mark_worker_defer (w, obj);
+      return;
+    }
+}
+
+/* Move a chunk from the top of W's stack to the pool.  Call this with
+   the pool locked.  */
+
+static void
+mark_worker_share (struct mark_worker *w)
+{
+  struct mark_chunk *chunk = mark_pool.free_chunks;
+  if (chunk)
+    mark_pool.free_chunks = chunk->next;
+  else
+    {
+      chunk = malloc (sizeof *chunk);
+      if (!chunk)
+	return;
+    }
+  w->stack.sp -= MARK_CHUNK_SIZE;
+  memcpy (chunk->entries, &w->stack.stack[w->stack.sp],
+	  sizeof chunk->entries);
+  chunk->n = MARK_CHUNK_SIZE;
+  chunk->next = mark_pool.chunks;
+  mark_pool.chunks = chunk;
+  pthread_cond_signal (&mark_pool.work);
+}
+
+/* Move a chunk from the pool to W's stack.  Call this with the pool
+   locked and a chunk in it.  */
+
+static void
+mark_worker_take (struct mark_worker *w)
+{
+  struct mark_chunk *chunk = mark_pool.chunks;
+  mark_pool.chunks = chunk->next;
+  for (int i = 0; i < chunk->n; i++)
+    *mark_worker_push (&w->stack) = chunk->entries[i];
+  chunk->next = mark_pool.free_chunks;
+  mark_pool.free_chunks = chunk;
+}
+
+/* Take part in the current round of marking as W, and return when
+   all the threads in it have run out of work.  */
+
+static void
+mark_worker_run (struct mark_worker *w)
+{
+  for (;;)
+    {
+      while (w->stack.sp > 0)
+	{
+	  mark_worker_object (w, mark_entry_pop (&w->stack));
+	  if (w->stack.sp >= 2 * MARK_CHUNK_SIZE
+	      && __atomic_load_n (&mark_pool.waiting, __ATOMIC_RELAXED) > 0)
+	    {
+	      pthread_mutex_lock (&mark_pool.lock);
+	      mark_worker_share (w);
+	      pthread_mutex_unlock (&mark_pool.lock);
+	    }
+	}
+
+      pthread_mutex_lock (&mark_pool.lock);
+      if (!mark_pool.chunks)
+	{
+	  if (--mark_pool.active == 0)
+	    {
+	      mark_pool.round_over = true;
+	      pthread_cond_broadcast (&mark_pool.work);
+	    }
+	  __atomic_add_fetch (&mark_pool.waiting, 1, __ATOMIC_RELAXED);
+	  while (!mark_pool.chunks && !mark_pool.round_over)
+	    pthread_cond_wait (&mark_pool.work, &mark_pool.lock);
+	  __atomic_sub_fetch (&mark_pool.waiting, 1, __ATOMIC_RELAXED);
+	  if (mark_pool.round_over)
+	    {
+	      pthread_mutex_unlock (&mark_pool.lock);
+	      return;
+	    }
+	  mark_pool.active++;
+	}
+      mark_worker_take (w);
+      pthread_mutex_unlock (&mark_pool.lock);
+    }
+}
+
+/* The body of a marking thread.  */
+
+static void *
+mark_worker_main (void *arg)
+{
+  struct mark_worker *w = arg;
+  EMACS_INT round = 0;
+
+  pthread_mutex_lock (&mark_pool.lock);
+  for (;;)
+    {
+      while (mark_pool.round == round)
+	pthread_cond_wait (&mark_pool.start, &mark_pool.lock);
+      round = mark_pool.round;
+      if (w - mark_pool.workers < mark_pool.nround)
+	{
+	  pthread_mutex_unlock (&mark_pool.lock);
+	  mark_worker_run (w);
+	  pthread_mutex_lock (&mark_pool.lock);
+	  if (--mark_pool.running == 0)
+	    pthread_cond_signal (&mark_pool.done);
+	}
+    }
+  return NULL;
+}
+
+/* Start marking threads until there are NTHREADS in all, counting
+   the main thread.  */
+
+static void
+mark_parallel_start_threads (int nthreads)
+{
+  if (mark_pool.nthreads == 0)
+    mark_pool.nthreads = 1;
+  if (mark_pool.nthreads >= nthreads)
+    return;
+
+  for (; mark_pool.nthreads < nthreads; mark_pool.nthreads++)
+    {
+      struct mark_worker *w = &mark_pool.workers[mark_pool.nthreads];
+      if (!sys_native_thread_create (&w->thread, mark_worker_main, w))
+	break;
+    }
+}
+
+/* Mark everything reachable from the objects set aside, using all the
+   marking threads, and push the objects left to the main thread onto
+   the mark stack.  */
+
+static void
+mark_parallel_round (void)
+{
+  int nthreads = mark_pool.nround;
+  struct mark_worker *self = &mark_pool.workers[0];
+
+  pthread_mutex_lock (&mark_pool.lock);
+  eassert (!mark_pool.chunks && mark_pool.running == 0);
+  /* Keep one chunk's worth for this thread and share the rest.  */
+  while (mark_parallel_stk.sp > MARK_CHUNK_SIZE)
+    {
+      struct mark_chunk *chunk = mark_pool.free_chunks;
+      if (chunk)
+	mark_pool.free_chunks = chunk->next;
+      else
+	{
+	  chunk = malloc (sizeof *chunk);
+	  if (!chunk)
+	    break;
+	}
+      mark_parallel_stk.sp -= MARK_CHUNK_SIZE;
+      memcpy (chunk->entries, &mark_parallel_stk.stack[mark_parallel_stk.sp],
+	      sizeof chunk->entries);
+      chunk->n = MARK_CHUNK_SIZE;
+      chunk->next = mark_pool.chunks;
+      mark_pool.chunks = chunk;
+    }
+  while (mark_parallel_stk.sp > 0)
+    *mark_worker_push (&self->stack)
+      = mark_parallel_stk.stack[--mark_parallel_stk.sp];
+  mark_pool.round++;
+  mark_pool.active = nthreads;
+  mark_pool.running = nthreads - 1;
+  mark_pool.waiting = 0;
+  mark_pool.round_over = false;
+  pthread_cond_broadcast (&mark_pool.start);
+  pthread_mutex_unlock (&mark_pool.lock);
+
+  mark_worker_run (self);
+
+  pthread_mutex_lock (&mark_pool.lock);
+  while (mark_pool.running > 0)
+    pthread_cond_wait (&mark_pool.done, &mark_pool.lock);
+  pthread_mutex_unlock (&mark_pool.lock);
+
+  for (int i = 0; i < nthreads; i++)
+    {
+      struct mark_stack *deferred = &mark_pool.workers[i].deferred;
+      while (deferred->sp > 0)
+	mark_stack_push_value (deferred->stack[--deferred->sp].u.value);
+    }
+}
+
+/* Start setting objects aside for the marking threads, if
+   gc-mark-threads asks for them.  */
+
+static void
+mark_parallel_begin (void)
+{
+  int nthreads = clip_to_bounds (1, gc_mark_threads, MARK_THREADS_MAX);
+  mark_parallel_start_threads (nthreads);
+  mark_pool.nround = min (nthreads, mark_pool.nthreads);
+  mark_parallel_p = mark_pool.nround > 1;
+}
+
+/* Finish marking what was set aside, and stop setting objects aside.
+   After this, everything reachable from the roots marked so far is
+   marked.  */
+
+static void
+mark_parallel_end (void)
+{
+  if (!mark_parallel_p)
+    return;
+  process_mark_stack (0);
+  while (mark_parallel_stk.sp > 0)
+    {
+      mark_parallel_round ();
+      process_mark_stack (0);
+    }
+  mark_parallel_p = false;
+
+  if (mark_parallel_stk.size > MARK_STACK_KEEP)
+    {
+      xfree (mark_parallel_stk.stack);
+      mark_parallel_stk.stack = NULL;
+      mark_parallel_stk.size = 0;
+    }
+  for (int i = 0; i < mark_pool.nthreads; i++)
+    {
+      mark_worker_trim (&mark_pool.workers[i].stack);
+      mark_worker_trim (&mark_pool.workers[i].deferred);
+    }
+}
+
+#else /* !GC_PARALLEL_MARK */
+
+static void mark_parallel_begin (void) {}
+static void mark_parallel_end (void) {}
+
+#endif /* !GC_PARALLEL_MARK */
+
+#ifdef HAVE_GC_NURSERY
+
+/* Marking in a minor collection.  */
+
+/* Push VALUE onto the mark stack if it might be young.  */
+
+static void
+mark_old_value (Lisp_Object value)
+{
+  if (CONSP (value) || FLOATP (value))
+    mark_stack_push_value (value);
+}
+
+static void
+mark_old_values (Lisp_Object *values, ptrdiff_t n)
+{
+  for (ptrdiff_t i = 0; i < n; i++)
+    mark_old_value (values[i]);
+}
+
+static void
+mark_old_interval (INTERVAL i, void *dummy)
+{
+  mark_old_value (i->plist);
+}
+
+/* Push what the symbol, string or vector PTR refers to onto the mark
+   stack, as far as it might be young.  These follow what
+   process_mark_stack looks into.  */
+
+static void
+mark_old_symbol (struct Lisp_Symbol *ptr)
+{
+  mark_old_value (ptr->u.s.function);
+  mark_old_value (ptr->u.s.plist);
+  if (ptr->u.s.redirect == SYMBOL_PLAINVAL)
+    mark_old_value (SYMBOL_VAL (ptr));
+  else if (ptr->u.s.redirect == SYMBOL_LOCALIZED)
+    {
+      struct Lisp_Buffer_Local_Value *blv = SYMBOL_BLV (ptr);
+      mark_old_value (blv->valcell);
+      mark_old_value (blv->defcell);
+    }
+}
+
+static void
+mark_old_string (struct Lisp_String *ptr)
+{
+  if (ptr->u.s.intervals)
+    traverse_intervals_noorder (ptr->u.s.intervals, mark_old_interval, NULL);
+}
+
+static void
+mark_old_vector (struct Lisp_Vector *ptr)
+{
+  ptrdiff_t size = ptr->header.size;
+  ptrdiff_t start = 0;
+
+  if (size & PSEUDOVECTOR_FLAG)
+    {
+      switch (PSEUDOVECTOR_TYPE (ptr))
+	{
+	case PVEC_FREE:
+	case PVEC_BOOL_VECTOR:
+	case PVEC_SUBR:
+	  return;
+
+	case PVEC_SUB_CHAR_TABLE:
+	  start = SUB_CHAR_TABLE_OFFSET;
+	  break;
+
+	case PVEC_BUFFER:
+	  {
+	    struct buffer *b = (struct buffer *) ptr;
+	    if (buffer_intervals (b))
+	      traverse_intervals_noorder (buffer_intervals (b),
+					  mark_old_interval, NULL);
+	    mark_old_value (BVAR (b, undo_list));
+	  }
+	  break;
+
+	case PVEC_FRAME:
+	  {
+	    struct face_cache *c = ((struct frame *) ptr)->face_cache;
+	    for (int i = 0; c && i < c->used; i++)
+	      {
+		struct face *face = FACE_FROM_ID_OR_NULL (c->f, i);
+		if (face)
+		  mark_old_values (face->lface, LFACE_VECTOR_SIZE);
+	      }
+	  }
+	  break;
+
+	case PVEC_HASH_TABLE:
+	  {
+	    struct Lisp_Hash_Table *h = (struct Lisp_Hash_Table *) ptr;
+	    mark_old_value (h->test.user_hash_function);
+	    mark_old_value (h->test.user_cmp_function);
+	  }
+	  break;
+
+	default:
+	  break;
+	}
+      size &= PSEUDOVECTOR_SIZE_MASK;
+    }
+  mark_old_values (ptr->contents + start, size - start);
+}
+
+static void
+mark_old_dump_object (void *ptr, enum Lisp_Type type)
+{
+  switch (type)
+    {
+    case Lisp_Symbol:
+      mark_old_symbol (ptr);
+      break;
+    case Lisp_String:
+      mark_old_string (ptr);
+      break;
+    case Lisp_Vectorlike:
+      mark_old_vector (ptr);
+      break;
+    default:
+      /* Conses in the dump are old, and floats cannot refer to
+	 anything.  */
+      break;
+    }
+  process_mark_stack (0);
+}
+
+/* Mark the young objects that the objects other than conses and
+   floats, and the remembered conses, refer to.  The former include
+   the objects no longer in use that the last full collection did not
+   free; they keep what they refer to from being freed until the next
+   one, but that is all.  */
+
+static void
+mark_old_generation (void)
+{
+  for (struct vector_block *block = vector_blocks; block;
+       block = block->next)
+    for (struct Lisp_Vector *vector = (struct Lisp_Vector *) block->data;
+	 VECTOR_IN_BLOCK (vector, block);
+	 vector = ADVANCE (vector, vector_nbytes (vector)))
+      {
+	mark_old_vector (vector);
+	process_mark_stack (0);
+      }
+  for (struct large_vector *lv = large_vectors; lv; lv = lv->next)
+    {
+      mark_old_vector (large_vector_vec (lv));
+      process_mark_stack (0);
+    }
+
+  for (int i = 0; i < ARRAYELTS (lispsym); i++)
+    {
+      mark_old_symbol (&lispsym[i]);
+      process_mark_stack (0);
+    }
+  int lim = symbol_block_index;
+  for (struct symbol_block *sblk = symbol_block; sblk; sblk = sblk->next)
+    {
+      for (struct Lisp_Symbol *sym = sblk->symbols; sym < sblk->symbols + lim;
+	   sym++)
+	if (!deadp (sym->u.s.function))
+	  {
+	    mark_old_symbol (sym);
+	    process_mark_stack (0);
+	  }
+      lim = SYMBOL_BLOCK_SIZE;
+    }
+
+  for (struct string_block *b = string_blocks; b; b = b->next)
+    for (int i = 0; i < STRING_BLOCK_SIZE; i++)
+      if (b->strings[i].u.s.data)
+	{
+	  mark_old_string (&b->strings[i]);
+	  process_mark_stack (0);
+	}
+
+  pdumper_visit_live_objects (mark_old_dump_object);
+
+  for (ptrdiff_t i = 0; i < remembered_conses_size; i++)
+    if (remembered_conses[i])
+      {
+	mark_old_value (remembered_conses[i]->u.s.car);
+	mark_old_value (remembered_conses[i]->u.s.u.cdr);
+	process_mark_stack (0);
+      }
+}
+
+/* Mark the young conses and floats reachable from the objects on the
+   mark stack above BASE_SP, like process_mark_stack in a minor
+   collection.  Old objects are not looked into: what they refer to is
+   old too, or found by mark_old_generation.  */
+
+static void
+process_nursery_stack (ptrdiff_t base_sp)
+{
+  while (mark_stk.sp > base_sp)
+    {
+      Lisp_Object obj = mark_stack_pop ();
+    mark_obj: ;
+      void *po = XPNTR (obj);
+      if (PURE_P (po) || pdumper_object_p (po))
+	continue;
+
+      switch (XTYPE (obj))
+	{
+	case Lisp_Cons:
+	  {
+	    struct Lisp_Cons *ptr = po;
+	    if (XCONS_MARKED_P (ptr))
+	      break;
+	    XMARK_CONS (ptr);
+	    promoted_since_full += sizeof *ptr;
+	    if (!NILP (ptr->u.s.u.cdr))
+	      mark_stack_push_value (ptr->u.s.u.cdr);
+	    obj = ptr->u.s.car;
+	    goto mark_obj;
+	  }
+
+	case Lisp_Float:
+	  if (!XFLOAT_MARKED_P ((struct Lisp_Float *) po))
+	    {
+	      XFLOAT_MARK ((struct Lisp_Float *) po);
+	      promoted_since_full += sizeof (struct Lisp_Float);
+	    }
+	  break;
+
+	case Lisp_Vectorlike:
+	  /* The main thread is the only vector not allocated from the
+	     heap that has slots to look into, which mark_threads
+	     leads here.  */
+	  if (main_thread_p (po))
+	    mark_old_vector (po);
+	  break;
+
+	default:
+	  break;
+	}
+    }
+}
+
+/* Return true if the next collection can be a minor one.  */
+
+static bool
+minor_gc_due (void)
+{
+  return (minor_gcs_since_full < gc_minor_collections
+	  && promoted_since_full < gc_threshold
+	  && !remembered_conses_lost
+	  && NILP (Vmemory_full)
+	  && NILP (Vpurify_flag));
+}
+
+#endif /* HAVE_GC_NURSERY */
+
+static void
+mark_pinned_objects (void)
+{
+  for (struct pinned_object *pobj = pinned_objects; pobj; pobj = pobj->next)
+    mark_stack_push_value (pobj->object);
+  process_mark_stack (0);
+}
+
+static void
+mark_pinned_symbols (void)
+{
+  struct symbol_block *sblk;
+  int lim = (symbol_block_pinned == symbol_block
+	     ? symbol_block_index : SYMBOL_BLOCK_SIZE);
+
+  for (sblk = symbol_block_pinned; sblk; sblk = sblk->next)
+    {
+      struct Lisp_Symbol *sym = sblk->symbols, *end = sym + lim;
+      for (; sym < end; ++sym)
+	if (sym->u.s.pinned)
+	  mark_stack_push_value (make_lisp_symbol (sym));
+
+      lim = SYMBOL_BLOCK_SIZE;
+    }
+  process_mark_stack (0);
+}
+
+static void
+visit_vectorlike_root (struct gc_root_visitor visitor,
+                       struct Lisp_Vector *ptr,
+                       enum gc_root_type type)
+{
+  ptrdiff_t size = ptr->header.size;
+  ptrdiff_t i;
+
+  if (size & PSEUDOVECTOR_FLAG)
+    size &= PSEUDOVECTOR_SIZE_MASK;
+  for (i = 0; i < size; i++)
+    visitor.visit (&ptr->contents[i], type, visitor.data);
+}
+
+static void
+visit_buffer_root (struct gc_root_visitor visitor,
+                   struct buffer *buffer,
+                   enum gc_root_type type)
+{
+  /* Buffers that are roots don't have intervals, an undo list, or
+     other constructs that real buffers have.  */
+  eassert (buffer->base_buffer == NULL);
+  eassert (buffer->overlays_before == NULL);
+  eassert (buffer->overlays_after == NULL);
+
+  /* Visit the buffer-locals.  */
+  visit_vectorlike_root (visitor, (struct Lisp_Vector *) buffer, type);
+}
+
+/* Visit GC roots stored in the Emacs data section.  Used by both core
+   GC and by the portable dumping code.
+
+   There are other GC roots of course, but these roots are dynamic
+   runtime data structures that pdump doesn't care about and so we can
+   continue to mark those directly in garbage_collect.  */
+void
+visit_static_gc_roots (struct gc_root_visitor visitor)
+{
+  visit_buffer_root (visitor,
+                     &buffer_defaults,
+                     GC_ROOT_BUFFER_LOCAL_DEFAULT);
+  visit_buffer_root (visitor,
+                     &buffer_local_symbols,
+                     GC_ROOT_BUFFER_LOCAL_NAME);
+
+  for (int i = 0; i < ARRAYELTS (lispsym); i++)
+    {
+      Lisp_Object sptr = builtin_lisp_symbol (i);
+      visitor.visit (&sptr, GC_ROOT_C_SYMBOL, visitor.data);
+    }
+
+  for (int i = 0; i < staticidx; i++)
+    visitor.visit (staticvec[i], GC_ROOT_STATICPRO, visitor.data);
+}
+
+static void
+mark_object_root_visitor (Lisp_Object const *root_ptr,
+                          enum gc_root_type type,
+                          void *data)
+{
+  mark_stack_push_value (*root_ptr);
+}
+
+/* List of weak hash tables we found during marking the Lisp heap.
+   NULL on entry to garbage_collect and after it returns.  */
+static struct Lisp_Hash_Table *weak_hash_tables;
+
+NO_INLINE /* For better stack traces */
+static void
+mark_and_sweep_weak_table_contents (void)
+{
+  struct Lisp_Hash_Table *h;
+  bool marked;
+
+  /* Mark all keys and values that are in use.  Keep on marking until
+     there is no more change.  This is necessary for cases like
+     value-weak table A containing an entry X -> Y, where Y is used in a
+     key-weak table B, Z -> Y.  If B comes after A in the list of weak
+     tables, X -> Y might be removed from A, although when looking at B
+     one finds that it shouldn't.  */
+  do
+    {
+      marked = false;
+      for (h = weak_hash_tables; h; h = h->next_weak)
+        marked |= sweep_weak_table (h, false);
+    }
+  while (marked);
+
+  /* Remove hash table entries that aren't used.  */
+  while (weak_hash_tables)
+    {
+      h = weak_hash_tables;
+      weak_hash_tables = h->next_weak;
+      h->next_weak = NULL;
+      sweep_weak_table (h, true);
+    }
+}
+
+/* Return the number of bytes to cons between GCs, given THRESHOLD and
+   PERCENTAGE.  When calculating a threshold based on PERCENTAGE,
+   assume SINCE_GC bytes have been allocated since the most recent GC.
+   The returned value is positive and no greater than HI_THRESHOLD.  */
+static EMACS_INT
+consing_threshold (intmax_t threshold, Lisp_Object percentage,
+		   intmax_t since_gc)
+{
+  if (!NILP (Vmemory_full))
+    return memory_full_cons_threshold;
+  else
+    {
+      threshold = max (threshold, GC_DEFAULT_THRESHOLD / 10);
+      if (FLOATP (percentage))
+	{
+	  double tot = (XFLOAT_DATA (percentage)
+			* (total_bytes_of_live_objects () + since_gc));
+	  if (threshold < tot)
+	    {
+	      if (tot < HI_THRESHOLD)
+		return tot;
+	      else
+		return HI_THRESHOLD;
+	    }
+	}
+      return min (threshold, HI_THRESHOLD);
+    }
+}
+
+/* Adjust consing_until_gc and gc_threshold, given THRESHOLD and PERCENTAGE.
+   Return the updated consing_until_gc.  */
 
 static EMACS_INT
 bump_consing_until_gc (intmax_t threshold, Lisp_Object percentage)
@@ -6035,19 +7351,273 @@ watch_gc_cons_percentage (Lisp_Object symbol, Lisp_Object newval,
   return Qnil;
 }
 
+#ifdef HAVE_GC_INCREMENTAL
+
+/* Bytes consed since the incremental collection began, and the value
+   consing_until_gc had after the last slice.  */
+static EMACS_INT incremental_consed, incremental_step;
+
+/* Estimate of incremental_work for the whole collection.  */
+static intmax_t incremental_total;
+
+/* Consing between slices is at least gc_threshold divided by this.  */
+enum { INCREMENTAL_SLICES_MAX = 64 };
+
+/* Time spent in the slices of the incremental collection.  */
+static struct timespec incremental_elapsed;
+
+/* Return true if an incremental collection has begun.  */
+
+static bool
+incremental_gc_in_progress (void)
+{
+  return incremental_sweeping || gc_incremental_marking;
+}
+
+/* Return true if garbage is to be collected in slices, and nothing
+   was lost that would make the current collection unsound.  */
+
+static bool
+incremental_gc_p (void)
+{
+  return (NUMBERP (Vgc_incremental_slice)
+	  && 0 < XFLOATINT (Vgc_incremental_slice)
+	  && !garbage_collection_inhibited
+	  && NILP (Vpurify_flag) && NILP (Vmemory_full)
+	  && !remembered_conses_lost && !incremental_marks_lost);
+}
+
+/* Begin an incremental collection.  */
+
+static void
+begin_incremental_gc (void)
+{
+  eassert (!incremental_gc_in_progress ());
+  incremental_sweeping = true;
+  incremental_consed = 0;
+  incremental_step = consing_until_gc;
+  incremental_work = 0;
+  /* Each cons takes two pops, and each symbol about four.  */
+  incremental_total = (2 * gcstat.total_conses + gcstat.total_floats
+		       + 4 * gcstat.total_symbols + gcstat.total_strings
+		       + gcstat.total_vector_slots);
+}
+
+/* Push the contents of the remembered conses onto the mark stack,
+   and forget them.  */
+
+static void
+push_remembered_conses (void)
+{
+  for (ptrdiff_t i = 0; i < remembered_conses_size; i++)
+    if (remembered_conses[i])
+      {
+	mark_stack_push_value (remembered_conses[i]->u.s.car);
+	mark_stack_push_value (remembered_conses[i]->u.s.u.cdr);
+      }
+  clear_remembered_conses ();
+}
+
+/* Run a slice of the incremental collection, which must have begun,
+   for gc-incremental-slice seconds.  Return true if all that is left
+   to do is the final pause.  */
+
+static bool
+incremental_gc_slice (void)
+{
+  struct timespec start = current_timespec ();
+  bool done = false;
+
+  incremental_deadline
+    = timespec_add (start, dtotimespec (XFLOATINT (Vgc_incremental_slice)));
+  block_input ();
+  gc_in_progress = 1;
+
+  /* The slices begin by sweeping what the last collection left
+     unswept, so that the mark bits of conses and floats are clear,
+     and then push the staticpro'd roots.  */
+  if (incremental_sweeping)
+    {
+      while (sweep_lazily_step ())
+	if (timespec_cmp (incremental_deadline, current_timespec ()) <= 0)
+	  goto out;
+      incremental_sweeping = false;
+      gc_incremental_marking = true;
+      incremental_slice = true;
+      struct gc_root_visitor visitor = { .visit = mark_object_root_visitor };
+      visit_static_gc_roots (visitor);
+    }
+
+  incremental_slice = true;
+  push_remembered_conses ();
+  process_mark_stack (0);
+  incremental_slice = false;
+  done = mark_stack_empty_p () && !incremental_marks_lost;
+
+ out:
+  gc_in_progress = 0;
+  unblock_input ();
+  incremental_elapsed
+    = timespec_add (incremental_elapsed,
+		    timespec_sub (current_timespec (), start));
+  return done;
+}
+
+/* Run a slice of the incremental collection and decide when to run
+   the next, or finish the collection if that cannot wait.  */
+
+static void
+incremental_gc_step (void)
+{
+  incremental_consed += incremental_step - consing_until_gc;
+  intmax_t work = incremental_work;
+  if (incremental_consed < gc_threshold && incremental_gc_p ()
+      && !incremental_gc_slice ())
+    {
+      /* Space the slices so that marking is done by the time
+	 gc_threshold bytes have been consed since the collection
+	 began, going by how much of the estimated work this slice
+	 did.  Whatever is left then is marked in the final pause.  */
+      EMACS_INT left = gc_threshold - incremental_consed;
+      double done = max (incremental_work - work, 1);
+      double todo = max (incremental_total - incremental_work, done);
+      incremental_step = consing_until_gc
+	= clip_to_bounds (gc_threshold / INCREMENTAL_SLICES_MAX,
+			  left * (done / todo), left);
+    }
+  else
+    garbage_collect_1 (true);
+}
+
+/* Give up the incremental collection, for lack of memory to record
+   what it marked, and forget what it marked.  */
+
+static void
+abandon_incremental_gc (void)
+{
+  mark_stk.sp = 0;
+  mark_stack_trim ();
+  free (incremental_marks);
+  incremental_marks = NULL;
+  incremental_marks_count = incremental_marks_size = 0;
+  incremental_marks_lost = false;
+  clear_remembered_conses ();
+  unmark_conses_and_floats ();
+  pdumper_clear_marks ();
+  gc_incremental_marking = false;
+}
+
+/* Begin the final pause of the incremental collection.  Make grey
+   again the objects that slices marked in incremental_marks, and the
+   contents of the remembered conses, and stop the write barrier.
+   The rest of the final pause is that of a full collection, whose
+   marking then stops at the conses marked in slices.  */
+
+static void
+regrey_incremental_marks (void)
+{
+  for (ptrdiff_t i = 0; i < incremental_marks_size; i++)
+    if (!FIXNUMP (incremental_marks[i]))
+      mark_stack_push_value (incremental_marks[i]);
+  free (incremental_marks);
+  incremental_marks = NULL;
+  incremental_marks_count = incremental_marks_size = 0;
+  push_remembered_conses ();
+  gc_incremental_marking = false;
+}
+
+#endif /* HAVE_GC_INCREMENTAL */
+
 /* It may be time to collect garbage.  Recalculate consing_until_gc,
    since it might depend on current usage, and do the garbage
    collection if the recalculation says so.  */
 void
 maybe_garbage_collect (void)
 {
+#ifdef HAVE_GC_INCREMENTAL
+  if (incremental_gc_in_progress ())
+    {
+      incremental_gc_step ();
+      return;
+    }
+#endif
   if (bump_consing_until_gc (gc_cons_threshold, Vgc_cons_percentage) < 0)
-    garbage_collect ();
+    {
+#ifdef HAVE_GC_INCREMENTAL
+      if (incremental_gc_p ())
+	{
+	  begin_incremental_gc ();
+	  incremental_gc_step ();
+	  return;
+	}
+#endif
+      garbage_collect_1 (true);
+    }
+}
+
+#ifdef HAVE_GC_INCREMENTAL
+
+/* Run slices of the incremental collection until input arrives, and
+   if it does not, finish the collection.  */
+
+static void
+incremental_gc_idle (void)
+{
+  while (incremental_gc_p () && !incremental_gc_slice ())
+    if (detect_input_pending ())
+      return;
+  garbage_collect_1 (true);
+}
+
+#endif
+
+/* Emacs is about to wait for input.  Collect garbage now if enough
+   consing has gone on since the last collection, as controlled by
+   `gc-idle-fraction', so that the collection does not happen in the
+   middle of the next command instead.  In builds with the incremental
+   collector, also finish the collection in progress, if any.  */
+void
+maybe_garbage_collect_idle (void)
+{
+#ifdef HAVE_GC_INCREMENTAL
+  if (incremental_gc_in_progress ())
+    {
+      incremental_gc_idle ();
+      return;
+    }
+#endif
+  if (NUMBERP (Vgc_idle_fraction))
+    {
+      double fraction = XFLOATINT (Vgc_idle_fraction);
+      EMACS_INT until_gc = bump_consing_until_gc (gc_cons_threshold,
+						  Vgc_cons_percentage);
+      EMACS_INT since_gc = gc_threshold - until_gc;
+      if (0 < fraction && fraction * gc_threshold <= since_gc)
+	{
+#ifdef HAVE_GC_INCREMENTAL
+	  if (incremental_gc_p ())
+	    {
+	      begin_incremental_gc ();
+	      incremental_gc_idle ();
+	      return;
+	    }
+#endif
+	  garbage_collect_1 (true);
+	}
+    }
 }
 
 /* Subroutine of Fgarbage_collect that does most of the work.  */
 void
 garbage_collect (void)
+{
+  garbage_collect_1 (false);
+}
+
+/* Collect garbage, in a minor collection if MINOR_OK and the
+   generational collector says it is time for one.  */
+static void
+garbage_collect_1 (bool minor_ok)
 {
   Lisp_Object tail, buffer;
   char stack_top_variable;
@@ -6124,12 +7694,36 @@ garbage_collect (void)
 
   shrink_regexp_cache ();
 
+  finish_lazy_sweep ();
+
+#ifdef HAVE_GC_INCREMENTAL
+  incremental_sweeping = false;
+  if (gc_incremental_marking
+      && (remembered_conses_lost || incremental_marks_lost))
+    abandon_incremental_gc ();
+#endif
+
+#ifdef HAVE_GC_NURSERY
+  minor_gc = minor_ok && minor_gc_due ();
+  if (!minor_gc)
+    unmark_conses_and_floats ();
+#endif
+
   gc_in_progress = 1;
 
+#ifdef HAVE_GC_INCREMENTAL
+  if (gc_incremental_marking)
+    regrey_incremental_marks ();
+  else
+#endif
+  if (!minor_gc)
+    mark_parallel_begin ();
+
   /* Mark all the special slots that serve as the roots of accessibility.  */
 
   struct gc_root_visitor visitor = { .visit = mark_object_root_visitor };
   visit_static_gc_roots (visitor);
+  process_mark_stack (0);
 
   mark_pinned_objects ();
   mark_pinned_symbols ();
@@ -6150,37 +7744,68 @@ garbage_collect (void)
   mark_nsterm ();
 #endif
 
-  /* Everything is now marked, except for the data in font caches,
-     undo lists, and finalizers.  The first two are compacted by
-     removing an items which aren't reachable otherwise.  */
-
-  compact_font_caches ();
-
-  FOR_EACH_LIVE_BUFFER (tail, buffer)
+#ifdef HAVE_GC_NURSERY
+  if (minor_gc)
     {
-      struct buffer *nextb = XBUFFER (buffer);
-      if (!EQ (BVAR (nextb, undo_list), Qt))
-	bset_undo_list (nextb, compact_undo_list (BVAR (nextb, undo_list)));
-      /* Now that we have stripped the elements that need not be
-	 in the undo_list any more, we can finally mark the list.  */
-      mark_object (BVAR (nextb, undo_list));
+      /* The rest of the heap is old and stays as it is; font caches,
+	 undo lists, finalizers and weak hash tables are left alone
+	 until the next full collection.  */
+      mark_old_generation ();
+      mark_stack_trim ();
+      sweep_conses ();
+      sweep_floats ();
+      minor_gcs_since_full++;
     }
+  else
+#endif
+    {
+      mark_parallel_end ();
 
-  /* Now pre-sweep finalizers.  Here, we add any unmarked finalizers
-     to doomed_finalizers so we can run their associated functions
-     after GC.  It's important to scan finalizers at this stage so
-     that we can be sure that unmarked finalizers are really
-     unreachable except for references from their associated functions
-     and from other finalizers.  */
+      /* Everything is now marked, except for the data in font caches,
+	 undo lists, and finalizers.  The first two are compacted by
+	 removing an items which aren't reachable otherwise.  */
 
-  queue_doomed_finalizers (&doomed_finalizers, &finalizers);
-  mark_finalizer_list (&doomed_finalizers);
+      compact_font_caches ();
 
-  /* Must happen after all other marking and before gc_sweep.  */
-  mark_and_sweep_weak_table_contents ();
-  eassert (weak_hash_tables == NULL);
+      FOR_EACH_LIVE_BUFFER (tail, buffer)
+	{
+	  struct buffer *nextb = XBUFFER (buffer);
+	  if (!EQ (BVAR (nextb, undo_list), Qt))
+	    bset_undo_list (nextb,
+			    compact_undo_list (BVAR (nextb, undo_list)));
+	  /* Now that we have stripped the elements that need not be
+	     in the undo_list any more, we can finally mark the list.  */
+	  mark_object (BVAR (nextb, undo_list));
+	}
+
+      /* Now pre-sweep finalizers.  Here, we add any unmarked
+	 finalizers to doomed_finalizers so we can run their associated
+	 functions after GC.  It's important to scan finalizers at this
+	 stage so that we can be sure that unmarked finalizers are
+	 really unreachable except for references from their associated
+	 functions and from other finalizers.  */
+
+      queue_doomed_finalizers (&doomed_finalizers, &finalizers);
+      mark_finalizer_list (&doomed_finalizers);
+
+      /* Must happen after all other marking and before gc_sweep.  */
+      mark_and_sweep_weak_table_contents ();
+      eassert (weak_hash_tables == NULL);
+      mark_stack_trim ();
+
+      gc_sweep ();
 
-  gc_sweep ();
+#ifdef HAVE_GC_NURSERY
+      minor_gcs_since_full = 0;
+      promoted_since_full = 0;
+#endif
+    }
+
+#ifdef HAVE_GC_NURSERY
+  /* Everything in use is old now.  */
+  clear_remembered_conses ();
+  minor_gc = false;
+#endif
 
   unmark_main_thread ();
 
@@ -6219,8 +7844,14 @@ garbage_collect (void)
       static struct timespec gc_elapsed;
       gc_elapsed = timespec_add (gc_elapsed,
 				 timespec_sub (current_timespec (), start));
+#ifdef HAVE_GC_INCREMENTAL
+      gc_elapsed = timespec_add (gc_elapsed, incremental_elapsed);
+#endif
       Vgc_elapsed = make_float (timespectod (gc_elapsed));
     }
+#ifdef HAVE_GC_INCREMENTAL
+  incremental_elapsed = make_timespec (0, 0);
+#endif
 
   gcs_done++;
 
@@ -6355,7 +7986,7 @@ mark_glyph_matrix (struct glyph_matrix *matrix)
 static int last_marked_index;
 
 /* For debugging--call abort when we cdr down this many
-   links of a list, in mark_object.  In debugging,
+   links of a list, in process_mark_stack.  In debugging,
    the call to abort will hit a breakpoint.
    Normally this is zero and the check never goes off.  */
 ptrdiff_t mark_object_loop_halt EXTERNALLY_VISIBLE;
@@ -6379,7 +8010,7 @@ mark_vectorlike (union vectorlike_header *header)
      the number of Lisp_Object fields that we should trace.
      The distinction is used e.g. by Lisp_Process which places extra
      non-Lisp_Object fields at the end of the structure...  */
-  mark_objects (ptr->contents, size);
+  mark_stack_push_values (ptr->contents, size);
 }
 
 /* Like mark_vectorlike but optimized for char-tables (and
@@ -6408,23 +8039,10 @@ mark_char_table (struct Lisp_Vector *ptr, enum pvec_type pvectype)
 	    mark_char_table (XVECTOR (val), PVEC_SUB_CHAR_TABLE);
 	}
       else
-	mark_object (val);
+	mark_stack_push_value (val);
     }
 }
 
-NO_INLINE /* To reduce stack depth in mark_object.  */
-static Lisp_Object
-mark_compiled (struct Lisp_Vector *ptr)
-{
-  int i, size = ptr->header.size & PSEUDOVECTOR_SIZE_MASK;
-
-  set_vector_marked (ptr);
-  for (i = 0; i < size; i++)
-    if (i != COMPILED_CONSTANTS)
-      mark_object (ptr->contents[i]);
-  return size > COMPILED_CONSTANTS ? ptr->contents[COMPILED_CONSTANTS] : Qnil;
-}
-
 /* Mark the chain of overlays starting at PTR.  */
 
 static void
@@ -6436,7 +8054,7 @@ mark_overlay (struct Lisp_Overlay *ptr)
       /* These two are always markers and can be marked fast.  */
       set_vectorlike_marked (&XMARKER (ptr->start)->header);
       set_vectorlike_marked (&XMARKER (ptr->end)->header);
-      mark_object (ptr->plist);
+      mark_stack_push_value (ptr->plist);
     }
 }
 
@@ -6450,7 +8068,8 @@ mark_buffer (struct buffer *buffer)
 
   /* ...but there are some buffer-specific things.  */
 
-  mark_interval_tree (buffer_intervals (buffer));
+  if (!incremental_slice)
+    mark_interval_tree (buffer_intervals (buffer));
 
   /* For now, we just don't mark the undo_list.  It's done later in
      a special way just before the sweep phase, and after stripping
@@ -6459,7 +8078,7 @@ mark_buffer (struct buffer *buffer)
      for dead buffers, the undo_list should be nil (set by Fkill_buffer),
      but just to be on the safe side, we mark it here.  */
   if (!BUFFER_LIVE_P (buffer))
-      mark_object (BVAR (buffer, undo_list));
+    mark_stack_push_value (BVAR (buffer, undo_list));
 
   mark_overlay (buffer->overlays_before);
   mark_overlay (buffer->overlays_after);
@@ -6472,7 +8091,6 @@ mark_buffer (struct buffer *buffer)
 
 /* Mark Lisp faces in the face cache C.  */
 
-NO_INLINE /* To reduce stack depth in mark_object.  */
 static void
 mark_face_cache (struct face_cache *c)
 {
@@ -6487,13 +8105,12 @@ mark_face_cache (struct face_cache *c)
 	      if (face->font && !vectorlike_marked_p (&face->font->header))
 		mark_vectorlike (&face->font->header);
 
-	      mark_objects (face->lface, LFACE_VECTOR_SIZE);
+	      mark_stack_push_values (face->lface, LFACE_VECTOR_SIZE);
 	    }
 	}
     }
 }
 
-NO_INLINE /* To reduce stack depth in mark_object.  */
 static void
 mark_localized_symbol (struct Lisp_Symbol *ptr)
 {
@@ -6502,9 +8119,9 @@ mark_localized_symbol (struct Lisp_Symbol *ptr)
   /* If the value is set up for a killed buffer restore its global binding.  */
   if ((BUFFERP (where) && !BUFFER_LIVE_P (XBUFFER (where))))
     swap_in_global_binding (ptr);
-  mark_object (blv->where);
-  mark_object (blv->valcell);
-  mark_object (blv->defcell);
+  mark_stack_push_value (blv->where);
+  mark_stack_push_value (blv->valcell);
+  mark_stack_push_value (blv->defcell);
 }
 
 /* Remove killed buffers or items whose car is a killed buffer from
@@ -6539,6 +8156,8 @@ mark_frame (struct Lisp_Vector *ptr)
 {
   struct frame *f = (struct frame *) ptr;
   mark_vectorlike (&ptr->header);
+  if (incremental_slice)
+    return;
   mark_face_cache (f->face_cache);
 #ifdef HAVE_WINDOW_SYSTEM
   if (FRAME_WINDOW_P (f) && FRAME_OUTPUT_DATA (f))
@@ -6557,6 +8176,8 @@ mark_window (struct Lisp_Vector *ptr)
   struct window *w = (struct window *) ptr;
 
   mark_vectorlike (&ptr->header);
+  if (incremental_slice)
+    return;
 
   /* Mark glyph matrices, if any.  Marking window
      matrices is sufficient because frame matrices
@@ -6580,68 +8201,33 @@ mark_window (struct Lisp_Vector *ptr)
 static void
 mark_hash_table (struct Lisp_Vector *ptr)
 {
-  struct Lisp_Hash_Table *h = (struct Lisp_Hash_Table *) ptr;
-
-  mark_vectorlike (&h->header);
-  mark_object (h->test.name);
-  mark_object (h->test.user_hash_function);
-  mark_object (h->test.user_cmp_function);
-  /* If hash table is not weak, mark all keys and values.  For weak
-     tables, mark only the vector and not its contents --- that's what
-     makes it weak.  */
-  if (NILP (h->weak))
-    mark_object (h->key_and_value);
-  else
-    {
-      eassert (h->next_weak == NULL);
-      h->next_weak = weak_hash_tables;
-      weak_hash_tables = h;
-      set_vector_marked (XVECTOR (h->key_and_value));
-    }
-}
-
-void
-mark_objects (Lisp_Object *obj, ptrdiff_t n)
-{
-  for (ptrdiff_t i = 0; i < n; i++)
-    mark_object (obj[i]);
-}
-
-/* Determine type of generic Lisp_Object and mark it accordingly.
-
-   This function implements a straightforward depth-first marking
-   algorithm and so the recursion depth may be very high (a few
-   tens of thousands is not uncommon).  To minimize stack usage,
-   a few cold paths are moved out to NO_INLINE functions above.
-   In general, inlining them doesn't help you to gain more speed.  */
-
-void
-mark_object (Lisp_Object arg)
-{
-  register Lisp_Object obj;
-  void *po;
-#if GC_CHECK_MARKED_OBJECTS
-  struct mem_node *m = NULL;
-#endif
-  ptrdiff_t cdr_count = 0;
-
-  obj = arg;
- loop:
-
-  po = XPNTR (obj);
-  if (PURE_P (po))
-    return;
+  struct Lisp_Hash_Table *h = (struct Lisp_Hash_Table *) ptr;
 
-  last_marked[last_marked_index++] = obj;
-  last_marked_index &= LAST_MARKED_SIZE - 1;
+  mark_vectorlike (&h->header);
+  mark_stack_push_value (h->test.name);
+  mark_stack_push_value (h->test.user_hash_function);
+  mark_stack_push_value (h->test.user_cmp_function);
+  /* If hash table is not weak, mark all keys and values.  For weak
+     tables, mark only the vector and not its contents --- that's what
+     makes it weak.  */
+  if (NILP (h->weak))
+    mark_stack_push_value (h->key_and_value);
+  else if (!incremental_slice)
+    {
+      eassert (h->next_weak == NULL);
+      h->next_weak = weak_hash_tables;
+      weak_hash_tables = h;
+      set_vector_marked (XVECTOR (h->key_and_value));
+    }
+}
 
-  /* Perform some sanity checks on the objects marked here.  Abort if
-     we encounter an object we know is bogus.  This increases GC time
-     by ~80%.  */
+/* Perform some sanity checks on the objects marked here.  Abort if
+   we encounter an object we know is bogus.  This increases GC time
+   by ~80%.  */
 #if GC_CHECK_MARKED_OBJECTS
 
-  /* Check that the object pointed to by PO is known to be a Lisp
-     structure allocated from the heap.  */
+/* Check that the object pointed to by PO is known to be a Lisp
+   structure allocated from the heap.  */
 #define CHECK_ALLOCATED()			\
   do {						\
     if (pdumper_object_p (po))			\
@@ -6655,8 +8241,8 @@ #define CHECK_ALLOCATED()			\
       emacs_abort ();				\
   } while (0)
 
-  /* Check that the object pointed to by PO is live, using predicate
-     function LIVEP.  */
+/* Check that the object pointed to by PO is live, using predicate
+   function LIVEP.  */
 #define CHECK_LIVE(LIVEP, MEM_TYPE)		\
   do {						\
     if (pdumper_object_p (po))			\
@@ -6665,14 +8251,14 @@ #define CHECK_LIVE(LIVEP, MEM_TYPE)		\
       emacs_abort ();				\
   } while (0)
 
-  /* Check both of the above conditions, for non-symbols.  */
+/* Check both of the above conditions, for non-symbols.  */
 #define CHECK_ALLOCATED_AND_LIVE(LIVEP, MEM_TYPE) \
   do {						\
     CHECK_ALLOCATED ();				\
     CHECK_LIVE (LIVEP, MEM_TYPE);		\
   } while (false)
 
-  /* Check both of the above conditions, for symbols.  */
+/* Check both of the above conditions, for symbols.  */
 #define CHECK_ALLOCATED_AND_LIVE_SYMBOL()	\
   do {						\
     if (!c_symbol_p (ptr))			\
@@ -6689,199 +8275,241 @@ #define CHECK_ALLOCATED_AND_LIVE_SYMBOL()		((void) 0)
 
 #endif /* not GC_CHECK_MARKED_OBJECTS */
 
-  switch (XTYPE (obj))
+/* Mark the objects on the mark stack above BASE_SP, and everything
+   reachable from them, popping them as we go.
+
+   This is a depth-first traversal like the recursive one it replaces,
+   but its depth is bounded only by memory, so deeply nested data
+   cannot overflow the C stack.  The helpers above push the objects
+   they find instead of marking them, and must only be called from
+   here, or be followed by a call to this function.  */
+
+static void
+process_mark_stack (ptrdiff_t base_sp)
+{
+#if GC_CHECK_MARKED_OBJECTS
+  struct mem_node *m = NULL;
+#endif
+  ptrdiff_t cdr_count = 0;
+
+  eassume (mark_stk.sp >= base_sp && base_sp >= 0);
+
+#ifdef HAVE_GC_NURSERY
+  if (minor_gc)
     {
-    case Lisp_String:
-      {
-	register struct Lisp_String *ptr = XSTRING (obj);
-        if (string_marked_p (ptr))
-          break;
-	CHECK_ALLOCATED_AND_LIVE (live_string_p, MEM_TYPE_STRING);
-        set_string_marked (ptr);
-        mark_interval_tree (ptr->u.s.intervals);
+      process_nursery_stack (base_sp);
+      return;
+    }
+#endif
+
+  while (mark_stk.sp > base_sp)
+    {
+#ifdef HAVE_GC_INCREMENTAL
+      if (incremental_slice && incremental_slice_over ())
+	break;
+#endif
+      Lisp_Object obj = mark_stack_pop ();
+    mark_obj: ;
+      void *po = XPNTR (obj);
+      if (PURE_P (po))
+	continue;
+#if GC_PARALLEL_MARK
+      if (mark_parallel_p && mark_parallel_divert (obj))
+	continue;
+#endif
+
+      last_marked[last_marked_index++] = obj;
+      last_marked_index &= LAST_MARKED_SIZE - 1;
+
+      switch (XTYPE (obj))
+	{
+	case Lisp_String:
+	  {
+	    register struct Lisp_String *ptr = XSTRING (obj);
+	    if (string_marked_p (ptr))
+	      break;
+	    CHECK_ALLOCATED_AND_LIVE (live_string_p, MEM_TYPE_STRING);
+	    set_string_marked (ptr);
+	    if (!incremental_slice)
+	      mark_interval_tree (ptr->u.s.intervals);
 #ifdef GC_CHECK_STRING_BYTES
-	/* Check that the string size recorded in the string is the
-	   same as the one recorded in the sdata structure.  */
-	string_bytes (ptr);
+	    /* Check that the string size recorded in the string is the
+	       same as the one recorded in the sdata structure.  */
+	    string_bytes (ptr);
 #endif /* GC_CHECK_STRING_BYTES */
-      }
-      break;
+	  }
+	  break;
 
-    case Lisp_Vectorlike:
-      {
-	register struct Lisp_Vector *ptr = XVECTOR (obj);
+	case Lisp_Vectorlike:
+	  {
+	    register struct Lisp_Vector *ptr = XVECTOR (obj);
 
-	if (vector_marked_p (ptr))
-	  break;
+	    if (vector_marked_p (ptr))
+	      break;
 
-        enum pvec_type pvectype
-          = PSEUDOVECTOR_TYPE (ptr);
+	    enum pvec_type pvectype
+	      = PSEUDOVECTOR_TYPE (ptr);
 
 #ifdef GC_CHECK_MARKED_OBJECTS
-        if (!pdumper_object_p (po) && !SUBRP (obj) && !main_thread_p (po))
-          {
-	    m = mem_find (po);
-	    if (m == MEM_NIL)
-	      emacs_abort ();
-	    if (m->type == MEM_TYPE_VECTORLIKE)
-	      CHECK_LIVE (live_large_vector_p, MEM_TYPE_VECTORLIKE);
-	    else
-	      CHECK_LIVE (live_small_vector_p, MEM_TYPE_VECTOR_BLOCK);
-          }
+	    if (!pdumper_object_p (po) && !SUBRP (obj) && !main_thread_p (po))
+	      {
+		m = mem_find (po);
+		if (m == MEM_NIL)
+		  emacs_abort ();
+		if (m->type == MEM_TYPE_VECTORLIKE)
+		  CHECK_LIVE (live_large_vector_p, MEM_TYPE_VECTORLIKE);
+		else
+		  CHECK_LIVE (live_small_vector_p, MEM_TYPE_VECTOR_BLOCK);
+	      }
 #endif
 
-	switch (pvectype)
-	  {
-	  case PVEC_BUFFER:
-	    mark_buffer ((struct buffer *) ptr);
-            break;
-
-          case PVEC_COMPILED:
-            /* Although we could treat this just like a vector, mark_compiled
-               returns the COMPILED_CONSTANTS element, which is marked at the
-               next iteration of goto-loop here.  This is done to avoid a few
-               recursive calls to mark_object.  */
-            obj = mark_compiled (ptr);
-            if (!NILP (obj))
-              goto loop;
-            break;
-
-          case PVEC_FRAME:
-            mark_frame (ptr);
-            break;
-
-          case PVEC_WINDOW:
-            mark_window (ptr);
-            break;
-
-	  case PVEC_HASH_TABLE:
-            mark_hash_table (ptr);
-	    break;
-
-	  case PVEC_CHAR_TABLE:
-	  case PVEC_SUB_CHAR_TABLE:
-	    mark_char_table (ptr, (enum pvec_type) pvectype);
-	    break;
+	    switch (pvectype)
+	      {
+	      case PVEC_BUFFER:
+		mark_buffer ((struct buffer *) ptr);
+		break;
+
+	      case PVEC_FRAME:
+		mark_frame (ptr);
+		break;
+
+	      case PVEC_WINDOW:
+		mark_window (ptr);
+		break;
+
+	      case PVEC_HASH_TABLE:
+		mark_hash_table (ptr);
+		break;
+
+	      case PVEC_CHAR_TABLE:
+	      case PVEC_SUB_CHAR_TABLE:
+		mark_char_table (ptr, (enum pvec_type) pvectype);
+		break;
+
+	      case PVEC_BOOL_VECTOR:
+		/* bool vectors in a dump are permanently "marked", since
+		   they're in the old section and don't have mark bits.
+		   If we're looking at a dumped bool vector, we should
+		   have aborted above when we called vector_marked_p, so
+		   we should never get here.  */
+		eassert (!pdumper_object_p (ptr));
+		set_vector_marked (ptr);
+		break;
 
-          case PVEC_BOOL_VECTOR:
-            /* bool vectors in a dump are permanently "marked", since
-               they're in the old section and don't have mark bits.
-               If we're looking at a dumped bool vector, we should
-               have aborted above when we called vector_marked_p, so
-               we should never get here.  */
-            eassert (!pdumper_object_p (ptr));
-            set_vector_marked (ptr);
-            break;
-
-          case PVEC_OVERLAY:
-	    mark_overlay (XOVERLAY (obj));
-	    break;
+	      case PVEC_OVERLAY:
+		mark_overlay (XOVERLAY (obj));
+		break;
 
-	  case PVEC_SUBR:
+	      case PVEC_SUBR:
 #ifdef HAVE_NATIVE_COMP
-	    if (SUBR_NATIVE_COMPILEDP (obj))
-	      {
-		set_vector_marked (ptr);
-		struct Lisp_Subr *subr = XSUBR (obj);
-		mark_object (subr->native_intspec);
-		mark_object (subr->native_comp_u);
-		mark_object (subr->lambda_list);
-		mark_object (subr->type);
-	      }
+		if (SUBR_NATIVE_COMPILEDP (obj))
+		  {
+		    set_vector_marked (ptr);
+		    struct Lisp_Subr *subr = XSUBR (obj);
+		    mark_stack_push_value (subr->native_intspec);
+		    mark_stack_push_value (subr->native_comp_u);
+		    mark_stack_push_value (subr->lambda_list);
+		    mark_stack_push_value (subr->type);
+		  }
 #endif
-	    break;
+		break;
 
-	  case PVEC_FREE:
-	    emacs_abort ();
+	      case PVEC_FREE:
+		emacs_abort ();
 
-	  default:
-	    /* A regular vector, or a pseudovector needing no special
-	       treatment.  */
-	    mark_vectorlike (&ptr->header);
+	      default:
+		/* A regular vector, or a pseudovector needing no special
+		   treatment.  */
+		mark_vectorlike (&ptr->header);
+	      }
 	  }
-      }
-      break;
+	  break;
 
-    case Lisp_Symbol:
-      {
-	struct Lisp_Symbol *ptr = XSYMBOL (obj);
-      nextsym:
-        if (symbol_marked_p (ptr))
-          break;
-        CHECK_ALLOCATED_AND_LIVE_SYMBOL ();
-        set_symbol_marked (ptr);
-	/* Attempt to catch bogus objects.  */
-	eassert (valid_lisp_object_p (ptr->u.s.function));
-	mark_object (ptr->u.s.function);
-	mark_object (ptr->u.s.plist);
-	switch (ptr->u.s.redirect)
+	case Lisp_Symbol:
 	  {
-	  case SYMBOL_PLAINVAL: mark_object (SYMBOL_VAL (ptr)); break;
-	  case SYMBOL_VARALIAS:
-	    {
-	      Lisp_Object tem;
-	      XSETSYMBOL (tem, SYMBOL_ALIAS (ptr));
-	      mark_object (tem);
+	    struct Lisp_Symbol *ptr = XSYMBOL (obj);
+	  nextsym:
+	    if (symbol_marked_p (ptr))
 	      break;
-	    }
-	  case SYMBOL_LOCALIZED:
-	    mark_localized_symbol (ptr);
-	    break;
-	  case SYMBOL_FORWARDED:
-	    /* If the value is forwarded to a buffer or keyboard field,
-	       these are marked when we see the corresponding object.
-	       And if it's forwarded to a C variable, either it's not
-	       a Lisp_Object var, or it's staticpro'd already.  */
-	    break;
-	  default: emacs_abort ();
+	    CHECK_ALLOCATED_AND_LIVE_SYMBOL ();
+	    set_symbol_marked (ptr);
+	    /* Attempt to catch bogus objects.  */
+	    eassert (valid_lisp_object_p (ptr->u.s.function));
+	    mark_stack_push_value (ptr->u.s.function);
+	    mark_stack_push_value (ptr->u.s.plist);
+	    switch (ptr->u.s.redirect)
+	      {
+	      case SYMBOL_PLAINVAL:
+		mark_stack_push_value (SYMBOL_VAL (ptr));
+		break;
+	      case SYMBOL_VARALIAS:
+		{
+		  Lisp_Object tem;
+		  XSETSYMBOL (tem, SYMBOL_ALIAS (ptr));
+		  mark_stack_push_value (tem);
+		  break;
+		}
+	      case SYMBOL_LOCALIZED:
+		mark_localized_symbol (ptr);
+		break;
+	      case SYMBOL_FORWARDED:
+		/* If the value is forwarded to a buffer or keyboard field,
+		   these are marked when we see the corresponding object.
+		   And if it's forwarded to a C variable, either it's not
+		   a Lisp_Object var, or it's staticpro'd already.  */
+		break;
+	      default: emacs_abort ();
+	      }
+	    if (!PURE_P (XSTRING (ptr->u.s.name)))
+	      set_string_marked (XSTRING (ptr->u.s.name));
+	    if (!incremental_slice)
+	      mark_interval_tree (string_intervals (ptr->u.s.name));
+	    /* Inner loop to mark next symbol in this bucket, if any.  */
+	    po = ptr = ptr->u.s.next;
+	    if (ptr)
+	      goto nextsym;
 	  }
-	if (!PURE_P (XSTRING (ptr->u.s.name)))
-          set_string_marked (XSTRING (ptr->u.s.name));
-        mark_interval_tree (string_intervals (ptr->u.s.name));
-	/* Inner loop to mark next symbol in this bucket, if any.  */
-	po = ptr = ptr->u.s.next;
-	if (ptr)
-	  goto nextsym;
-      }
-      break;
-
-    case Lisp_Cons:
-      {
-	struct Lisp_Cons *ptr = XCONS (obj);
-	if (cons_marked_p (ptr))
 	  break;
-	CHECK_ALLOCATED_AND_LIVE (live_cons_p, MEM_TYPE_CONS);
-        set_cons_marked (ptr);
-	/* If the cdr is nil, avoid recursion for the car.  */
-	if (NILP (ptr->u.s.u.cdr))
+
+	case Lisp_Cons:
 	  {
+	    struct Lisp_Cons *ptr = XCONS (obj);
+	    if (cons_marked_p (ptr))
+	      break;
+	    CHECK_ALLOCATED_AND_LIVE (live_cons_p, MEM_TYPE_CONS);
+	    set_cons_marked (ptr);
+	    /* Visit the car next and leave the cdr for later, so that the
+	       stack grows with the nesting of the list and not its length.
+	       If the cdr is nil, there is nothing to leave.  */
+	    if (NILP (ptr->u.s.u.cdr))
+	      cdr_count = 0;
+	    else
+	      {
+		mark_stack_push_value (ptr->u.s.u.cdr);
+		cdr_count++;
+		if (cdr_count == mark_object_loop_halt)
+		  emacs_abort ();
+	      }
 	    obj = ptr->u.s.car;
-	    cdr_count = 0;
-	    goto loop;
+	    goto mark_obj;
 	  }
-	mark_object (ptr->u.s.car);
-	obj = ptr->u.s.u.cdr;
-	cdr_count++;
-	if (cdr_count == mark_object_loop_halt)
-	  emacs_abort ();
-	goto loop;
-      }
 
-    case Lisp_Float:
-      CHECK_ALLOCATED_AND_LIVE (live_float_p, MEM_TYPE_FLOAT);
-      /* Do not mark floats stored in a dump image: these floats are
-         "cold" and do not have mark bits.  */
-      if (pdumper_object_p (XFLOAT (obj)))
-        eassert (pdumper_cold_object_p (XFLOAT (obj)));
-      else if (!XFLOAT_MARKED_P (XFLOAT (obj)))
-        XFLOAT_MARK (XFLOAT (obj));
-      break;
+	case Lisp_Float:
+	  CHECK_ALLOCATED_AND_LIVE (live_float_p, MEM_TYPE_FLOAT);
+	  /* Do not mark floats stored in a dump image: these floats are
+	     "cold" and do not have mark bits.  */
+	  if (pdumper_object_p (XFLOAT (obj)))
+	    eassert (pdumper_cold_object_p (XFLOAT (obj)));
+	  else if (!XFLOAT_MARKED_P (XFLOAT (obj)))
+	    XFLOAT_MARK (XFLOAT (obj));
+	  break;
 
-    case_Lisp_Int:
-      break;
+	case_Lisp_Int:
+	  break;
 
-    default:
-      emacs_abort ();
+	default:
+	  emacs_abort ();
+	}
     }
 
 #undef CHECK_LIVE
@@ -6889,6 +8517,25 @@ #define CHECK_ALLOCATED_AND_LIVE_SYMBOL()		((void) 0)
 #undef CHECK_ALLOCATED_AND_LIVE
 }
 
+void
+mark_objects (Lisp_Object *obj, ptrdiff_t n)
+{
+  ptrdiff_t sp = mark_stk.sp;
+  mark_stack_push_values (obj, n);
+  process_mark_stack (sp);
+}
+
+/* Determine type of generic Lisp_Object and mark it accordingly,
+   along with everything reachable from it.  */
+
+void
+mark_object (Lisp_Object obj)
+{
+  ptrdiff_t sp = mark_stk.sp;
+  mark_stack_push_value (obj);
+  process_mark_stack (sp);
+}
+
 /* Mark the Lisp pointers in the terminal objects.
    Called by Fgarbage_collect.  */
 
@@ -6905,9 +8552,10 @@ mark_terminals (void)
 	 gets marked.  */
       mark_image_cache (t->image_cache);
 #endif /* HAVE_WINDOW_SYSTEM */
-      if (!vectorlike_marked_p (&t->header))
+      if (!minor_gc && !vectorlike_marked_p (&t->header))
 	mark_vectorlike (&t->header);
     }
+  process_mark_stack (0);
 }
 
 /* Value is non-zero if OBJ will survive the current GC because it's
@@ -6958,132 +8606,292 @@ survives_gc_p (Lisp_Object obj)
 
 
 
+/* Conses and floats are swept lazily: at the end of a GC, only the
+   block they are being allocated from is swept, and Fcons and
+   make_float sweep the other blocks one at a time as they run out of
+   free objects.  Whatever is left is swept just before the next GC.
+   The number of objects in use is known from the mark bits all the
+   same.  */
+
+/* Whether the conses and floats in use stay marked after a GC, which
+   is how the generational collector tells the old ones.  */
+#ifdef HAVE_GC_NURSERY
+enum { sticky_marks = true };
+#else
+enum { sticky_marks = false };
+#endif
+
+/* Return the number of objects marked in the mark bits BITS of a
+   block in which the first LIM objects have been allocated.  */
+
+static object_ct
+count_mark_bits (bits_word const *bits, int lim)
+{
+  object_ct n = 0;
+  for (int i = 0; i < (lim + BITS_PER_BITS_WORD - 1) / BITS_PER_BITS_WORD; i++)
+    n += (BITS_WORD_MAX <= UINT_MAX ? count_one_bits (bits[i])
+	  : BITS_WORD_MAX <= ULONG_MAX ? count_one_bits_l (bits[i])
+	  : count_one_bits_ll (bits[i]));
+  return n;
+}
+
+/* Number of free conses in the cons blocks swept since the last GC.  */
+
+static object_ct cons_sweep_free;
+
+/* Sweep the cons block *CPREV, in which the first LIM conses have
+   been allocated: put the unmarked conses on the free list and unmark
+   the others, unless they are to stay old.  If no conses in it are in
+   use and there are enough free ones elsewhere, free the block
+   instead.  Return the address of the link to the next block.  */
+
+static struct cons_block **
+sweep_cons_block (struct cons_block **cprev, int lim)
+{
+  struct cons_block *cblk = *cprev;
+  int this_free = 0;
+  int ilim = (lim + BITS_PER_BITS_WORD - 1) / BITS_PER_BITS_WORD;
+
+  /* Scan the mark bits an int at a time.  */
+  for (int i = 0; i < ilim; i++)
+    {
+      if (cblk->gcmarkbits[i] == BITS_WORD_MAX)
+	{
+	  /* Fast path - all cons cells for this int are marked.  */
+	  if (!sticky_marks)
+	    cblk->gcmarkbits[i] = 0;
+	}
+      else
+	{
+	  /* Some cons cells for this int are not marked.
+	     Find which ones, and free them.  */
+	  int start, pos, stop;
+
+	  start = i * BITS_PER_BITS_WORD;
+	  stop = lim - start;
+	  if (stop > BITS_PER_BITS_WORD)
+	    stop = BITS_PER_BITS_WORD;
+	  stop += start;
+
+	  for (pos = start; pos < stop; pos++)
+	    {
+	      struct Lisp_Cons *acons = &cblk->conses[pos];
+	      if (!XCONS_MARKED_P (acons))
+		{
+		  this_free++;
+		  cblk->conses[pos].u.s.u.chain = cons_free_list;
+		  cons_free_list = &cblk->conses[pos];
+		  cons_free_list->u.s.car = dead_object ();
+		}
+	      else if (!sticky_marks)
+		XUNMARK_CONS (acons);
+	    }
+	}
+    }
+
+  /* If this block contains only free conses and we have already
+     seen more than two blocks worth of free conses then deallocate
+     this block.  */
+  if (this_free == CONS_BLOCK_SIZE && cons_sweep_free > CONS_BLOCK_SIZE)
+    {
+      *cprev = cblk->next;
+      /* Unhook from the free list.  */
+      cons_free_list = cblk->conses[0].u.s.u.chain;
+      lisp_align_free (cblk);
+      return cprev;
+    }
+  cons_sweep_free += this_free;
+  return &cblk->next;
+}
+
+/* Sweep the cons blocks left from the last GC until there are free
+   conses or no blocks left.  If ALL, sweep all of them.  */
+
+static void
+sweep_some_conses_1 (bool all)
+{
+  while (cons_sweep_prev && (all || !cons_free_list))
+    {
+      struct cons_block **next
+	= sweep_cons_block (cons_sweep_prev, CONS_BLOCK_SIZE);
+      cons_sweep_prev = *next ? next : NULL;
+    }
+}
+
+static void
+sweep_some_conses (void)
+{
+  sweep_some_conses_1 (false);
+}
+
 NO_INLINE /* For better stack traces */
 static void
 sweep_conses (void)
 {
-  struct cons_block **cprev = &cons_block;
+  object_ct num_used = 0, num_allocated = 0;
   int lim = cons_block_index;
-  object_ct num_free = 0, num_used = 0;
 
-  cons_free_list = 0;
+  eassert (!cons_sweep_prev);
+  for (struct cons_block *cblk = cons_block; cblk; cblk = cblk->next)
+    {
+      num_used += count_mark_bits (cblk->gcmarkbits, lim);
+      num_allocated += lim;
+      lim = CONS_BLOCK_SIZE;
+    }
 
-  for (struct cons_block *cblk; (cblk = *cprev); )
+  cons_free_list = 0;
+  cons_sweep_free = 0;
+  if (cons_block)
     {
-      int i = 0;
-      int this_free = 0;
-      int ilim = (lim + BITS_PER_BITS_WORD - 1) / BITS_PER_BITS_WORD;
+      struct cons_block **next = sweep_cons_block (&cons_block,
+						   cons_block_index);
+      cons_sweep_prev = *next ? next : NULL;
+    }
+  gcstat.total_conses = num_used;
+  gcstat.total_free_conses = num_allocated - num_used;
+}
 
-      /* Scan the mark bits an int at a time.  */
-      for (i = 0; i < ilim; i++)
-        {
-          if (cblk->gcmarkbits[i] == BITS_WORD_MAX)
-            {
-              /* Fast path - all cons cells for this int are marked.  */
-              cblk->gcmarkbits[i] = 0;
-              num_used += BITS_PER_BITS_WORD;
-            }
-          else
-            {
-              /* Some cons cells for this int are not marked.
-                 Find which ones, and free them.  */
-              int start, pos, stop;
+/* Number of free floats in the float blocks swept since the last GC.  */
 
-              start = i * BITS_PER_BITS_WORD;
-              stop = lim - start;
-              if (stop > BITS_PER_BITS_WORD)
-                stop = BITS_PER_BITS_WORD;
-              stop += start;
+static object_ct float_sweep_free;
 
-              for (pos = start; pos < stop; pos++)
-                {
-		  struct Lisp_Cons *acons = &cblk->conses[pos];
-		  if (!XCONS_MARKED_P (acons))
-                    {
-                      this_free++;
-                      cblk->conses[pos].u.s.u.chain = cons_free_list;
-                      cons_free_list = &cblk->conses[pos];
-                      cons_free_list->u.s.car = dead_object ();
-                    }
-                  else
-                    {
-                      num_used++;
-		      XUNMARK_CONS (acons);
-                    }
-                }
-            }
-        }
+/* Sweep the float block *FPREV like sweep_cons_block.  */
 
-      lim = CONS_BLOCK_SIZE;
-      /* If this block contains only free conses and we have already
-         seen more than two blocks worth of free conses then deallocate
-         this block.  */
-      if (this_free == CONS_BLOCK_SIZE && num_free > CONS_BLOCK_SIZE)
-        {
-          *cprev = cblk->next;
-          /* Unhook from the free list.  */
-          cons_free_list = cblk->conses[0].u.s.u.chain;
-          lisp_align_free (cblk);
-        }
-      else
-        {
-          num_free += this_free;
-          cprev = &cblk->next;
-        }
+static struct float_block **
+sweep_float_block (struct float_block **fprev, int lim)
+{
+  struct float_block *fblk = *fprev;
+  int this_free = 0;
+
+  for (int i = 0; i < lim; i++)
+    {
+      struct Lisp_Float *afloat = &fblk->floats[i];
+      if (!XFLOAT_MARKED_P (afloat))
+	{
+	  this_free++;
+	  fblk->floats[i].u.chain = float_free_list;
+	  float_free_list = &fblk->floats[i];
+	}
+      else if (!sticky_marks)
+	XFLOAT_UNMARK (afloat);
     }
-  gcstat.total_conses = num_used;
-  gcstat.total_free_conses = num_free;
+
+  /* If this block contains only free floats and we have already
+     seen more than two blocks worth of free floats then deallocate
+     this block.  */
+  if (this_free == FLOAT_BLOCK_SIZE && float_sweep_free > FLOAT_BLOCK_SIZE)
+    {
+      *fprev = fblk->next;
+      /* Unhook from the free list.  */
+      float_free_list = fblk->floats[0].u.chain;
+      lisp_align_free (fblk);
+      return fprev;
+    }
+  float_sweep_free += this_free;
+  return &fblk->next;
+}
+
+/* Sweep the float blocks left from the last GC like
+   sweep_some_conses_1.  */
+
+static void
+sweep_some_floats_1 (bool all)
+{
+  while (float_sweep_prev && (all || !float_free_list))
+    {
+      struct float_block **next
+	= sweep_float_block (float_sweep_prev, FLOAT_BLOCK_SIZE);
+      float_sweep_prev = *next ? next : NULL;
+    }
+}
+
+static void
+sweep_some_floats (void)
+{
+  sweep_some_floats_1 (false);
 }
 
 NO_INLINE /* For better stack traces */
 static void
 sweep_floats (void)
 {
-  struct float_block **fprev = &float_block;
+  object_ct num_used = 0, num_allocated = 0;
   int lim = float_block_index;
-  object_ct num_free = 0, num_used = 0;
-
-  float_free_list = 0;
 
-  for (struct float_block *fblk; (fblk = *fprev); )
+  eassert (!float_sweep_prev);
+  for (struct float_block *fblk = float_block; fblk; fblk = fblk->next)
     {
-      int this_free = 0;
-      for (int i = 0; i < lim; i++)
-	{
-	  struct Lisp_Float *afloat = &fblk->floats[i];
-	  if (!XFLOAT_MARKED_P (afloat))
-	    {
-	      this_free++;
-	      fblk->floats[i].u.chain = float_free_list;
-	      float_free_list = &fblk->floats[i];
-	    }
-	  else
-	    {
-	      num_used++;
-	      XFLOAT_UNMARK (afloat);
-	    }
-	}
+      num_used += count_mark_bits (fblk->gcmarkbits, lim);
+      num_allocated += lim;
       lim = FLOAT_BLOCK_SIZE;
-      /* If this block contains only free floats and we have already
-         seen more than two blocks worth of free floats then deallocate
-         this block.  */
-      if (this_free == FLOAT_BLOCK_SIZE && num_free > FLOAT_BLOCK_SIZE)
-        {
-          *fprev = fblk->next;
-          /* Unhook from the free list.  */
-          float_free_list = fblk->floats[0].u.chain;
-          lisp_align_free (fblk);
-        }
-      else
-        {
-          num_free += this_free;
-          fprev = &fblk->next;
-        }
+    }
+
+  float_free_list = 0;
+  float_sweep_free = 0;
+  if (float_block)
+    {
+      struct float_block **next = sweep_float_block (&float_block,
+						     float_block_index);
+      float_sweep_prev = *next ? next : NULL;
     }
   gcstat.total_floats = num_used;
-  gcstat.total_free_floats = num_free;
+  gcstat.total_free_floats = num_allocated - num_used;
+}
+
+/* Finish sweeping the conses and floats left from the last GC, so
+   that all their mark bits are clear, or only those of the old ones
+   with the generational collector.  */
+
+static void
+finish_lazy_sweep (void)
+{
+  sweep_some_conses_1 (true);
+  sweep_some_floats_1 (true);
+}
+
+#ifdef HAVE_GC_INCREMENTAL
+
+/* Sweep one more cons block and one more float block left from the
+   last GC.  Return false if there were none left.  */
+
+static bool
+sweep_lazily_step (void)
+{
+  if (!cons_sweep_prev && !float_sweep_prev)
+    return false;
+  if (cons_sweep_prev)
+    {
+      struct cons_block **next
+	= sweep_cons_block (cons_sweep_prev, CONS_BLOCK_SIZE);
+      cons_sweep_prev = *next ? next : NULL;
+    }
+  if (float_sweep_prev)
+    {
+      struct float_block **next
+	= sweep_float_block (float_sweep_prev, FLOAT_BLOCK_SIZE);
+      float_sweep_prev = *next ? next : NULL;
+    }
+  return true;
+}
+
+#endif
+
+#if defined HAVE_GC_NURSERY || defined HAVE_GC_INCREMENTAL
+
+/* Make all conses and floats young again before a full collection,
+   or unmark them when an incremental one is abandoned.  */
+
+static void
+unmark_conses_and_floats (void)
+{
+  for (struct cons_block *cblk = cons_block; cblk; cblk = cblk->next)
+    memset (cblk->gcmarkbits, 0, sizeof cblk->gcmarkbits);
+  for (struct float_block *fblk = float_block; fblk; fblk = fblk->next)
+    memset (fblk->gcmarkbits, 0, sizeof fblk->gcmarkbits);
 }
 
+#endif
+
 NO_INLINE /* For better stack traces */
 static void
 sweep_intervals (void)
@@ -7584,6 +9392,21 @@ syms_of_alloc (void)
 If this portion is smaller than `gc-cons-threshold', this is ignored.  */);
   Vgc_cons_percentage = make_float (0.1);
 
+  DEFVAR_LISP ("gc-idle-fraction", Vgc_idle_fraction,
+	       doc: /* Portion of the consing between collections to collect early when idle.
+When Emacs is about to wait for input and at least this portion of the
+consing that `gc-cons-threshold' and `gc-cons-percentage' allow between
+garbage collections has taken place, it collects garbage right away,
+so that it rarely needs to in the middle of a command.  The threshold
+still applies as before while Emacs is busy.
+
+Each collection takes as long as before, but more of them happen while
+Emacs waits for input.  With a value of 0.5, for instance, garbage may
+be collected up to twice as often.
+If this is not a positive number, as by default, Emacs does not collect
+garbage early.  */);
+  Vgc_idle_fraction = Qnil;
+
   DEFVAR_INT ("pure-bytes-used", pure_bytes_used,
 	      doc: /* Number of bytes of shareable Lisp data allocated so far.  */);
 
@@ -7615,6 +9438,53 @@ syms_of_alloc (void)
 It can also be set to a hash-table, in which case this table is used to
 do hash-consing of the objects allocated to pure space.  */);
 
+  DEFVAR_INT ("gc-mark-threads", gc_mark_threads,
+	      doc: /* Number of threads that mark the heap during garbage collection.
+If this is more than 1, that many threads, counting the main one,
+mark the bulk of the heap in parallel.  This is experimental: it is
+meant to make collecting big heaps faster on machines with as many
+cores, but how much it gains has yet to be measured, which is why it
+is off by default.  The value is capped at 64, and ignored where
+threads are not supported and in builds that check marked objects.  */);
+  gc_mark_threads = 1;
+
+#ifdef HAVE_GC_NURSERY
+  DEFVAR_INT ("gc-minor-collections", gc_minor_collections,
+	      doc: /* Number of minor garbage collections between full ones.
+A minor collection only frees the conses and floats that became
+garbage since the last collection.  It does not mark the old conses
+and floats, but it still scans every other object in the heap, such
+as vectors, symbols and strings, for references to young ones.  Its
+pause therefore grows with the size of the whole heap rather than
+with the number of young objects, and saves less over a full one the
+fewer of the heap's objects are conses and floats.  The next
+collection is a full one anyway once minor ones kept more conses and
+floats than `gc-cons-threshold' allows between collections, and
+`garbage-collect' always does a full one.
+If this is 0, all collections are full ones.
+Generational collection is experimental, and only available in Emacs
+configured with `--with-gc-nursery'.  */);
+  gc_minor_collections = 8;
+#endif
+
+#ifdef HAVE_GC_INCREMENTAL
+  DEFVAR_LISP ("gc-incremental-slice", Vgc_incremental_slice,
+	       doc: /* Seconds of each slice of incremental garbage collection.
+If this is a positive number, garbage is not collected all at once
+when consing reaches `gc-cons-threshold'.  Instead, the heap is marked
+in slices of about this many seconds, spaced out so that marking is
+done by the time that much more consing has taken place, and also
+run while Emacs waits for input.  A final pause then marks what
+changed in the meantime and frees the garbage.  It scans every object
+in the heap other than conses and floats again, so it is only shorter
+than a full collection by the time conses and floats take to mark.
+`garbage-collect' finishes the collection in progress, if any.
+If this is nil, garbage is collected all at once.
+Incremental collection is experimental, and only available in Emacs
+configured with `--with-gc-incremental'.  */);
+  Vgc_incremental_slice = make_float (0.002);
+#endif
+
   DEFVAR_BOOL ("garbage-collection-messages", garbage_collection_messages,
 	       doc: /* Non-nil means display messages at start and end of garbage collection.  */);
   garbage_collection_messages = 0;
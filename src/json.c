@@ -20,14 +20,21 @@ Copyright (C) 2017-2022 Free Software Foundation, Inc.
 #include <config.h>
 
 #include <errno.h>
+#include <fcntl.h>
+#include <math.h>
 #include <pthread.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <c-strcase.h>
+#include <count-trailing-zeros.h>
 #include <jansson.h>
 #include <string.h>
+#ifdef __linux__
+# include <sys/epoll.h>
+#endif
 
 #include "lisp.h"
 #include "intervals.h"
@@ -35,12 +42,10 @@ Copyright (C) 2017-2022 Free Software Foundation, Inc.
 #include "thread.h"
 #include "buffer.h"
 #include "coding.h"
+#include "process.h"
+#include "systime.h"
 #include "spsupr.c"
 
-#define JSON_HAS_ERROR_CODE (JANSSON_VERSION_HEX >= 0x020B00)
-
-const int BUFFER_SIZE = 1000;
-
 #ifdef WINDOWSNT
 # include <windows.h>
 # include "w32common.h"
@@ -52,6 +57,8 @@ DEF_DLL_FN (void, json_delete, (json_t *json));
 DEF_DLL_FN (json_t *, json_array, (void));
 DEF_DLL_FN (int, json_array_append_new, (json_t *array, json_t *value));
 DEF_DLL_FN (size_t, json_array_size, (const json_t *array));
+DEF_DLL_FN (json_t *, json_array_get, (const json_t *array, size_t index));
+DEF_DLL_FN (int, json_array_extend, (json_t *array, json_t *other));
 DEF_DLL_FN (json_t *, json_object, (void));
 DEF_DLL_FN (int, json_object_set_new,
 	    (json_t *object, const char *key, json_t *value));
@@ -59,29 +66,16 @@ DEF_DLL_FN (json_t *, json_null, (void));
 DEF_DLL_FN (json_t *, json_true, (void));
 DEF_DLL_FN (json_t *, json_false, (void));
 DEF_DLL_FN (json_t *, json_integer, (json_int_t value));
+DEF_DLL_FN (json_int_t, json_integer_value, (const json_t *integer));
 DEF_DLL_FN (json_t *, json_real, (double value));
 DEF_DLL_FN (json_t *, json_stringn, (const char *value, size_t len));
 DEF_DLL_FN (char *, json_dumps, (const json_t *json, size_t flags));
 DEF_DLL_FN (int, json_dump_callback,
 	    (const json_t *json, json_dump_callback_t callback, void *data,
 	     size_t flags));
-DEF_DLL_FN (json_int_t, json_integer_value, (const json_t *integer));
-DEF_DLL_FN (double, json_real_value, (const json_t *real));
+DEF_DLL_FN (json_t *, json_object_get, (const json_t *object, const char *key));
 DEF_DLL_FN (const char *, json_string_value, (const json_t *string));
 DEF_DLL_FN (size_t, json_string_length, (const json_t *string));
-DEF_DLL_FN (json_t *, json_array_get, (const json_t *array, size_t index));
-DEF_DLL_FN (json_t *, json_object_get, (const json_t *object, const char *key));
-DEF_DLL_FN (size_t, json_object_size, (const json_t *object));
-DEF_DLL_FN (const char *, json_object_iter_key, (void *iter));
-DEF_DLL_FN (void *, json_object_iter, (json_t *object));
-DEF_DLL_FN (json_t *, json_object_iter_value, (void *iter));
-DEF_DLL_FN (void *, json_object_key_to_iter, (const char *key));
-DEF_DLL_FN (void *, json_object_iter_next, (json_t *object, void *iter));
-DEF_DLL_FN (json_t *, json_loads,
-	    (const char *input, size_t flags, json_error_t *error));
-DEF_DLL_FN (json_t *, json_load_callback,
-	    (json_load_callback_t callback, void *data, size_t flags,
-	     json_error_t *error));
 
 /* This is called by json_decref, which is an inline function.  */
 void json_delete(json_t *json)
@@ -104,30 +98,22 @@ init_json_functions (void)
   LOAD_DLL_FN (library, json_array);
   LOAD_DLL_FN (library, json_array_append_new);
   LOAD_DLL_FN (library, json_array_size);
+  LOAD_DLL_FN (library, json_array_get);
+  LOAD_DLL_FN (library, json_array_extend);
   LOAD_DLL_FN (library, json_object);
   LOAD_DLL_FN (library, json_object_set_new);
   LOAD_DLL_FN (library, json_null);
   LOAD_DLL_FN (library, json_true);
   LOAD_DLL_FN (library, json_false);
   LOAD_DLL_FN (library, json_integer);
+  LOAD_DLL_FN (library, json_integer_value);
   LOAD_DLL_FN (library, json_real);
   LOAD_DLL_FN (library, json_stringn);
   LOAD_DLL_FN (library, json_dumps);
   LOAD_DLL_FN (library, json_dump_callback);
-  LOAD_DLL_FN (library, json_integer_value);
-  LOAD_DLL_FN (library, json_real_value);
+  LOAD_DLL_FN (library, json_object_get);
   LOAD_DLL_FN (library, json_string_value);
   LOAD_DLL_FN (library, json_string_length);
-  LOAD_DLL_FN (library, json_array_get);
-  LOAD_DLL_FN (library, json_object_get);
-  LOAD_DLL_FN (library, json_object_size);
-  LOAD_DLL_FN (library, json_object_iter_key);
-  LOAD_DLL_FN (library, json_object_iter);
-  LOAD_DLL_FN (library, json_object_iter_value);
-  LOAD_DLL_FN (library, json_object_key_to_iter);
-  LOAD_DLL_FN (library, json_object_iter_next);
-  LOAD_DLL_FN (library, json_loads);
-  LOAD_DLL_FN (library, json_load_callback);
 
   init_json ();
 
@@ -138,30 +124,22 @@ #define json_set_alloc_funcs fn_json_set_alloc_funcs
 #define json_array fn_json_array
 #define json_array_append_new fn_json_array_append_new
 #define json_array_size fn_json_array_size
+#define json_array_get fn_json_array_get
+#define json_array_extend fn_json_array_extend
 #define json_object fn_json_object
 #define json_object_set_new fn_json_object_set_new
 #define json_null fn_json_null
 #define json_true fn_json_true
 #define json_false fn_json_false
 #define json_integer fn_json_integer
+#define json_integer_value fn_json_integer_value
 #define json_real fn_json_real
 #define json_stringn fn_json_stringn
 #define json_dumps fn_json_dumps
 #define json_dump_callback fn_json_dump_callback
-#define json_integer_value fn_json_integer_value
-#define json_real_value fn_json_real_value
+#define json_object_get fn_json_object_get
 #define json_string_value fn_json_string_value
 #define json_string_length fn_json_string_length
-#define json_array_get fn_json_array_get
-#define json_object_get fn_json_object_get
-#define json_object_size fn_json_object_size
-#define json_object_iter_key fn_json_object_iter_key
-#define json_object_iter fn_json_object_iter
-#define json_object_iter_value fn_json_object_iter_value
-#define json_object_key_to_iter fn_json_object_key_to_iter
-#define json_object_iter_next fn_json_object_iter_next
-#define json_loads fn_json_loads
-#define json_load_callback fn_json_load_callback
 
 #endif	/* WINDOWSNT */
 
@@ -193,35 +171,15 @@ json_free (void *ptr)
   free (ptr);
 }
 
+static void json_init_scan (void);
+
 void
 init_json (void)
 {
   json_set_alloc_funcs (json_malloc, json_free);
+  json_init_scan ();
 }
 
-#if !JSON_HAS_ERROR_CODE
-
-/* Return whether STRING starts with PREFIX.  */
-
-static bool
-json_has_prefix (const char *string, const char *prefix)
-{
-  return strncmp (string, prefix, strlen (prefix)) == 0;
-}
-
-/* Return whether STRING ends with SUFFIX.  */
-
-static bool
-json_has_suffix (const char *string, const char *suffix)
-{
-  size_t string_len = strlen (string);
-  size_t suffix_len = strlen (suffix);
-  return string_len >= suffix_len
-    && memcmp (string + string_len - suffix_len, suffix, suffix_len) == 0;
-}
-
-#endif
-
 /* Note that all callers of make_string_from_utf8 and build_string_from_utf8
    below either pass only value UTF-8 strings or use the functionf for
    formatting error messages; in the latter case correctness isn't
@@ -237,7 +195,7 @@ json_encode (Lisp_Object string)
 {
   /* FIXME: Raise an error if STRING is not a scalar value
      sequence.  */
-  return encode_string_utf_8 (string, Qnil, false, Qt, Qt);
+  return encode_string_utf_8 (string, Qnil, true, Qt, Qt);
 }
 
 static AVOID
@@ -246,41 +204,6 @@ json_out_of_memory (void)
   xsignal0 (Qjson_out_of_memory);
 }
 
-/* Signal a Lisp error corresponding to the JSON ERROR.  */
-
-static AVOID
-json_parse_error (const json_error_t *error)
-{
-  Lisp_Object symbol;
-#if JSON_HAS_ERROR_CODE
-  switch (json_error_code (error))
-    {
-    case json_error_premature_end_of_input:
-      symbol = Qjson_end_of_file;
-      break;
-    case json_error_end_of_input_expected:
-      symbol = Qjson_trailing_content;
-      break;
-    default:
-      symbol = Qjson_parse_error;
-      break;
-    }
-#else
-  if (json_has_suffix (error->text, "expected near end of file"))
-    symbol = Qjson_end_of_file;
-  else if (json_has_prefix (error->text, "end of file expected"))
-    symbol = Qjson_trailing_content;
-  else
-    symbol = Qjson_parse_error;
-#endif
-  xsignal (symbol,
-           list5 (build_string_from_utf8 (error->text),
-                  build_string_from_utf8 (error->source),
-		  INT_TO_INTEGER (error->line),
-                  INT_TO_INTEGER (error->column),
-		  INT_TO_INTEGER (error->position)));
-}
-
 static void
 json_release_object (void *object)
 {
@@ -791,557 +714,5252 @@ DEFUN ("json-insert", Fjson_insert, Sjson_insert, 1, MANY,
   return unbind_to (count, Qnil);
 }
 
-/* Convert a JSON object to a Lisp object.  */
+/* Direct JSON-to-Lisp parser.  It builds Lisp objects straight from
+   the JSON text, without an intermediate Jansson tree.  */
 
-static Lisp_Object ARG_NONNULL ((1))
-json_to_lisp (json_t *json, const struct json_configuration *conf)
+struct json_parser
 {
-  switch (json_typeof (json))
-    {
-    case JSON_NULL:
-      return conf->null_object;
-    case JSON_FALSE:
-      return conf->false_object;
-    case JSON_TRUE:
-      return Qt;
-    case JSON_INTEGER:
-      {
-	json_int_t i = json_integer_value (json);
-	return INT_TO_INTEGER (i);
-      }
-    case JSON_REAL:
-      return make_float (json_real_value (json));
-    case JSON_STRING:
-      return make_string_from_utf8 (json_string_value (json),
-				    json_string_length (json));
-    case JSON_ARRAY:
-      {
-        if (++lisp_eval_depth > max_lisp_eval_depth)
-          xsignal0 (Qjson_object_too_deep);
-        size_t size = json_array_size (json);
-        if (PTRDIFF_MAX < size)
-          overflow_error ();
-        Lisp_Object result;
-        switch (conf->array_type)
-          {
-          case json_array_array:
-            {
-              result = make_vector (size, Qunbound);
-              for (ptrdiff_t i = 0; i < size; ++i)
-                {
-                  rarely_quit (i);
-                  ASET (result, i,
-                        json_to_lisp (json_array_get (json, i), conf));
-                }
-              break;
-            }
-          case json_array_list:
-            {
-              result = Qnil;
-              for (ptrdiff_t i = size - 1; i >= 0; --i)
-                {
-                  rarely_quit (i);
-                  result = Fcons (json_to_lisp (json_array_get (json, i), conf),
-                                  result);
-                }
-              break;
-            }
-          default:
-            /* Can't get here.  */
-            emacs_abort ();
-          }
-        --lisp_eval_depth;
-        return result;
-      }
-    case JSON_OBJECT:
+  /* The input, and the next byte to read.  */
+  const unsigned char *begin;
+  const unsigned char *current;
+  const unsigned char *end;
+  /* Name of the input in error messages.  */
+  const char *source;
+  const struct json_configuration *conf;
+  /* Whether "\u0000" is allowed in strings.  */
+  bool allow_nul;
+  /* Stack of the elements, keys and values of the arrays and objects
+     being parsed.  Garbage collection cannot happen while parsing, so
+     the objects need not be protected.  */
+  Lisp_Object *objects;
+  ptrdiff_t objects_size;
+  ptrdiff_t objects_used;
+  /* The unescaped bytes of the last string or number parsed.  */
+  unsigned char *bytes;
+  ptrdiff_t bytes_size;
+};
+
+static void
+json_parser_done (void *parser)
+{
+  struct json_parser *p = parser;
+  xfree (p->objects);
+  xfree (p->bytes);
+}
+
+/* Signal an error of type SYMBOL at the current position of P, with
+   the same data as Jansson's errors: TEXT, the name of the input, and
+   the line, column and byte position.  */
+
+static AVOID
+json_parser_error (struct json_parser *p, Lisp_Object symbol,
+		   const char *text)
+{
+  intmax_t line = 1;
+  const unsigned char *line_start = p->begin;
+  for (const unsigned char *q = p->begin; q < p->current; q++)
+    if (*q == '\n')
       {
-        if (++lisp_eval_depth > max_lisp_eval_depth)
-          xsignal0 (Qjson_object_too_deep);
-        Lisp_Object result;
-        switch (conf->object_type)
-          {
-          case json_object_hashtable:
-            {
-              size_t size = json_object_size (json);
-              if (FIXNUM_OVERFLOW_P (size))
-                overflow_error ();
-              result = CALLN (Fmake_hash_table, QCtest, Qequal, QCsize,
-                              make_fixed_natnum (size));
-              struct Lisp_Hash_Table *h = XHASH_TABLE (result);
-              const char *key_str;
-              json_t *value;
-              json_object_foreach (json, key_str, value)
-                {
-		  Lisp_Object key = build_string_from_utf8 (key_str), hash;
-                  ptrdiff_t i = hash_lookup (h, key, &hash);
-                  /* Keys in JSON objects are unique, so the key can't
-                     be present yet.  */
-                  eassert (i < 0);
-                  hash_put (h, key, json_to_lisp (value, conf), hash);
-                }
-              break;
-            }
-          case json_object_alist:
-            {
-              result = Qnil;
-              const char *key_str;
-              json_t *value;
-              json_object_foreach (json, key_str, value)
-                {
-                  Lisp_Object key
-		    = Fintern (build_string_from_utf8 (key_str), Qnil);
-                  result
-                    = Fcons (Fcons (key, json_to_lisp (value, conf)),
-                             result);
-                }
-              result = Fnreverse (result);
-              break;
-            }
-          case json_object_plist:
-            {
-              result = Qnil;
-              const char *key_str;
-              json_t *value;
-              json_object_foreach (json, key_str, value)
-                {
-                  USE_SAFE_ALLOCA;
-                  ptrdiff_t key_str_len = strlen (key_str);
-                  char *keyword_key_str = SAFE_ALLOCA (1 + key_str_len + 1);
-                  keyword_key_str[0] = ':';
-                  strcpy (&keyword_key_str[1], key_str);
-                  Lisp_Object key = intern_1 (keyword_key_str, key_str_len + 1);
-                  /* Build the plist as value-key since we're going to
-                     reverse it in the end.*/
-                  result = Fcons (key, result);
-                  result = Fcons (json_to_lisp (value, conf), result);
-                  SAFE_FREE ();
-                }
-              result = Fnreverse (result);
-              break;
-            }
-          default:
-            /* Can't get here.  */
-            emacs_abort ();
-          }
-        --lisp_eval_depth;
-        return result;
+	line++;
+	line_start = q + 1;
       }
-    }
-  /* Can't get here.  */
-  emacs_abort ();
+  xsignal (symbol,
+	   list5 (build_string (text), build_string (p->source),
+		  INT_TO_INTEGER (line),
+		  INT_TO_INTEGER (p->current - line_start),
+		  INT_TO_INTEGER (p->current - p->begin)));
 }
 
-DEFUN ("json-parse-string", Fjson_parse_string, Sjson_parse_string, 1, MANY,
-       NULL,
-       doc: /* Parse the JSON STRING into a Lisp object.
-This is essentially the reverse operation of `json-serialize', which
-see.  The returned object will be the JSON null value, the JSON false
-value, t, a number, a string, a vector, a list, a hashtable, an alist,
-or a plist.  Its elements will be further objects of these types.  If
-there are duplicate keys in an object, all but the last one are
-ignored.  If STRING doesn't contain a valid JSON object, this function
-signals an error of type `json-parse-error'.
+/* Signal json-end-of-file if P is at the end of its input, and
+   json-parse-error with TEXT otherwise.  */
 
-The arguments ARGS are a list of keyword/argument pairs:
+static AVOID
+json_parser_unexpected (struct json_parser *p, const char *text)
+{
+  if (p->current == p->end)
+    json_parser_error (p, Qjson_end_of_file, "unexpected end of input");
+  json_parser_error (p, Qjson_parse_error, text);
+}
 
-The keyword argument `:object-type' specifies which Lisp type is used
-to represent objects; it can be `hash-table', `alist' or `plist'.  It
-defaults to `hash-table'.
+/* Skip whitespace and return the next byte, or -1 at the end of
+   input.  */
 
-The keyword argument `:array-type' specifies which Lisp type is used
-to represent arrays; it can be `array' (the default) or `list'.
+static int
+json_skip_whitespace (struct json_parser *p)
+{
+  for (; p->current < p->end; p->current++)
+    switch (*p->current)
+      {
+      case ' ': case '\t': case '\n': case '\r':
+	break;
+      default:
+	return *p->current;
+      }
+  return -1;
+}
 
-The keyword argument `:null-object' specifies which object to use
-to represent a JSON null value.  It defaults to `:null'.
+static void
+json_parser_push (struct json_parser *p, Lisp_Object object)
+{
+  if (p->objects_used == p->objects_size)
+    p->objects = xpalloc (p->objects, &p->objects_size, 1, -1,
+			  sizeof *p->objects);
+  p->objects[p->objects_used++] = object;
+}
 
-The keyword argument `:false-object' specifies which object to use to
-represent a JSON false value.  It defaults to `:false'.
-usage: (json-parse-string STRING &rest ARGS) */)
-  (ptrdiff_t nargs, Lisp_Object *args)
+/* Make room for N more bytes after the first USED bytes of P's byte
+   workspace.  */
+
+static void
+json_parser_reserve_bytes (struct json_parser *p, ptrdiff_t used,
+			   ptrdiff_t n)
 {
-  ptrdiff_t count = SPECPDL_INDEX ();
+  if (p->bytes_size - used < n)
+    p->bytes = xpalloc (p->bytes, &p->bytes_size,
+			n - (p->bytes_size - used), -1, 1);
+}
 
-#ifdef WINDOWSNT
-  if (!json_initialized)
+/* Return the length of the valid UTF-8 sequence starting at S, whose
+   first byte is not ASCII and which ends before END, or 0 if it is
+   invalid.  Overlong forms, surrogates and code points above U+10FFFF
+   are invalid.  This and the other json_scan_* functions do not need
+   the global lock.  */
+
+static int
+json_scan_utf8 (const unsigned char *s, const unsigned char *end)
+{
+  ptrdiff_t avail = end - s;
+  int len;
+  unsigned char lo = 0x80, hi = 0xBF;
+  if (0xC2 <= s[0] && s[0] <= 0xDF)
+    len = 2;
+  else if (0xE0 <= s[0] && s[0] <= 0xEF)
     {
-      Lisp_Object status;
-      json_initialized = init_json_functions ();
-      status = json_initialized ? Qt : Qnil;
-      Vlibrary_cache = Fcons (Fcons (Qjson, status), Vlibrary_cache);
+      len = 3;
+      if (s[0] == 0xE0)
+	lo = 0xA0;
+      else if (s[0] == 0xED)
+	hi = 0x9F;
     }
-  if (!json_initialized)
-    Fsignal (Qjson_unavailable,
-	     list1 (build_unibyte_string ("jansson library not found")));
-#endif
-
-  Lisp_Object string = args[0];
-  CHECK_STRING (string);
-  Lisp_Object encoded = json_encode (string);
-  check_string_without_embedded_nulls (encoded);
-  struct json_configuration conf =
-    {json_object_hashtable, json_array_array, QCnull, QCfalse};
-  json_parse_args (nargs - 1, args + 1, &conf, true);
-
-  json_error_t error;
-  json_t *object
-    = json_loads (SSDATA (encoded), JSON_DECODE_ANY, &error);
-  if (object == NULL)
-    json_parse_error (&error);
+  else if (0xF0 <= s[0] && s[0] <= 0xF4)
+    {
+      len = 4;
+      if (s[0] == 0xF0)
+	lo = 0x90;
+      else if (s[0] == 0xF4)
+	hi = 0x8F;
+    }
+  else
+    return 0;
+  if (avail < len || s[1] < lo || hi < s[1])
+    return 0;
+  for (int i = 2; i < len; i++)
+    if ((s[i] & 0xC0) != 0x80)
+      return 0;
+  return len;
+}
 
-  /* Avoid leaking the object in case of further errors.  */
-  if (object != NULL)
-    record_unwind_protect_ptr (json_release_object, object);
+/* Return the first byte in [S, END) that cannot be copied verbatim
+   from a JSON string, that is, a quote, a backslash, a control
+   character or a non-ASCII byte, or END if there is none.  */
 
-  return unbind_to (count, json_to_lisp (object, &conf));
+static const unsigned char *
+json_scan_plain_1 (const unsigned char *s, const unsigned char *end)
+{
+  while (s < end && 0x20 <= *s && *s < 0x80 && *s != '"' && *s != '\\')
+    s++;
+  return s;
 }
 
-// JSONRPC
-
-#define ERROR_BUFFER_SIZE 1024 * 1024 * 4
+#if defined __x86_64__ && defined __GNUC__
+# define JSON_SCAN_SIMD true
+# include <immintrin.h>
 
-struct json_rpc_state
-{
-  pthread_mutex_t handle_mx;
-  struct SSP_Handle* handle;
-  json_t* message;
-  json_error_t error;
-  bool done;
-  char error_buffer[ERROR_BUFFER_SIZE + 1];
-  int error_buffer_read;
-};
+/* SSE2 is part of the x86-64 baseline, so this needs no runtime
+   check.  Comparing as signed bytes, both control characters and
+   non-ASCII bytes are less than 0x20.  */
 
-/* Usage:
- * if (can_use_handle (state))
- *   {
- *     ... use state->handle
- *     end_using_handle (state);
- *   }
- */
-inline static void
-end_using_handle (struct json_rpc_state *state)
-{
-  assert (state->handle);
-  pthread_mutex_unlock (&state->handle_mx);
-}
-inline static int
-can_use_handle (struct json_rpc_state *state)
+static const unsigned char *
+json_scan_plain_sse2 (const unsigned char *s, const unsigned char *end)
 {
-  if (pthread_mutex_lock (&state->handle_mx) == 0)
+  const __m128i space = _mm_set1_epi8 (0x20);
+  const __m128i quote = _mm_set1_epi8 ('"');
+  const __m128i backslash = _mm_set1_epi8 ('\\');
+  for (; end - s >= 16; s += 16)
     {
-      if (state->handle)
-	return 1; /* handle is good */
-      /* else handle is already gone */
-      end_using_handle (state);
+      __m128i v = _mm_loadu_si128 ((const __m128i *) s);
+      __m128i special = _mm_or_si128 (_mm_cmplt_epi8 (v, space),
+				      _mm_or_si128 (_mm_cmpeq_epi8 (v, quote),
+						    _mm_cmpeq_epi8 (v, backslash)));
+      int mask = _mm_movemask_epi8 (special);
+      if (mask != 0)
+	return s + count_trailing_zeros (mask);
     }
-  return 0;
+  return json_scan_plain_1 (s, end);
 }
 
-inline static void
-CHECK_RPC_CONNECTION (Lisp_Object obj)
+__attribute__ ((target ("avx2"))) static const unsigned char *
+json_scan_plain_avx2 (const unsigned char *s, const unsigned char *end)
 {
-  CHECK_TYPE (USER_PTRP (obj), Quser_ptrp, obj);
+  const __m256i space = _mm256_set1_epi8 (0x20);
+  const __m256i quote = _mm256_set1_epi8 ('"');
+  const __m256i backslash = _mm256_set1_epi8 ('\\');
+  for (; end - s >= 32; s += 32)
+    {
+      __m256i v = _mm256_loadu_si256 ((const __m256i *) s);
+      __m256i special
+	= _mm256_or_si256 (_mm256_cmpgt_epi8 (space, v),
+			   _mm256_or_si256 (_mm256_cmpeq_epi8 (v, quote),
+					    _mm256_cmpeq_epi8 (v, backslash)));
+      unsigned int mask = _mm256_movemask_epi8 (special);
+      if (mask != 0)
+	return s + count_trailing_zeros (mask);
+    }
+  return json_scan_plain_sse2 (s, end);
 }
 
+static const unsigned char *(*json_scan_plain) (const unsigned char *,
+						const unsigned char *)
+  = json_scan_plain_sse2;
+#else
+# define JSON_SCAN_SIMD false
+# define json_scan_plain json_scan_plain_1
+#endif
+
+/* Pick the fastest implementation of json_scan_plain the CPU
+   supports.  */
+
 static void
-json_rpc_state_free (void *ptr)
+json_init_scan (void)
 {
-  struct json_rpc_state *state = ptr;
-  assert (state->handle == NULL); /* Loop must be exited */
-  pthread_mutex_destroy (&state->handle_mx);
-  free (state);
+#if JSON_SCAN_SIMD
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("avx2"))
+    json_scan_plain = json_scan_plain_avx2;
+#endif
 }
 
+/* Return the value of the four hex digits at S, or -1 if they are not
+   hex digits.  */
 
-DEFUN ("json-rpc-connection", Fjson_rpc_connection, Sjson_rpc_connection, 1, MANY,
-       NULL,
-       doc: /* Create JSONRPC connection. */)
-  (ptrdiff_t nargs, Lisp_Object *args)
+static int
+json_scan_hex4 (const unsigned char *s)
 {
-  USE_SAFE_ALLOCA;
-  char **new_argv;
-  SAFE_NALLOCA (new_argv, 1, nargs + 1);
-  new_argv[nargs] = NULL;
-
-  for (int i = 0; i < nargs; i++)
+  int value = 0;
+  for (int i = 0; i < 4; i++)
     {
-      CHECK_STRING (args[i]);
-      new_argv[i] = SSDATA (args[i]);
+      int c = s[i], digit;
+      if ('0' <= c && c <= '9')
+	digit = c - '0';
+      else if ('a' <= c && c <= 'f')
+	digit = c - 'a' + 10;
+      else if ('A' <= c && c <= 'F')
+	digit = c - 'A' + 10;
+      else
+	return -1;
+      value = (value << 4) | digit;
     }
+  return value;
+}
 
-  struct SSP_Opts opts;
-  memset(&opts, 0, sizeof(opts));
-  opts.binary = new_argv[0];
-  opts.argv = new_argv;
-  opts.read_timeout_ms = -1;
-  struct SSP_Handle* handle = ssp_spawn(&opts);
-  if (!handle)
+/* Parse four hex digits at P's current position.  */
+
+static int
+json_parse_hex4 (struct json_parser *p)
+{
+  if (p->end - p->current < 4)
     {
-      Fsignal (Qerror, list1 (build_string ("Failed to start process.")));
+      p->current = p->end;
+      json_parser_unexpected (p, "invalid escape");
     }
-  else
+  int value = json_scan_hex4 (p->current);
+  if (value < 0)
+    json_parser_error (p, Qjson_parse_error, "invalid escape");
+  p->current += 4;
+  return value;
+}
+
+/* Parse the rest of a string whose opening quote has been consumed,
+   and store its unescaped UTF-8 bytes in P's byte workspace after
+   PREFIX bytes left for the caller.  Return the total number of bytes
+   and store the number of characters they encode in *NCHARS.  */
+
+static ptrdiff_t
+json_parse_string_bytes (struct json_parser *p, ptrdiff_t prefix,
+			 ptrdiff_t *nchars)
+{
+  ptrdiff_t used = prefix;
+  ptrdiff_t chars = prefix;
+  for (;;)
     {
-      struct json_rpc_state *state = malloc (sizeof (struct json_rpc_state));
-      /* TODO: state might be NULL */
-      pthread_mutex_init (&state->handle_mx, NULL);
-      /* TODO: mutex_init could fail */
-      state->handle = handle;
-      state->done = false;
-      state->error_buffer_read = 0;
-      SAFE_FREE ();
-      return make_user_ptr (json_rpc_state_free, state);
+      /* Copy the longest run of plain ASCII characters at once.  */
+      const unsigned char *run = json_scan_plain (p->current, p->end);
+      ptrdiff_t n = run - p->current;
+      json_parser_reserve_bytes (p, used, n + MAX_MULTIBYTE_LENGTH);
+      memcpy (p->bytes + used, p->current, n);
+      used += n;
+      chars += n;
+      p->current = run;
+
+      if (p->current == p->end)
+	json_parser_unexpected (p, "unterminated string");
+      int c = *p->current;
+      if (c == '"')
+	{
+	  p->current++;
+	  *nchars = chars;
+	  return used;
+	}
+      else if (c == '\\')
+	{
+	  p->current++;
+	  if (p->current == p->end)
+	    json_parser_unexpected (p, "invalid escape");
+	  int code;
+	  switch (*p->current++)
+	    {
+	    case '"': code = '"'; break;
+	    case '\\': code = '\\'; break;
+	    case '/': code = '/'; break;
+	    case 'b': code = '\b'; break;
+	    case 'f': code = '\f'; break;
+	    case 'n': code = '\n'; break;
+	    case 'r': code = '\r'; break;
+	    case 't': code = '\t'; break;
+	    case 'u':
+	      code = json_parse_hex4 (p);
+	      if (0xDC00 <= code && code <= 0xDFFF)
+		json_parser_error (p, Qjson_parse_error,
+				   "invalid Unicode escape");
+	      if (0xD800 <= code && code <= 0xDBFF)
+		{
+		  if (p->end - p->current < 2
+		      || p->current[0] != '\\' || p->current[1] != 'u')
+		    json_parser_error (p, Qjson_parse_error,
+				       "invalid Unicode escape");
+		  p->current += 2;
+		  int low = json_parse_hex4 (p);
+		  if (!(0xDC00 <= low && low <= 0xDFFF))
+		    json_parser_error (p, Qjson_parse_error,
+				       "invalid Unicode escape");
+		  code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+		}
+	      if (code == 0 && !p->allow_nul)
+		json_parser_error (p, Qjson_parse_error,
+				   "\\u0000 is not allowed");
+	      break;
+	    default:
+	      p->current--;
+	      json_parser_error (p, Qjson_parse_error, "invalid escape");
+	    }
+	  used += CHAR_STRING (code, p->bytes + used);
+	  chars++;
+	}
+      else if (c < 0x20)
+	json_parser_error (p, Qjson_parse_error,
+			   "control character in string");
+      else
+	{
+	  int len = json_scan_utf8 (p->current, p->end);
+	  if (len == 0)
+	    json_parser_error (p, Qjson_parse_error, "invalid UTF-8");
+	  memcpy (p->bytes + used, p->current, len);
+	  p->current += len;
+	  used += len;
+	  chars++;
+	}
     }
 }
 
-struct json_rpc_send_params
-{
-  struct json_rpc_state *state;
-  json_t* message;
-};
+/* Number of slots of json_key_cache, a power of two, and how many
+   consecutive slots a key may occupy.  */
+#define JSON_KEY_CACHE_SIZE 1024
+#define JSON_KEY_CACHE_PROBES 4
 
-static void
-json_rpc_send_callback (void * arg)
+/* Cache of the symbols and keywords recently used as object keys,
+   indexed by the hash of their names.  Objects in JSON texts keep
+   reusing the same few keys, and this is cheaper than looking them up
+   in the obarray each time.  Only symbols interned in the initial
+   obarray, which is JSON_KEY_CACHE_OBARRAY once known, are cached.
+   Both are staticpro'd, so the cache is marked by the garbage
+   collector and dumped like any other Lisp data.  */
+static Lisp_Object json_key_cache;
+static Lisp_Object json_key_cache_obarray;
+
+/* Return the symbol whose name is the NBYTES bytes of UTF-8 at STR,
+   which encode NCHARS characters, interning it if needed.  */
+
+static Lisp_Object
+json_intern (const char *str, ptrdiff_t nchars, ptrdiff_t nbytes)
 {
-  struct json_rpc_send_params *param = arg;
-  struct json_rpc_state *state = param->state;
-  json_t *message = param->message;
-  struct thread_state *self = current_thread;
+  Lisp_Object obarray = check_obarray (Vobarray);
+  bool cached = EQ (obarray, json_key_cache_obarray);
+  EMACS_UINT hash = hash_string (str, nbytes);
+  if (cached)
+    for (int i = 0; i < JSON_KEY_CACHE_PROBES; i++)
+      {
+	Lisp_Object symbol
+	  = AREF (json_key_cache, (hash + i) % JSON_KEY_CACHE_SIZE);
+	if (NILP (symbol))
+	  break;
+	/* A symbol uninterned since it was cached doesn't count.  */
+	Lisp_Object name = SYMBOL_NAME (symbol);
+	if (SBYTES (name) == nbytes && memcmp (SDATA (name), str, nbytes) == 0
+	    && SYMBOL_INTERNED_IN_INITIAL_OBARRAY_P (symbol))
+	  return symbol;
+      }
 
-  if (can_use_handle (state))
-    {
-      release_global_lock ();
-      sys_thread_yield ();
+  Lisp_Object symbol = oblookup (obarray, str, nchars, nbytes);
+  if (!SYMBOLP (symbol))
+    symbol = intern_driver (make_specified_string (str, nchars, nbytes,
+						   nchars != nbytes),
+			    obarray, symbol);
 
-      char *string = json_dumps (message, JSON_COMPACT | JSON_ENCODE_ANY);
-      /* TODO: no point in copying whole message */
-      size_t size = strlen (string);
-      char *msg = malloc (size + 100);
-      /* TODO: missing test if msg != NULL */
-      sprintf (msg, "Content-Length: %zu\r\n\r\n%s", size, string);
-      /* TODO: send could do a partial send */
-      state->handle->send (state->handle, msg, strlen(msg));
-      end_using_handle (state);
-      free (msg);
-      free (string);
-      acquire_global_lock (self);
+  if (SYMBOL_INTERNED_IN_INITIAL_OBARRAY_P (symbol))
+    {
+      json_key_cache_obarray = obarray;
+      /* Take the first free slot, or evict the key's home slot.  */
+      ptrdiff_t slot = hash % JSON_KEY_CACHE_SIZE;
+      for (int i = 0; i < JSON_KEY_CACHE_PROBES; i++)
+	if (NILP (AREF (json_key_cache, (hash + i) % JSON_KEY_CACHE_SIZE)))
+	  {
+	    slot = (hash + i) % JSON_KEY_CACHE_SIZE;
+	    break;
+	  }
+      ASET (json_key_cache, slot, symbol);
     }
+  return symbol;
 }
 
-static struct json_rpc_state * json_rpc_state(Lisp_Object connection) {
-  return XUSER_PTR (connection)->p;
+static Lisp_Object json_parse_value (struct json_parser *);
+
+/* Scan the number at *S, which ends before END, and advance *S past
+   it.  Set *IS_FLOAT if it has a fraction or exponent.  If it is
+   invalid, return false with *S at the offending byte.  */
+
+static bool
+json_scan_number (const unsigned char **s, const unsigned char *end,
+		  bool *is_float)
+{
+  const unsigned char *q = *s;
+  *is_float = false;
+  if (*q == '-')
+    q++;
+  if (q < end && *q == '0')
+    q++;
+  else if (q < end && '1' <= *q && *q <= '9')
+    while (q < end && '0' <= *q && *q <= '9')
+      q++;
+  else
+    goto invalid;
+  if (q < end && *q == '.')
+    {
+      q++;
+      if (!(q < end && '0' <= *q && *q <= '9'))
+	goto invalid;
+      while (q < end && '0' <= *q && *q <= '9')
+	q++;
+      *is_float = true;
+    }
+  if (q < end && (*q == 'e' || *q == 'E'))
+    {
+      q++;
+      if (q < end && (*q == '+' || *q == '-'))
+	q++;
+      if (!(q < end && '0' <= *q && *q <= '9'))
+	goto invalid;
+      while (q < end && '0' <= *q && *q <= '9')
+	q++;
+      *is_float = true;
+    }
+  *s = q;
+  return true;
+
+ invalid:
+  *s = q;
+  return false;
 }
 
-DEFUN ("json-rpc-send", Fjson_rpc_send, Sjson_rpc_send, 1, MANY,
+/* Parse a number starting at P's current position.  */
+
+static Lisp_Object
+json_parse_number (struct json_parser *p)
+{
+  const unsigned char *start = p->current;
+  bool is_float;
+  if (!json_scan_number (&p->current, p->end, &is_float))
+    json_parser_unexpected (p, "invalid number");
+  const unsigned char *q = p->current;
+
+  ptrdiff_t len = q - start;
+  bool negative = *start == '-';
+  /* Integers of up to 18 digits cannot overflow intmax_t.  */
+  if (!is_float && len - negative <= 18)
+    {
+      intmax_t value = 0;
+      for (const unsigned char *d = start + negative; d < q; d++)
+	value = value * 10 + (*d - '0');
+      return make_int (negative ? -value : value);
+    }
+
+  json_parser_reserve_bytes (p, 0, len + 1);
+  memcpy (p->bytes, start, len);
+  p->bytes[len] = '\0';
+  if (!is_float)
+    return string_to_number ((char *) p->bytes, 10, NULL);
+  double value = strtod ((char *) p->bytes, NULL);
+  if (isinf (value))
+    {
+      p->current = start;
+      json_parser_error (p, Qjson_parse_error, "real number overflow");
+    }
+  return make_float (value);
+}
+
+/* Parse the literal WORD at P's current position, and return
+   VALUE.  */
+
+static Lisp_Object
+json_parse_literal (struct json_parser *p, const char *word,
+		    Lisp_Object value)
+{
+  ptrdiff_t len = strlen (word);
+  ptrdiff_t avail = p->end - p->current;
+  if (memcmp (p->current, word, min (len, avail)) != 0)
+    json_parser_error (p, Qjson_parse_error, "invalid token");
+  if (avail < len)
+    {
+      p->current = p->end;
+      json_parser_unexpected (p, "invalid token");
+    }
+  p->current += len;
+  return value;
+}
+
+/* Parse an array whose '[' is at P's current position.  */
+
+static Lisp_Object
+json_parse_array (struct json_parser *p)
+{
+  if (++lisp_eval_depth > max_lisp_eval_depth)
+    xsignal0 (Qjson_object_too_deep);
+  p->current++;
+  ptrdiff_t first = p->objects_used;
+  int c = json_skip_whitespace (p);
+  if (c == ']')
+    p->current++;
+  else
+    for (;;)
+      {
+	json_parser_push (p, json_parse_value (p));
+	c = json_skip_whitespace (p);
+	p->current++;
+	if (c == ']')
+	  break;
+	if (c != ',')
+	  {
+	    p->current--;
+	    json_parser_unexpected (p, "',' or ']' expected");
+	  }
+	rarely_quit (p->objects_used);
+      }
+
+  ptrdiff_t size = p->objects_used - first;
+  Lisp_Object result;
+  switch (p->conf->array_type)
+    {
+    case json_array_array:
+      result = make_vector (size, Qnil);
+      memcpy (XVECTOR (result)->contents, p->objects + first,
+	      size * sizeof *p->objects);
+      break;
+    case json_array_list:
+      result = Qnil;
+      for (ptrdiff_t i = p->objects_used - 1; i >= first; i--)
+	result = Fcons (p->objects[i], result);
+      break;
+    default:
+      /* Can't get here.  */
+      emacs_abort ();
+    }
+  p->objects_used = first;
+  --lisp_eval_depth;
+  return result;
+}
+
+/* Parse an object key whose opening quote has been consumed, and
+   return it as a string, symbol or keyword depending on the object
+   type.  */
+
+static Lisp_Object
+json_parse_key (struct json_parser *p)
+{
+  ptrdiff_t nchars, nbytes;
+  switch (p->conf->object_type)
+    {
+    case json_object_hashtable:
+      nbytes = json_parse_string_bytes (p, 0, &nchars);
+      return make_specified_string ((char *) p->bytes, nchars, nbytes,
+				    true);
+    case json_object_alist:
+      nbytes = json_parse_string_bytes (p, 0, &nchars);
+      return json_intern ((char *) p->bytes, nchars, nbytes);
+    case json_object_plist:
+      nbytes = json_parse_string_bytes (p, 1, &nchars);
+      p->bytes[0] = ':';
+      return json_intern ((char *) p->bytes, nchars, nbytes);
+    default:
+      /* Can't get here.  */
+      emacs_abort ();
+    }
+}
+
+/* Objects with more members than this use a hash table to find
+   duplicate keys.  */
+enum { JSON_SMALL_OBJECT = 16 };
+
+/* Parse an object whose '{' is at P's current position.  */
+
+static Lisp_Object
+json_parse_object (struct json_parser *p)
+{
+  if (++lisp_eval_depth > max_lisp_eval_depth)
+    xsignal0 (Qjson_object_too_deep);
+  p->current++;
+  ptrdiff_t first = p->objects_used;
+  int c = json_skip_whitespace (p);
+  if (c == '}')
+    p->current++;
+  else
+    for (;;)
+      {
+	if (c != '"')
+	  json_parser_unexpected (p, "string expected");
+	p->current++;
+	json_parser_push (p, json_parse_key (p));
+	if (json_skip_whitespace (p) != ':')
+	  json_parser_unexpected (p, "':' expected");
+	p->current++;
+	json_parser_push (p, json_parse_value (p));
+	c = json_skip_whitespace (p);
+	p->current++;
+	if (c == '}')
+	  break;
+	if (c != ',')
+	  {
+	    p->current--;
+	    json_parser_unexpected (p, "',' or '}' expected");
+	  }
+	c = json_skip_whitespace (p);
+	rarely_quit (p->objects_used);
+      }
+
+  Lisp_Object *members = p->objects + first;
+  ptrdiff_t size = (p->objects_used - first) / 2;
+  Lisp_Object result;
+  if (p->conf->object_type == json_object_hashtable)
+    {
+      result = CALLN (Fmake_hash_table, QCtest, Qequal, QCsize,
+		      make_fixed_natnum (size));
+      struct Lisp_Hash_Table *h = XHASH_TABLE (result);
+      for (ptrdiff_t i = 0; i < size; i++)
+	{
+	  Lisp_Object key = members[2 * i], hash;
+	  ptrdiff_t j = hash_lookup (h, key, &hash);
+	  /* The last of duplicate keys wins.  */
+	  if (j < 0)
+	    hash_put (h, key, members[2 * i + 1], hash);
+	  else
+	    set_hash_value_slot (h, j, members[2 * i + 1]);
+	}
+    }
+  else
+    {
+      /* Like Jansson, keep duplicate keys at the position of their
+	 first occurrence with the value of their last one.  Later
+	 duplicates are marked by replacing their key with
+	 Qunbound.  */
+      if (size <= JSON_SMALL_OBJECT)
+	{
+	  for (ptrdiff_t i = 1; i < size; i++)
+	    for (ptrdiff_t j = 0; j < i; j++)
+	      if (EQ (members[2 * j], members[2 * i]))
+		{
+		  members[2 * j + 1] = members[2 * i + 1];
+		  members[2 * i] = Qunbound;
+		  break;
+		}
+	}
+      else
+	{
+	  Lisp_Object seen = CALLN (Fmake_hash_table, QCtest, Qeq, QCsize,
+				    make_fixed_natnum (size));
+	  struct Lisp_Hash_Table *h = XHASH_TABLE (seen);
+	  for (ptrdiff_t i = 0; i < size; i++)
+	    {
+	      Lisp_Object key = members[2 * i], hash;
+	      ptrdiff_t j = hash_lookup (h, key, &hash);
+	      if (j < 0)
+		hash_put (h, key, make_fixnum (i), hash);
+	      else
+		{
+		  members[2 * XFIXNUM (HASH_VALUE (h, j)) + 1]
+		    = members[2 * i + 1];
+		  members[2 * i] = Qunbound;
+		}
+	    }
+	}
+
+      result = Qnil;
+      for (ptrdiff_t i = size - 1; i >= 0; i--)
+	if (!EQ (members[2 * i], Qunbound))
+	  result = (p->conf->object_type == json_object_alist
+		    ? Fcons (Fcons (members[2 * i], members[2 * i + 1]),
+			     result)
+		    : Fcons (members[2 * i],
+			     Fcons (members[2 * i + 1], result)));
+    }
+  p->objects_used = first;
+  --lisp_eval_depth;
+  return result;
+}
+
+/* Parse the JSON value at P's current position.  */
+
+static Lisp_Object
+json_parse_value (struct json_parser *p)
+{
+  int c = json_skip_whitespace (p);
+  switch (c)
+    {
+    case '{':
+      return json_parse_object (p);
+    case '[':
+      return json_parse_array (p);
+    case '"':
+      {
+	p->current++;
+	ptrdiff_t nchars;
+	ptrdiff_t nbytes = json_parse_string_bytes (p, 0, &nchars);
+	return make_specified_string ((char *) p->bytes, nchars, nbytes,
+				      true);
+      }
+    case 't':
+      return json_parse_literal (p, "true", Qt);
+    case 'f':
+      return json_parse_literal (p, "false", p->conf->false_object);
+    case 'n':
+      return json_parse_literal (p, "null", p->conf->null_object);
+    case '-': case '0': case '1': case '2': case '3': case '4':
+    case '5': case '6': case '7': case '8': case '9':
+      return json_parse_number (p);
+    default:
+      json_parser_unexpected (p, "invalid token");
+    }
+}
+
+/* Parse the SIZE bytes of JSON text at TEXT into a Lisp object as
+   specified by CONF.  SOURCE names the input in error messages.  If
+   ALLOW_NUL, strings may contain "\u0000".  If CONSUMED is non-NULL,
+   parsing stops after the first value and *CONSUMED is set to the
+   number of bytes it took; otherwise anything but whitespace after
+   the value is an error.  */
+
+static Lisp_Object
+json_parse (const char *text, ptrdiff_t size, const char *source,
+	    bool allow_nul, const struct json_configuration *conf,
+	    ptrdiff_t *consumed)
+{
+  struct json_parser p = {
+    .begin = (const unsigned char *) text,
+    .current = (const unsigned char *) text,
+    .end = (const unsigned char *) text + size,
+    .source = source,
+    .conf = conf,
+    .allow_nul = allow_nul
+  };
+  ptrdiff_t count = SPECPDL_INDEX ();
+  record_unwind_protect_ptr (json_parser_done, &p);
+
+  Lisp_Object result = json_parse_value (&p);
+  if (consumed)
+    *consumed = p.current - p.begin;
+  else if (json_skip_whitespace (&p) >= 0)
+    json_parser_error (&p, Qjson_trailing_content,
+		       "end of input expected");
+
+  return unbind_to (count, result);
+}
+
+DEFUN ("json-parse-string", Fjson_parse_string, Sjson_parse_string, 1, MANY,
        NULL,
-       doc: /* Send message to jsonrpc connection */)
+       doc: /* Parse the JSON STRING into a Lisp object.
+This is essentially the reverse operation of `json-serialize', which
+see.  The returned object will be the JSON null value, the JSON false
+value, t, a number, a string, a vector, a list, a hashtable, an alist,
+or a plist.  Its elements will be further objects of these types.  If
+there are duplicate keys in an object, all but the last one are
+ignored.  If STRING doesn't contain a valid JSON object, this function
+signals an error of type `json-parse-error'.
+
+The arguments ARGS are a list of keyword/argument pairs:
+
+The keyword argument `:object-type' specifies which Lisp type is used
+to represent objects; it can be `hash-table', `alist' or `plist'.  It
+defaults to `hash-table'.
+
+The keyword argument `:array-type' specifies which Lisp type is used
+to represent arrays; it can be `array' (the default) or `list'.
+
+The keyword argument `:null-object' specifies which object to use
+to represent a JSON null value.  It defaults to `:null'.
+
+The keyword argument `:false-object' specifies which object to use to
+represent a JSON false value.  It defaults to `:false'.
+usage: (json-parse-string STRING &rest ARGS) */)
   (ptrdiff_t nargs, Lisp_Object *args)
 {
-  Lisp_Object connection = args[0];
-  CHECK_RPC_CONNECTION(connection);
+  ptrdiff_t count = SPECPDL_INDEX ();
+
+#ifdef WINDOWSNT
+  if (!json_initialized)
+    {
+      Lisp_Object status;
+      json_initialized = init_json_functions ();
+      status = json_initialized ? Qt : Qnil;
+      Vlibrary_cache = Fcons (Fcons (Qjson, status), Vlibrary_cache);
+    }
+  if (!json_initialized)
+    Fsignal (Qjson_unavailable,
+	     list1 (build_unibyte_string ("jansson library not found")));
+#endif
+
+  Lisp_Object string = args[0];
+  CHECK_STRING (string);
+  Lisp_Object encoded = json_encode (string);
+  check_string_without_embedded_nulls (encoded);
+  struct json_configuration conf =
+    {json_object_hashtable, json_array_array, QCnull, QCfalse};
+  json_parse_args (nargs - 1, args + 1, &conf, true);
+
+  return unbind_to (count, json_parse (SSDATA (encoded), SBYTES (encoded),
+				      "<string>", false, &conf, NULL));
+}
+
+// JSONRPC
+
+/* Default number of bytes of a server's stderr a connection keeps.  */
+#define JSON_RPC_STDERR_SIZE (64 * 1024)
+
+/* Maximum number of bytes read from a server's stderr at once.  */
+#define JSON_RPC_STDERR_CHUNK 4096
+
+/* Minimum number of bytes requested from the server's stdout per
+   read.  */
+#define JSON_RPC_READ_CHUNK (64 * 1024)
+
+/* Room reserved in front of an outgoing message for its header:
+   "Content-Length: " followed by up to 20 digits and "\r\n\r\n".  */
+#define JSON_RPC_HEADER_MAX 48
+
+/* A connection's send buffer is kept from one message to the next,
+   however large it grew, so that resending a large document does not
+   grow it anew.  Connections with a writer thread give it away with
+   each message instead.  Once it is larger than JSON_RPC_SEND_BUFFER_KEEP
+   bytes but JSON_RPC_SEND_BUFFER_SHRINK messages in a row fit in that
+   many, it is freed.  */
+#define JSON_RPC_SEND_BUFFER_KEEP (1024 * 1024)
+#define JSON_RPC_SEND_BUFFER_SHRINK 64
+
+/* Milliseconds a connection's writer thread is given to write what
+   is still queued when the connection is closed.  */
+#define JSON_RPC_FLUSH_TIMEOUT 500
+
+/* Default number of bytes a connection's writer thread may have
+   pending before `json-rpc-send' reports backpressure.  */
+#define JSON_RPC_SEND_HIGH_WATER (8 * 1024 * 1024)
+
+/* Capacity of the queue between a connection's reader thread and
+   `json-rpc'.  Must be a power of two.  */
+#define JSON_RPC_QUEUE_SIZE 1024
+
+/* Maximum number of queued messages `json-rpc' dispatches per
+   acquisition of the global lock.  */
+#define JSON_RPC_DRAIN_MAX 64
+
+/* Number of buckets of the latency histograms of `json-rpc-stats'.
+   The last one also counts everything longer.  */
+#define JSON_RPC_STATS_BUCKETS 32
+
+/* Maximum number of cancelled requests per connection whose responses
+   are still expected.  Beyond that, the oldest are forgotten and their
+   responses delivered like any other message.  */
+#define JSON_RPC_CANCELLED_MAX 256
+
+#ifdef __linux__
+/* Connections created with `:reader-thread shared' are all served by
+   a single native thread waiting on an epoll set; see
+   json_rpc_loop.  Elsewhere they get a reader thread of their own.  */
+# define JSON_RPC_EVENT_LOOP 1
+
+/* Maximum number of readiness events that thread handles per
+   wakeup.  */
+# define JSON_RPC_LOOP_EVENTS 64
+#endif
+
+/* Lazily converted messages.
+
+   A connection created with `:lazy' indexes each message without the
+   global lock into a json_dom: an array of nodes, one per value, laid
+   out in document order.  Each node records where the text of its
+   value lies in the message body and how many nodes it spans, so that
+   `json-rpc-get' can walk to a value without converting anything and
+   then parse just that value's text with json_parse.  */
+
+enum json_dom_type
+{
+  JSON_DOM_NULL,
+  JSON_DOM_FALSE,
+  JSON_DOM_TRUE,
+  JSON_DOM_NUMBER,
+  JSON_DOM_STRING,
+  JSON_DOM_ARRAY,
+  JSON_DOM_OBJECT
+};
+
+/* Nesting depth beyond which a message is not indexed.  */
+#define JSON_DOM_MAX_DEPTH 10000
+
+struct json_dom_node
+{
+  /* A json_dom_type.  */
+  uint8_t type;
+  /* Number of elements or members of arrays and objects.  */
+  uint32_t count;
+  /* Number of nodes spanned by the value, including this one.  The
+     members of an object are spanned by pairs of nodes, a string node
+     for the key followed by the nodes of the value.  */
+  uint32_t extent;
+  /* Offsets in the body of the start and end of the value's text,
+     including the quotes of strings.  */
+  uint32_t start;
+  uint32_t end;
+};
+
+struct json_dom
+{
+  /* The message body, allocated with malloc.  */
+  char *body;
+  size_t length;
+  struct json_dom_node *nodes;
+  size_t nnodes;
+};
+
+struct json_dom_builder
+{
+  const unsigned char *begin;
+  const unsigned char *current;
+  const unsigned char *end;
+  struct json_dom_node *nodes;
+  size_t nnodes;
+  size_t nodes_size;
+};
+
+static void
+json_dom_free (void *ptr)
+{
+  struct json_dom *dom = ptr;
+  if (dom != NULL)
+    {
+      free (dom->body);
+      free (dom->nodes);
+      free (dom);
+    }
+}
+
+static int
+json_dom_skip_whitespace (struct json_dom_builder *b)
+{
+  for (; b->current < b->end; b->current++)
+    switch (*b->current)
+      {
+      case ' ': case '\t': case '\n': case '\r':
+	break;
+      default:
+	return *b->current;
+      }
+  return -1;
+}
+
+/* Append a node of TYPE starting at B's current position and return
+   its index, or -1 if out of memory.  */
+
+static ptrdiff_t
+json_dom_add (struct json_dom_builder *b, enum json_dom_type type)
+{
+  if (b->nnodes == b->nodes_size)
+    {
+      size_t size = b->nodes_size < 64 ? 64 : 2 * b->nodes_size;
+      struct json_dom_node *nodes
+	= realloc (b->nodes, size * sizeof *nodes);
+      if (nodes == NULL)
+	return -1;
+      b->nodes = nodes;
+      b->nodes_size = size;
+    }
+  struct json_dom_node *node = &b->nodes[b->nnodes];
+  node->type = type;
+  node->count = 0;
+  node->extent = 1;
+  node->start = b->current - b->begin;
+  node->end = node->start;
+  return b->nnodes++;
+}
+
+/* Scan the rest of a string whose opening quote has been consumed,
+   checking it the same way json_parse_string_bytes does.  */
+
+static bool
+json_dom_string (struct json_dom_builder *b)
+{
+  for (;;)
+    {
+      b->current = json_scan_plain (b->current, b->end);
+      if (b->current == b->end)
+	return false;
+      int c = *b->current;
+      if (c == '"')
+	{
+	  b->current++;
+	  return true;
+	}
+      else if (c == '\\')
+	{
+	  if (b->end - b->current < 2)
+	    return false;
+	  c = b->current[1];
+	  b->current += 2;
+	  if (c == 'u')
+	    {
+	      if (b->end - b->current < 4)
+		return false;
+	      int code = json_scan_hex4 (b->current);
+	      b->current += 4;
+	      if (code < 0 || (0xDC00 <= code && code <= 0xDFFF))
+		return false;
+	      if (0xD800 <= code && code <= 0xDBFF)
+		{
+		  if (b->end - b->current < 6
+		      || b->current[0] != '\\' || b->current[1] != 'u')
+		    return false;
+		  int low = json_scan_hex4 (b->current + 2);
+		  if (!(0xDC00 <= low && low <= 0xDFFF))
+		    return false;
+		  b->current += 6;
+		}
+	    }
+	  else if (!strchr ("\"\\/bfnrt", c) || c == '\0')
+	    return false;
+	}
+      else if (c < 0x20)
+	return false;
+      else
+	{
+	  int len = json_scan_utf8 (b->current, b->end);
+	  if (len == 0)
+	    return false;
+	  b->current += len;
+	}
+    }
+}
+
+/* Index the value at B's current position.  */
+
+static bool
+json_dom_value (struct json_dom_builder *b, int depth)
+{
+  int c = json_dom_skip_whitespace (b);
+  ptrdiff_t index;
+  switch (c)
+    {
+    case '{':
+    case '[':
+      {
+	bool object = c == '{';
+	if (depth >= JSON_DOM_MAX_DEPTH)
+	  return false;
+	index = json_dom_add (b, object ? JSON_DOM_OBJECT : JSON_DOM_ARRAY);
+	if (index < 0)
+	  return false;
+	b->current++;
+	uint32_t count = 0;
+	c = json_dom_skip_whitespace (b);
+	if (c == (object ? '}' : ']'))
+	  b->current++;
+	else
+	  for (;;)
+	    {
+	      if (object)
+		{
+		  if (c != '"' || json_dom_add (b, JSON_DOM_STRING) < 0)
+		    return false;
+		  b->current++;
+		  if (!json_dom_string (b))
+		    return false;
+		  b->nodes[b->nnodes - 1].end = b->current - b->begin;
+		  if (json_dom_skip_whitespace (b) != ':')
+		    return false;
+		  b->current++;
+		}
+	      if (!json_dom_value (b, depth + 1))
+		return false;
+	      count++;
+	      c = json_dom_skip_whitespace (b);
+	      if (c < 0)
+		return false;
+	      b->current++;
+	      if (c == (object ? '}' : ']'))
+		break;
+	      if (c != ',')
+		return false;
+	      c = json_dom_skip_whitespace (b);
+	    }
+	b->nodes[index].count = count;
+	b->nodes[index].extent = b->nnodes - index;
+	break;
+      }
+    case '"':
+      index = json_dom_add (b, JSON_DOM_STRING);
+      if (index < 0)
+	return false;
+      b->current++;
+      if (!json_dom_string (b))
+	return false;
+      break;
+    case 't': case 'f': case 'n':
+      {
+	const char *word = c == 't' ? "true" : c == 'f' ? "false" : "null";
+	ptrdiff_t len = strlen (word);
+	index = json_dom_add (b, (c == 't' ? JSON_DOM_TRUE
+				  : c == 'f' ? JSON_DOM_FALSE
+				  : JSON_DOM_NULL));
+	if (index < 0 || b->end - b->current < len
+	    || memcmp (b->current, word, len) != 0)
+	  return false;
+	b->current += len;
+	break;
+      }
+    case '-': case '0': case '1': case '2': case '3': case '4':
+    case '5': case '6': case '7': case '8': case '9':
+      {
+	index = json_dom_add (b, JSON_DOM_NUMBER);
+	bool is_float;
+	if (index < 0 || !json_scan_number (&b->current, b->end, &is_float))
+	  return false;
+	/* The body is null-terminated, so strtod stops at its end.  */
+	if (is_float
+	    && isinf (strtod ((const char *) b->begin + b->nodes[index].start,
+			      NULL)))
+	  return false;
+	break;
+      }
+    default:
+      return false;
+    }
+  b->nodes[index].end = b->current - b->begin;
+  return true;
+}
+
+/* Index the LENGTH bytes of BODY, which must be allocated with malloc
+   and followed by a null byte.  Return the index, which owns BODY, or
+   NULL if BODY is not valid JSON or cannot be indexed; in that case
+   the caller keeps ownership of BODY.  This does not need the global
+   lock.  */
+
+static struct json_dom *
+json_dom_build (char *body, size_t length)
+{
+  if (length >= UINT32_MAX)
+    return NULL;
+  struct json_dom_builder b = {
+    .begin = (const unsigned char *) body,
+    .current = (const unsigned char *) body,
+    .end = (const unsigned char *) body + length
+  };
+  struct json_dom *dom = NULL;
+  if (json_dom_value (&b, 0) && json_dom_skip_whitespace (&b) < 0)
+    dom = malloc (sizeof *dom);
+  if (dom == NULL)
+    {
+      free (b.nodes);
+      return NULL;
+    }
+  dom->body = body;
+  dom->length = length;
+  dom->nodes = b.nodes;
+  dom->nnodes = b.nnodes;
+  return dom;
+}
+
+static bool
+JSON_DOM_P (Lisp_Object object)
+{
+  return USER_PTRP (object) && XUSER_PTR (object)->finalizer == json_dom_free;
+}
+
+/* Return a Lisp object for DOM, which it takes ownership of.  */
+
+static Lisp_Object
+make_json_dom (struct json_dom *dom)
+{
+  return make_user_ptr (json_dom_free, dom);
+}
+
+/* Return whether the string node NODE of DOM is the JSON text of the
+   unibyte UTF-8 string KEY.  */
+
+static bool
+json_dom_key_equal (struct json_dom *dom, struct json_dom_node *node,
+		    Lisp_Object key)
+{
+  const char *text = dom->body + node->start + 1;
+  ptrdiff_t nbytes = node->end - node->start - 2;
+  if (!memchr (text, '\\', nbytes))
+    return nbytes == SBYTES (key) && memcmp (text, SDATA (key), nbytes) == 0;
+  struct json_configuration conf
+    = {json_object_hashtable, json_array_array, QCnull, QCfalse};
+  Lisp_Object string = json_parse (dom->body + node->start,
+				   node->end - node->start, "<buffer>",
+				   true, &conf, NULL);
+  return (SBYTES (string) == SBYTES (key)
+	  && memcmp (SDATA (string), SDATA (key), SBYTES (key)) == 0);
+}
+
+/* Return the index of the node of DOM reached from node INDEX by
+   following the NPATH elements of PATH, or -1 if there is none.  */
+
+static ptrdiff_t
+json_dom_lookup (struct json_dom *dom, ptrdiff_t index, ptrdiff_t npath,
+		 Lisp_Object *path)
+{
+  for (ptrdiff_t i = 0; i < npath && index >= 0; i++)
+    {
+      struct json_dom_node *node = &dom->nodes[index];
+      Lisp_Object elt = path[i];
+      if (STRINGP (elt))
+	{
+	  if (node->type != JSON_DOM_OBJECT)
+	    return -1;
+	  Lisp_Object key = json_encode (elt);
+	  ptrdiff_t member = index + 1;
+	  index = -1;
+	  /* The last of duplicate keys wins.  */
+	  for (uint32_t j = 0; j < node->count; j++)
+	    {
+	      if (json_dom_key_equal (dom, &dom->nodes[member], key))
+		index = member + 1;
+	      member += 1 + dom->nodes[member + 1].extent;
+	    }
+	}
+      else
+	{
+	  CHECK_FIXNAT (elt);
+	  if (node->type != JSON_DOM_ARRAY || XFIXNAT (elt) >= node->count)
+	    return -1;
+	  index++;
+	  for (EMACS_INT j = XFIXNAT (elt); j > 0; j--)
+	    index += dom->nodes[index].extent;
+	}
+    }
+  return index;
+}
+
+/* Statistics of a connection created with `:stats'.
+
+   They are updated by whichever thread does the work, with relaxed
+   atomic operations and no lock, and read by `json-rpc-stats'.
+   Connections without statistics only pay for checking that their
+   json_rpc_stats pointer is null.  */
+
+enum json_rpc_counter
+{
+  JSON_RPC_BYTES_IN,
+  JSON_RPC_BYTES_OUT,
+  JSON_RPC_MESSAGES_IN,
+  JSON_RPC_MESSAGES_OUT,
+  JSON_RPC_COUNTERS
+};
+
+/* High-water marks.  */
+enum json_rpc_peak
+{
+  JSON_RPC_QUEUE_PEAK,
+  JSON_RPC_OUTBOX_MESSAGES_PEAK,
+  JSON_RPC_OUTBOX_BYTES_PEAK,
+  JSON_RPC_PEAKS
+};
+
+enum json_rpc_timing
+{
+  /* Finding the next message in the receive buffer.  */
+  JSON_RPC_FRAME,
+  /* Looking at a message off the global lock: reading its id, copying
+     it out of the receive buffer and, for `:lazy' connections,
+     indexing it.  */
+  JSON_RPC_PARSE,
+  /* From being queued by the reader to being popped by `json-rpc'.  */
+  JSON_RPC_QUEUE_WAIT,
+  /* Acquiring the global lock again after reading or writing.  */
+  JSON_RPC_LOCK_WAIT,
+  /* Turning a message into a Lisp object with the lock held.  */
+  JSON_RPC_CONVERT,
+  JSON_RPC_CALLBACK,
+  /* Serializing an outgoing message.  */
+  JSON_RPC_SERIALIZE,
+  /* Writing an outgoing message to the server.  */
+  JSON_RPC_WRITE,
+  JSON_RPC_TIMINGS
+};
+
+/* Bucket I of a histogram counts durations shorter than 2^I
+   microseconds, but not shorter than 2^(I-1).  */
+struct json_rpc_histogram
+{
+  uint64_t count;
+  uint64_t total_ns;
+  uint64_t max_ns;
+  uint64_t buckets[JSON_RPC_STATS_BUCKETS];
+};
+
+/* Only made of uint64_t, so that it can be read and reset one word
+   at a time.  */
+struct json_rpc_stats
+{
+  uint64_t counters[JSON_RPC_COUNTERS];
+  uint64_t peaks[JSON_RPC_PEAKS];
+  struct json_rpc_histogram timings[JSON_RPC_TIMINGS];
+};
+
+static uint64_t
+json_rpc_now (void)
+{
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* Return the current time if STATS is non-NULL, to be passed to
+   json_rpc_stats_time, and 0 otherwise.  */
+
+static uint64_t
+json_rpc_stats_start (struct json_rpc_stats *stats)
+{
+  return stats ? json_rpc_now () : 0;
+}
+
+static void
+json_rpc_stats_count (struct json_rpc_stats *stats,
+		      enum json_rpc_counter counter, uint64_t n)
+{
+  if (stats)
+    __atomic_fetch_add (&stats->counters[counter], n, __ATOMIC_RELAXED);
+}
+
+/* Raise *PEAK to VALUE if it is lower.  */
+
+static void
+json_rpc_stats_raise (uint64_t *peak, uint64_t value)
+{
+  uint64_t old = __atomic_load_n (peak, __ATOMIC_RELAXED);
+  while (old < value
+	 && !__atomic_compare_exchange_n (peak, &old, value, true,
+					  __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    continue;
+}
+
+static void
+json_rpc_stats_peak (struct json_rpc_stats *stats, enum json_rpc_peak peak,
+		     uint64_t value)
+{
+  if (stats)
+    json_rpc_stats_raise (&stats->peaks[peak], value);
+}
+
+/* Record in STATS, if non-NULL, that TIMING took from START, as
+   returned by json_rpc_stats_start, until now.  */
+
+static void
+json_rpc_stats_time (struct json_rpc_stats *stats,
+		     enum json_rpc_timing timing, uint64_t start)
+{
+  if (stats == NULL)
+    return;
+  uint64_t ns = json_rpc_now () - start;
+  struct json_rpc_histogram *histogram = &stats->timings[timing];
+  int bucket = 0;
+  for (uint64_t us = ns / 1000;
+       us > 0 && bucket < JSON_RPC_STATS_BUCKETS - 1; us >>= 1)
+    bucket++;
+  __atomic_fetch_add (&histogram->count, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add (&histogram->total_ns, ns, __ATOMIC_RELAXED);
+  __atomic_fetch_add (&histogram->buckets[bucket], 1, __ATOMIC_RELAXED);
+  json_rpc_stats_raise (&histogram->max_ns, ns);
+}
+
+/* A message read by a reader thread.  Its body, allocated with malloc
+   and null-terminated, is either indexed in DOM or, if the connection
+   is not lazy or the body is not valid JSON, in BODY to be parsed by
+   `json-rpc' with the global lock held.  */
+struct json_rpc_entry
+{
+  char *body;
+  size_t length;
+  struct json_dom *dom;
+  /* The id of the message if it is a response; see
+     json_rpc_peek_id.  */
+  intmax_t id;
+  /* When it was queued, if the connection keeps statistics.  */
+  uint64_t queued_at;
+};
+
+/* Single-producer/single-consumer ring of message bodies.  Only the
+   reader thread advances TAIL and only `json-rpc' advances HEAD, so
+   pushing and popping need no lock; MX and the condition variables
+   are only used to sleep while the ring is empty or full.  */
+struct json_rpc_queue
+{
+  struct json_rpc_entry entries[JSON_RPC_QUEUE_SIZE];
+  size_t head;
+  size_t tail;
+  /* Set by the reader thread after pushing its last message.  */
+  bool closed;
+  bool consumer_waiting;
+  bool producer_waiting;
+  pthread_mutex_t mx;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  /* Set to wake up the consumer although no message arrived.  */
+  bool kicked;
+  /* Set if the consumer is the command loop rather than `json-rpc';
+     see `json-rpc-set-callback'.  */
+  bool dispatched;
+  /* Set by the shared I/O thread when it stopped reading because the
+     ring was full.  Whoever clears it again asks that thread to
+     resume.  */
+  bool stalled;
+};
+
+/* The last LENGTH bytes a server wrote to its stderr, starting at
+   offset START of the ring buffer DATA.  DATA is allocated on demand
+   and grows up to LIMIT bytes; after that the oldest bytes are
+   overwritten.  TOTAL counts all the bytes ever written.  Written by
+   whoever reads from the server and read by Lisp, hence MX.  */
+struct json_rpc_stderr
+{
+  pthread_mutex_t mx;
+  char *data;
+  size_t size;
+  size_t limit;
+  size_t start;
+  size_t length;
+  uintmax_t total;
+};
+
+/* A growable byte buffer holding END bytes.  */
+struct json_rpc_buffer
+{
+  char *data;
+  size_t size;
+  size_t end;
+};
+
+/* Where the members of a didChange notification that coalescing
+   looks at are in the text of the framed message, as offsets in its
+   buffer.  */
+struct json_rpc_change
+{
+  /* The document's URI, quotes included.  */
+  size_t uri;
+  size_t uri_end;
+  /* The version of the document after the changes.  */
+  intmax_t version;
+  /* The contentChanges array, brackets included.  */
+  size_t changes;
+  size_t changes_end;
+  /* Whether one of the changes replaces the whole text.  */
+  bool replace;
+};
+
+/* A framed message waiting to be written to the server; its bytes
+   start at offset START of BUFFER.  */
+struct json_rpc_outgoing
+{
+  struct json_rpc_outgoing *next;
+  struct json_rpc_buffer buffer;
+  size_t start;
+  /* The id of the message if it was sent with `json-rpc-request', or
+     -1.  */
+  intmax_t id;
+  /* Number of bytes counted for the message in its outbox.  */
+  size_t size;
+  /* Whether the message is a didChange notification into which the
+     next ones about the same document are merged while it waits, and
+     the time after which it is written anyway.  */
+  bool coalesce;
+  struct json_rpc_change change;
+  struct timespec flush_at;
+};
+
+/* Messages waiting for a connection's writer thread.  BYTES and
+   MESSAGES count what has not been written yet, including the
+   message being written.  */
+struct json_rpc_outbox
+{
+  pthread_mutex_t mx;
+  pthread_cond_t not_empty;
+  struct json_rpc_outgoing *first;
+  struct json_rpc_outgoing *last;
+  size_t bytes;
+  size_t messages;
+  size_t high_water;
+  bool closed;
+  /* Set, and FINISHED_COND signaled, when the writer thread exits.  */
+  bool finished;
+  pthread_cond_t finished_cond;
+  /* Whether didChange notifications are coalesced, and how long the
+     writer thread holds one back for the next ones when it is
+     idle.  */
+  bool coalesce;
+  struct timespec coalesce_delay;
+};
+
+/* Ids of requests cancelled with `json-rpc-cancel' whose responses
+   have not arrived yet.  Whichever of the thread feeding the queue and
+   `json-rpc' sees such a response first drops it along with its id.
+   COUNT is only changed with MX held, but can be read without it.  */
+struct json_rpc_ids
+{
+  pthread_mutex_t mx;
+  size_t count;
+  intmax_t ids[JSON_RPC_CANCELLED_MAX];
+};
+
+struct json_rpc_state
+{
+  pthread_mutex_t handle_mx;
+  struct SSP_Handle* handle;
+  /* Non-NULL if messages are read by the native thread READER.  */
+  struct json_rpc_queue *queue;
+  pthread_t reader;
+  /* Whether QUEUE is fed by the shared I/O thread instead of READER.
+     The fields below up to NEXT_FINISHED belong to that thread, which
+     only sets EOF, once the server closed its stdout or the
+     connection was shut down.  */
+  bool shared;
+  int stdout_fd;
+  int stderr_fd;
+  /* What STDOUT_FD and STDERR_FD are watched for; see
+     json_rpc_loop_watch.  */
+  int stdout_events;
+  int stderr_events;
+  bool eof;
+  bool finished;
+  bool removed;
+  struct json_rpc_state *next_finished;
+  /* Non-NULL if messages are written by the native thread WRITER.  */
+  struct json_rpc_outbox *outbox;
+  pthread_t writer;
+  /* The body of the last message read without a reader thread; its
+     MESSAGE_LENGTH bytes start at offset MESSAGE_START of
+     READ_BUFFER.  */
+  size_t message_start;
+  size_t message_length;
+  intmax_t message_id;
+  /* The methods given with `:supersede', each followed by a null
+     byte, with another one at the end, or NULL if there are none.  */
+  char *supersede;
+  /* Offset from READ_START up to which the receive buffer is known to
+     hold no complete header block.  */
+  size_t header_scanned;
+  /* Whether messages are indexed into a json_dom instead of being
+     converted right away, and the index of the last message read
+     without a reader thread.  */
+  bool lazy;
+  struct json_dom *dom;
+  bool done;
+  /* Set by `json-rpc-shutdown', after which nothing more is read from
+     the server even if it is still running.  */
+  bool shutdown;
+  /* Set once whatever fed QUEUE has let go of the connection, and
+     once json_rpc_close has started closing it, so that neither is
+     done twice.  */
+  bool reader_released;
+  bool closed;
+  /* Receive buffer.  The bytes between READ_START and READ_END have
+     been read from the server but not consumed yet; they may contain
+     the rest of the current message and the beginning of the next
+     ones.  */
+  char *read_buffer;
+  size_t read_buffer_size;
+  size_t read_start;
+  size_t read_end;
+  /* Buffer outgoing messages are serialized into, reused from one
+     message to the next.  While SEND_BUFFER_BUSY, it is lent to a
+     thread sending a message, and others use buffers of their own.
+     Both are only accessed with the global lock held.  */
+  struct json_rpc_buffer send_buffer;
+  bool send_buffer_busy;
+  /* Number of messages in a row that fit in JSON_RPC_SEND_BUFFER_KEEP
+     bytes while SEND_BUFFER was larger.  */
+  int send_buffer_small;
+  struct json_rpc_stderr stderr_ring;
+  /* Position in the stderr stream up to which `json-rpc' has passed
+     it to a `:stderr-function'.  */
+  uintmax_t stderr_delivered;
+  struct json_rpc_ids cancelled;
+  /* Non-NULL if the connection was created with `:stats'.  */
+  struct json_rpc_stats *stats;
+};
+
+/* Usage:
+ * if (can_use_handle (state))
+ *   {
+ *     ... use state->handle
+ *     end_using_handle (state);
+ *   }
+ */
+inline static void
+end_using_handle (struct json_rpc_state *state)
+{
+  assert (state->handle);
+  pthread_mutex_unlock (&state->handle_mx);
+}
+inline static int
+can_use_handle (struct json_rpc_state *state)
+{
+  if (pthread_mutex_lock (&state->handle_mx) == 0)
+    {
+      if (state->handle)
+	return 1; /* handle is good */
+      /* else handle is already gone */
+      pthread_mutex_unlock (&state->handle_mx);
+    }
+  return 0;
+}
+
+inline static void json_rpc_state_free (void *);
+
+bool
+json_rpc_connection_p (Lisp_Object obj)
+{
+  return (USER_PTRP (obj)
+	  && XUSER_PTR (obj)->finalizer == json_rpc_state_free);
+}
+
+static void
+CHECK_RPC_CONNECTION (Lisp_Object obj)
+{
+  CHECK_TYPE (json_rpc_connection_p (obj), Quser_ptrp, obj);
+}
+
+/* Pipe through which the producers of dispatched queues wake up the
+   command loop, which then runs json_rpc_wakeup_callback.
+   JSON_RPC_WAKEUP_PENDING is set while a byte is in the pipe or about
+   to be, so that a burst of messages costs a single write.  */
+static int json_rpc_wakeup_fd[2] = { -1, -1 };
+static bool json_rpc_wakeup_pending;
+
+static void
+json_rpc_wakeup (void)
+{
+  if (!__atomic_exchange_n (&json_rpc_wakeup_pending, true, __ATOMIC_SEQ_CST))
+    {
+      char c = 0;
+      while (write (json_rpc_wakeup_fd[1], &c, 1) < 0 && errno == EINTR)
+	continue;
+    }
+}
+
+/* Wake up the command loop if it is the consumer of QUEUE.  */
+
+static void
+json_rpc_queue_notify (struct json_rpc_queue *queue)
+{
+  if (__atomic_load_n (&queue->dispatched, __ATOMIC_SEQ_CST))
+    json_rpc_wakeup ();
+}
+
+static struct json_rpc_queue *
+json_rpc_queue_create (void)
+{
+  struct json_rpc_queue *queue = malloc (sizeof *queue);
+  if (queue == NULL)
+    return NULL;
+  queue->head = queue->tail = 0;
+  queue->closed = false;
+  queue->kicked = false;
+  queue->stalled = false;
+  queue->dispatched = false;
+  queue->consumer_waiting = queue->producer_waiting = false;
+  pthread_mutex_init (&queue->mx, NULL);
+  pthread_cond_init (&queue->not_empty, NULL);
+  pthread_cond_init (&queue->not_full, NULL);
+  return queue;
+}
+
+static void
+json_rpc_queue_free (struct json_rpc_queue *queue)
+{
+  for (size_t i = queue->head; i != queue->tail; i++)
+    {
+      struct json_rpc_entry *entry
+	= &queue->entries[i % JSON_RPC_QUEUE_SIZE];
+      free (entry->body);
+      json_dom_free (entry->dom);
+    }
+  pthread_cond_destroy (&queue->not_full);
+  pthread_cond_destroy (&queue->not_empty);
+  pthread_mutex_destroy (&queue->mx);
+  free (queue);
+}
+
+/* Wake up the other end of QUEUE if it is sleeping on COND.  */
+
+static void
+json_rpc_queue_wake (struct json_rpc_queue *queue, bool *waiting,
+		     pthread_cond_t *cond)
+{
+  if (__atomic_load_n (waiting, __ATOMIC_SEQ_CST))
+    {
+      pthread_mutex_lock (&queue->mx);
+      pthread_cond_signal (cond);
+      pthread_mutex_unlock (&queue->mx);
+    }
+}
+
+/* Return true if QUEUE has no room for another entry.  Only called
+   from its producer.  */
+
+static bool
+json_rpc_queue_full (struct json_rpc_queue *queue)
+{
+  return (queue->tail - __atomic_load_n (&queue->head, __ATOMIC_SEQ_CST)
+	  == JSON_RPC_QUEUE_SIZE);
+}
+
+/* Append ENTRY to QUEUE, waiting for room if it is full.  Only called
+   from its producer.  */
+
+static void
+json_rpc_queue_push (struct json_rpc_queue *queue,
+		     struct json_rpc_entry entry)
+{
+  size_t tail = queue->tail;
+  if (tail - __atomic_load_n (&queue->head, __ATOMIC_ACQUIRE)
+      == JSON_RPC_QUEUE_SIZE)
+    {
+      pthread_mutex_lock (&queue->mx);
+      __atomic_store_n (&queue->producer_waiting, true, __ATOMIC_SEQ_CST);
+      while (tail - __atomic_load_n (&queue->head, __ATOMIC_SEQ_CST)
+	     == JSON_RPC_QUEUE_SIZE)
+	pthread_cond_wait (&queue->not_full, &queue->mx);
+      __atomic_store_n (&queue->producer_waiting, false, __ATOMIC_SEQ_CST);
+      pthread_mutex_unlock (&queue->mx);
+    }
+  queue->entries[tail % JSON_RPC_QUEUE_SIZE] = entry;
+  __atomic_store_n (&queue->tail, tail + 1, __ATOMIC_SEQ_CST);
+  json_rpc_queue_wake (queue, &queue->consumer_waiting, &queue->not_empty);
+  json_rpc_queue_notify (queue);
+}
+
+/* Tell the consumer of QUEUE that no more messages will come.  */
+
+static void
+json_rpc_queue_close (struct json_rpc_queue *queue)
+{
+  pthread_mutex_lock (&queue->mx);
+  __atomic_store_n (&queue->closed, true, __ATOMIC_SEQ_CST);
+  pthread_cond_signal (&queue->not_empty);
+  pthread_mutex_unlock (&queue->mx);
+  json_rpc_queue_notify (queue);
+}
+
+/* Wake up the consumer of QUEUE even though no message arrived.  */
+
+static void
+json_rpc_queue_kick (struct json_rpc_queue *queue)
+{
+  pthread_mutex_lock (&queue->mx);
+  queue->kicked = true;
+  pthread_cond_signal (&queue->not_empty);
+  pthread_mutex_unlock (&queue->mx);
+  json_rpc_queue_notify (queue);
+}
+
+/* Remove the oldest entry of QUEUE into *ENTRY.  Return false if
+   QUEUE is empty.  Only called from `json-rpc'.  */
+
+static bool
+json_rpc_queue_pop (struct json_rpc_queue *queue,
+		    struct json_rpc_entry *entry)
+{
+  size_t head = queue->head;
+  if (head == __atomic_load_n (&queue->tail, __ATOMIC_ACQUIRE))
+    return false;
+  *entry = queue->entries[head % JSON_RPC_QUEUE_SIZE];
+  __atomic_store_n (&queue->head, head + 1, __ATOMIC_SEQ_CST);
+  json_rpc_queue_wake (queue, &queue->producer_waiting, &queue->not_full);
+  return true;
+}
+
+/* Wait until QUEUE holds at least COUNT entries, is closed or is
+   kicked.  If DEADLINE is valid, give up when the realtime clock
+   reaches it.  */
+
+static void
+json_rpc_queue_wait (struct json_rpc_queue *queue, size_t count,
+		     struct timespec deadline)
+{
+  pthread_mutex_lock (&queue->mx);
+  __atomic_store_n (&queue->consumer_waiting, true, __ATOMIC_SEQ_CST);
+  while (__atomic_load_n (&queue->tail, __ATOMIC_SEQ_CST) - queue->head < count
+	 && !__atomic_load_n (&queue->closed, __ATOMIC_SEQ_CST)
+	 && !queue->kicked)
+    {
+      if (!timespec_valid_p (deadline))
+	pthread_cond_wait (&queue->not_empty, &queue->mx);
+      else if (pthread_cond_timedwait (&queue->not_empty, &queue->mx,
+				       &deadline) == ETIMEDOUT)
+	break;
+    }
+  queue->kicked = false;
+  __atomic_store_n (&queue->consumer_waiting, false, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock (&queue->mx);
+}
+
+static struct json_rpc_outbox *
+json_rpc_outbox_create (size_t high_water, bool coalesce,
+			struct timespec coalesce_delay)
+{
+  struct json_rpc_outbox *outbox = malloc (sizeof *outbox);
+  if (outbox == NULL)
+    return NULL;
+  pthread_mutex_init (&outbox->mx, NULL);
+  pthread_cond_init (&outbox->not_empty, NULL);
+  pthread_cond_init (&outbox->finished_cond, NULL);
+  outbox->first = outbox->last = NULL;
+  outbox->bytes = outbox->messages = 0;
+  outbox->high_water = high_water;
+  outbox->closed = outbox->finished = false;
+  outbox->coalesce = coalesce;
+  outbox->coalesce_delay = coalesce_delay;
+  return outbox;
+}
+
+static void
+json_rpc_outgoing_free (struct json_rpc_outgoing *outgoing)
+{
+  free (outgoing->buffer.data);
+  free (outgoing);
+}
+
+static void
+json_rpc_outbox_free (struct json_rpc_outbox *outbox)
+{
+  while (outbox->first)
+    {
+      struct json_rpc_outgoing *next = outbox->first->next;
+      json_rpc_outgoing_free (outbox->first);
+      outbox->first = next;
+    }
+  pthread_cond_destroy (&outbox->not_empty);
+  pthread_cond_destroy (&outbox->finished_cond);
+  pthread_mutex_destroy (&outbox->mx);
+  free (outbox);
+}
+
+static size_t json_rpc_put_header (struct json_rpc_buffer *);
+
+/* Merge the didChange notification NEXT into CHANGE, the one before
+   it, if NEXT is about the version of the same document that directly
+   follows CHANGE, and return true.  Otherwise, or if out of memory,
+   leave both alone and return false.
+
+   The merge works on the text of the messages: the content changes of
+   CHANGE are put in front of those of NEXT, unless NEXT replaces the
+   whole text anyway, and the result takes the place of CHANGE, whose
+   old text ends up in NEXT.  */
+
+static bool
+json_rpc_merge_change (struct json_rpc_outgoing *change,
+		       struct json_rpc_outgoing *next)
+{
+  struct json_rpc_change *old = &change->change, *new = &next->change;
+  size_t uri_length = old->uri_end - old->uri;
+  if (new->version != old->version + 1
+      || new->uri_end - new->uri != uri_length
+      || memcmp (change->buffer.data + old->uri,
+		 next->buffer.data + new->uri, uri_length) != 0)
+    return false;
+
+  /* The messages are written compactly, so an array with anything in
+     it is longer than "[]".  */
+  size_t length = old->changes_end - old->changes - 2;
+  if (!new->replace && length > 0)
+    {
+      bool empty = new->changes_end - new->changes == 2;
+      size_t shift = length + !empty;
+      char *data = realloc (next->buffer.data, next->buffer.end + shift);
+      if (data == NULL)
+	return false;
+      next->buffer.data = data;
+      next->buffer.size = next->buffer.end + shift;
+      char *changes = data + new->changes + 1;
+      memmove (changes + shift, changes,
+	       next->buffer.end - (new->changes + 1));
+      memcpy (changes, change->buffer.data + old->changes + 1, length);
+      if (!empty)
+	changes[length] = ',';
+      next->buffer.end += shift;
+      new->changes_end += shift;
+      new->replace = old->replace;
+      next->start = json_rpc_put_header (&next->buffer);
+    }
+
+  struct json_rpc_buffer buffer = change->buffer;
+  change->buffer = next->buffer;
+  change->start = next->start;
+  change->change = *new;
+  next->buffer = buffer;
+  return true;
+}
+
+/* Queue OUTGOING for writing, or merge it into the last message queued
+   if both are didChange notifications that can be coalesced.  Return
+   false if OUTBOX is above its high-water mark afterwards.  */
+
+static bool
+json_rpc_outbox_push (struct json_rpc_outbox *outbox,
+		      struct json_rpc_outgoing *outgoing,
+		      struct json_rpc_stats *stats)
+{
+  outgoing->next = NULL;
+  pthread_mutex_lock (&outbox->mx);
+  struct json_rpc_outgoing *last = outbox->last;
+  bool merged = (outgoing->coalesce && last && last->coalesce
+		 && json_rpc_merge_change (last, outgoing));
+  if (merged)
+    {
+      outbox->bytes -= last->size;
+      last->size = last->buffer.end - last->start;
+      outbox->bytes += last->size;
+    }
+  else
+    {
+      if (last)
+	last->next = outgoing;
+      else
+	outbox->first = outgoing;
+      outbox->last = outgoing;
+      outbox->messages++;
+      outbox->bytes += outgoing->size;
+    }
+  json_rpc_stats_peak (stats, JSON_RPC_OUTBOX_MESSAGES_PEAK, outbox->messages);
+  json_rpc_stats_peak (stats, JSON_RPC_OUTBOX_BYTES_PEAK, outbox->bytes);
+  bool below = outbox->bytes <= outbox->high_water;
+  pthread_cond_signal (&outbox->not_empty);
+  pthread_mutex_unlock (&outbox->mx);
+  if (merged)
+    json_rpc_outgoing_free (outgoing);
+  return below;
+}
+
+/* Take the request with ID back from OUTBOX and return true, unless
+   the writer thread has already started writing it.  */
+
+static bool
+json_rpc_outbox_remove (struct json_rpc_outbox *outbox, intmax_t id)
+{
+  struct json_rpc_outgoing *prev = NULL, *outgoing;
+  pthread_mutex_lock (&outbox->mx);
+  for (outgoing = outbox->first; outgoing; outgoing = outgoing->next)
+    {
+      if (outgoing->id == id)
+	{
+	  if (prev)
+	    prev->next = outgoing->next;
+	  else
+	    outbox->first = outgoing->next;
+	  if (outbox->last == outgoing)
+	    outbox->last = prev;
+	  outbox->bytes -= outgoing->size;
+	  outbox->messages--;
+	  break;
+	}
+      prev = outgoing;
+    }
+  pthread_mutex_unlock (&outbox->mx);
+  if (outgoing == NULL)
+    return false;
+  json_rpc_outgoing_free (outgoing);
+  return true;
+}
+
+/* Tell the writer thread of OUTBOX to exit once it is empty.  */
+
+static void
+json_rpc_outbox_close (struct json_rpc_outbox *outbox)
+{
+  pthread_mutex_lock (&outbox->mx);
+  outbox->closed = true;
+  pthread_cond_signal (&outbox->not_empty);
+  pthread_mutex_unlock (&outbox->mx);
+}
+
+/* Wait up to TIMEOUT for the writer thread of OUTBOX to exit.  Return
+   true if it did.  */
+
+static bool
+json_rpc_outbox_wait (struct json_rpc_outbox *outbox,
+		      struct timespec timeout)
+{
+  struct timespec deadline = timespec_add (current_timespec (), timeout);
+  pthread_mutex_lock (&outbox->mx);
+  while (!outbox->finished
+	 && pthread_cond_timedwait (&outbox->finished_cond, &outbox->mx,
+				    &deadline) != ETIMEDOUT)
+    continue;
+  bool finished = outbox->finished;
+  pthread_mutex_unlock (&outbox->mx);
+  return finished;
+}
+
+/* Drop the messages still queued in OUTBOX.  */
+
+static void
+json_rpc_outbox_discard (struct json_rpc_outbox *outbox)
+{
+  pthread_mutex_lock (&outbox->mx);
+  while (outbox->first)
+    {
+      struct json_rpc_outgoing *next = outbox->first->next;
+      outbox->bytes -= outbox->first->size;
+      outbox->messages--;
+      json_rpc_outgoing_free (outbox->first);
+      outbox->first = next;
+    }
+  outbox->last = NULL;
+  pthread_mutex_unlock (&outbox->mx);
+}
+
+/* Remember that the response to the request with ID is to be
+   dropped.  */
+
+static void
+json_rpc_ids_add (struct json_rpc_ids *ids, intmax_t id)
+{
+  pthread_mutex_lock (&ids->mx);
+  size_t count = ids->count;
+  if (count == JSON_RPC_CANCELLED_MAX)
+    memmove (ids->ids, ids->ids + 1, --count * sizeof *ids->ids);
+  ids->ids[count] = id;
+  __atomic_store_n (&ids->count, count + 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock (&ids->mx);
+}
+
+/* If ID is in IDS, remove it and return true.  */
+
+static bool
+json_rpc_ids_take (struct json_rpc_ids *ids, intmax_t id)
+{
+  if (id < 0 || __atomic_load_n (&ids->count, __ATOMIC_SEQ_CST) == 0)
+    return false;
+  bool found = false;
+  pthread_mutex_lock (&ids->mx);
+  for (size_t i = 0; i < ids->count; i++)
+    if (ids->ids[i] == id)
+      {
+	memmove (ids->ids + i, ids->ids + i + 1,
+		 (ids->count - i - 1) * sizeof *ids->ids);
+	__atomic_store_n (&ids->count, ids->count - 1, __ATOMIC_SEQ_CST);
+	found = true;
+	break;
+      }
+  pthread_mutex_unlock (&ids->mx);
+  return found;
+}
+
+static void
+json_rpc_stderr_init (struct json_rpc_stderr *ring, size_t limit)
+{
+  pthread_mutex_init (&ring->mx, NULL);
+  ring->data = NULL;
+  ring->size = 0;
+  ring->limit = limit;
+  ring->start = 0;
+  ring->length = 0;
+  ring->total = 0;
+}
+
+static void
+json_rpc_stderr_free (struct json_rpc_stderr *ring)
+{
+  pthread_mutex_destroy (&ring->mx);
+  free (ring->data);
+}
+
+/* Append the SIZE bytes at DATA to RING.  Does not need the global
+   lock.  */
+
+static void
+json_rpc_stderr_write (struct json_rpc_stderr *ring, const char *data,
+		       size_t size)
+{
+  pthread_mutex_lock (&ring->mx);
+  ring->total += size;
+  if (size > ring->limit)
+    {
+      data += size - ring->limit;
+      size = ring->limit;
+    }
+  if (ring->length + size > ring->size && ring->size < ring->limit)
+    {
+      /* Grow the buffer, straightening it out on the way.  If that
+	 fails, keep using the old one.  */
+      size_t new_size = max (ring->length + size, 2 * ring->size);
+      new_size = min (max (new_size, JSON_RPC_STDERR_CHUNK), ring->limit);
+      char *new_data = malloc (new_size);
+      if (new_data != NULL)
+	{
+	  size_t first = min (ring->length, ring->size - ring->start);
+	  if (ring->length > 0)
+	    {
+	      memcpy (new_data, ring->data + ring->start, first);
+	      memcpy (new_data + first, ring->data, ring->length - first);
+	    }
+	  free (ring->data);
+	  ring->data = new_data;
+	  ring->size = new_size;
+	  ring->start = 0;
+	}
+    }
+  if (size > ring->size)
+    {
+      data += size - ring->size;
+      size = ring->size;
+    }
+  for (size_t written = 0; written < size; )
+    {
+      size_t end = (ring->start + ring->length) % ring->size;
+      size_t n = min (size - written, ring->size - end);
+      memcpy (ring->data + end, data + written, n);
+      written += n;
+      ring->length += n;
+      if (ring->length > ring->size)
+	{
+	  ring->start = (ring->start + ring->length - ring->size) % ring->size;
+	  ring->length = ring->size;
+	}
+    }
+  pthread_mutex_unlock (&ring->mx);
+}
+
+/* Return how many bytes of RING's contents lie after position POS in
+   the stream.  */
+
+static size_t
+json_rpc_stderr_pending (struct json_rpc_stderr *ring, uintmax_t pos)
+{
+  pthread_mutex_lock (&ring->mx);
+  uintmax_t oldest = ring->total - ring->length;
+  size_t pending = ring->total - max (pos, oldest);
+  pthread_mutex_unlock (&ring->mx);
+  return pending;
+}
+
+/* Copy to DEST up to SIZE bytes of RING's contents from position *POS
+   in the stream on, or from its oldest byte if that is later, and
+   advance *POS past them.  Return the number of bytes copied.  */
+
+static size_t
+json_rpc_stderr_read (struct json_rpc_stderr *ring, uintmax_t *pos,
+		      char *dest, size_t size)
+{
+  pthread_mutex_lock (&ring->mx);
+  uintmax_t oldest = ring->total - ring->length;
+  if (*pos < oldest)
+    *pos = oldest;
+  size_t n = min (ring->total - *pos, size);
+  for (size_t copied = 0; copied < n; )
+    {
+      size_t offset = (ring->start + (*pos - oldest)) % ring->size;
+      size_t chunk = min (n - copied, ring->size - offset);
+      memcpy (dest + copied, ring->data + offset, chunk);
+      copied += chunk;
+      *pos += chunk;
+    }
+  pthread_mutex_unlock (&ring->mx);
+  return n;
+}
+
+/* Return RING's contents from position *POS in the stream on as a
+   string, and advance *POS past them.  */
+
+static Lisp_Object
+json_rpc_stderr_string (struct json_rpc_stderr *ring, uintmax_t *pos)
+{
+  USE_SAFE_ALLOCA;
+  size_t size = json_rpc_stderr_pending (ring, *pos);
+  char *text = SAFE_ALLOCA (size);
+  /* Bytes that arrive meanwhile are left for next time.  */
+  size = json_rpc_stderr_read (ring, pos, text, size);
+  Lisp_Object string = make_string (text, size);
+  SAFE_FREE ();
+  return string;
+}
+
+/* Start a native thread running FUNC (STATE) and store its id in
+   *THREAD.  Return false on failure.  */
+
+static bool
+json_rpc_create_thread (pthread_t *thread, void *(*func) (void *),
+			struct json_rpc_state *state)
+{
+  return sys_native_thread_create (thread, func, state);
+}
+
+static void *json_rpc_reader (void *);
+static void *json_rpc_writer (void *);
+#ifdef JSON_RPC_EVENT_LOOP
+static bool json_rpc_loop_add (struct json_rpc_state *);
+static void json_rpc_loop_close (struct json_rpc_state *);
+#endif
+
+/* Start the reader thread of STATE, or hand STATE over to the shared
+   I/O thread if SHARED.  Return false on failure.  */
+
+static bool
+json_rpc_start_reader (struct json_rpc_state *state, bool shared)
+{
+  state->queue = json_rpc_queue_create ();
+  if (state->queue == NULL)
+    return false;
+  bool started;
+#ifdef JSON_RPC_EVENT_LOOP
+  if (shared)
+    started = json_rpc_loop_add (state);
+  else
+#endif
+    started = json_rpc_create_thread (&state->reader, json_rpc_reader, state);
+  if (!started)
+    {
+      json_rpc_queue_free (state->queue);
+      state->queue = NULL;
+      return false;
+    }
+  return true;
+}
+
+/* Start the writer thread of STATE.  Return false on failure.  */
+
+static bool
+json_rpc_start_writer (struct json_rpc_state *state, size_t high_water,
+		       bool coalesce, struct timespec coalesce_delay)
+{
+  state->outbox = json_rpc_outbox_create (high_water, coalesce,
+					  coalesce_delay);
+  if (state->outbox == NULL)
+    return false;
+  if (!json_rpc_create_thread (&state->writer, json_rpc_writer, state))
+    {
+      json_rpc_outbox_free (state->outbox);
+      state->outbox = NULL;
+      return false;
+    }
+  return true;
+}
+
+static void
+json_rpc_join_writer (void *arg)
+{
+  struct json_rpc_state *state = arg;
+  struct thread_state *self = current_thread;
+  release_global_lock ();
+  if (!json_rpc_outbox_wait (state->outbox,
+			     make_timespec (0, (JSON_RPC_FLUSH_TIMEOUT
+						* 1000000))))
+    {
+      /* The server is not reading.  Drop what is queued and wake the
+	 writer thread up from a send that would never return.  */
+      json_rpc_outbox_discard (state->outbox);
+      state->handle->cancel_send (state->handle);
+    }
+  pthread_join (state->writer, NULL);
+  acquire_global_lock (self);
+}
+
+/* Stop the writer thread of STATE, if any.  It is given
+   JSON_RPC_FLUSH_TIMEOUT to write what is queued, and the rest is
+   dropped.  The global lock is released meanwhile, and STATE's handle
+   must not be locked, since other threads may need it to send.  The
+   outbox stays until the handle is closed.  */
+
+static void
+json_rpc_stop_writer (struct json_rpc_state *state)
+{
+  if (state->outbox)
+    {
+      json_rpc_outbox_close (state->outbox);
+      flush_stack_call_func (json_rpc_join_writer, state);
+    }
+}
+
+static void
+json_rpc_state_free (void *ptr)
+{
+  struct json_rpc_state *state = ptr;
+  assert (state->handle == NULL); /* Loop must be exited */
+  pthread_mutex_destroy (&state->handle_mx);
+  pthread_mutex_destroy (&state->cancelled.mx);
+  free (state->supersede);
+  free (state->stats);
+  if (state->outbox)
+    json_rpc_outbox_free (state->outbox);
+  if (state->queue)
+    json_rpc_queue_free (state->queue);
+  free (state->read_buffer);
+  free (state->send_buffer.data);
+  json_dom_free (state->dom);
+  json_rpc_stderr_free (&state->stderr_ring);
+  free (state);
+}
+
+
+DEFUN ("json-rpc-connection", Fjson_rpc_connection, Sjson_rpc_connection, 1, MANY,
+       NULL,
+       doc: /* Create JSONRPC connection.
+PROGRAM is the server to run and ARGS its arguments, all strings.
+They can be followed by keyword/argument pairs:
+
+The keyword argument `:socket' names a Unix domain socket to connect
+to instead of running a program.  Likewise, the keyword arguments
+`:host' and `:port' specify a TCP server to connect to; `:port' is a
+port number or a service name.  Such connections have no stderr.
+
+The keyword argument `:environment' is a list of strings of the form
+"NAME=VALUE" to add to the server's environment, which is otherwise
+inherited from Emacs; a string "NAME" removes NAME from it.  The
+keyword argument `:directory' specifies the server's working
+directory; by default it inherits that of Emacs.  The keyword argument
+`:process-group', if non-nil, puts the server in a process group of its
+own, so that signals sent to Emacs's group do not reach it.
+
+The keyword argument `:reader-thread', if non-nil, makes the
+connection read and parse incoming messages in a native thread of its
+own, without holding the global lock.  `json-rpc' then only converts
+and dispatches them, several at a time.  If the value is `shared',
+the connection is instead served by a single native thread that reads
+from all such connections, so that many servers do not need as many
+threads.
+
+The keyword argument `:writer-thread', if non-nil, makes the
+connection write outgoing messages from a native thread of its own, so
+that `json-rpc-send' returns as soon as a message is queued instead of
+waiting for the server to read it.  When the connection is closed,
+messages the server does not read within half a second are dropped.
+
+The keyword argument `:send-high-water' specifies how many bytes may
+be queued for the writer thread before `json-rpc-send' starts
+returning nil to signal backpressure.  It defaults to 8 MiB.
+
+The keyword argument `:coalesce-changes', if non-nil, makes the writer
+thread merge consecutive "textDocument/didChange" notifications about
+successive versions of the same document into one while they wait to
+be written, as they do when the server is not reading.  If the value
+is a number, the writer thread also holds such a notification back for
+up to that many seconds when it is idle, to merge the next ones into
+it.  Anything sent after it is only held back with it.  This requires
+`:writer-thread'.
+
+The keyword argument `:lazy', if non-nil, makes `json-rpc' pass
+messages as objects that are only indexed when they are read, without
+holding the global lock.  Their parts are converted on demand by
+`json-rpc-get'.  Messages that cannot be indexed, such as those nested
+more than 10000 levels deep, are converted right away.
+
+The keyword argument `:stderr-size' specifies how many bytes of the
+server's stderr output to keep for `json-rpc-stderr'.  Older output is
+discarded.  It defaults to 64 KiB; memory is only allocated as output
+arrives.
+
+The keyword argument `:supersede' is a list of method names, such as
+"textDocument/completion", whose requests are only useful until the
+next one about the same document.  Each request of such a method sent
+with `json-rpc-request' cancels the previous one that is still waiting
+for its response.
+
+The keyword argument `:stats', if non-nil, makes the connection count
+the messages and bytes it exchanges and measure how long each stage of
+handling them takes, for `json-rpc-stats'.
+usage: (json-rpc-connection PROGRAM &rest ARGS)  */)
+  (ptrdiff_t nargs, Lisp_Object *args)
+{
+  ptrdiff_t argc = 0;
+  while (argc < nargs && STRINGP (args[argc]))
+    argc++;
+
+  bool reader_thread = false;
+  bool shared_reader = false;
+  bool writer_thread = false;
+  bool lazy = false;
+  size_t high_water = JSON_RPC_SEND_HIGH_WATER;
+  bool coalesce = false;
+  struct timespec coalesce_delay = make_timespec (0, 0);
+  size_t stderr_size = JSON_RPC_STDERR_SIZE;
+  Lisp_Object socket_name = Qnil, host = Qnil, port = Qnil;
+  Lisp_Object environment = Qnil, directory = Qnil, supersede = Qnil;
+  bool process_group = false;
+  bool stats = false;
+  if ((nargs - argc) % 2 != 0)
+    wrong_type_argument (Qplistp, Flist (nargs - argc, args + argc));
+  for (ptrdiff_t i = argc; i < nargs; i += 2)
+    {
+      if (EQ (args[i], QCreader_thread))
+	{
+	  reader_thread = !NILP (args[i + 1]);
+	  shared_reader = EQ (args[i + 1], Qshared);
+	}
+      else if (EQ (args[i], QCwriter_thread))
+	writer_thread = !NILP (args[i + 1]);
+      else if (EQ (args[i], QCsend_high_water))
+	{
+	  CHECK_FIXNAT (args[i + 1]);
+	  high_water = XFIXNAT (args[i + 1]);
+	}
+      else if (EQ (args[i], QCcoalesce_changes))
+	{
+	  coalesce = !NILP (args[i + 1]);
+	  if (NUMBERP (args[i + 1]))
+	    coalesce_delay = dtotimespec (XFLOATINT (args[i + 1]));
+	}
+      else if (EQ (args[i], QClazy))
+	lazy = !NILP (args[i + 1]);
+      else if (EQ (args[i], QCstderr_size))
+	{
+	  CHECK_FIXNAT (args[i + 1]);
+	  stderr_size = XFIXNAT (args[i + 1]);
+	}
+      else if (EQ (args[i], QCsocket))
+	{
+	  CHECK_STRING (args[i + 1]);
+	  socket_name = args[i + 1];
+	}
+      else if (EQ (args[i], QChost))
+	{
+	  CHECK_STRING (args[i + 1]);
+	  host = args[i + 1];
+	}
+      else if (EQ (args[i], QCport))
+	{
+	  if (!FIXNATP (args[i + 1]))
+	    CHECK_STRING (args[i + 1]);
+	  port = args[i + 1];
+	}
+      else if (EQ (args[i], QCenvironment))
+	{
+	  environment = args[i + 1];
+	  Lisp_Object tail = environment;
+	  FOR_EACH_TAIL (tail)
+	    CHECK_STRING (XCAR (tail));
+	  CHECK_LIST_END (tail, environment);
+	}
+      else if (EQ (args[i], QCdirectory))
+	{
+	  CHECK_STRING (args[i + 1]);
+	  directory = args[i + 1];
+	}
+      else if (EQ (args[i], QCprocess_group))
+	process_group = !NILP (args[i + 1]);
+      else if (EQ (args[i], QCsupersede))
+	{
+	  supersede = args[i + 1];
+	  Lisp_Object tail = supersede;
+	  FOR_EACH_TAIL (tail)
+	    CHECK_STRING (XCAR (tail));
+	  CHECK_LIST_END (tail, supersede);
+	}
+      else if (EQ (args[i], QCstats))
+	stats = !NILP (args[i + 1]);
+      else
+	wrong_choice (listn (14, QCreader_thread, QCwriter_thread,
+			     QCsend_high_water, QCcoalesce_changes,
+			     QClazy, QCstderr_size,
+			     QCsocket, QChost, QCport, QCenvironment,
+			     QCdirectory, QCprocess_group, QCsupersede,
+			     QCstats),
+		      args[i]);
+    }
+  if (coalesce && !writer_thread)
+    error ("Coalescing requires a connection with a writer thread");
+  bool use_socket = !NILP (socket_name) || !NILP (host) || !NILP (port);
+  if (!use_socket)
+    CHECK_STRING (args[0]);
+  else if (argc > 0)
+    error ("A connection has either a program or a socket");
+  else if (NILP (socket_name)
+	   ? NILP (host) || NILP (port)
+	   : !NILP (host) || !NILP (port))
+    error ("A connection needs either `:socket' or both `:host' and `:port'");
+
+  /* Encode strings before pointing into their data, which allocation
+     may move.  */
+  Lisp_Object encoded_environment = Qnil;
+  for (; CONSP (environment); environment = XCDR (environment))
+    encoded_environment = Fcons (ENCODE_SYSTEM (XCAR (environment)),
+				 encoded_environment);
+  encoded_environment = Fnreverse (encoded_environment);
+  if (!NILP (directory))
+    directory = ENCODE_FILE (Fexpand_file_name (directory, Qnil));
+  if (!NILP (socket_name))
+    socket_name = ENCODE_FILE (Fexpand_file_name (socket_name, Qnil));
+  if (!NILP (host))
+    host = ENCODE_SYSTEM (host);
+  Lisp_Object encoded_supersede = Qnil;
+  ptrdiff_t supersede_size = 1;
+  for (; CONSP (supersede); supersede = XCDR (supersede))
+    {
+      Lisp_Object method = json_encode (XCAR (supersede));
+      supersede_size += SBYTES (method) + 1;
+      encoded_supersede = Fcons (method, encoded_supersede);
+    }
+
+  USE_SAFE_ALLOCA;
+  char **new_argv;
+  SAFE_NALLOCA (new_argv, 1, argc + 1);
+  new_argv[argc] = NULL;
+
+  for (int i = 0; i < argc; i++)
+    new_argv[i] = SSDATA (args[i]);
+
+  struct SSP_Opts opts;
+  memset(&opts, 0, sizeof(opts));
+  opts.binary = new_argv[0];
+  opts.argv = new_argv;
+  opts.read_timeout_ms = -1;
+  struct SSP_Handle* handle;
+  if (use_socket)
+    {
+      char service[INT_BUFSIZE_BOUND (EMACS_INT)];
+      if (!NILP (socket_name))
+	opts.socket_path = SSDATA (socket_name);
+      else
+	{
+	  opts.host = SSDATA (host);
+	  if (FIXNATP (port))
+	    {
+	      sprintf (service, "%"pI"d", XFIXNAT (port));
+	      opts.service = service;
+	    }
+	  else
+	    opts.service = SSDATA (port);
+	}
+      handle = ssp_connect (&opts);
+    }
+  else
+    {
+      ptrdiff_t nenv = list_length (encoded_environment);
+      char **envp;
+      SAFE_NALLOCA (envp, 1, nenv + 1);
+      Lisp_Object tail = encoded_environment;
+      for (ptrdiff_t i = 0; i < nenv; i++, tail = XCDR (tail))
+	envp[i] = SSDATA (XCAR (tail));
+      envp[nenv] = NULL;
+      if (nenv > 0)
+	opts.envp = envp;
+      if (!NILP (directory))
+	opts.cwd = SSDATA (directory);
+      opts.new_pgroup = process_group;
+      handle = ssp_spawn(&opts);
+    }
+  if (!handle)
+    {
+      int err = errno;
+      report_file_errno (use_socket ? "Connecting to json-rpc server"
+			 : "Starting json-rpc server",
+			 (!use_socket ? args[0]
+			  : NILP (socket_name) ? list2 (host, port)
+			  : socket_name),
+			 err);
+    }
+  else
+    {
+      struct json_rpc_state *state = malloc (sizeof (struct json_rpc_state));
+      if (state == NULL)
+	{
+	  handle->close (handle);
+	  memory_full (sizeof (struct json_rpc_state));
+	}
+      int err = pthread_mutex_init (&state->handle_mx, NULL);
+      if (err == 0)
+	{
+	  err = pthread_mutex_init (&state->cancelled.mx, NULL);
+	  if (err != 0)
+	    pthread_mutex_destroy (&state->handle_mx);
+	}
+      if (err != 0)
+	{
+	  handle->close (handle);
+	  free (state);
+	  error ("Failed to initialize json-rpc connection: %s",
+		 emacs_strerror (err));
+	}
+      state->handle = handle;
+      state->queue = NULL;
+      state->shared = false;
+      state->outbox = NULL;
+      state->header_scanned = 0;
+      state->done = false;
+      state->shutdown = false;
+      state->reader_released = false;
+      state->closed = false;
+      state->lazy = lazy;
+      state->dom = NULL;
+      state->read_buffer = NULL;
+      state->read_buffer_size = 0;
+      state->read_start = 0;
+      state->read_end = 0;
+      state->send_buffer.data = NULL;
+      state->send_buffer.size = 0;
+      state->send_buffer.end = 0;
+      state->send_buffer_busy = false;
+      state->send_buffer_small = 0;
+      json_rpc_stderr_init (&state->stderr_ring, stderr_size);
+      state->stderr_delivered = 0;
+      state->cancelled.count = 0;
+      /* Without memory for it, requests are simply not superseded.  */
+      state->supersede
+	= NILP (encoded_supersede) ? NULL : malloc (supersede_size);
+      if (state->supersede)
+	{
+	  char *p = state->supersede;
+	  for (; CONSP (encoded_supersede);
+	       encoded_supersede = XCDR (encoded_supersede))
+	    {
+	      Lisp_Object method = XCAR (encoded_supersede);
+	      memcpy (p, SSDATA (method), SBYTES (method) + 1);
+	      p += SBYTES (method) + 1;
+	    }
+	  *p = '\0';
+	}
+      /* Likewise, without memory for them, nothing is measured.  */
+      state->stats = stats ? calloc (1, sizeof *state->stats) : NULL;
+      SAFE_FREE ();
+      if (writer_thread
+	  && !json_rpc_start_writer (state, high_water, coalesce,
+				     coalesce_delay))
+	{
+	  handle->close (handle);
+	  state->handle = NULL;
+	  json_rpc_state_free (state);
+	  Fsignal (Qerror,
+		   list1 (build_string ("Failed to start writer thread.")));
+	}
+      if (reader_thread && !json_rpc_start_reader (state, shared_reader))
+	{
+	  json_rpc_stop_writer (state);
+	  handle->close (handle);
+	  state->handle = NULL;
+	  json_rpc_state_free (state);
+	  Fsignal (Qerror,
+		   list1 (build_string ("Failed to start reader thread.")));
+	}
+      return make_user_ptr (json_rpc_state_free, state);
+    }
+}
+
+struct json_rpc_send_params
+{
+  struct json_rpc_state *state;
+  /* The framed message, which starts at offset START.  */
+  struct json_rpc_buffer buffer;
+  size_t start;
+  /* Whether BUFFER is the connection's send buffer, to be given back
+     once the message is sent.  */
+  bool borrowed;
+  /* Whether the message is a didChange notification sent through a
+     connection that coalesces them, and where its members are.  */
+  bool coalesce;
+  struct json_rpc_change change;
+  /* The id of the message if it is sent with `json-rpc-request', or
+     -1.  */
+  intmax_t id;
+  /* Set to false if the message could not be queued for lack of
+     memory.  */
+  bool queued;
+  /* Set to false if the writer thread is above its high-water
+     mark.  */
+  bool below_high_water;
+  /* Set to false if the message could not be written to the
+     server.  */
+  bool sent;
+};
+
+/* Make BUFFER at least SIZE bytes long.  Return false if out of
+   memory.  */
+
+static bool
+json_rpc_buffer_reserve (struct json_rpc_buffer *buffer, size_t size)
+{
+  if (buffer->size >= size)
+    return true;
+  size_t new_size = max (buffer->size * 2, 64 * 1024);
+  if (new_size < size)
+    new_size = size;
+  char *data = realloc (buffer->data, new_size);
+  if (data == NULL)
+    return false;
+  buffer->data = data;
+  buffer->size = new_size;
+  return true;
+}
+
+/* Put the LSP header in front of the body that BUFFER holds from
+   offset JSON_RPC_HEADER_MAX on, and return the offset at which the
+   header starts.  */
+
+static size_t
+json_rpc_put_header (struct json_rpc_buffer *buffer)
+{
+  char header[JSON_RPC_HEADER_MAX];
+  int header_size
+    = snprintf (header, sizeof header, "Content-Length: %zu\r\n\r\n",
+		buffer->end - JSON_RPC_HEADER_MAX);
+  size_t start = JSON_RPC_HEADER_MAX - header_size;
+  memcpy (buffer->data + start, header, header_size);
+  return start;
+}
+
+/* Messages sent to servers are serialized straight from Lisp objects
+   into the text of a buffer reused from one message to the next, in a
+   single pass, instead of being converted to a jansson tree that is
+   dumped afterwards.  The result is the same as that of
+   `json-serialize'.
+
+   Duplicate object members are detected with hash sets of the names
+   of the members written so far, which are identified by their
+   offsets in the output.  The sets of the objects being written, one
+   inside the other, are kept one above the other in JSON_RPC_KEYS, so
+   that only the innermost one, at the top, ever has to grow.  */
+
+struct json_rpc_key
+{
+  EMACS_UINT hash;
+  /* Offset in the output of the name, after its opening quote, or 0
+     for an empty slot.  */
+  size_t start;
+  size_t length;
+};
+
+static struct json_rpc_key *json_rpc_keys;
+static ptrdiff_t json_rpc_keys_size;
+
+/* The set of members of an object being written: the SIZE slots of
+   JSON_RPC_KEYS from BASE on, COUNT of which are used.  */
+struct json_rpc_members
+{
+  ptrdiff_t base;
+  ptrdiff_t size;
+  ptrdiff_t count;
+};
+
+struct json_rpc_out
+{
+  struct json_rpc_buffer *buffer;
+  const struct json_configuration *conf;
+  /* The end of the sets of members in JSON_RPC_KEYS.  */
+  ptrdiff_t keys_top;
+};
+
+/* Make room for N more bytes in OUT.  */
+
+static void
+json_rpc_out_reserve (struct json_rpc_out *out, size_t n)
+{
+  struct json_rpc_buffer *buffer = out->buffer;
+  if (buffer->size - buffer->end < n
+      && (SIZE_MAX - buffer->end < n
+	  || !json_rpc_buffer_reserve (buffer, buffer->end + n)))
+    json_out_of_memory ();
+}
+
+static void
+json_rpc_out_bytes (struct json_rpc_out *out, const char *bytes, size_t n)
+{
+  json_rpc_out_reserve (out, n);
+  memcpy (out->buffer->data + out->buffer->end, bytes, n);
+  out->buffer->end += n;
+}
+
+/* Write the N bytes of UTF-8 at S as a JSON string.  */
+
+static void
+json_rpc_out_quoted (struct json_rpc_out *out, const unsigned char *s,
+		     ptrdiff_t n)
+{
+  struct json_rpc_buffer *buffer = out->buffer;
+  /* Room for the rest of the string is made again after each escape
+     sequence, which takes up to 6 bytes instead of 1.  */
+  json_rpc_out_reserve (out, n + 2);
+  buffer->data[buffer->end++] = '"';
+  const unsigned char *p = s, *end = s + n;
+  for (;;)
+    {
+      const unsigned char *run = p;
+      while (p < end && *p >= 0x20 && *p != '"' && *p != '\\')
+	p++;
+      memcpy (buffer->data + buffer->end, run, p - run);
+      buffer->end += p - run;
+      if (p == end)
+	break;
+      json_rpc_out_reserve (out, (end - p) + 6 + 1);
+      char *d = buffer->data + buffer->end;
+      unsigned char c = *p++;
+      switch (c)
+	{
+	case '"': case '\\': d[0] = '\\'; d[1] = c; buffer->end += 2; break;
+	case '\b': memcpy (d, "\\b", 2); buffer->end += 2; break;
+	case '\f': memcpy (d, "\\f", 2); buffer->end += 2; break;
+	case '\n': memcpy (d, "\\n", 2); buffer->end += 2; break;
+	case '\r': memcpy (d, "\\r", 2); buffer->end += 2; break;
+	case '\t': memcpy (d, "\\t", 2); buffer->end += 2; break;
+	default:
+	  buffer->end += sprintf (d, "\\u%04X", c);
+	  break;
+	}
+    }
+  buffer->data[buffer->end++] = '"';
+}
+
+/* Return true if STRING is made of ASCII characters only, so that
+   its bytes are already UTF-8.  */
+
+static bool
+json_rpc_ascii_p (Lisp_Object string)
+{
+  if (STRING_MULTIBYTE (string))
+    return SCHARS (string) == SBYTES (string);
+  for (ptrdiff_t i = 0; i < SBYTES (string); i++)
+    if (SREF (string, i) >= 0x80)
+      return false;
+  return true;
+}
+
+/* Return STRING encoded in UTF-8, signaling an error if that is not
+   possible.  */
+
+static Lisp_Object
+json_rpc_utf8 (Lisp_Object string)
+{
+  if (json_rpc_ascii_p (string))
+    return string;
+  Lisp_Object encoded = json_encode (string);
+  /* A multibyte string is returned as is when it is valid UTF-8.  */
+  if (!STRING_MULTIBYTE (encoded))
+    json_check_utf8 (encoded);
+  return encoded;
+}
+
+static void
+json_rpc_out_members_init (struct json_rpc_out *out,
+			   struct json_rpc_members *members)
+{
+  members->base = out->keys_top;
+  members->size = 8;
+  members->count = 0;
+  if (json_rpc_keys_size < members->base + members->size)
+    json_rpc_keys = xpalloc (json_rpc_keys, &json_rpc_keys_size,
+			     members->base + members->size
+			     - json_rpc_keys_size,
+			     -1, sizeof *json_rpc_keys);
+  memset (json_rpc_keys + members->base, 0,
+	  members->size * sizeof *json_rpc_keys);
+  out->keys_top = members->base + members->size;
+}
+
+/* Double the size of MEMBERS, which must be at the top.  The new set
+   is built right above the old one, and moved down.  */
+
+static void
+json_rpc_out_members_grow (struct json_rpc_out *out,
+			   struct json_rpc_members *members)
+{
+  eassert (out->keys_top == members->base + members->size);
+  ptrdiff_t size = 2 * members->size;
+  ptrdiff_t scratch = members->base + members->size;
+  if (json_rpc_keys_size < scratch + size)
+    json_rpc_keys = xpalloc (json_rpc_keys, &json_rpc_keys_size,
+			     scratch + size - json_rpc_keys_size,
+			     -1, sizeof *json_rpc_keys);
+  struct json_rpc_key *old = json_rpc_keys + members->base;
+  struct json_rpc_key *new = json_rpc_keys + scratch;
+  memset (new, 0, size * sizeof *new);
+  for (ptrdiff_t i = 0; i < members->size; i++)
+    if (old[i].start != 0)
+      {
+	ptrdiff_t j = old[i].hash & (size - 1);
+	while (new[j].start != 0)
+	  j = (j + 1) & (size - 1);
+	new[j] = old[i];
+      }
+  memmove (old, new, size * sizeof *new);
+  members->size = size;
+  out->keys_top = members->base + size;
+}
+
+/* Write the name of a member of the object whose set of members is
+   MEMBERS, made of the N bytes of UTF-8 at KEY, followed by a colon.
+   If the object already has a member of that name, write nothing and
+   return the offset at which the name of that member starts;
+   otherwise, return 0.  */
+
+static size_t
+json_rpc_out_member (struct json_rpc_out *out,
+		     struct json_rpc_members *members,
+		     const unsigned char *key, ptrdiff_t n)
+{
+  struct json_rpc_buffer *buffer = out->buffer;
+  size_t mark = buffer->end;
+  if (members->count > 0)
+    json_rpc_out_bytes (out, ",", 1);
+  size_t start = buffer->end + 1;
+  json_rpc_out_quoted (out, key, n);
+  size_t length = buffer->end - 1 - start;
+  EMACS_UINT hash = hash_string (buffer->data + start, length);
+
+  if (2 * (members->count + 1) > members->size)
+    json_rpc_out_members_grow (out, members);
+  struct json_rpc_key *slots = json_rpc_keys + members->base;
+  ptrdiff_t i = hash & (members->size - 1);
+  for (; slots[i].start != 0; i = (i + 1) & (members->size - 1))
+    if (slots[i].hash == hash && slots[i].length == length
+	&& memcmp (buffer->data + slots[i].start, buffer->data + start,
+		   length) == 0)
+      {
+	buffer->end = mark;
+	return slots[i].start;
+      }
+  slots[i] = (struct json_rpc_key) { hash, start, length };
+  members->count++;
+  json_rpc_out_bytes (out, ":", 1);
+  return 0;
+}
+
+static void json_rpc_out_value (struct json_rpc_out *, Lisp_Object);
+
+static bool
+json_rpc_id_p (const unsigned char *key, ptrdiff_t length)
+{
+  return length == 2 && key[0] == 'i' && key[1] == 'd';
+}
+
+/* Write LISP, a hash table, alist or plist, as a JSON object.  If ID
+   is not negative, make it the object's "id" member, in place of any
+   that LISP has.  */
+
+static void
+json_rpc_out_object (struct json_rpc_out *out, Lisp_Object lisp,
+		     intmax_t id)
+{
+  struct json_rpc_members members;
+  json_rpc_out_members_init (out, &members);
+  json_rpc_out_bytes (out, "{", 1);
+
+  if (HASH_TABLE_P (lisp))
+    {
+      struct Lisp_Hash_Table *h = XHASH_TABLE (lisp);
+      for (ptrdiff_t i = 0; i < HASH_TABLE_SIZE (h); ++i)
+        {
+          Lisp_Object key = HASH_KEY (h, i);
+          if (!EQ (key, Qunbound))
+            {
+              CHECK_STRING (key);
+              Lisp_Object ekey = json_rpc_utf8 (key);
+              check_string_without_embedded_nulls (ekey);
+	      if (id >= 0 && json_rpc_id_p (SDATA (ekey), SBYTES (ekey)))
+		continue;
+              /* Reject duplicate keys.  These are possible if the hash
+		 table test is not `equal'.  */
+	      if (json_rpc_out_member (out, &members, SDATA (ekey),
+				       SBYTES (ekey)))
+                wrong_type_argument (Qjson_value_p, lisp);
+	      json_rpc_out_value (out, HASH_VALUE (h, i));
+            }
+        }
+    }
+  else if (CONSP (lisp))
+    {
+      Lisp_Object tail = lisp;
+      bool is_plist = !CONSP (XCAR (tail));
+      FOR_EACH_TAIL (tail)
+        {
+          Lisp_Object value;
+          Lisp_Object key_symbol;
+          if (is_plist)
+            {
+              key_symbol = XCAR (tail);
+              tail = XCDR (tail);
+              CHECK_CONS (tail);
+              value = XCAR (tail);
+            }
+          else
+            {
+              Lisp_Object pair = XCAR (tail);
+              CHECK_CONS (pair);
+              key_symbol = XCAR (pair);
+              value = XCDR (pair);
+            }
+          CHECK_SYMBOL (key_symbol);
+          Lisp_Object key = json_rpc_utf8 (SYMBOL_NAME (key_symbol));
+          check_string_without_embedded_nulls (key);
+	  const unsigned char *key_str = SDATA (key);
+	  ptrdiff_t key_length = SBYTES (key);
+          /* In plists, ensure leading ":" in keys is stripped.  */
+          if (is_plist && ':' == key_str[0] && key_length > 1)
+	    {
+	      key_str++;
+	      key_length--;
+	    }
+          /* Only add element if key is not already present.  */
+	  if (!(id >= 0 && json_rpc_id_p (key_str, key_length))
+	      && json_rpc_out_member (out, &members, key_str, key_length) == 0)
+	    json_rpc_out_value (out, value);
+        }
+      CHECK_LIST_END (tail, lisp);
+    }
+
+  if (id >= 0)
+    {
+      char number[INT_BUFSIZE_BOUND (intmax_t)];
+      json_rpc_out_member (out, &members, (const unsigned char *) "id", 2);
+      json_rpc_out_bytes (out, number, sprintf (number, "%"PRIdMAX, id));
+    }
+
+  json_rpc_out_bytes (out, "}", 1);
+  out->keys_top = members.base;
+}
+
+/* Write the float VALUE the way jansson does.  */
+
+static void
+json_rpc_out_float (struct json_rpc_out *out, double value)
+{
+  /* jansson refuses to represent them.  */
+  if (!isfinite (value))
+    json_out_of_memory ();
+  /* "%.17g" takes at most 24 bytes.  */
+  char number[32];
+  int n = sprintf (number, "%.17g", value);
+  /* Make sure the number is read back as a float, and drop the plus
+     sign and leading zeros of the exponent.  */
+  char *e = strchr (number, 'e');
+  if (e == NULL && strchr (number, '.') == NULL)
+    n += sprintf (number + n, ".0");
+  else if (e)
+    {
+      char *start = e + 1, *end = e + 2;
+      if (*start == '-')
+	start++;
+      while (*end == '0')
+	end++;
+      memmove (start, end, number + n + 1 - end);
+      n -= end - start;
+    }
+  json_rpc_out_bytes (out, number, n);
+}
+
+/* Write LISP as JSON.  Signal an error of type `wrong-type-argument'
+   if LISP cannot be represented, as lisp_to_json does.  */
+
+static void
+json_rpc_out_value (struct json_rpc_out *out, Lisp_Object lisp)
+{
+  const struct json_configuration *conf = out->conf;
+  if (EQ (lisp, conf->null_object))
+    json_rpc_out_bytes (out, "null", 4);
+  else if (EQ (lisp, conf->false_object))
+    json_rpc_out_bytes (out, "false", 5);
+  else if (EQ (lisp, Qt))
+    json_rpc_out_bytes (out, "true", 4);
+  else if (INTEGERP (lisp))
+    {
+      intmax_t low = TYPE_MINIMUM (json_int_t);
+      intmax_t high = TYPE_MAXIMUM (json_int_t);
+      intmax_t value = check_integer_range (lisp, low, high);
+      char number[INT_BUFSIZE_BOUND (intmax_t)];
+      json_rpc_out_bytes (out, number, sprintf (number, "%"PRIdMAX, value));
+    }
+  else if (FLOATP (lisp))
+    json_rpc_out_float (out, XFLOAT_DATA (lisp));
+  else if (STRINGP (lisp))
+    {
+      Lisp_Object encoded = json_rpc_utf8 (lisp);
+      json_rpc_out_quoted (out, SDATA (encoded), SBYTES (encoded));
+    }
+  else if (VECTORP (lisp) || HASH_TABLE_P (lisp) || NILP (lisp)
+	   || CONSP (lisp))
+    {
+      if (++lisp_eval_depth > max_lisp_eval_depth)
+	xsignal0 (Qjson_object_too_deep);
+      if (VECTORP (lisp))
+	{
+	  json_rpc_out_bytes (out, "[", 1);
+	  for (ptrdiff_t i = 0; i < ASIZE (lisp); ++i)
+	    {
+	      if (i > 0)
+		json_rpc_out_bytes (out, ",", 1);
+	      json_rpc_out_value (out, AREF (lisp, i));
+	    }
+	  json_rpc_out_bytes (out, "]", 1);
+	}
+      else
+	json_rpc_out_object (out, lisp, -1);
+      --lisp_eval_depth;
+    }
+  else
+    wrong_type_argument (Qjson_value_p, lisp);
+}
+
+/* Serialize MESSAGE according to CONF, with its LSP header, into
+   BUFFER, and return the offset at which the framed message starts.
+   If ID is not negative, MESSAGE must be a JSON object, to which an
+   "id" member of that value is added.  */
+
+static size_t
+json_rpc_serialize (Lisp_Object message,
+		    const struct json_configuration *conf, intmax_t id,
+		    struct json_rpc_buffer *buffer)
+{
+  struct json_rpc_out out = { .buffer = buffer, .conf = conf };
+  buffer->end = JSON_RPC_HEADER_MAX;
+  if (!json_rpc_buffer_reserve (buffer, JSON_RPC_HEADER_MAX))
+    json_out_of_memory ();
+  if (id < 0)
+    json_rpc_out_value (&out, message);
+  else if (!EQ (message, conf->null_object)
+	   && !EQ (message, conf->false_object)
+	   && (HASH_TABLE_P (message) || NILP (message) || CONSP (message)))
+    json_rpc_out_object (&out, message, id);
+  else
+    error ("A json-rpc request must be a JSON object");
+  return json_rpc_put_header (buffer);
+}
+
+/* Write all SIZE bytes of BUFFER to HANDLE, continuing after partial
+   sends.  Return false if the server cannot be written to.  */
+
+static bool
+json_rpc_send_all (struct SSP_Handle *handle, char *buffer, size_t size)
+{
+  while (size > 0)
+    {
+      int sent = handle->send (handle, buffer, min (size, INT_MAX));
+      if (sent <= 0)
+	return false;
+      buffer += sent;
+      size -= sent;
+    }
+  return true;
+}
+
+/* Body of a connection's writer thread.  Runs without the global
+   lock and must not touch Lisp objects.  */
+
+static void *
+json_rpc_writer (void *arg)
+{
+  struct json_rpc_state *state = arg;
+  struct json_rpc_outbox *outbox = state->outbox;
+  bool failed = false;
+  pthread_mutex_lock (&outbox->mx);
+  for (;;)
+    {
+      while (outbox->first == NULL && !outbox->closed)
+	pthread_cond_wait (&outbox->not_empty, &outbox->mx);
+      struct json_rpc_outgoing *outgoing = outbox->first;
+      if (outgoing == NULL)
+	break;
+      /* Give a didChange notification until its deadline to absorb the
+	 next ones, unless something is already queued after it.  */
+      if (outgoing->coalesce && outgoing == outbox->last && !outbox->closed
+	  && timespec_cmp (current_timespec (), outgoing->flush_at) < 0)
+	{
+	  pthread_cond_timedwait (&outbox->not_empty, &outbox->mx,
+				  &outgoing->flush_at);
+	  continue;
+	}
+      outbox->first = outgoing->next;
+      if (outbox->first == NULL)
+	outbox->last = NULL;
+      pthread_mutex_unlock (&outbox->mx);
+
+      size_t size = outgoing->size;
+      size_t start = outgoing->start;
+      /* Once the server stopped accepting input, drop the rest.  */
+      if (!failed)
+	{
+	  uint64_t written = json_rpc_stats_start (state->stats);
+	  failed = !json_rpc_send_all (state->handle,
+				       outgoing->buffer.data + start,
+				       outgoing->buffer.end - start);
+	  if (!failed)
+	    {
+	      json_rpc_stats_time (state->stats, JSON_RPC_WRITE, written);
+	      json_rpc_stats_count (state->stats, JSON_RPC_MESSAGES_OUT, 1);
+	      json_rpc_stats_count (state->stats, JSON_RPC_BYTES_OUT,
+				    outgoing->buffer.end - start);
+	    }
+	}
+      json_rpc_outgoing_free (outgoing);
+
+      pthread_mutex_lock (&outbox->mx);
+      outbox->bytes -= size;
+      outbox->messages--;
+    }
+  outbox->finished = true;
+  pthread_cond_broadcast (&outbox->finished_cond);
+  pthread_mutex_unlock (&outbox->mx);
+  return NULL;
+}
+
+/* Queue PARAM's message for the writer thread, which takes its buffer
+   over.  */
+
+static void
+json_rpc_send_queued (struct json_rpc_send_params *param)
+{
+  struct json_rpc_outgoing *outgoing = calloc (1, sizeof *outgoing);
+  if (outgoing == NULL)
+    {
+      param->queued = false;
+      return;
+    }
+  /* Rather than copying the message, give the buffer away, minus the
+     room it does not use; the connection grows a new one for the next
+     message.  */
+  outgoing->buffer = param->buffer;
+  char *data = realloc (param->buffer.data, param->buffer.end);
+  if (data)
+    {
+      outgoing->buffer.data = data;
+      outgoing->buffer.size = param->buffer.end;
+    }
+  param->buffer = (struct json_rpc_buffer) { NULL, 0, 0 };
+  outgoing->start = param->start;
+  outgoing->id = param->id;
+  outgoing->size = outgoing->buffer.end - outgoing->start;
+  struct json_rpc_outbox *outbox = param->state->outbox;
+  if (param->coalesce)
+    {
+      outgoing->coalesce = true;
+      outgoing->change = param->change;
+      outgoing->flush_at = timespec_add (current_timespec (),
+					 outbox->coalesce_delay);
+    }
+  param->below_high_water
+    = json_rpc_outbox_push (outbox, outgoing, param->state->stats);
+}
+
+static void
+json_rpc_send_callback (void * arg)
+{
+  struct json_rpc_send_params *param = arg;
+  struct json_rpc_state *state = param->state;
+  struct thread_state *self = current_thread;
+
+  if (can_use_handle (state))
+    {
+      release_global_lock ();
+      sys_thread_yield ();
+
+      struct json_rpc_stats *stats = state->stats;
+      if (state->outbox)
+	json_rpc_send_queued (param);
+      else
+	{
+	  size_t size = param->buffer.end - param->start;
+	  uint64_t written = json_rpc_stats_start (stats);
+	  param->sent = json_rpc_send_all (state->handle,
+					   param->buffer.data + param->start,
+					   size);
+	  if (param->sent)
+	    {
+	      json_rpc_stats_time (stats, JSON_RPC_WRITE, written);
+	      json_rpc_stats_count (stats, JSON_RPC_MESSAGES_OUT, 1);
+	      json_rpc_stats_count (stats, JSON_RPC_BYTES_OUT, size);
+	    }
+	}
+      end_using_handle (state);
+      uint64_t waited = json_rpc_stats_start (stats);
+      acquire_global_lock (self);
+      json_rpc_stats_time (stats, JSON_RPC_LOCK_WAIT, waited);
+    }
+}
+
+/* Set up PARAMS to send a message with ID, or -1, through STATE,
+   borrowing STATE's send buffer unless another thread still uses it.
+   json_rpc_send_done must be called afterwards, even after a nonlocal
+   exit.  */
+
+static void
+json_rpc_send_init (struct json_rpc_send_params *params,
+		    struct json_rpc_state *state, intmax_t id)
+{
+  *params = (struct json_rpc_send_params) {
+    .state = state,
+    .id = id,
+    .queued = true,
+    .below_high_water = true,
+    .sent = true
+  };
+  if (!state->send_buffer_busy)
+    {
+      params->buffer = state->send_buffer;
+      params->borrowed = state->send_buffer_busy = true;
+    }
+}
+
+/* Give back or free the buffer of PARAMS, a struct
+   json_rpc_send_params.  */
+
+static void
+json_rpc_send_done (void *arg)
+{
+  struct json_rpc_send_params *params = arg;
+  if (params->borrowed)
+    {
+      struct json_rpc_state *state = params->state;
+      if (params->buffer.size <= JSON_RPC_SEND_BUFFER_KEEP
+	  || params->buffer.end > JSON_RPC_SEND_BUFFER_KEEP)
+	state->send_buffer_small = 0;
+      else if (++state->send_buffer_small == JSON_RPC_SEND_BUFFER_SHRINK)
+	{
+	  free (params->buffer.data);
+	  params->buffer.data = NULL;
+	  params->buffer.size = 0;
+	  state->send_buffer_small = 0;
+	}
+      state->send_buffer = params->buffer;
+      state->send_buffer_busy = false;
+    }
+  else
+    free (params->buffer.data);
+}
+
+static const char *json_rpc_skip_space (const char *, const char *);
+static const char *json_rpc_skip_value (const char *, const char *);
+static const char *json_rpc_find_member (const char *, const char *,
+					 const char *, const char **);
+
+/* If the message in PARAMS is a didChange notification with a version
+   and content changes, find where they are and return true.  */
+
+static bool
+json_rpc_find_change (struct json_rpc_send_params *params)
+{
+  static char const method[] = "\"textDocument/didChange\"";
+  const char *data = params->buffer.data;
+  const char *body = data + JSON_RPC_HEADER_MAX;
+  const char *end = data + params->buffer.end;
+  const char *value_end, *params_end, *document_end, *uri_end;
+  const char *version_end, *changes_end;
+  const char *value = json_rpc_find_member (body, end, "method", &value_end);
+  if (value == NULL || value_end - value != sizeof method - 1
+      || memcmp (value, method, sizeof method - 1) != 0
+      || json_rpc_find_member (body, end, "id", &value_end))
+    return false;
+  const char *message_params
+    = json_rpc_find_member (body, end, "params", &params_end);
+  const char *document
+    = (message_params
+       ? json_rpc_find_member (message_params, params_end, "textDocument",
+			       &document_end)
+       : NULL);
+  const char *uri
+    = (document
+       ? json_rpc_find_member (document, document_end, "uri", &uri_end)
+       : NULL);
+  const char *version
+    = (uri
+       ? json_rpc_find_member (document, document_end, "version",
+			       &version_end)
+       : NULL);
+  const char *changes
+    = (version
+       ? json_rpc_find_member (message_params, params_end, "contentChanges",
+			       &changes_end)
+       : NULL);
+  if (changes == NULL || *uri != '"' || *changes != '[')
+    return false;
+
+  intmax_t number = 0;
+  for (const char *p = version; p < version_end; p++)
+    if ('0' <= *p && *p <= '9' && number <= (INTMAX_MAX - (*p - '0')) / 10)
+      number = 10 * number + (*p - '0');
+    else
+      return false;
+
+  /* A change without a range replaces the whole text.  */
+  bool replace = false;
+  const char *p = json_rpc_skip_space (changes + 1, changes_end);
+  if (*p != ']')
+    for (;;)
+      {
+	const char *change_end = json_rpc_skip_value (p, changes_end);
+	if (*p != '{' || change_end == NULL || change_end == changes_end)
+	  return false;
+	if (!json_rpc_find_member (p, change_end, "range", &value_end))
+	  replace = true;
+	p = json_rpc_skip_space (change_end, changes_end);
+	if (*p == ']')
+	  break;
+	if (*p != ',')
+	  return false;
+	p = json_rpc_skip_space (p + 1, changes_end);
+      }
+
+  params->change = (struct json_rpc_change) {
+    .uri = uri - data,
+    .uri_end = uri_end - data,
+    .version = number,
+    .changes = changes - data,
+    .changes_end = changes_end - data,
+    .replace = replace
+  };
+  return true;
+}
+
+/* Serialize MESSAGE according to CONF into PARAMS, set up by
+   json_rpc_send_init.  */
+
+static void
+json_rpc_send_serialize (struct json_rpc_send_params *params,
+			 Lisp_Object message,
+			 const struct json_configuration *conf)
+{
+  struct json_rpc_stats *stats = params->state->stats;
+  uint64_t serialized = json_rpc_stats_start (stats);
+  params->start = json_rpc_serialize (message, conf, params->id,
+				      &params->buffer);
+  json_rpc_stats_time (stats, JSON_RPC_SERIALIZE, serialized);
+  struct json_rpc_outbox *outbox = params->state->outbox;
+  params->coalesce = (outbox && outbox->coalesce && params->id < 0
+		      && json_rpc_find_change (params));
+}
+
+/* Send the message in PARAMS, or queue it if its connection has a
+   writer thread.  Return false if that thread is above its high-water
+   mark.  Signal an error if the server cannot be written to.  */
+
+static bool
+json_rpc_send_message (struct json_rpc_send_params *params)
+{
+  flush_stack_call_func (json_rpc_send_callback, params);
+  if (!params->queued)
+    json_out_of_memory ();
+  if (!params->sent)
+    error ("Cannot write to the json-rpc server");
+  return params->below_high_water;
+}
+
+/* Requests sent with `json-rpc-request' whose responses have not been
+   delivered yet, as a table mapping their ids to conses (CALLBACK
+   . CONNECTION).  */
+static Lisp_Object json_rpc_requests;
+
+/* Id of the next request sent with `json-rpc-request'.  */
+static EMACS_INT json_rpc_next_id = 1;
+
+/* Table mapping the keys returned by json_rpc_supersede_key to the id
+   of the last request sent with that key.  */
+static Lisp_Object json_rpc_superseding;
+
+static struct json_rpc_state * json_rpc_state(Lisp_Object connection) {
+  return XUSER_PTR (connection)->p;
+}
+
+DEFUN ("json-rpc-send", Fjson_rpc_send, Sjson_rpc_send, 1, MANY,
+       NULL,
+       doc: /* Send message to jsonrpc connection.
+If CONNECTION has a writer thread, the message is only queued.  The
+return value is then nil if more than the connection's
+`:send-high-water' bytes are waiting to be written, and t otherwise.
+Otherwise, an error is signaled if the server cannot be written to.
+usage: (json-rpc-send CONNECTION MESSAGE &rest ARGS)  */)
+  (ptrdiff_t nargs, Lisp_Object *args)
+{
+  Lisp_Object connection = args[0];
+  CHECK_RPC_CONNECTION(connection);
+
+  struct json_configuration conf =
+    {json_object_hashtable, json_array_array, QCnull, QCfalse};
+  json_parse_args (nargs - 2, args + 2, &conf, false);
+
+  ptrdiff_t count = SPECPDL_INDEX ();
+  struct json_rpc_send_params params;
+  json_rpc_send_init (&params, json_rpc_state (connection), -1);
+  record_unwind_protect_ptr (json_rpc_send_done, &params);
+  json_rpc_send_serialize (&params, args[1], &conf);
+  bool below_high_water = json_rpc_send_message (&params);
+  return unbind_to (count, below_high_water ? Qt : Qnil);
+}
+
+static void
+json_rpc_forget_request (Lisp_Object id)
+{
+  Fremhash (id, json_rpc_requests);
+}
+
+/* Give up on the request with ID sent to CONNECTION, if it is still
+   waiting for its response, and return true; otherwise return false.
+   If the request is still in the outbox of CONNECTION's writer thread,
+   it is simply taken back.  Otherwise, the server is sent a
+   "$/cancelRequest" notification and the response is dropped when it
+   arrives.  */
+
+static bool
+json_rpc_cancel_request (Lisp_Object connection, EMACS_INT id)
+{
+  struct json_rpc_state *state = json_rpc_state (connection);
+  Lisp_Object key = make_fixnum (id);
+  Lisp_Object request = Fgethash (key, json_rpc_requests, Qnil);
+  if (!CONSP (request) || json_rpc_state (XCDR (request)) != state)
+    return false;
+  Fremhash (key, json_rpc_requests);
+
+  bool taken_back = false;
+  if (can_use_handle (state))
+    {
+      if (state->outbox)
+	taken_back = json_rpc_outbox_remove (state->outbox, id);
+      end_using_handle (state);
+    }
+  if (taken_back)
+    return true;
+
+  /* Expect the response before the server can send it.  */
+  json_rpc_ids_add (&state->cancelled, id);
+  ptrdiff_t count = SPECPDL_INDEX ();
+  struct json_rpc_send_params params;
+  json_rpc_send_init (&params, state, -1);
+  record_unwind_protect_ptr (json_rpc_send_done, &params);
+  char message[sizeof "{\"jsonrpc\":\"2.0\",\"method\":\"$/cancelRequest\","
+	       "\"params\":{\"id\":}}" + INT_STRLEN_BOUND (EMACS_INT)];
+  int length = sprintf (message, "{\"jsonrpc\":\"2.0\","
+			"\"method\":\"$/cancelRequest\","
+			"\"params\":{\"id\":%"pI"d}}", id);
+  params.buffer.end = JSON_RPC_HEADER_MAX;
+  if (!json_rpc_buffer_reserve (&params.buffer, JSON_RPC_HEADER_MAX + length))
+    json_out_of_memory ();
+  memcpy (params.buffer.data + params.buffer.end, message, length);
+  params.buffer.end += length;
+  params.start = json_rpc_put_header (&params.buffer);
+  json_rpc_send_message (&params);
+  unbind_to (count, Qnil);
+  return true;
+}
+
+/* If the request in PARAMS, to be sent to CONNECTION, is of a method
+   that CONNECTION was told to supersede, return the key under which it
+   supersedes the previous such request, a list (CONNECTION METHOD
+   . URI) where URI is that of the request's "textDocument", or nil if
+   it has none.  Otherwise, return nil.  Both are taken from the
+   serialized request, escapes included.  */
+
+static Lisp_Object
+json_rpc_supersede_key (Lisp_Object connection,
+			struct json_rpc_send_params *params)
+{
+  struct json_rpc_state *state = json_rpc_state (connection);
+  const char *body = params->buffer.data + JSON_RPC_HEADER_MAX;
+  const char *end = params->buffer.data + params->buffer.end;
+  const char *method_end;
+  const char *method = (state->supersede
+			? json_rpc_find_member (body, end, "method",
+						&method_end)
+			: NULL);
+  if (method == NULL || *method != '"')
+    return Qnil;
+  size_t method_length = method_end - method - 2;
+  for (const char *p = state->supersede; *p; p += strlen (p) + 1)
+    if (strlen (p) == method_length
+	&& memcmp (p, method + 1, method_length) == 0)
+      {
+	const char *params_end, *document_end, *uri_end;
+	const char *params = json_rpc_find_member (body, end, "params",
+						   &params_end);
+	const char *document
+	  = (params ? json_rpc_find_member (params, params_end,
+					    "textDocument", &document_end)
+	     : NULL);
+	const char *uri
+	  = (document ? json_rpc_find_member (document, document_end, "uri",
+					      &uri_end)
+	     : NULL);
+	Lisp_Object uri_string = Qnil;
+	if (uri && *uri == '"')
+	  uri_string = make_unibyte_string (uri + 1, uri_end - uri - 2);
+	return Fcons (connection,
+		      Fcons (make_unibyte_string (p, method_length),
+			     uri_string));
+      }
+  return Qnil;
+}
+
+DEFUN ("json-rpc-request", Fjson_rpc_request, Sjson_rpc_request, 3, MANY,
+       NULL,
+       doc: /* Send MESSAGE to CONNECTION as a request and return its id.
+MESSAGE must serialize to a JSON object, to which an "id" member is
+added.  Ids are natural numbers, distinct across all the requests sent
+with this function, so messages sent with `json-rpc-send' should not
+use the same ones.  ARGS are the keyword arguments of `json-rpc-send',
+whose return value is ignored.
+
+If the method of MESSAGE is one of those CONNECTION was told to
+supersede with `:supersede', the previous request of that method about
+the same "textDocument" is cancelled as if by `json-rpc-cancel'.
+
+When the response with that id arrives, the function reading
+CONNECTION, `json-rpc' or the callback set with
+`json-rpc-set-callback', calls (CALLBACK RESPONSE ERROR) instead of
+its own callback, with RESPONSE converted according to its own
+arguments.  ERROR is non-nil if the response could not be parsed.
+The id is read from the response before it is converted, and with
+`:reader-thread' by that thread, so the responses to requests
+cancelled with `json-rpc-cancel' are dropped without being converted.
+Requests still unanswered when the connection is closed are
+forgotten.
+usage: (json-rpc-request CONNECTION MESSAGE CALLBACK &rest ARGS)  */)
+  (ptrdiff_t nargs, Lisp_Object *args)
+{
+  Lisp_Object connection = args[0];
+  CHECK_RPC_CONNECTION (connection);
+
+  struct json_configuration conf =
+    {json_object_hashtable, json_array_array, QCnull, QCfalse};
+  json_parse_args (nargs - 3, args + 3, &conf, false);
+
+  ptrdiff_t count = SPECPDL_INDEX ();
+  EMACS_INT id = json_rpc_next_id++;
+  struct json_rpc_send_params params;
+  json_rpc_send_init (&params, json_rpc_state (connection), id);
+  record_unwind_protect_ptr (json_rpc_send_done, &params);
+  json_rpc_send_serialize (&params, args[1], &conf);
+  Lisp_Object key = make_fixnum (id);
+
+  Lisp_Object supersede_key = json_rpc_supersede_key (connection, &params);
+  if (!NILP (supersede_key))
+    {
+      Lisp_Object previous
+	= Fgethash (supersede_key, json_rpc_superseding, Qnil);
+      if (FIXNUMP (previous))
+	json_rpc_cancel_request (connection, XFIXNUM (previous));
+      Fputhash (supersede_key, key, json_rpc_superseding);
+    }
+
+  /* The request is registered before it is sent, since another thread
+     could read its response as soon as it is.  */
+  Fputhash (key, Fcons (args[2], connection), json_rpc_requests);
+  ptrdiff_t registered = SPECPDL_INDEX ();
+  record_unwind_protect (json_rpc_forget_request, key);
+  json_rpc_send_message (&params);
+  clear_unwind_protect (registered);
+  return unbind_to (count, key);
+}
+
+DEFUN ("json-rpc-cancel", Fjson_rpc_cancel, Sjson_rpc_cancel, 2, 2, 0,
+       doc: /* Cancel the request with ID sent to CONNECTION.
+ID is a value returned by `json-rpc-request'.  The request's callback
+will not be called.  If the request is still queued for the
+connection's writer thread, it is not sent at all.  Otherwise, the
+server is sent a "$/cancelRequest" notification, and the response is
+dropped without being converted when it arrives.  Return non-nil if
+the request was still waiting for its response.  */)
+  (Lisp_Object connection, Lisp_Object id)
+{
+  CHECK_RPC_CONNECTION (connection);
+  CHECK_FIXNAT (id);
+  return json_rpc_cancel_request (connection, XFIXNAT (id)) ? Qt : Qnil;
+}
+
+/* Read, and reset if RESET, the statistics word at P.  */
+
+static Lisp_Object
+json_rpc_stats_value (uint64_t *p, bool reset)
+{
+  uint64_t value = (reset ? __atomic_exchange_n (p, 0, __ATOMIC_RELAXED)
+		    : __atomic_load_n (p, __ATOMIC_RELAXED));
+  return make_uint (value);
+}
+
+static Lisp_Object
+json_rpc_stats_seconds (uint64_t *p, bool reset)
+{
+  uint64_t ns = (reset ? __atomic_exchange_n (p, 0, __ATOMIC_RELAXED)
+		 : __atomic_load_n (p, __ATOMIC_RELAXED));
+  return make_float (ns / 1e9);
+}
+
+DEFUN ("json-rpc-stats", Fjson_rpc_stats, Sjson_rpc_stats, 1, 2, 0,
+       doc: /* Return the statistics of CONNECTION as a property list.
+Return nil if CONNECTION was not created with `:stats'.
+
+The properties `:bytes-in', `:bytes-out', `:messages-in' and
+`:messages-out' count what was received from and sent to the server.
+`:queue-high-water' is the largest number of messages that waited for
+`json-rpc' in the reader thread's queue, and
+`:outbox-messages-high-water' and `:outbox-bytes-high-water' the
+largest number of messages and bytes that waited for the writer
+thread.
+
+The properties `:frame', `:parse', `:queue-wait', `:lock-wait',
+`:convert', `:callback', `:serialize' and `:write' describe how long
+each stage of handling messages took: finding them in the data read,
+looking at them without the global lock, waiting in the reader
+thread's queue, acquiring the global lock, converting them to Lisp
+objects, running the callback, and serializing and writing outgoing
+messages.  Each is a property list of `:count', `:total' and `:max',
+in seconds, and `:histogram', a vector whose element I counts the
+durations of at least 2^(I-1) but less than 2^I microseconds.
+
+If RESET is non-nil, also reset the statistics to zero.  */)
+  (Lisp_Object connection, Lisp_Object reset)
+{
+  CHECK_RPC_CONNECTION (connection);
+  struct json_rpc_state *state = XUSER_PTR (connection)->p;
+  struct json_rpc_stats *stats = state->stats;
+  if (stats == NULL)
+    return Qnil;
+  bool zero = !NILP (reset);
+
+  Lisp_Object const counters[JSON_RPC_COUNTERS]
+    = { QCbytes_in, QCbytes_out, QCmessages_in, QCmessages_out };
+  Lisp_Object const peaks[JSON_RPC_PEAKS]
+    = { QCqueue_high_water, QCoutbox_messages_high_water,
+	QCoutbox_bytes_high_water };
+  Lisp_Object const timings[JSON_RPC_TIMINGS]
+    = { QCframe, QCparse, QCqueue_wait, QClock_wait, QCconvert,
+	QCcallback, QCserialize, QCwrite };
+
+  Lisp_Object result = Qnil;
+  for (int i = JSON_RPC_TIMINGS - 1; i >= 0; i--)
+    {
+      struct json_rpc_histogram *histogram = &stats->timings[i];
+      Lisp_Object buckets = make_nil_vector (JSON_RPC_STATS_BUCKETS);
+      for (int j = 0; j < JSON_RPC_STATS_BUCKETS; j++)
+	ASET (buckets, j, json_rpc_stats_value (&histogram->buckets[j], zero));
+      Lisp_Object timing
+	= list (QCcount, json_rpc_stats_value (&histogram->count, zero),
+		QCtotal, json_rpc_stats_seconds (&histogram->total_ns, zero),
+		QCmax, json_rpc_stats_seconds (&histogram->max_ns, zero),
+		QChistogram, buckets);
+      result = Fcons (timings[i], Fcons (timing, result));
+    }
+  for (int i = JSON_RPC_PEAKS - 1; i >= 0; i--)
+    result = Fcons (peaks[i],
+		    Fcons (json_rpc_stats_value (&stats->peaks[i], zero),
+			   result));
+  for (int i = JSON_RPC_COUNTERS - 1; i >= 0; i--)
+    result = Fcons (counters[i],
+		    Fcons (json_rpc_stats_value (&stats->counters[i], zero),
+			   result));
+  return result;
+}
+
+DEFUN ("json-rpc-send-queue-depth", Fjson_rpc_send_queue_depth,
+       Sjson_rpc_send_queue_depth, 1, 1, 0,
+       doc: /* Return what CONNECTION's writer thread has yet to write.
+The value is a cons (MESSAGES . BYTES), or nil if CONNECTION has no
+writer thread.  */)
+  (Lisp_Object connection)
+{
+  CHECK_RPC_CONNECTION (connection);
+  struct json_rpc_state *state = json_rpc_state (connection);
+  Lisp_Object result = Qnil;
+  if (can_use_handle (state))
+    {
+      struct json_rpc_outbox *outbox = state->outbox;
+      if (outbox)
+	{
+	  pthread_mutex_lock (&outbox->mx);
+	  size_t messages = outbox->messages;
+	  size_t bytes = outbox->bytes;
+	  pthread_mutex_unlock (&outbox->mx);
+	  result = Fcons (make_uint (messages), make_uint (bytes));
+	}
+      end_using_handle (state);
+    }
+  return result;
+}
+
+DEFUN ("json-rpc-shutdown", Fjson_rpc_shutdown, Sjson_rpc_shutdown, 1, 1, 0,
+       doc: /* Shutdowns json rpc connection */)
+  (Lisp_Object connection)
+{
+  CHECK_RPC_CONNECTION (connection);
+  struct json_rpc_state *state = json_rpc_state (connection);
+  if (can_use_handle (state))
+    {
+#ifdef JSON_RPC_EVENT_LOOP
+      if (state->shared)
+	json_rpc_loop_close (state);
+      else
+#endif
+	{
+	  __atomic_store_n (&state->shutdown, true, __ATOMIC_SEQ_CST);
+	  state->handle->cancel_recv (state->handle);
+	}
+      end_using_handle (state);
+    }
+  return Qnil;
+}
+
+DEFUN ("json-rpc-pid", Fjson_rpc_pid, Sjson_rpc_pid, 1, 1, 0,
+       doc: /* Shutdowns json rpc connection */)
+  (Lisp_Object connection)
+{
+  int res = 0; /* or -1? */
+  CHECK_RPC_CONNECTION (connection);
+  struct json_rpc_state *state = json_rpc_state (connection);
+  if (can_use_handle (state))
+    {
+      res = state->handle->pid;
+      end_using_handle (state);
+    }
+  return make_int (res);
+}
+
+DEFUN ("json-rpc-stderr", Fjson_rpc_stderr, Sjson_rpc_stderr, 1, 1, 0,
+       doc: /* Return what the server of CONNECTION wrote to stderr.
+Only the last `:stderr-size' bytes are kept; see `json-rpc-connection'.
+To get the output as it arrives, use the `:stderr-function' argument
+of `json-rpc' instead.  */)
+  (Lisp_Object connection)
+{
+  CHECK_RPC_CONNECTION(connection);
+  struct json_rpc_state* state = json_rpc_state(connection);
+  uintmax_t pos = 0;
+  return json_rpc_stderr_string (&state->stderr_ring, &pos);
+}
+
+DEFUN ("json-rpc-alive-p", Fjson_rpc_alive_p, Sjson_rpc_alive_p, 1, 1, 0,
+       doc: /* Returns if json rpc connection is alive */)
+  (Lisp_Object connection)
+{
+  int res = 0; /* is not, by default */
+  CHECK_RPC_CONNECTION(connection);
+  struct json_rpc_state *state = json_rpc_state (connection);
+  if (can_use_handle (state))
+    {
+      if (state->shared)
+	res = !__atomic_load_n (&state->eof, __ATOMIC_SEQ_CST);
+      else
+	res = state->handle->isalive (state->handle);
+      end_using_handle (state);
+    }
+  return res ? Qt : Qnil;
+}
+
+static size_t read_stdout (struct json_rpc_state *param, char *buffer,
+			   size_t size)
+{
+  struct SSP_Handle *handle = param->handle;
+  size_t result, read_res;
+  do
+    {
+      char stderr_chunk[JSON_RPC_STDERR_CHUNK];
+      size_t stderr_size = sizeof stderr_chunk;
+      result = size;
+      read_res = handle->recv (handle, buffer, &result,
+			       stderr_chunk, &stderr_size);
+
+      if (stderr_size)
+	{
+	  json_rpc_stderr_write (&param->stderr_ring, stderr_chunk,
+				 stderr_size);
+	  /* Let `json-rpc' pass it on right away.  */
+	  if (param->queue)
+	    json_rpc_queue_kick (param->queue);
+	}
+
+      if (result)
+	break;
+  } while ((read_res > 0 || handle->isalive (handle))
+	   && !__atomic_load_n (&param->shutdown, __ATOMIC_SEQ_CST));
+
+  return result;
+}
+
+/* Make room for at least MIN_FREE more bytes at the end of PARAM's
+   receive buffer, moving the unconsumed bytes to its front or
+   growing it if needed.  Return false if out of memory.  */
+
+static bool
+json_rpc_reserve (struct json_rpc_state *param, size_t min_free)
+{
+  size_t pending = param->read_end - param->read_start;
+  if (param->read_buffer_size - param->read_end >= min_free)
+    return true;
+  if (param->read_start > 0)
+    {
+      memmove (param->read_buffer, param->read_buffer + param->read_start,
+	       pending);
+      param->read_start = 0;
+      param->read_end = pending;
+      if (param->read_buffer_size - pending >= min_free)
+	return true;
+    }
+  size_t new_size = max (JSON_RPC_READ_CHUNK, param->read_buffer_size * 2);
+  if (new_size - pending < min_free)
+    new_size = pending + min_free;
+  char *buffer = realloc (param->read_buffer, new_size);
+  if (buffer == NULL)
+    return false;
+  param->read_buffer = buffer;
+  param->read_buffer_size = new_size;
+  return true;
+}
+
+/* Append at least one chunk of the server's output to PARAM's receive
+   buffer, reading as much as is available.  Return the number of
+   bytes read, or 0 if the server is gone or we are out of memory.  */
+
+static size_t
+json_rpc_fill (struct json_rpc_state *param)
+{
+  /* Room may already have been made for the rest of a large body.  */
+  if (param->read_buffer_size - param->read_end < JSON_RPC_READ_CHUNK / 4
+      && !json_rpc_reserve (param, JSON_RPC_READ_CHUNK))
+    return 0;
+  size_t bytes_read = read_stdout (param,
+				   param->read_buffer + param->read_end,
+				   param->read_buffer_size - param->read_end);
+  param->read_end += bytes_read;
+  json_rpc_stats_count (param->stats, JSON_RPC_BYTES_IN, bytes_read);
+  return bytes_read;
+}
+
+/* Parse the header block in [START, END) and store the value of its
+   Content-Length header in *CONTENT_LENGTH.  Other headers, such as
+   Content-Type (which LSP restricts to UTF-8 JSON anyway), are
+   ignored.  Return false if the block has no valid
+   Content-Length.  */
+
+static bool
+json_rpc_parse_header (const char *start, const char *end,
+		       size_t *content_length)
+{
+  static const char name[] = "Content-Length";
+  bool found = false;
+  while (start < end)
+    {
+      const char *eol = memmem (start, end - start, "\r\n", 2);
+      if (eol == NULL)
+	eol = end;
+      const char *colon = memchr (start, ':', eol - start);
+      if (colon != NULL && colon - start == sizeof name - 1
+	  && c_strncasecmp (start, name, sizeof name - 1) == 0)
+	{
+	  const char *p = colon + 1;
+	  while (p < eol && (*p == ' ' || *p == '\t'))
+	    p++;
+	  if (p == eol)
+	    return false;
+	  size_t value = 0;
+	  for (; p < eol && '0' <= *p && *p <= '9'; p++)
+	    if (INT_MULTIPLY_WRAPV (value, 10, &value)
+		|| INT_ADD_WRAPV (value, *p - '0', &value)
+		|| PTRDIFF_MAX < value)
+	      return false;
+	  while (p < eol && (*p == ' ' || *p == '\t'))
+	    p++;
+	  if (p != eol)
+	    return false;
+	  *content_length = value;
+	  found = true;
+	}
+      start = eol + 2;
+    }
+  return found;
+}
+
+/* If PARAM's receive buffer holds a complete message, consume it, set
+   PARAM->message_start and PARAM->message_length to where its body
+   lies and return true.  The body stays there until the buffer is
+   filled again.  Otherwise return false, after making room for the
+   rest of the message if its header is complete.  Header blocks
+   without a valid Content-Length are skipped.  */
+
+static bool
+json_rpc_take_message (struct json_rpc_state *param)
+{
+  uint64_t start_time = json_rpc_stats_start (param->stats);
+  for (;;)
+    {
+      char *start = param->read_buffer + param->read_start;
+      size_t pending = param->read_end - param->read_start;
+      size_t scanned = param->header_scanned;
+      char *end = (pending < 4 ? NULL
+		   : memmem (start + scanned, pending - scanned,
+			     "\r\n\r\n", 4));
+      if (end == NULL)
+	{
+	  /* The terminator may straddle the end of what we have so
+	     far.  */
+	  param->header_scanned = pending < 3 ? 0 : pending - 3;
+	  return false;
+	}
+      size_t header_length = end + 4 - start;
+      size_t content_length;
+      if (!json_rpc_parse_header (start, end + 2, &content_length))
+	{
+	  param->read_start += header_length;
+	  param->header_scanned = 0;
+	  continue;
+	}
+      if (pending - header_length < content_length)
+	{
+	  /* If this fails, the next fill reports it.  */
+	  param->header_scanned = end - start;
+	  json_rpc_reserve (param,
+			    content_length - (pending - header_length));
+	  return false;
+	}
+      param->message_start = param->read_start + header_length;
+      param->message_length = content_length;
+      param->read_start += header_length + content_length;
+      param->header_scanned = 0;
+      json_rpc_stats_time (param->stats, JSON_RPC_FRAME, start_time);
+      json_rpc_stats_count (param->stats, JSON_RPC_MESSAGES_IN, 1);
+      return true;
+    }
+}
+
+/* Read the next message from the server and set
+   PARAM->message_start and PARAM->message_length to where its body
+   lies in the receive buffer.  The body stays there until the next
+   read.  Return false once the server closed the connection.  */
+
+static bool
+json_rpc_read_message (struct json_rpc_state *param)
+{
+  while (!json_rpc_take_message (param))
+    if (json_rpc_fill (param) == 0)
+      return false;
+  return true;
+}
+
+/* Return a null-terminated copy of the body of the last message read
+   by PARAM, allocated with malloc, or NULL if out of memory.  */
+
+static char *
+json_rpc_copy_message (struct json_rpc_state *param)
+{
+  char *body = malloc (param->message_length + 1);
+  if (body != NULL)
+    {
+      memcpy (body, param->read_buffer + param->message_start,
+	      param->message_length);
+      body[param->message_length] = '\0';
+    }
+  return body;
+}
+
+/* Return the first byte from P on that is not JSON whitespace.  */
+
+static const char *
+json_rpc_skip_space (const char *p, const char *end)
+{
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+    p++;
+  return p;
+}
+
+/* Return the end of the JSON string starting at P, or NULL if it does
+   not end before END.  */
+
+static const char *
+json_rpc_skip_string (const char *p, const char *end)
+{
+  for (p++; p < end; p++)
+    if (*p == '\\')
+      p++;
+    else if (*p == '"')
+      return p + 1;
+  return NULL;
+}
+
+/* Return the end of the JSON value starting at P, or NULL if it does
+   not end before END.  The value is not validated.  */
+
+static const char *
+json_rpc_skip_value (const char *p, const char *end)
+{
+  ptrdiff_t depth = 0;
+  for (; p < end; p++)
+    switch (*p)
+      {
+      case '"':
+	p = json_rpc_skip_string (p, end);
+	if (p == NULL)
+	  return NULL;
+	if (depth == 0)
+	  return p;
+	p--;
+	break;
+      case '{': case '[':
+	depth++;
+	break;
+      case '}': case ']':
+	if (depth == 0)
+	  return p;
+	if (--depth == 0)
+	  return p + 1;
+	break;
+      case ',': case ' ': case '\t': case '\n': case '\r':
+	if (depth == 0)
+	  return p;
+	break;
+      }
+  return depth == 0 ? p : NULL;
+}
+
+/* Return the id of the message whose body is the LENGTH bytes at
+   BODY if it is a response, that is an object with an "id" member but
+   no "method" member, and the id is a fixnum that is a natural
+   number.  Otherwise, return -1.
+
+   This is meant to be cheap enough to call on every message before it
+   is parsed: it only skims over the members of the object, which it
+   does not validate, and stops as soon as it has seen the id and a
+   "result" or "error" member, which usually come before the bulk of
+   a response.  */
+
+static intmax_t
+json_rpc_peek_id (const char *body, size_t length)
+{
+  const char *p = body, *end = body + length;
+  intmax_t id = -1;
+  bool response = false;
+  p = json_rpc_skip_space (p, end);
+  if (p == end || *p != '{')
+    return -1;
+  for (p++; ; p++)
+    {
+      p = json_rpc_skip_space (p, end);
+      if (p == end || *p != '"')
+	return -1;
+      const char *key = p + 1;
+      p = json_rpc_skip_string (p, end);
+      if (p == NULL)
+	return -1;
+      ptrdiff_t key_length = p - 1 - key;
+      p = json_rpc_skip_space (p, end);
+      if (p == end || *p != ':')
+	return -1;
+      const char *value = json_rpc_skip_space (p + 1, end);
+      p = json_rpc_skip_value (value, end);
+      if (p == NULL || p == value)
+	return -1;
+
+      if (key_length == 2 && memcmp (key, "id", 2) == 0)
+	{
+	  id = 0;
+	  for (const char *q = value; q < p; q++)
+	    if ('0' <= *q && *q <= '9'
+		&& id <= (MOST_POSITIVE_FIXNUM - (*q - '0')) / 10)
+	      id = 10 * id + (*q - '0');
+	    else
+	      return -1;
+	}
+      else if (key_length == 6 && memcmp (key, "method", 6) == 0)
+	return -1;
+      else if ((key_length == 6 && memcmp (key, "result", 6) == 0)
+	       || (key_length == 5 && memcmp (key, "error", 5) == 0))
+	response = true;
+      if (response && id >= 0)
+	return id;
+
+      p = json_rpc_skip_space (p, end);
+      if (p == end || *p != ',')
+	return id;
+    }
+}
+
+/* If the JSON object starting at P has a member named KEY, return the
+   start of its value and set *VALUE_END to its end.  Otherwise, or if
+   the object does not end before END, return NULL.  Names are compared
+   as they are written, escapes included, and nothing is validated.  */
+
+static const char *
+json_rpc_find_member (const char *p, const char *end, const char *key,
+		      const char **value_end)
+{
+  size_t key_length = strlen (key);
+  p = json_rpc_skip_space (p, end);
+  if (p == end || *p != '{')
+    return NULL;
+  for (p++; ; p++)
+    {
+      p = json_rpc_skip_space (p, end);
+      if (p == end || *p != '"')
+	return NULL;
+      const char *name = p + 1;
+      p = json_rpc_skip_string (p, end);
+      if (p == NULL)
+	return NULL;
+      bool found = (p - 1 - name == key_length
+		    && memcmp (name, key, key_length) == 0);
+      p = json_rpc_skip_space (p, end);
+      if (p == end || *p != ':')
+	return NULL;
+      const char *value = json_rpc_skip_space (p + 1, end);
+      p = json_rpc_skip_value (value, end);
+      if (p == NULL || p == value)
+	return NULL;
+      if (found)
+	{
+	  *value_end = p;
+	  return value;
+	}
+      p = json_rpc_skip_space (p, end);
+      if (p == end || *p != ',')
+	return NULL;
+    }
+}
+
+static void
+json_rpc_callback (void *arg)
+{
+  struct json_rpc_state *param = arg;
+  struct thread_state *self = current_thread;
+
+  release_global_lock ();
+  sys_thread_yield ();
+
+  /* Responses to cancelled requests are skipped right away.  */
+  uint64_t parsed = 0;
+  do
+    if (!json_rpc_read_message (param))
+      param->done = true;
+    else
+      {
+	parsed = json_rpc_stats_start (param->stats);
+	param->message_id
+	  = json_rpc_peek_id (param->read_buffer + param->message_start,
+			      param->message_length);
+      }
+  while (!param->done
+	 && json_rpc_ids_take (&param->cancelled, param->message_id));
+
+  if (!param->done)
+    {
+      if (param->lazy)
+	{
+	  /* If the message cannot be indexed, it is parsed from the
+	     receive buffer instead.  */
+	  char *body = json_rpc_copy_message (param);
+	  if (body != NULL)
+	    {
+	      param->dom = json_dom_build (body, param->message_length);
+	      if (param->dom == NULL)
+		free (body);
+	    }
+	}
+      json_rpc_stats_time (param->stats, JSON_RPC_PARSE, parsed);
+    }
+
+  uint64_t waited = json_rpc_stats_start (param->stats);
+  acquire_global_lock (self);
+  json_rpc_stats_time (param->stats, JSON_RPC_LOCK_WAIT, waited);
+}
+
+/* Push the last message read by PARAM onto its queue, indexed if
+   PARAM is lazy.  Drop it if out of memory or if it is the response
+   to a cancelled request.  */
+
+static void
+json_rpc_queue_message (struct json_rpc_state *param)
+{
+  struct json_rpc_stats *stats = param->stats;
+  uint64_t parsed = json_rpc_stats_start (stats);
+  intmax_t id
+    = json_rpc_peek_id (param->read_buffer + param->message_start,
+			param->message_length);
+  if (json_rpc_ids_take (&param->cancelled, id))
+    return;
+  struct json_rpc_entry entry = { NULL, param->message_length, NULL, id, 0 };
+  entry.body = json_rpc_copy_message (param);
+  if (entry.body == NULL)
+    return;
+  if (param->lazy)
+    {
+      entry.dom = json_dom_build (entry.body, entry.length);
+      if (entry.dom != NULL)
+	entry.body = NULL;
+    }
+  json_rpc_stats_time (stats, JSON_RPC_PARSE, parsed);
+  entry.queued_at = json_rpc_stats_start (stats);
+  json_rpc_queue_push (param->queue, entry);
+  if (stats)
+    {
+      struct json_rpc_queue *queue = param->queue;
+      json_rpc_stats_peak (stats, JSON_RPC_QUEUE_PEAK,
+			   (__atomic_load_n (&queue->tail, __ATOMIC_SEQ_CST)
+			    - __atomic_load_n (&queue->head,
+					       __ATOMIC_SEQ_CST)));
+    }
+}
+
+/* Body of a connection's reader thread.  Runs without the global
+   lock and must not touch Lisp objects.  */
+
+static void *
+json_rpc_reader (void *arg)
+{
+  struct json_rpc_state *param = arg;
+  while (json_rpc_read_message (param))
+    json_rpc_queue_message (param);
+  json_rpc_queue_close (param->queue);
+  return NULL;
+}
+
+#ifdef JSON_RPC_EVENT_LOOP
+
+/* The shared I/O thread.
+
+   Connections created with `:reader-thread shared' do not get a
+   reader thread of their own.  Instead, the descriptors of their
+   servers' stdout and stderr are added to a single epoll set, and one
+   native thread, started along with the first such connection, reads
+   whatever becomes available, frames it and pushes the messages onto
+   the connections' queues, from which `json-rpc' drains them as
+   usual.  This thread never blocks on a connection: when a queue is
+   full, it stops watching that server's stdout until `json-rpc' has
+   made room and sent a JSON_RPC_LOOP_RESUME request.
+
+   Requests from Lisp go through a pipe that is part of the epoll set,
+   so that the thread handles them in order.  A connection is only
+   freed after a JSON_RPC_LOOP_REMOVE request, which `json-rpc' waits
+   for, so the thread never touches a connection that is gone.  */
+
+enum json_rpc_loop_op
+{
+  /* The connection's queue has room again.  */
+  JSON_RPC_LOOP_RESUME,
+  /* Stop reading from the server, as if it had closed its stdout.  */
+  JSON_RPC_LOOP_CLOSE,
+  /* Forget the connection, which is finished.  */
+  JSON_RPC_LOOP_REMOVE
+};
+
+struct json_rpc_loop_request
+{
+  struct json_rpc_state *state;
+  enum json_rpc_loop_op op;
+};
+
+static struct
+{
+  bool started;
+  pthread_t thread;
+  int epoll_fd;
+  /* The pipe requests are written to.  */
+  int request_fd[2];
+  /* Signaled whenever a connection has been removed.  */
+  pthread_mutex_t mx;
+  pthread_cond_t removed;
+} json_rpc_loop;
+
+/* Tag of epoll events for STATE's stderr; those for its stdout carry
+   STATE itself and those for the request pipe carry 0.  */
+#define JSON_RPC_LOOP_STDERR 1
+
+/* Make STATE's descriptor FD, whose registration is in *CURRENT,
+   wait for EVENTS: EPOLLIN to be read from, 0 to be ignored for now,
+   or -1 to be ignored for good.  Ignored descriptors are kept out of
+   the epoll set, which would otherwise still report hangups.  */
+
+static void
+json_rpc_loop_watch (struct json_rpc_state *state, int fd, int *current,
+		     int events)
+{
+  if (*current == events || *current < 0)
+    return;
+  struct epoll_event event = { .events = EPOLLIN };
+  event.data.u64 = (uintptr_t) state;
+  if (fd == state->stderr_fd)
+    event.data.u64 |= JSON_RPC_LOOP_STDERR;
+  if (events > 0)
+    epoll_ctl (json_rpc_loop.epoll_fd, EPOLL_CTL_ADD, fd, &event);
+  else if (*current > 0)
+    epoll_ctl (json_rpc_loop.epoll_fd, EPOLL_CTL_DEL, fd, &event);
+  *current = events;
+}
+
+/* Queue the complete messages in STATE's receive buffer.  If STATE's
+   queue fills up, stop reading from its server until `json-rpc'
+   makes room.  Return true if STATE is finished: its server's stdout
+   is closed and everything it sent has been queued.  */
+
+static bool
+json_rpc_loop_dispatch (struct json_rpc_state *state)
+{
+  struct json_rpc_queue *queue = state->queue;
+  for (;;)
+    {
+      if (json_rpc_queue_full (queue))
+	{
+	  /* Check again after setting STALLED, so that either we see
+	     the room `json-rpc' made or it sees the flag.  If both
+	     happen, whoever clears the flag carries on.  */
+	  __atomic_store_n (&queue->stalled, true, __ATOMIC_SEQ_CST);
+	  if (json_rpc_queue_full (queue)
+	      || !__atomic_exchange_n (&queue->stalled, false,
+				       __ATOMIC_SEQ_CST))
+	    {
+	      json_rpc_loop_watch (state, state->stdout_fd,
+				   &state->stdout_events, 0);
+	      return false;
+	    }
+	}
+      if (!json_rpc_take_message (state))
+	break;
+      json_rpc_queue_message (state);
+    }
+  if (!state->eof)
+    {
+      json_rpc_loop_watch (state, state->stdout_fd, &state->stdout_events,
+			   EPOLLIN);
+      return false;
+    }
+  json_rpc_loop_watch (state, state->stdout_fd, &state->stdout_events, -1);
+  json_rpc_loop_watch (state, state->stderr_fd, &state->stderr_events, -1);
+  return true;
+}
+
+/* Stop reading from STATE's server.  */
+
+static void
+json_rpc_loop_eof (struct json_rpc_state *state)
+{
+  __atomic_store_n (&state->eof, true, __ATOMIC_SEQ_CST);
+  json_rpc_loop_watch (state, state->stdout_fd, &state->stdout_events, -1);
+}
+
+/* Read what STATE's server wrote to its stdout.  */
+
+static void
+json_rpc_loop_read_stdout (struct json_rpc_state *state)
+{
+  if (state->read_buffer_size - state->read_end < JSON_RPC_READ_CHUNK / 4
+      && !json_rpc_reserve (state, JSON_RPC_READ_CHUNK))
+    {
+      json_rpc_loop_eof (state);
+      return;
+    }
+  ssize_t n;
+  do
+    n = recv (state->stdout_fd, state->read_buffer + state->read_end,
+	      state->read_buffer_size - state->read_end, MSG_DONTWAIT);
+  while (n < 0 && errno == EINTR);
+  if (n > 0)
+    {
+      state->read_end += n;
+      json_rpc_stats_count (state->stats, JSON_RPC_BYTES_IN, n);
+    }
+  else if (n == 0 || errno != EAGAIN)
+    json_rpc_loop_eof (state);
+}
+
+/* Read what STATE's server wrote to its stderr.  */
+
+static void
+json_rpc_loop_read_stderr (struct json_rpc_state *state)
+{
+  char chunk[JSON_RPC_STDERR_CHUNK];
+  ssize_t n;
+  do
+    n = recv (state->stderr_fd, chunk, sizeof chunk, MSG_DONTWAIT);
+  while (n < 0 && errno == EINTR);
+  if (n > 0)
+    {
+      json_rpc_stderr_write (&state->stderr_ring, chunk, n);
+      json_rpc_queue_kick (state->queue);
+    }
+  else if (n == 0 || errno != EAGAIN)
+    json_rpc_loop_watch (state, state->stderr_fd, &state->stderr_events,
+			 -1);
+}
+
+/* Handle the requests waiting in the pipe.  Add the connections that
+   become finished to *FINISHED.  */
+
+static void
+json_rpc_loop_handle_requests (struct json_rpc_state **finished)
+{
+  struct json_rpc_loop_request request;
+  ssize_t n;
+  while ((n = read (json_rpc_loop.request_fd[0], &request, sizeof request))
+	 == sizeof request)
+    {
+      struct json_rpc_state *state = request.state;
+      switch (request.op)
+	{
+	case JSON_RPC_LOOP_CLOSE:
+	  if (state->finished)
+	    break;
+	  json_rpc_loop_eof (state);
+	  FALLTHROUGH;
+	case JSON_RPC_LOOP_RESUME:
+	  if (!state->finished && json_rpc_loop_dispatch (state))
+	    {
+	      state->finished = true;
+	      state->next_finished = *finished;
+	      *finished = state;
+	    }
+	  break;
+	case JSON_RPC_LOOP_REMOVE:
+	  pthread_mutex_lock (&json_rpc_loop.mx);
+	  state->removed = true;
+	  pthread_cond_broadcast (&json_rpc_loop.removed);
+	  pthread_mutex_unlock (&json_rpc_loop.mx);
+	  break;
+	}
+    }
+  /* Requests are written whole, so anything else means the pipe is
+     empty.  */
+  eassert (n < 0);
+}
+
+/* Body of the shared I/O thread.  Runs without the global lock and
+   must not touch Lisp objects.  */
+
+static void *
+json_rpc_loop_run (void *arg)
+{
+  struct epoll_event events[JSON_RPC_LOOP_EVENTS];
+  for (;;)
+    {
+      int n = epoll_wait (json_rpc_loop.epoll_fd, events,
+			  JSON_RPC_LOOP_EVENTS, -1);
+      /* Queues are only closed after all the events of this round
+	 have been handled: `json-rpc' may free a connection as soon
+	 as its queue is closed.  */
+      struct json_rpc_state *finished = NULL;
+      for (int i = 0; i < n; i++)
+	{
+	  uint64_t tag = events[i].data.u64;
+	  struct json_rpc_state *state
+	    = (struct json_rpc_state *) (uintptr_t)
+	      (tag & ~(uint64_t) JSON_RPC_LOOP_STDERR);
+	  if (state == NULL)
+	    json_rpc_loop_handle_requests (&finished);
+	  else if (state->finished)
+	    continue;
+	  else if (tag & JSON_RPC_LOOP_STDERR)
+	    json_rpc_loop_read_stderr (state);
+	  else
+	    {
+	      json_rpc_loop_read_stdout (state);
+	      if (json_rpc_loop_dispatch (state))
+		{
+		  state->finished = true;
+		  state->next_finished = finished;
+		  finished = state;
+		}
+	    }
+	}
+      while (finished != NULL)
+	{
+	  struct json_rpc_state *next = finished->next_finished;
+	  json_rpc_queue_close (finished->queue);
+	  finished = next;
+	}
+    }
+  return NULL;
+}
+
+/* Start the shared I/O thread unless it is running.  Return false on
+   failure.  Only called with the global lock held.  */
+
+static bool
+json_rpc_loop_start (void)
+{
+  if (json_rpc_loop.started)
+    return true;
+  json_rpc_loop.epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+  if (json_rpc_loop.epoll_fd < 0)
+    return false;
+  struct epoll_event event = { .events = EPOLLIN, .data.u64 = 0 };
+  if (pipe2 (json_rpc_loop.request_fd, O_CLOEXEC) != 0)
+    goto fail_pipe;
+  if (fcntl (json_rpc_loop.request_fd[0], F_SETFL, O_NONBLOCK) != 0
+      || epoll_ctl (json_rpc_loop.epoll_fd, EPOLL_CTL_ADD,
+		    json_rpc_loop.request_fd[0], &event) != 0)
+    goto fail;
+  pthread_mutex_init (&json_rpc_loop.mx, NULL);
+  pthread_cond_init (&json_rpc_loop.removed, NULL);
+  if (!json_rpc_create_thread (&json_rpc_loop.thread, json_rpc_loop_run,
+			       NULL))
+    {
+      pthread_cond_destroy (&json_rpc_loop.removed);
+      pthread_mutex_destroy (&json_rpc_loop.mx);
+      goto fail;
+    }
+  json_rpc_loop.started = true;
+  return true;
+
+ fail:
+  close (json_rpc_loop.request_fd[0]);
+  close (json_rpc_loop.request_fd[1]);
+ fail_pipe:
+  close (json_rpc_loop.epoll_fd);
+  return false;
+}
+
+/* Hand STATE, whose queue exists, over to the shared I/O thread.
+   Return false on failure.  */
+
+static bool
+json_rpc_loop_add (struct json_rpc_state *state)
+{
+  if (!json_rpc_loop_start ())
+    return false;
+  state->shared = true;
+  state->stdout_fd = state->handle->stdout_fd;
+  state->stderr_fd = state->handle->stderr_fd;
+  state->stdout_events = EPOLLIN;
+  /* Socket connections have no stderr.  */
+  state->stderr_events = state->stderr_fd < 0 ? -1 : EPOLLIN;
+  state->eof = state->finished = state->removed = false;
+  state->next_finished = NULL;
+  struct epoll_event event = { .events = EPOLLIN };
+  event.data.u64 = (uintptr_t) state | JSON_RPC_LOOP_STDERR;
+  if (state->stderr_fd >= 0
+      && epoll_ctl (json_rpc_loop.epoll_fd, EPOLL_CTL_ADD, state->stderr_fd,
+		    &event) != 0)
+    return false;
+  event.data.u64 = (uintptr_t) state;
+  if (epoll_ctl (json_rpc_loop.epoll_fd, EPOLL_CTL_ADD, state->stdout_fd,
+		 &event) != 0)
+    {
+      if (state->stderr_fd >= 0)
+	epoll_ctl (json_rpc_loop.epoll_fd, EPOLL_CTL_DEL, state->stderr_fd,
+		   &event);
+      return false;
+    }
+  return true;
+}
+
+/* Send the request OP about STATE to the shared I/O thread.  */
+
+static void
+json_rpc_loop_request (struct json_rpc_state *state,
+		       enum json_rpc_loop_op op)
+{
+  struct json_rpc_loop_request request = { state, op };
+  /* Writes this small to a pipe are atomic.  */
+  while (write (json_rpc_loop.request_fd[1], &request, sizeof request) < 0
+	 && errno == EINTR)
+    continue;
+}
+
+/* Make the shared I/O thread stop reading from STATE's server.  */
+
+static void
+json_rpc_loop_close (struct json_rpc_state *state)
+{
+  json_rpc_loop_request (state, JSON_RPC_LOOP_CLOSE);
+}
+
+/* Take STATE, which is finished, away from the shared I/O thread.  */
+
+static void
+json_rpc_loop_remove (struct json_rpc_state *state)
+{
+  json_rpc_loop_request (state, JSON_RPC_LOOP_REMOVE);
+  pthread_mutex_lock (&json_rpc_loop.mx);
+  while (!state->removed)
+    pthread_cond_wait (&json_rpc_loop.removed, &json_rpc_loop.mx);
+  pthread_mutex_unlock (&json_rpc_loop.mx);
+}
+
+#endif /* JSON_RPC_EVENT_LOOP */
+
+struct json_rpc_wait_params
+{
+  struct json_rpc_queue *queue;
+  /* Once a message has arrived, keep waiting up to LATENCY for
+     BATCH_SIZE messages to be queued.  */
+  size_t batch_size;
+  struct timespec latency;
+  struct json_rpc_stats *stats;
+};
+
+static void
+json_rpc_wait_callback (void *arg)
+{
+  struct json_rpc_wait_params *params = arg;
+  struct thread_state *self = current_thread;
+
+  release_global_lock ();
+  sys_thread_yield ();
+
+  json_rpc_queue_wait (params->queue, 1, invalid_timespec ());
+  if (params->batch_size > 1 && timespec_sign (params->latency) > 0)
+    json_rpc_queue_wait (params->queue, params->batch_size,
+			 timespec_add (current_timespec (), params->latency));
+
+  uint64_t waited = json_rpc_stats_start (params->stats);
+  acquire_global_lock (self);
+  json_rpc_stats_time (params->stats, JSON_RPC_LOCK_WAIT, waited);
+}
+
+/* A message body being parsed by json_rpc_parse_message.  */
+
+struct json_rpc_message
+{
+  const char *body;
+  size_t length;
+  const struct json_configuration *conf;
+  Lisp_Object error;
+};
+
+static Lisp_Object
+json_rpc_parse_body (ptrdiff_t nargs, Lisp_Object *args)
+{
+  struct json_rpc_message *message = xmint_pointer (args[0]);
+  return json_parse (message->body, message->length, "<buffer>", true,
+		     message->conf, NULL);
+}
+
+static Lisp_Object
+json_rpc_parse_failed (Lisp_Object error, ptrdiff_t nargs,
+		       Lisp_Object *args)
+{
+  struct json_rpc_message *message = xmint_pointer (args[0]);
+  message->error = error;
+  return Qnil;
+}
 
-  struct json_configuration conf =
-    {json_object_hashtable, json_array_array, QCnull, QCfalse};
-  json_parse_args (nargs - 2, args + 2, &conf, false);
+/* Parse the LENGTH bytes of BODY into a Lisp object.  If that fails,
+   set *ERROR to the error, a cons (SYMBOL . DATA), otherwise to
+   nil.  */
 
-  json_t *message = lisp_to_json (args[1], &conf);
+static Lisp_Object
+json_rpc_parse_message (const char *body, size_t length,
+			const struct json_configuration *conf,
+			Lisp_Object *error)
+{
+  struct json_rpc_message message = { body, length, conf, Qnil };
+  Lisp_Object arg = make_mint_ptr (&message);
+  Lisp_Object result
+    = internal_condition_case_n (json_rpc_parse_body, 1, &arg,
+				 list2 (Qjson_parse_error,
+					Qjson_object_too_deep),
+				 json_rpc_parse_failed);
+  *error = message.error;
+  return result;
+}
 
-  /* TODO: params is on the stack; is this an issue? */
-  struct json_rpc_send_params params = {
-    .state = json_rpc_state(connection),
-    .message = message
-  };
-  flush_stack_call_func (json_rpc_send_callback, &params);
-  return Qnil;
+/* Return the Lisp value of the message whose body is the LENGTH bytes
+   of BODY, or of DOM if that is non-NULL, in which case the value
+   takes it over.  Set *ERROR like json_rpc_parse_message.  */
+
+static Lisp_Object
+json_rpc_message_value (const char *body, size_t length,
+			struct json_dom *dom,
+			const struct json_configuration *conf,
+			Lisp_Object *error)
+{
+  if (dom != NULL)
+    {
+      *error = Qnil;
+      return make_json_dom (dom);
+    }
+  return json_rpc_parse_message (body, length, conf, error);
 }
 
-DEFUN ("json-rpc-shutdown", Fjson_rpc_shutdown, Sjson_rpc_shutdown, 1, 1, 0,
-       doc: /* Shutdowns json rpc connection */)
-  (Lisp_Object connection)
+/* If the message with ID read by PARAM answers one of its requests,
+   forget the request and return its callback.  Otherwise, return nil,
+   and set *DROP if the message answers a cancelled request.  */
+
+static Lisp_Object
+json_rpc_take_request (struct json_rpc_state *param, intmax_t id,
+		       bool *drop)
 {
-  CHECK_RPC_CONNECTION (connection);
-  struct json_rpc_state *state = json_rpc_state (connection);
-  if (can_use_handle (state))
+  *drop = false;
+  if (id < 0)
+    return Qnil;
+  Lisp_Object key = make_fixnum (id);
+  Lisp_Object request = Fgethash (key, json_rpc_requests, Qnil);
+  if (CONSP (request) && json_rpc_state (XCDR (request)) == param)
     {
-      state->handle->cancel_recv (state->handle);
-      end_using_handle (state);
+      Fremhash (key, json_rpc_requests);
+      return XCAR (request);
     }
+  *drop = json_rpc_ids_take (&param->cancelled, id);
   return Qnil;
 }
 
-DEFUN ("json-rpc-pid", Fjson_rpc_pid, Sjson_rpc_pid, 1, 1, 0,
-       doc: /* Shutdowns json rpc connection */)
-  (Lisp_Object connection)
+/* Forget the requests sent to PARAM's server that are still waiting
+   for their responses, and those they would supersede.  */
+
+static void
+json_rpc_forget_requests (struct json_rpc_state *param)
 {
-  int res = 0; /* or -1? */
-  CHECK_RPC_CONNECTION (connection);
-  struct json_rpc_state *state = json_rpc_state (connection);
-  if (can_use_handle (state))
+  struct Lisp_Hash_Table *h = XHASH_TABLE (json_rpc_requests);
+  for (ptrdiff_t i = 0; h->count > 0 && i < HASH_TABLE_SIZE (h); i++)
     {
-      res = state->handle->pid;
-      end_using_handle (state);
+      Lisp_Object key = HASH_KEY (h, i);
+      if (!EQ (key, Qunbound)
+	  && json_rpc_state (XCDR (HASH_VALUE (h, i))) == param)
+	hash_remove_from_table (h, key);
+    }
+  h = XHASH_TABLE (json_rpc_superseding);
+  for (ptrdiff_t i = 0; h->count > 0 && i < HASH_TABLE_SIZE (h); i++)
+    {
+      Lisp_Object key = HASH_KEY (h, i);
+      if (!EQ (key, Qunbound) && json_rpc_state (XCAR (key)) == param)
+	hash_remove_from_table (h, key);
     }
-  return make_int (res);
 }
 
-DEFUN ("json-rpc-stderr", Fjson_rpc_stderr, Sjson_rpc_stderr, 1, 1, 0,
-       doc: /* Shutdowns json rpc connection */)
-  (Lisp_Object connection)
+/* Pass the message read by PARAM whose body is the LENGTH bytes of
+   BODY, or DOM, to CALLBACK, or the error if it is not valid JSON.
+   If it is the response with ID to a request, pass it to the
+   request's callback instead, or drop it if the request was
+   cancelled.  */
+
+static void
+json_rpc_deliver (struct json_rpc_state *param, Lisp_Object callback,
+		  const char *body, size_t length, struct json_dom *dom,
+		  intmax_t id, const struct json_configuration *conf)
 {
-  CHECK_RPC_CONNECTION(connection);
-  struct json_rpc_state* state = json_rpc_state(connection);
-  return make_string(state->error_buffer, state->error_buffer_read);
+  bool drop;
+  Lisp_Object request = json_rpc_take_request (param, id, &drop);
+  if (drop)
+    {
+      json_dom_free (dom);
+      return;
+    }
+  Lisp_Object error;
+  uint64_t start = json_rpc_stats_start (param->stats);
+  Lisp_Object message
+    = json_rpc_message_value (body, length, dom, conf, &error);
+  json_rpc_stats_time (param->stats, JSON_RPC_CONVERT, start);
+  start = json_rpc_stats_start (param->stats);
+  if (!NILP (request))
+    CALLN (Ffuncall, request, message, error);
+  else if (NILP (error))
+    CALLN (Ffuncall, callback, message, Qnil, Qnil);
+  else
+    CALLN (Ffuncall, callback, Qnil, error, Qnil);
+  json_rpc_stats_time (param->stats, JSON_RPC_CALLBACK, start);
 }
 
-DEFUN ("json-rpc-alive-p", Fjson_rpc_alive_p, Sjson_rpc_alive_p, 1, 1, 0,
-       doc: /* Returns if json rpc connection is alive */)
-  (Lisp_Object connection)
+/* Entries popped from a queue to be delivered as one batch.  Those
+   from NEXT on have not been released yet.  */
+
+struct json_rpc_batch
 {
-  int res = 0; /* is not, by default */
-  CHECK_RPC_CONNECTION(connection);
-  struct json_rpc_state *state = json_rpc_state (connection);
-  if (can_use_handle (state))
+  struct json_rpc_entry *entries;
+  ptrdiff_t next;
+  ptrdiff_t count;
+};
+
+static void
+json_rpc_batch_release (void *ptr)
+{
+  struct json_rpc_batch *batch = ptr;
+  for (ptrdiff_t i = batch->next; i < batch->count; i++)
     {
-      res = state->handle->isalive (state->handle);
-      end_using_handle (state);
+      free (batch->entries[i].body);
+      json_dom_free (batch->entries[i].dom);
     }
-  return res ? Qt : Qnil;
 }
 
-static size_t read_stdout (struct json_rpc_state *param, char *buffer,
-			   size_t size)
+/* Pass the messages of BATCH, read by PARAM, to CALLBACK as a single
+   vector, then the parse errors among them one by one.  Responses to
+   requests are passed to their callbacks as they come instead.  */
+
+static void
+json_rpc_deliver_batch (struct json_rpc_state *param, Lisp_Object callback,
+			struct json_rpc_batch *batch,
+			const struct json_configuration *conf)
 {
-  struct SSP_Handle *handle = param->handle;
-  size_t result, read_res;
-  do
-    {
-      result = size;
-      size_t stderr_size = ERROR_BUFFER_SIZE - param->error_buffer_read;
-      read_res = handle->recv (handle, buffer, &result,
-			  param->error_buffer + param->error_buffer_read,
-			  &stderr_size);
+  ptrdiff_t count = SPECPDL_INDEX ();
+  record_unwind_protect_ptr (json_rpc_batch_release, batch);
 
-      if (stderr_size)
+  Lisp_Object *messages;
+  USE_SAFE_ALLOCA;
+  SAFE_ALLOCA_LISP (messages, batch->count);
+  ptrdiff_t nmessages = 0;
+  Lisp_Object errors = Qnil;
+  for (; batch->next < batch->count; batch->next++)
+    {
+      struct json_rpc_entry *entry = &batch->entries[batch->next];
+      bool drop;
+      Lisp_Object request = json_rpc_take_request (param, entry->id, &drop);
+      Lisp_Object error = Qnil;
+      Lisp_Object message = Qnil;
+      if (drop)
+	json_dom_free (entry->dom);
+      else
 	{
-	  param->error_buffer_read += stderr_size;
-	  if (param->error_buffer_read == ERROR_BUFFER_SIZE) {
-	    param->error_buffer_read = ERROR_BUFFER_SIZE / 2;
-	    strcpy(param->error_buffer, param->error_buffer + ERROR_BUFFER_SIZE / 2);
-	  }
+	  uint64_t start = json_rpc_stats_start (param->stats);
+	  message = json_rpc_message_value (entry->body, entry->length,
+					    entry->dom, conf, &error);
+	  json_rpc_stats_time (param->stats, JSON_RPC_CONVERT, start);
+	}
+      entry->dom = NULL;
+      free (entry->body);
+      entry->body = NULL;
+      if (drop)
+	continue;
+      if (!NILP (request))
+	{
+	  uint64_t start = json_rpc_stats_start (param->stats);
+	  CALLN (Ffuncall, request, message, error);
+	  json_rpc_stats_time (param->stats, JSON_RPC_CALLBACK, start);
 	}
+      else if (NILP (error))
+	messages[nmessages++] = message;
+      else
+	errors = Fcons (error, errors);
+    }
 
-      if (result)
-	break;
-  } while (read_res > 0 || handle->isalive (handle));
+  if (nmessages > 0)
+    {
+      uint64_t start = json_rpc_stats_start (param->stats);
+      CALLN (Ffuncall, callback, Fvector (nmessages, messages), Qnil, Qnil);
+      json_rpc_stats_time (param->stats, JSON_RPC_CALLBACK, start);
+    }
+  for (errors = Fnreverse (errors); CONSP (errors); errors = XCDR (errors))
+    CALLN (Ffuncall, callback, Qnil, XCAR (errors), Qnil);
 
-  return result;
+  SAFE_FREE ();
+  unbind_to (count, Qnil);
 }
 
-static bool read_until (struct json_rpc_state *param, const char *needle,
-			char *output)
+/* Pass what PARAM's server wrote to stderr since last time to
+   FUNCTION, unless that is nil.  */
+
+static void
+json_rpc_deliver_stderr (struct json_rpc_state *param, Lisp_Object function)
 {
-  // XXX: optimize the first read and make sure output is not
-  // overflowing
-  size_t bytes_read = 0;
-  int read = 0;
-  while (strstr (output, needle) == NULL)
-    {
-      bytes_read = read_stdout (param, output + read, 1);
-      if (bytes_read == 0)
-	return false;
-      read += bytes_read;
-    }
-  return true;
+  if (!NILP (function)
+      && json_rpc_stderr_pending (&param->stderr_ring,
+				  param->stderr_delivered) > 0)
+    CALLN (Ffuncall, function,
+	   json_rpc_stderr_string (&param->stderr_ring,
+				   &param->stderr_delivered));
 }
 
+/* Tell the shared I/O thread to read from PARAM's server again if it
+   stopped because PARAM's queue was full and HANDLED entries have
+   just been popped.  */
+
 static void
-json_rpc_callback (void *arg)
+json_rpc_resume (struct json_rpc_state *param, ptrdiff_t handled)
 {
-  struct json_rpc_state *param = arg;
-  struct thread_state *self = current_thread;
-
-  release_global_lock ();
-  sys_thread_yield ();
+#ifdef JSON_RPC_EVENT_LOOP
+  if (param->shared && handled > 0
+      && __atomic_exchange_n (&param->queue->stalled, false,
+			      __ATOMIC_SEQ_CST))
+    json_rpc_loop_request (param, JSON_RPC_LOOP_RESUME);
+#endif
+}
 
-  char data[BUFFER_SIZE + 1];
+/* Pop up to MAX messages from PARAM's queue and pass them to
+   CALLBACK, as a single vector if BATCH_SIZE is positive, in which
+   case ENTRIES has room for MAX entries.  Return how many were
+   popped.  */
 
-  memset (data, '\0', BUFFER_SIZE);
-  if (read_until (param, "Content-Length:", data))
+static ptrdiff_t
+json_rpc_deliver_queued (struct json_rpc_state *param, Lisp_Object callback,
+			 const struct json_configuration *conf,
+			 ptrdiff_t batch_size, struct json_rpc_entry *entries,
+			 ptrdiff_t max)
+{
+  struct json_rpc_queue *queue = param->queue;
+  ptrdiff_t handled = 0;
+  if (batch_size > 0)
     {
-      memset (data, '\0', BUFFER_SIZE);
-
-      if (read_until (param, "\r\n\r\n", data))
+      while (handled < max
+	     && json_rpc_queue_pop (queue, &entries[handled]))
 	{
-	  char *_end;
-	  const size_t content_length = strtol (data, &_end, 10);
-	  size_t has_to_read = content_length;
-	  char *msg = malloc (content_length + 1);
-	  while (has_to_read > 0)
-	    {
-	      int bytes_read
-		= read_stdout (param, msg + (content_length - has_to_read),
-			       has_to_read);
-	      if (bytes_read == 0)
-		{
-		  param->done = true;
-		  break;
-		}
-
-	      has_to_read -= bytes_read;
-	    }
-	  if (!param->done)
-	    {
-	      msg[content_length] = '\0';
-	      param->message = json_loads (msg, JSON_DECODE_ANY | JSON_ALLOW_NUL, &param->error);
-	      free (msg);
-	    }
+	  if (param->stats)
+	    json_rpc_stats_time (param->stats, JSON_RPC_QUEUE_WAIT,
+				 entries[handled].queued_at);
+	  handled++;
 	}
-      else
+      json_rpc_resume (param, handled);
+      struct json_rpc_batch batch = {entries, 0, handled};
+      json_rpc_deliver_batch (param, callback, &batch, conf);
+    }
+  else
+    {
+      struct json_rpc_entry entry;
+      while (handled < max && json_rpc_queue_pop (queue, &entry))
 	{
-	  param->done = true;
+	  if (param->stats)
+	    json_rpc_stats_time (param->stats, JSON_RPC_QUEUE_WAIT,
+				 entry.queued_at);
+	  json_rpc_resume (param, 1);
+	  ptrdiff_t count = SPECPDL_INDEX ();
+	  record_unwind_protect_ptr (json_free, entry.body);
+	  json_rpc_deliver (param, callback, entry.body, entry.length,
+			    entry.dom, entry.id, conf);
+	  unbind_to (count, Qnil);
+	  handled++;
 	}
     }
+  return handled;
+}
+
+/* Wait until whatever fed PARAM's queue, which is closed, has let go
+   of PARAM.  */
+
+static void
+json_rpc_release_reader (struct json_rpc_state *param)
+{
+  if (param->reader_released)
+    return;
+  param->reader_released = true;
+#ifdef JSON_RPC_EVENT_LOOP
+  if (param->shared)
+    json_rpc_loop_remove (param);
   else
+#endif
+    pthread_join (param->reader, NULL);
+}
+
+/* Close PARAM's handle once everything has been read from it, and
+   forget the requests left unanswered.  Do nothing if that has been
+   done already.  */
+
+static void
+json_rpc_close (struct json_rpc_state *param)
+{
+  if (param->closed)
+    return;
+  param->closed = true;
+  json_rpc_forget_requests (param);
+  json_rpc_stop_writer (param);
+  /* If the handle cannot be locked, nobody else can lock it to use it
+     either (see can_use_handle), so close it all the same.  */
+  bool locked = pthread_mutex_lock (&param->handle_mx) == 0;
+  /* Messages queued since the writer thread exited are dropped.  */
+  if (param->outbox)
     {
-      param->done = true;
+      json_rpc_outbox_free (param->outbox);
+      param->outbox = NULL;
     }
+  param->handle->close (param->handle);
+  param->handle = NULL;
+  if (locked)
+    pthread_mutex_unlock (&param->handle_mx);
+}
 
-  acquire_global_lock (self);
+/* Dispatch the messages parsed by PARAM's reader thread until it
+   finishes.  If BATCH_SIZE is positive, messages are passed to
+   CALLBACK in vectors of at most that many, waiting up to LATENCY for
+   a batch to fill up.  Stderr output is passed to STDERR_FUNCTION.  */
+
+static void
+json_rpc_drain (struct json_rpc_state *param, Lisp_Object callback,
+		const struct json_configuration *conf,
+		ptrdiff_t batch_size, struct timespec latency,
+		Lisp_Object stderr_function)
+{
+  struct json_rpc_queue *queue = param->queue;
+  struct json_rpc_wait_params wait_params = {
+    .queue = queue,
+    .batch_size = batch_size,
+    .latency = latency,
+    .stats = param->stats
+  };
+  ptrdiff_t max_handled = batch_size > 0 ? batch_size : JSON_RPC_DRAIN_MAX;
+  struct json_rpc_entry *entries = NULL;
+  USE_SAFE_ALLOCA;
+  if (batch_size > 0)
+    SAFE_NALLOCA (entries, 1, batch_size);
+
+  for (;;)
+    {
+      flush_stack_call_func (json_rpc_wait_callback, &wait_params);
+
+      /* Everything pushed before the queue was closed is popped
+	 below, so once it is closed a short batch means we are
+	 done.  */
+      bool closed = __atomic_load_n (&queue->closed, __ATOMIC_SEQ_CST);
+      json_rpc_deliver_stderr (param, stderr_function);
+      if (json_rpc_deliver_queued (param, callback, conf, batch_size,
+				   entries, max_handled) < max_handled
+	  && closed)
+	break;
+    }
+  SAFE_FREE ();
+  json_rpc_release_reader (param);
 }
 
-static Lisp_Object
-get_json_parse_error (const json_error_t *error)
+DEFUN ("json-rpc-message-p", Fjson_rpc_message_p, Sjson_rpc_message_p,
+       1, 1, 0,
+       doc: /* Return t if OBJECT is a message from a `:lazy' connection.
+Such messages are not converted to Lisp objects until their parts are
+accessed with `json-rpc-get'.  */)
+  (Lisp_Object object)
+{
+  return JSON_DOM_P (object) ? Qt : Qnil;
+}
+
+DEFUN ("json-rpc-get", Fjson_rpc_get, Sjson_rpc_get, 1, MANY,
+       NULL,
+       doc: /* Return the part of MESSAGE at PATH as a Lisp object.
+MESSAGE is a message received from a connection created with
+`:lazy'.  ARGS starts with the path, a sequence of strings naming
+object members and natural numbers indexing arrays; an empty path
+denotes the whole message.  The value is nil if there is nothing at
+PATH.  Only the text of the part that is returned is converted.
+
+The path can be followed by the keyword/argument pairs accepted by
+`json-parse-string', which control the conversion.
+usage: (json-rpc-get MESSAGE &rest ARGS)  */)
+  (ptrdiff_t nargs, Lisp_Object *args)
+{
+  CHECK_TYPE (JSON_DOM_P (args[0]), Qjson_rpc_message_p, args[0]);
+  struct json_dom *dom = XUSER_PTR (args[0])->p;
+
+  ptrdiff_t npath = 0;
+  while (1 + npath < nargs && !SYMBOLP (args[1 + npath]))
+    npath++;
+  struct json_configuration conf =
+    {json_object_hashtable, json_array_array, QCnull, QCfalse};
+  json_parse_args (nargs - 1 - npath, args + 1 + npath, &conf, true);
+
+  ptrdiff_t index = json_dom_lookup (dom, 0, npath, args + 1);
+  if (index < 0)
+    return Qnil;
+  struct json_dom_node *node = &dom->nodes[index];
+  return json_parse (dom->body + node->start, node->end - node->start,
+		     "<buffer>", true, &conf, NULL);
+}
+
+/* Connections whose messages are dispatched from the command loop, as
+   a list of elements (CONNECTION CALLBACK . ARGS), where CALLBACK and
+   ARGS are the arguments given to `json-rpc-set-callback'.  */
+static Lisp_Object json_rpc_dispatched;
+
+/* True while json_rpc_dispatch_all runs.  A callback that waits for
+   input, or another thread waiting meanwhile, would otherwise
+   dispatch again from within it, out of order.  Such a wakeup only
+   sets JSON_RPC_REDISPATCH, and the dispatch is done again once the
+   running one is over.  */
+static bool json_rpc_dispatching;
+static bool json_rpc_redispatch;
+
+/* Calls of `accept-process-output' waiting for dispatched connections,
+   as a list of elements (CONNECTION . CELL).  The car of CELL is set
+   to t once messages of CONNECTION were dispatched or it was closed,
+   and to 0 if it stopped being dispatched.  */
+static Lisp_Object json_rpc_waiting;
+
+/* Tell `accept-process-output' that CONNECTION got to VALUE, t if
+   messages were dispatched and 0 if it is no longer dispatched.  */
+
+static void
+json_rpc_note_dispatch (Lisp_Object connection, Lisp_Object value)
+{
+  if (EQ (value, Qt))
+    note_fd_callback_input ();
+  for (Lisp_Object tail = json_rpc_waiting; CONSP (tail); tail = XCDR (tail))
+    if (EQ (XCAR (XCAR (tail)), connection))
+      XSETCAR (XCDR (XCAR (tail)), value);
+}
+
+/* Parse the keyword arguments ARGS of `json-rpc' and
+   `json-rpc-set-callback' into *CONF, *BATCH_SIZE, *LATENCY and
+   *STDERR_FUNCTION.  */
+
+static void
+json_rpc_parse_args (ptrdiff_t nargs, Lisp_Object *args,
+		     struct json_configuration *conf, ptrdiff_t *batch_size,
+		     struct timespec *latency, Lisp_Object *stderr_function)
 {
-  Lisp_Object symbol;
-#if JSON_HAS_ERROR_CODE
-  switch (json_error_code (error))
+  *conf = (struct json_configuration)
+    {json_object_hashtable, json_array_array, QCnull, QCfalse};
+  *batch_size = 0;
+  *latency = make_timespec (0, 0);
+  *stderr_function = Qnil;
+
+  /* Pick out the batching arguments and leave the others to
+     json_parse_args.  */
+  USE_SAFE_ALLOCA;
+  Lisp_Object *conf_args;
+  SAFE_ALLOCA_LISP (conf_args, nargs);
+  ptrdiff_t conf_nargs = 0;
+  for (ptrdiff_t i = 0; i < nargs; i += 2)
     {
-    case json_error_premature_end_of_input:
-      symbol = Qjson_end_of_file;
-      break;
-    case json_error_end_of_input_expected:
-      symbol = Qjson_trailing_content;
-      break;
-    default:
-      symbol = Qjson_parse_error;
-      break;
+      if (i + 1 < nargs && EQ (args[i], QCbatch_size))
+	{
+	  CHECK_FIXNAT (args[i + 1]);
+	  *batch_size = XFIXNAT (args[i + 1]);
+	}
+      else if (i + 1 < nargs && EQ (args[i], QCbatch_latency))
+	{
+	  CHECK_NUMBER (args[i + 1]);
+	  *latency = dtotimespec (XFLOATINT (args[i + 1]));
+	}
+      else if (i + 1 < nargs && EQ (args[i], QCstderr_function))
+	*stderr_function = args[i + 1];
+      else
+	{
+	  conf_args[conf_nargs++] = args[i];
+	  if (i + 1 < nargs)
+	    conf_args[conf_nargs++] = args[i + 1];
+	}
     }
-#else
-  if (json_has_suffix (error->text, "expected near end of file"))
-    symbol = Qjson_end_of_file;
-  else if (json_has_prefix (error->text, "end of file expected"))
-    symbol = Qjson_trailing_content;
-  else
-    symbol = Qjson_parse_error;
-#endif
-  return Fcons (symbol, list5 (build_string_from_utf8 (error->text),
-			       build_string_from_utf8 (error->source),
-			       INT_TO_INTEGER (error->line),
-			       INT_TO_INTEGER (error->column),
-			       INT_TO_INTEGER (error->position)));
+  json_parse_args (conf_nargs, conf_args, conf, true);
+  SAFE_FREE ();
 }
 
-DEFUN ("json-rpc", Fjson_rpc, Sjson_rpc, 1, MANY,
+DEFUN ("json-rpc", Fjson_rpc, Sjson_rpc, 2, MANY,
        NULL,
-       doc: /* Runs json-rpc dispach loop over jsonrpc connection */)
+       doc: /* Runs json-rpc dispach loop over jsonrpc connection.
+CALLBACK is called as (CALLBACK MESSAGE ERROR DONE) for each message
+read from CONNECTION, or with a non-nil ERROR if a message could not
+be parsed.  It is called with a non-nil DONE when the server closes
+the connection, after which this function returns.
+
+The arguments ARGS are a list of keyword/argument pairs.  Besides
+those accepted by `json-parse-string':
+
+The keyword argument `:batch-size', a positive integer, makes CALLBACK
+receive a vector of up to that many messages at a time instead of
+single messages.  Parse errors are still reported one by one, after
+the batch they arrived in.  Batching requires a connection created
+with `:reader-thread'.
+
+The keyword argument `:batch-latency' specifies how many seconds to
+wait for a batch to fill up once its first message has arrived.  It
+defaults to 0, meaning only messages already queued are batched.
+
+The keyword argument `:stderr-function' specifies a function to call
+with each chunk of output the server writes to stderr, as a string.
+Chunks are passed as soon as they arrive if the connection has a
+reader thread, and otherwise along with the next message.
+usage: (json-rpc CONNECTION CALLBACK &rest ARGS)  */)
   (ptrdiff_t nargs, Lisp_Object *args)
 {
   Lisp_Object connection = args[0];
@@ -1349,77 +5967,286 @@ DEFUN ("json-rpc", Fjson_rpc, Sjson_rpc, 1, MANY,
 
   Lisp_Object callback = args[1];
 
-  struct json_configuration conf =
-    {json_object_hashtable, json_array_array, QCnull, QCfalse};
-
-  json_parse_args (nargs - 2, args + 2, &conf, true);
+  struct json_configuration conf;
+  ptrdiff_t batch_size;
+  struct timespec latency;
+  Lisp_Object stderr_function;
+  json_rpc_parse_args (nargs - 2, args + 2, &conf, &batch_size, &latency,
+		       &stderr_function);
 
   struct json_rpc_state* param = json_rpc_state(connection);
-  struct SSP_Handle* handle = param->handle;
 
-  while (!param->done && handle->isalive(handle))
-    {
-      flush_stack_call_func (json_rpc_callback, param);
+  if (batch_size > 0 && !param->queue)
+    error ("Batching requires a connection with a reader thread");
+  if (!NILP (Fassq (connection, json_rpc_dispatched)))
+    error ("Connection is dispatched by `json-rpc-set-callback'");
+
+  if (param->queue)
+    json_rpc_drain (param, callback, &conf, batch_size, latency,
+		    stderr_function);
+  else
+    /* Don't stop as soon as the server exits: the receive buffer may
+       still hold messages it sent before.  PARAM->done is set once
+       everything has been consumed.  */
+    while (!param->done)
+      {
+	flush_stack_call_func (json_rpc_callback, param);
+	json_rpc_deliver_stderr (param, stderr_function);
+
+	if (!param->done)
+	  {
+	    struct json_dom *dom = param->dom;
+	    param->dom = NULL;
+	    json_rpc_deliver (param, callback,
+			      param->read_buffer + param->message_start,
+			      param->message_length, dom, param->message_id,
+			      &conf);
+	  }
+      }
+  CALLN (Ffuncall, callback, Qnil, Qnil, Qt);
+  json_rpc_close (param);
+  return Qnil;
+}
 
-      if (!param->done)
+/* Dispatching from the command loop.
+
+   A connection given a callback with `json-rpc-set-callback' is not
+   drained by `json-rpc'.  Instead, whatever feeds its queue also
+   writes to the wakeup pipe, which is watched by
+   wait_reading_process_output like a process.  Whenever it becomes
+   readable, the command loop passes the queued messages of all such
+   connections to their callbacks, but for no longer than
+   `json-rpc-dispatch-budget' at a time, so that input stays
+   responsive while servers are chatty.  */
+
+/* Dispatch the messages queued for the connection of ENTRY, an
+   element of json_rpc_dispatched, until DEADLINE.  Return false if
+   time ran out before its queue was empty.  */
+
+static bool
+json_rpc_dispatch (Lisp_Object entry, struct timespec deadline)
+{
+  Lisp_Object connection = XCAR (entry);
+  Lisp_Object callback = XCAR (XCDR (entry));
+  Lisp_Object args = XCDR (XCDR (entry));
+  struct json_rpc_state *param = json_rpc_state (connection);
+
+  struct json_configuration conf;
+  ptrdiff_t batch_size;
+  struct timespec latency;
+  Lisp_Object stderr_function;
+  USE_SAFE_ALLOCA;
+  Lisp_Object *argv;
+  ptrdiff_t nargs = list_length (args);
+  SAFE_ALLOCA_LISP (argv, nargs);
+  for (ptrdiff_t i = 0; i < nargs; i++, args = XCDR (args))
+    argv[i] = XCAR (args);
+  json_rpc_parse_args (nargs, argv, &conf, &batch_size, &latency,
+		       &stderr_function);
+  struct json_rpc_entry *entries = NULL;
+  if (batch_size > 0)
+    SAFE_NALLOCA (entries, 1, batch_size);
+  ptrdiff_t max_handled = batch_size > 0 ? batch_size : 1;
+
+  bool done = false;
+  for (;;)
+    {
+      bool closed = __atomic_load_n (&param->queue->closed,
+				     __ATOMIC_SEQ_CST);
+      json_rpc_deliver_stderr (param, stderr_function);
+      ptrdiff_t handled
+	= json_rpc_deliver_queued (param, callback, &conf, batch_size,
+				   entries, max_handled);
+      if (handled > 0)
+	json_rpc_note_dispatch (connection, Qt);
+      if (handled < max_handled)
 	{
-	  if (param->message != NULL)
-	    {
-	      Lisp_Object msg = json_to_lisp (param->message, &conf);
-	      free (param->message);
-              param->message = NULL;
-	      CALLN (Ffuncall, callback, msg, Qnil, Qnil);
-	    }
-	  else
+	  if (closed)
 	    {
-	      Lisp_Object error = get_json_parse_error(&param->error);
-	      CALLN (Ffuncall, callback, Qnil, error, Qnil);
+	      json_rpc_dispatched = Fdelq (entry, json_rpc_dispatched);
+	      json_rpc_release_reader (param);
+	      CALLN (Ffuncall, callback, Qnil, Qnil, Qt);
+	      json_rpc_close (param);
+	      json_rpc_note_dispatch (connection, Qt);
 	    }
-	} else {
-      }
+	  done = true;
+	  break;
+	}
+      if (timespec_cmp (current_timespec (), deadline) >= 0)
+	break;
     }
-  CALLN (Ffuncall, callback, Qnil, Qnil, Qt);
-  if (pthread_mutex_lock (&param->handle_mx) == 0)
+  SAFE_FREE ();
+  return done;
+}
+
+static void
+json_rpc_dispatch_end (void)
+{
+  json_rpc_dispatching = false;
+  if (json_rpc_redispatch)
     {
-      param->handle->close (param->handle);
-      param->handle = NULL;
-      pthread_mutex_unlock (&param->handle_mx);
+      json_rpc_redispatch = false;
+      json_rpc_wakeup ();
     }
-  /* TODO: what if mutex_lock fails? */
+}
+
+/* Dispatch the messages queued for all connections in
+   json_rpc_dispatched within the time budget.  */
+
+static Lisp_Object
+json_rpc_dispatch_all (void)
+{
+  ptrdiff_t count = SPECPDL_INDEX ();
+  json_rpc_dispatching = true;
+  record_unwind_protect_void (json_rpc_dispatch_end);
+  specbind (Qinhibit_quit, Qt);
+  struct timespec deadline
+    = timespec_add (current_timespec (),
+		    dtotimespec (NUMBERP (Vjson_rpc_dispatch_budget)
+				 ? XFLOATINT (Vjson_rpc_dispatch_budget)
+				 : 0));
+  for (Lisp_Object tail = json_rpc_dispatched; CONSP (tail);
+       tail = XCDR (tail))
+    if (!json_rpc_dispatch (XCAR (tail), deadline))
+      {
+	/* Come back for the rest, starting where we stopped so that
+	   no connection starves.  */
+	Lisp_Object head = json_rpc_dispatched;
+	if (!EQ (head, tail))
+	  {
+	    Lisp_Object last = head;
+	    while (!EQ (XCDR (last), tail))
+	      last = XCDR (last);
+	    XSETCDR (last, Qnil);
+	    json_rpc_dispatched = nconc2 (tail, head);
+	  }
+	json_rpc_wakeup ();
+	break;
+      }
+  return unbind_to (count, Qnil);
+}
+
+static Lisp_Object
+json_rpc_dispatch_error (Lisp_Object error)
+{
+  cmd_error_internal (error, "error in json-rpc callback: ");
+  /* Let the remaining messages be dispatched next time around.  */
+  json_rpc_wakeup ();
   return Qnil;
 }
 
-// jsonrpc end
+static void
+json_rpc_wakeup_callback (int fd, void *data)
+{
+  __atomic_store_n (&json_rpc_wakeup_pending, false, __ATOMIC_SEQ_CST);
+  char buffer[64];
+  while (read (fd, buffer, sizeof buffer) > 0)
+    continue;
+  if (json_rpc_dispatching)
+    {
+      json_rpc_redispatch = true;
+      return;
+    }
+  internal_condition_case (json_rpc_dispatch_all, Qerror,
+			   json_rpc_dispatch_error);
+}
 
-struct json_read_buffer_data
+static void
+json_rpc_stop_waiting (Lisp_Object entry)
 {
-  /* Byte position of position to read the next chunk from.  */
-  ptrdiff_t point;
-};
+  json_rpc_waiting = Fdelq (entry, json_rpc_waiting);
+}
 
-/* Callback for json_load_callback that reads from the current buffer.
-   DATA must point to a structure of type json_read_buffer_data.
-   data->point must point to the byte position to read from; after
-   reading, data->point is advanced accordingly.  The buffer point
-   itself is ignored.  This function may not exit nonlocally.  */
+/* Do what `accept-process-output' does for PROCESS, SECS and NSECS
+   when PROCESS is the json-rpc connection CONNECTION: wait until some
+   of its messages were dispatched from the command loop or it was
+   closed.  */
 
-static size_t
-json_read_buffer_callback (void *buffer, size_t buflen, void *data)
+Lisp_Object
+json_rpc_accept_output (Lisp_Object connection, intmax_t secs, int nsecs)
+{
+  if (NILP (Fassq (connection, json_rpc_dispatched)))
+    error ("Messages of this json-rpc connection are not dispatched");
+  /* The messages would only be dispatched once the callback
+     returned.  */
+  if (json_rpc_dispatching)
+    error ("Cannot wait for a json-rpc connection from a callback");
+  ptrdiff_t count = SPECPDL_INDEX ();
+  Lisp_Object cell = Fcons (Qnil, Qnil);
+  Lisp_Object entry = Fcons (connection, cell);
+  json_rpc_waiting = Fcons (entry, json_rpc_waiting);
+  record_unwind_protect (json_rpc_stop_waiting, entry);
+  wait_reading_process_output (secs, nsecs, 0, false, cell, NULL, 0);
+  return unbind_to (count, EQ (XCAR (cell), Qt) ? Qt : Qnil);
+}
+
+DEFUN ("json-rpc-set-callback", Fjson_rpc_set_callback,
+       Sjson_rpc_set_callback, 2, MANY, NULL,
+       doc: /* Dispatch the messages of CONNECTION from the command loop.
+Instead of being passed by `json-rpc', which blocks the calling
+thread, messages from CONNECTION are passed to CALLBACK whenever Emacs
+waits for input or for process output, as with `sit-for' or
+`accept-process-output', in the same way as `json-rpc' does.  After
+it has been called with a non-nil DONE, the connection is closed.
+
+Each time around, the command loop dispatches the messages of all
+such connections for at most `json-rpc-dispatch-budget' seconds and
+leaves the rest for later.  `accept-process-output' without a
+PROCESS argument returns once some messages have been dispatched.
+With CONNECTION as its PROCESS argument, it waits until messages of
+CONNECTION have been dispatched or CONNECTION has been closed; it
+cannot do so from within CALLBACK, and its JUST-THIS-ONE argument is
+ignored.
+
+The connection must have been created with `:reader-thread'.  ARGS are
+the keyword arguments of `json-rpc', except that `:batch-latency' is
+ignored.  If CALLBACK is nil, stop dispatching, so that `json-rpc' can
+be called instead.
+usage: (json-rpc-set-callback CONNECTION CALLBACK &rest ARGS)  */)
+  (ptrdiff_t nargs, Lisp_Object *args)
 {
-  struct json_read_buffer_data *d = data;
+  Lisp_Object connection = args[0];
+  CHECK_RPC_CONNECTION (connection);
+  struct json_rpc_state *param = json_rpc_state (connection);
+  if (!param->queue)
+    error ("Dispatching requires a connection with a reader thread");
+  if (param->handle == NULL)
+    error ("Connection is closed");
+
+  /* Check the arguments now rather than each time they are used.  */
+  struct json_configuration conf;
+  ptrdiff_t batch_size;
+  struct timespec latency;
+  Lisp_Object stderr_function;
+  json_rpc_parse_args (nargs - 2, args + 2, &conf, &batch_size, &latency,
+		       &stderr_function);
+
+  json_rpc_dispatched = Fdelq (Fassq (connection, json_rpc_dispatched),
+			       json_rpc_dispatched);
+  if (NILP (args[1]))
+    {
+      json_rpc_note_dispatch (connection, make_fixnum (0));
+      __atomic_store_n (&param->queue->dispatched, false, __ATOMIC_SEQ_CST);
+      return Qnil;
+    }
 
-  /* First, parse from point to the gap or the end of the accessible
-     portion, whatever is closer.  */
-  ptrdiff_t point = d->point;
-  ptrdiff_t end = BUFFER_CEILING_OF (point) + 1;
-  ptrdiff_t count = end - point;
-  if (buflen < count)
-    count = buflen;
-  memcpy (buffer, BYTE_POS_ADDR (point), count);
-  d->point += count;
-  return count;
+  if (json_rpc_wakeup_fd[0] < 0)
+    {
+      if (pipe2 (json_rpc_wakeup_fd, O_CLOEXEC | O_NONBLOCK) != 0)
+	report_file_error ("Creating json-rpc wakeup pipe", Qnil);
+      add_non_keyboard_read_fd (json_rpc_wakeup_fd[0],
+				json_rpc_wakeup_callback, NULL);
+    }
+  json_rpc_dispatched = Fcons (Fcons (connection, Flist (nargs - 1, args + 1)),
+			       json_rpc_dispatched);
+  __atomic_store_n (&param->queue->dispatched, true, __ATOMIC_SEQ_CST);
+  /* Deal with what was queued before.  */
+  json_rpc_wakeup ();
+  return Qnil;
 }
 
+// jsonrpc end
+
 DEFUN ("json-parse-buffer", Fjson_parse_buffer, Sjson_parse_buffer,
        0, MANY, NULL,
        doc: /* Read JSON object from current buffer starting at point.
@@ -1471,25 +6298,18 @@ DEFUN ("json-parse-buffer", Fjson_parse_buffer, Sjson_parse_buffer,
     {json_object_hashtable, json_array_array, QCnull, QCfalse};
   json_parse_args (nargs, args, &conf, true);
 
+  /* Parse the text from point to the end of the accessible portion
+     in place, which needs it to be contiguous.  */
   ptrdiff_t point = PT_BYTE;
-  struct json_read_buffer_data data = {.point = point};
-  json_error_t error;
-  json_t *object
-    = json_load_callback (json_read_buffer_callback, &data,
-                          JSON_DECODE_ANY | JSON_DISABLE_EOF_CHECK,
-                          &error);
-
-  if (object == NULL)
-    json_parse_error (&error);
-
-  /* Avoid leaking the object in case of further errors.  */
-  record_unwind_protect_ptr (json_release_object, object);
-
-  /* Convert and then move point only if everything succeeded.  */
-  Lisp_Object lisp = json_to_lisp (object, &conf);
-
-  /* Adjust point by how much we just read.  */
-  point += error.position;
+  if (point < GPT_BYTE && GPT_BYTE < ZV_BYTE)
+    move_gap_both (PT, PT_BYTE);
+  ptrdiff_t consumed;
+  Lisp_Object lisp = json_parse ((char *) BYTE_POS_ADDR (point),
+				 ZV_BYTE - point, "<buffer>", false, &conf,
+				 &consumed);
+
+  /* Move point only if everything succeeded.  */
+  point += consumed;
   SET_PT_BOTH (BYTE_TO_CHAR (point), point);
 
   return unbind_to (count, lisp);
@@ -1514,6 +6334,10 @@ define_error (Lisp_Object name, const char *message, Lisp_Object parent)
 void
 syms_of_json (void)
 {
+  json_key_cache = make_nil_vector (JSON_KEY_CACHE_SIZE);
+  staticpro (&json_key_cache);
+  staticpro (&json_key_cache_obarray);
+
   DEFSYM (QCnull, ":null");
   DEFSYM (QCfalse, ":false");
 
@@ -1560,19 +6384,79 @@ syms_of_json (void)
   DEFSYM (QCarray_type, ":array-type");
   DEFSYM (QCnull_object, ":null-object");
   DEFSYM (QCfalse_object, ":false-object");
+  DEFSYM (QCreader_thread, ":reader-thread");
+  DEFSYM (Qshared, "shared");
+  DEFSYM (QCsocket, ":socket");
+  DEFSYM (QCenvironment, ":environment");
+  DEFSYM (QCdirectory, ":directory");
+  DEFSYM (QCprocess_group, ":process-group");
+  DEFSYM (QCsupersede, ":supersede");
+
+  DEFSYM (QCwriter_thread, ":writer-thread");
+  DEFSYM (QCsend_high_water, ":send-high-water");
+  DEFSYM (QCcoalesce_changes, ":coalesce-changes");
+  DEFSYM (QCstats, ":stats");
+  DEFSYM (QCcount, ":count");
+  DEFSYM (QCtotal, ":total");
+  DEFSYM (QCmax, ":max");
+  DEFSYM (QChistogram, ":histogram");
+  DEFSYM (QCbytes_in, ":bytes-in");
+  DEFSYM (QCbytes_out, ":bytes-out");
+  DEFSYM (QCmessages_in, ":messages-in");
+  DEFSYM (QCmessages_out, ":messages-out");
+  DEFSYM (QCqueue_high_water, ":queue-high-water");
+  DEFSYM (QCoutbox_messages_high_water, ":outbox-messages-high-water");
+  DEFSYM (QCoutbox_bytes_high_water, ":outbox-bytes-high-water");
+  DEFSYM (QCframe, ":frame");
+  DEFSYM (QCparse, ":parse");
+  DEFSYM (QCqueue_wait, ":queue-wait");
+  DEFSYM (QClock_wait, ":lock-wait");
+  DEFSYM (QCconvert, ":convert");
+  DEFSYM (QCcallback, ":callback");
+  DEFSYM (QCserialize, ":serialize");
+  DEFSYM (QCwrite, ":write");
+  DEFSYM (QCbatch_size, ":batch-size");
+  DEFSYM (QCbatch_latency, ":batch-latency");
+  DEFSYM (QClazy, ":lazy");
+  DEFSYM (QCstderr_size, ":stderr-size");
+  DEFSYM (QCstderr_function, ":stderr-function");
+  DEFSYM (Qjson_rpc_message_p, "json-rpc-message-p");
   DEFSYM (Qalist, "alist");
   DEFSYM (Qplist, "plist");
   DEFSYM (Qarray, "array");
 
+  json_rpc_dispatched = Qnil;
+  staticpro (&json_rpc_dispatched);
+  json_rpc_waiting = Qnil;
+  staticpro (&json_rpc_waiting);
+  json_rpc_requests = CALLN (Fmake_hash_table, QCtest, Qeql);
+  staticpro (&json_rpc_requests);
+  json_rpc_superseding = CALLN (Fmake_hash_table, QCtest, Qequal);
+  staticpro (&json_rpc_superseding);
+
+  DEFVAR_LISP ("json-rpc-dispatch-budget", Vjson_rpc_dispatch_budget,
+	       doc: /* Seconds the command loop may spend dispatching json-rpc messages.
+This is how long messages are passed to the callbacks set with
+`json-rpc-set-callback' before Emacs looks at input again.  The
+connections left over are served first the next time.  */);
+  Vjson_rpc_dispatch_budget = make_float (0.01);
+
   defsubr (&Sjson_serialize);
   defsubr (&Sjson_insert);
   defsubr (&Sjson_parse_string);
   defsubr (&Sjson_rpc);
+  defsubr (&Sjson_rpc_set_callback);
   defsubr (&Sjson_rpc_connection);
   defsubr (&Sjson_rpc_send);
+  defsubr (&Sjson_rpc_request);
+  defsubr (&Sjson_rpc_cancel);
+  defsubr (&Sjson_rpc_stats);
+  defsubr (&Sjson_rpc_send_queue_depth);
   defsubr (&Sjson_rpc_shutdown);
   defsubr (&Sjson_rpc_pid);
   defsubr (&Sjson_rpc_stderr);
   defsubr (&Sjson_rpc_alive_p);
+  defsubr (&Sjson_rpc_message_p);
+  defsubr (&Sjson_rpc_get);
   defsubr (&Sjson_parse_buffer);
 }
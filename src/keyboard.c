@@ -2782,6 +2782,11 @@ read_char (int commandflag, Lisp_Object map,
       /* delay_level is 4 for files under around 50k, 7 at 100k,
 	 9 at 200k, 11 at 300k, and 12 at 500k.  It is 15 at 1 meg.  */
 
+      /* Collect garbage now if enough consing has gone on, rather than
+	 in the middle of the next command.  */
+      if (!detect_input_pending_run_timers (0))
+	maybe_garbage_collect_idle ();
+
       /* Auto save if enough time goes by without input.  */
       if (commandflag != 0 && commandflag != -2
 	  && num_nonmacro_input_events > last_auto_save
@@ -1426,6 +1426,18 @@ xcdr_addr (Lisp_Object c)
   return lisp_h_XCDR (c);
 }
 
+#ifdef HAVE_GC_NURSERY
+/* Defined in alloc.c.  The write barrier of the generational
+   collector: record C if it is an old cons.  */
+extern void gc_remember_cons (Lisp_Object c);
+#endif
+#ifdef HAVE_GC_INCREMENTAL
+/* Defined in alloc.c.  The write barrier of the incremental
+   collector: while it is marking, record C if it is marked.  */
+extern bool gc_incremental_marking;
+extern void gc_remember_cons (Lisp_Object c);
+#endif
+
 /* Use these to set the fields of a cons cell.
 
    Note that both arguments may refer to the same object, so 'n'
@@ -1433,11 +1445,27 @@ xcdr_addr (Lisp_Object c)
 INLINE void
 XSETCAR (Lisp_Object c, Lisp_Object n)
 {
+#ifdef HAVE_GC_NURSERY
+  if (CONSP (n) || TAGGEDP (n, Lisp_Float))
+    gc_remember_cons (c);
+#endif
+#ifdef HAVE_GC_INCREMENTAL
+  if (gc_incremental_marking && !FIXNUMP (n))
+    gc_remember_cons (c);
+#endif
   *xcar_addr (c) = n;
 }
 INLINE void
 XSETCDR (Lisp_Object c, Lisp_Object n)
 {
+#ifdef HAVE_GC_NURSERY
+  if (CONSP (n) || TAGGEDP (n, Lisp_Float))
+    gc_remember_cons (c);
+#endif
+#ifdef HAVE_GC_INCREMENTAL
+  if (gc_incremental_marking && !FIXNUMP (n))
+    gc_remember_cons (c);
+#endif
   *xcdr_addr (c) = n;
 }
 
@@ -3687,6 +3715,8 @@ verify (FLT_RADIX == 2 || FLT_RADIX == 16);
 /* Defined in json.c.  */
 extern void init_json (void);
 extern void syms_of_json (void);
+extern bool json_rpc_connection_p (Lisp_Object);
+extern Lisp_Object json_rpc_accept_output (Lisp_Object, intmax_t, int);
 #endif
 
 /* Defined in insdel.c.  */
@@ -3837,6 +3867,7 @@ flush_stack_call_func (void (*func) (void *arg), void *arg)
 extern void garbage_collect (void);
 extern void maybe_garbage_collect (void);
 extern bool maybe_garbage_collect_eagerly (EMACS_INT factor);
+extern void maybe_garbage_collect_idle (void);
 extern const char *pending_malloc_warning;
 extern Lisp_Object zero_vector;
 extern EMACS_INT consing_until_gc;
@@ -5154,6 +5154,30 @@ pdumper_find_object_type_impl (const void *obj)
     : PDUMPER_NO_OBJECT;
 }
 
+#ifdef HAVE_GC_NURSERY
+void
+pdumper_visit_live_objects_impl (void (*fn) (void *, enum Lisp_Type))
+{
+  if (!dump_loaded_p ())
+    return;
+  const struct dump_table_locator *table
+    = &dump_private.header.object_starts;
+  const struct dump_reloc *const relocs = dump_ptr (dump_public.start,
+						    table->offset);
+  for (ptrdiff_t i = 0; i < table->nr_entries; i++)
+    {
+      /* The object starts are sorted by offset.  */
+      dump_off offset = dump_reloc_get_offset (relocs[i]);
+      if (offset >= dump_private.header.discardable_start)
+	break;
+      if (dump_bitset_bit_set_p (&dump_private.last_mark_bits,
+				 offset / DUMP_ALIGNMENT))
+	fn ((char *) dump_public.start + offset,
+	    (enum Lisp_Type) relocs[i].type);
+    }
+}
+#endif
+
 bool
 pdumper_marked_p_impl (const void *obj)
 {
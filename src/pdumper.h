@@ -222,6 +222,25 @@ pdumper_object_p_precise (const void *obj)
 #endif
 }
 
+#ifdef HAVE_GC_NURSERY
+extern void pdumper_visit_live_objects_impl (void (*) (void *,
+							enum Lisp_Type));
+
+/* Call FN with the address and type of each object in the dump that
+   the last GC found live, or of all of them if there has been no GC
+   yet.  Objects the GC does not mark, such as those in the cold
+   section, are left out.  */
+INLINE void
+pdumper_visit_live_objects (void (*fn) (void *, enum Lisp_Type))
+{
+#ifdef HAVE_PDUMPER
+  pdumper_visit_live_objects_impl (fn);
+#else
+  (void) fn;
+#endif
+}
+#endif
+
 extern bool pdumper_marked_p_impl (const void *obj);
 
 /* Return whether OBJ is marked according to the portable dumper.
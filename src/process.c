@@ -483,6 +483,16 @@ add_non_keyboard_read_fd (int fd, fd_callback func, void *data)
   fd_callback_info[fd].flags &= ~KEYBOARD_FD;
 }
 
+/* Incremented by fd callbacks that passed input on to Lisp, so that
+   `accept-process-output' returns for it as for process output.  */
+static uintmax_t fd_callback_input_count;
+
+void
+note_fd_callback_input (void)
+{
+  fd_callback_input_count++;
+}
+
 static void
 add_process_read_fd (int fd)
 {
@@ -4730,7 +4740,9 @@ DEFUN ("accept-process-output", Faccept_process_output, Saccept_process_output,
        doc: /* Allow any pending output from subprocesses to be read by Emacs.
 It is given to their filter functions.
 Optional argument PROCESS means to return only after output is
-received from PROCESS or PROCESS closes the connection.
+received from PROCESS or PROCESS closes the connection.  PROCESS can
+also be a json-rpc connection whose messages are dispatched by
+`json-rpc-set-callback'; see there.
 
 Optional second argument SECONDS and third argument MILLISEC
 specify a timeout; return after that much time even if there is
@@ -4749,8 +4761,12 @@ DEFUN ("accept-process-output", Faccept_process_output, Saccept_process_output,
 {
   intmax_t secs;
   int nsecs;
+  bool json_rpc = false;
 
-  if (! NILP (process))
+#ifdef HAVE_JSON
+  json_rpc = json_rpc_connection_p (process);
+#endif
+  if (! NILP (process) && ! json_rpc)
     {
       CHECK_PROCESS (process);
       struct Lisp_Process *proc = XPROCESS (process);
@@ -4811,6 +4827,11 @@ DEFUN ("accept-process-output", Faccept_process_output, Saccept_process_output,
   else if (! NILP (process))
     nsecs = 0;
 
+#ifdef HAVE_JSON
+  if (json_rpc)
+    return json_rpc_accept_output (process, secs, nsecs);
+#endif
+
   return
     ((wait_reading_process_output (secs, nsecs, 0, 0,
 				   Qnil,
@@ -5747,7 +5768,13 @@ wait_reading_process_output (intmax_t time_limit, int nsecs, int read_kbd,
 		   && FD_ISSET (channel, &Available))
 		  || ((d->flags & FOR_WRITE)
 		      && FD_ISSET (channel, &Writeok))))
-            d->func (channel, d->data);
+	    {
+	      uintmax_t input_count = fd_callback_input_count;
+	      d->func (channel, d->data);
+	      if (!wait_proc && fd_callback_input_count != input_count
+		  && got_some_output < 1)
+		got_some_output = 1;
+	    }
 	}
 
       /* Do round robin if `process-pritoritize-lower-fds' is nil. */
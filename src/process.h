@@ -285,6 +285,7 @@ pset_gnutls_cred_type (struct Lisp_Process *p, Lisp_Object val)
 
 extern void add_read_fd (int fd, fd_callback func, void *data);
 extern void add_non_keyboard_read_fd (int fd, fd_callback func, void *data);
+extern void note_fd_callback_input (void);
 extern void delete_read_fd (int fd);
 extern void add_write_fd (int fd, fd_callback func, void *data);
 extern void delete_write_fd (int fd);
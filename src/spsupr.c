@@ -3,16 +3,35 @@
 #if defined(__linux__) || defined(__FreeBSD__) || defined(__APPLE__)
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <assert.h>
-#include <err.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
 #include <poll.h>
+#include <signal.h>
 #include <stddef.h>
 #include <string.h>
 #include <sysexits.h>
 #include <unistd.h>
 
+/* posix_spawn() does not copy the parent's page tables the way fork()
+ * does, which matters when the parent has a large heap */
+#if defined(HAVE_POSIX_SPAWN) && \
+    (defined(HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCHDIR) || \
+     defined(HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCHDIR_NP))
+#define SSP_POSIX_SPAWN 1
+#include <spawn.h>
+#ifdef HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCHDIR
+#define ssp_addchdir posix_spawn_file_actions_addchdir
+#else
+#define ssp_addchdir posix_spawn_file_actions_addchdir_np
+#endif
+#endif
+
 enum { parent_end = 0, child_end = 1 };
 
 struct SSP_Posix {
@@ -101,6 +120,13 @@ ssp_cancel_recv(struct SSP_Handle *ssph)
 	send(h->cancelwr_fd, h, 1, 0);
 }
 
+static void
+ssp_cancel_send(struct SSP_Handle *ssph)
+{
+	struct SSP_Posix *h = GETH(ssph);
+	shutdown(h->io_fd, SHUT_WR);
+}
+
 static int
 ssp_isalive(struct SSP_Handle *ssph)
 {
@@ -115,12 +141,175 @@ ssp_close(struct SSP_Handle *ssph)
 	int status;
 	close(h->cancelrd_fd);
 	close(h->cancelwr_fd);
-	close(h->err_fd);
+	if (h->err_fd != -1)
+		close(h->err_fd);
 	close(h->io_fd);
-	(void)waitpid(h->pid, &status, WNOHANG);
+	if (h->pid > 0)
+		(void)waitpid(h->pid, &status, WNOHANG);
 	free(h);
 }
 
+/* Fills in RES to talk through IO_FD and ERR_FD (-1 if none) to
+ * process PID (0 if none); UNBL_FDS are the cancel socketpair */
+static struct SSP_Handle *
+ssp_init(struct SSP_Posix *res, int io_fd, int err_fd, int unbl_fds[2],
+	 pid_t pid, int timeout_ms)
+{
+	res->handle.send = &ssp_send;
+	res->handle.recv = &ssp_recv;
+	res->handle.cancel_recv = &ssp_cancel_recv;
+	res->handle.cancel_send = &ssp_cancel_send;
+	res->handle.isalive = &ssp_isalive;
+	res->handle.close = &ssp_close;
+	res->handle.pid = pid;
+	res->handle.stdout_fd = io_fd;
+	res->handle.stderr_fd = err_fd;
+	/* poll() ignores negative descriptors */
+	res->fds[0].fd = io_fd;
+	res->fds[0].events = POLLIN;
+	res->fds[1].fd = err_fd;
+	res->fds[1].events = POLLIN;
+	res->fds[2].fd = unbl_fds[parent_end];
+	res->fds[2].events = POLLIN;
+	res->pid = pid;
+	res->io_fd = io_fd;
+	res->err_fd = err_fd;
+	res->cancelwr_fd = unbl_fds[child_end];
+	res->cancelrd_fd = unbl_fds[parent_end];
+	res->timeout_ms = timeout_ms;
+	res->isalive = 1;
+	return &res->handle;
+}
+
+/* Sets close-on-exec on both FDS */
+static int
+ssp_cloexec(int fds[2])
+{
+	return fcntl(fds[0], F_SETFD, FD_CLOEXEC) == -1 ||
+		fcntl(fds[1], F_SETFD, FD_CLOEXEC) == -1 ? -1 : 0;
+}
+
+/* Returns non-zero if ENVP has an entry for the variable of VAR */
+static int
+ssp_env_overridden(const char *var, char *const *envp)
+{
+	size_t len = strcspn(var, "=");
+	for (; *envp; ++envp)
+		if (strncmp(*envp, var, len) == 0 &&
+		    ((*envp)[len] == '=' || (*envp)[len] == '\0'))
+			return 1;
+	return 0;
+}
+
+/* Returns the environment for a child as OPTS->envp says, in a
+ * malloc()ed array whose strings are not copied, or NULL */
+static char **
+ssp_environ(char *const *envp)
+{
+	size_t n = 0, m = 0, i, j = 0;
+	char **res;
+
+	while (environ[n])
+		++n;
+	while (envp[m])
+		++m;
+	res = (char **)malloc((n + m + 1) * sizeof(*res));
+	if (!res)
+		return NULL;
+	for (i = 0; i < n; ++i)
+		if (!ssp_env_overridden(environ[i], envp))
+			res[j++] = environ[i];
+	for (i = 0; i < m; ++i)
+		if (strchr(envp[i], '='))
+			res[j++] = envp[i];
+	res[j] = NULL;
+	return res;
+}
+
+/* Starts OPTS->binary with IO_FD as its stdin and stdout and ERR_FD as
+ * its stderr.  Returns its pid, or -1 with errno set */
+static pid_t
+ssp_launch(struct SSP_Opts *opts, int io_fd, int err_fd)
+{
+	char **env = environ, **merged = NULL;
+	pid_t pid = -1;
+	int eno = 0;
+
+	if (opts->envp) {
+		merged = ssp_environ(opts->envp);
+		if (!merged)
+			return -1;
+		env = merged;
+	}
+#ifdef SSP_POSIX_SPAWN
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	sigset_t sigdefault, sigmask;
+	short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+
+	if ((eno = posix_spawn_file_actions_init(&actions)))
+		goto out;
+	if ((eno = posix_spawnattr_init(&attr)))
+		goto out_actions;
+	/* Emacs ignores SIGPIPE, but the child should not */
+	sigemptyset(&sigdefault);
+	sigaddset(&sigdefault, SIGPIPE);
+	sigemptyset(&sigmask);
+	if (opts->new_pgroup)
+		flags |= POSIX_SPAWN_SETPGROUP;
+	if ((eno = posix_spawn_file_actions_adddup2(&actions, io_fd,
+						     STDIN_FILENO)) ||
+	    (eno = posix_spawn_file_actions_adddup2(&actions, io_fd,
+						     STDOUT_FILENO)) ||
+	    (eno = posix_spawn_file_actions_adddup2(&actions, err_fd,
+						     STDERR_FILENO)) ||
+	    (opts->cwd && (eno = ssp_addchdir(&actions, opts->cwd))) ||
+	    (eno = posix_spawnattr_setsigdefault(&attr, &sigdefault)) ||
+	    (eno = posix_spawnattr_setsigmask(&attr, &sigmask)) ||
+	    (eno = posix_spawnattr_setpgroup(&attr, 0)) ||
+	    (eno = posix_spawnattr_setflags(&attr, flags)))
+		goto out_attr;
+	/* Like execvp(), this only searches PATH if there is no slash */
+	eno = posix_spawnp(&pid, opts->binary, &actions, &attr, opts->argv,
+			   env);
+out_attr:
+	posix_spawnattr_destroy(&attr);
+out_actions:
+	posix_spawn_file_actions_destroy(&actions);
+out:
+#else
+	pid = fork();
+	if (pid == 0) {
+		/* Child: only async-signal-safe calls from here on */
+		if (dup2(io_fd, STDIN_FILENO) == -1 ||
+		    dup2(io_fd, STDOUT_FILENO) == -1 ||
+		    dup2(err_fd, STDERR_FILENO) == -1)
+			_exit(EX_OSERR);
+		if (opts->cwd && chdir(opts->cwd) == -1)
+			_exit(EX_OSERR);
+		if (opts->new_pgroup)
+			setpgid(0, 0);
+		signal(SIGPIPE, SIG_DFL);
+		environ = env;
+		if (opts->binary[0] == '/' || opts->binary[0] == '.') {
+			/* Assume path is included */
+			execv(opts->binary, opts->argv);
+		} else {
+			execvp(opts->binary, opts->argv);
+		}
+		_exit(EX_OSERR);
+	}
+	if (pid == -1)
+		eno = errno;
+#endif
+	free(merged);
+	if (eno) {
+		errno = eno;
+		return -1;
+	}
+	return pid;
+}
+
 struct SSP_Handle *
 ssp_spawn(struct SSP_Opts *opts)
 {
@@ -138,63 +327,20 @@ ssp_spawn(struct SSP_Opts *opts)
 	if (!res)
 		return NULL;
 
+	/* Only the duplicates made for the child's stdio survive exec */
 	if (socketpair(AF_LOCAL, SOCK_STREAM, 0, io_fds) == -1 ||
 	    socketpair(AF_LOCAL, SOCK_STREAM, 0, err_fds) == -1 ||
-	    socketpair(AF_LOCAL, SOCK_STREAM, 0, unbl_fds) == -1)
+	    socketpair(AF_LOCAL, SOCK_STREAM, 0, unbl_fds) == -1 ||
+	    ssp_cloexec(io_fds) == -1 || ssp_cloexec(err_fds) == -1 ||
+	    ssp_cloexec(unbl_fds) == -1)
 		goto abort;
-	pid = fork();
-	if (pid == 0) {
-		/* Child: */
-		char *const *it;
-		close(io_fds[parent_end]);
-		close(err_fds[parent_end]);
-		close(unbl_fds[1]);
-		close(unbl_fds[0]);
-		if (dup2(io_fds[child_end], STDIN_FILENO) == -1 ||
-		    dup2(io_fds[child_end], STDOUT_FILENO) == -1 ||
-		    dup2(err_fds[child_end], STDERR_FILENO) == -1)
-			err(EX_OSERR, "dup2");
-
-		if (opts->envp)
-			for (it = opts->envp; *it; ++it)
-				putenv(*it);
-
-		if (opts->binary[0] == '/' || opts->binary[0] == '.') {
-			/* Assume path is included */
-			execv(opts->binary, opts->argv);
-		} else {
-			execvp(opts->binary, opts->argv);
-		}
-		err(EX_OSERR, "cannot execute '%s'", opts->binary);
-		exit(EX_OSERR);
-
-	} else if (pid != -1) {
-		close(io_fds[child_end]);
-		close(err_fds[child_end]);
-		res->handle.send = &ssp_send;
-		res->handle.recv = &ssp_recv;
-		res->handle.cancel_recv = &ssp_cancel_recv;
-		res->handle.isalive = &ssp_isalive;
-		res->handle.close = &ssp_close;
-		res->handle.pid = pid;
-		res->fds[0].fd = io_fds[parent_end];
-		res->fds[0].events = POLLIN;
-		res->fds[1].fd = err_fds[parent_end];
-		res->fds[1].events = POLLIN;
-		res->fds[2].fd = unbl_fds[parent_end];
-		res->fds[2].events = POLLIN;
-		res->pid = pid;
-		res->io_fd = io_fds[parent_end];
-		res->err_fd = err_fds[parent_end];
-		res->cancelwr_fd = unbl_fds[child_end];
-		res->cancelrd_fd = unbl_fds[parent_end];
-		res->timeout_ms = opts->read_timeout_ms;
-		res->isalive = 1;
-		return &res->handle;
-
-	} else {
+	pid = ssp_launch(opts, io_fds[child_end], err_fds[child_end]);
+	if (pid == -1)
 		goto abort;
-	}
+	close(io_fds[child_end]);
+	close(err_fds[child_end]);
+	return ssp_init(res, io_fds[parent_end], err_fds[parent_end], unbl_fds,
+			pid, opts->read_timeout_ms);
 abort:
 	eno = errno;
 	if (unbl_fds[1] != -1)
@@ -215,6 +361,106 @@ ssp_spawn(struct SSP_Opts *opts)
 	return NULL;
 }
 
+/* Returns a socket connected as OPTS says, or -1 with errno set */
+static int
+ssp_connect_socket(struct SSP_Opts *opts)
+{
+	struct addrinfo hints, *ai, *it;
+	int fd = -1, res, eno, one = 1;
+
+	if (opts->socket_path) {
+		struct sockaddr_un sun;
+		if (strlen(opts->socket_path) >= sizeof(sun.sun_path)) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		strcpy(sun.sun_path, opts->socket_path);
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd == -1)
+			return -1;
+		do
+			res = connect(fd, (struct sockaddr *)&sun, sizeof(sun));
+		while (res == -1 && errno == EINTR);
+		if (res == -1)
+			goto fail;
+	} else {
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		res = getaddrinfo(opts->host, opts->service, &hints, &ai);
+		if (res != 0) {
+			errno = res == EAI_SYSTEM ? errno : EHOSTUNREACH;
+			return -1;
+		}
+		for (it = ai; it; it = it->ai_next) {
+			fd = socket(it->ai_family, it->ai_socktype,
+				    it->ai_protocol);
+			if (fd == -1)
+				continue;
+			do
+				res = connect(fd, it->ai_addr, it->ai_addrlen);
+			while (res == -1 && errno == EINTR);
+			if (res == 0)
+				break;
+			eno = errno;
+			close(fd);
+			fd = -1;
+			errno = eno;
+		}
+		freeaddrinfo(ai);
+		if (fd == -1)
+			return -1;
+		/* Messages are written whole; don't hold back their tails */
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	}
+	if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1)
+		goto fail;
+	return fd;
+fail:
+	eno = errno;
+	close(fd);
+	errno = eno;
+	return -1;
+}
+
+struct SSP_Handle *
+ssp_connect(struct SSP_Opts *opts)
+{
+	int unbl_fds[2] = { -1, -1 };
+	int fd, eno;
+	struct SSP_Posix *res;
+
+	assert(opts);
+	assert(opts->socket_path || (opts->host && opts->service));
+
+	res = (struct SSP_Posix *)calloc(1, sizeof(*res));
+	if (!res)
+		return NULL;
+	if (socketpair(AF_LOCAL, SOCK_STREAM, 0, unbl_fds) == -1 ||
+	    ssp_cloexec(unbl_fds) == -1) {
+		eno = errno;
+		if (unbl_fds[0] != -1) {
+			close(unbl_fds[0]);
+			close(unbl_fds[1]);
+		}
+		free(res);
+		errno = eno;
+		return NULL;
+	}
+	fd = ssp_connect_socket(opts);
+	if (fd == -1) {
+		eno = errno;
+		close(unbl_fds[0]);
+		close(unbl_fds[1]);
+		free(res);
+		errno = eno;
+		return NULL;
+	}
+	return ssp_init(res, fd, -1, unbl_fds, 0, opts->read_timeout_ms);
+}
+
 #else
 #error Platform is not supported
 #endif /* POSIX */
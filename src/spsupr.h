@@ -11,18 +11,38 @@
 	       void *stderr_buf, size_t *stderr_buf_sz);
   /* Interrupts pending recv() so that it will immediately exit with 0 */
   void (*cancel_recv) (struct SSP_Handle *ssph);
+  /* Makes pending and later send() fail at once */
+  void (*cancel_send) (struct SSP_Handle *ssph);
   /* Returns non-zero while sub-process exists */
   int (*isalive) (struct SSP_Handle *ssph);
   void (*close) (struct SSP_Handle *ssph);
   int pid;
+  /* For callers multiplexing several handles: the descriptors recv()
+   * reads from.  Read them with MSG_DONTWAIT instead of calling recv() */
+  int stdout_fd;
+  int stderr_fd;
 };
 
 struct SSP_Opts {
 	const char *binary;
 	char *const *argv; /* NULL-terminated */
-	char *const *envp; /* NULL-terminated */
+	/* NULL-terminated "NAME=VALUE" entries added to the inherited
+	 * environment; an entry without '=' removes NAME from it */
+	char *const *envp;
+	/* Working directory of the child, NULL to inherit ours */
+	const char *cwd;
+	/* Non-zero to put the child in a new process group */
+	int new_pgroup;
 	/* 0 for polling, -1 for wait forever */
 	int read_timeout_ms;
+	/* For ssp_connect(): either the Unix domain socket to connect to,
+	 * or the host and service (port) of a TCP server */
+	const char *socket_path;
+	const char *host;
+	const char *service;
 };
 
 struct SSP_Handle *ssp_spawn(struct SSP_Opts *opts);
+/* Like ssp_spawn(), but talks to an already running server.  The
+ * handle has no stderr and its pid is 0 */
+struct SSP_Handle *ssp_connect(struct SSP_Opts *opts);
@@ -18,6 +18,7 @@ Copyright (C) 2012-2022 Free Software Foundation, Inc.
 
 #include <config.h>
 #include <setjmp.h>
+#include <signal.h>
 #include <stdio.h>
 #include <string.h>
 #include "lisp.h"
@@ -542,3 +543,24 @@ sys_thread_yield (void)
 #error port me
 
 #endif
+
+#if defined HAVE_PTHREAD && !defined WINDOWSNT
+
+/* Start a joinable native thread running FUNC (ARG), which never runs
+   Lisp, and store its id in *THREAD.  All signals are blocked in it,
+   so that they are left to the Lisp threads.  Return true on
+   success.  */
+
+bool
+sys_native_thread_create (pthread_t *thread, thread_creation_function *func,
+			  void *arg)
+{
+  sigset_t blocked, oldset;
+  sigfillset (&blocked);
+  pthread_sigmask (SIG_BLOCK, &blocked, &oldset);
+  int err = pthread_create (thread, NULL, func, arg);
+  pthread_sigmask (SIG_SETMASK, &oldset, NULL);
+  return err == 0;
+}
+
+#endif
@@ -110,4 +110,11 @@ #define SYSTHREAD_H
 extern void sys_thread_yield (void);
 extern void sys_thread_set_name (const char *);
 
+#if defined HAVE_PTHREAD && !defined WINDOWSNT
+# include <pthread.h>
+NODISCARD extern bool sys_native_thread_create (pthread_t *,
+						thread_creation_function *,
+						void *);
+#endif
+
 #endif /* SYSTHREAD_H */
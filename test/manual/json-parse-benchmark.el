@@ -0,0 +1,68 @@
+;;; json-parse-benchmark.el --- measure JSON parsing -*- lexical-binding: t -*-
+
+;; Copyright (C) 2022 Free Software Foundation, Inc.
+
+;; This file is part of GNU Emacs.
+
+;; GNU Emacs is free software: you can redistribute it and/or modify
+;; it under the terms of the GNU General Public License as published by
+;; the Free Software Foundation, either version 3 of the License, or
+;; (at your option) any later version.
+
+;; GNU Emacs is distributed in the hope that it will be useful,
+;; but WITHOUT ANY WARRANTY; without even the implied warranty of
+;; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+;; GNU General Public License for more details.
+
+;; You should have received a copy of the GNU General Public License
+;; along with GNU Emacs.  If not, see <https://www.gnu.org/licenses/>.
+
+;;; Commentary:
+
+;; This is not a test, but a benchmark of `json-parse-string' on
+;; payloads shaped like large responses of language servers.  Run it
+;; with
+;;
+;;    emacs -batch -l json-parse-benchmark.el -f json-parse-benchmark
+
+;;; Code:
+
+(require 'benchmark)
+
+(defun json-parse-benchmark (&optional repetitions)
+  "Print the throughput of `json-parse-string' in MB/s.
+The payloads are shaped like large responses of language servers.
+Each is parsed REPETITIONS times, 10 by default."
+  (let* ((repetitions (or repetitions 10))
+         (gc-cons-threshold (max gc-cons-threshold 100000000))
+         (tokens (vconcat (number-sequence 0 999999)))
+         (diagnostic
+          (list :range (list :start (list :line 10 :character 4)
+                             :end (list :line 10 :character 20))
+                :severity 1 :source "compiler"
+                :message (concat (make-string 200 ?x) " «é» "
+                                 (make-string 200 ?y))))
+         (payloads
+          (list (cons "semanticTokens"
+                      (json-serialize (list :result (list :data tokens))))
+                (cons "publishDiagnostics"
+                      (json-serialize
+                       (list :params
+                             (list :uri "file:///tmp/x.c"
+                                   :diagnostics
+                                   (make-vector 20000 diagnostic)))))
+                (cons "long strings"
+                      (json-serialize
+                       (make-vector 100 (make-string 100000 ?z)))))))
+    (dolist (payload payloads)
+      (dolist (object-type '(hash-table plist))
+        (garbage-collect)
+        (let ((time (car (benchmark-run repetitions
+                           (json-parse-string (cdr payload)
+                                              :object-type object-type)))))
+          (message "%s (%s): %.0f MB/s"
+                   (car payload) object-type
+                   (/ (* repetitions (string-bytes (cdr payload)))
+                      time 1e6)))))))
+
+;;; json-parse-benchmark.el ends here
@@ -0,0 +1,262 @@
+;;; json-rpc-benchmarks.el --- benchmarks for json-rpc connections  -*- lexical-binding: t -*-
+
+;; Copyright (C) 2022 Free Software Foundation, Inc.
+
+;; This file is part of GNU Emacs.
+
+;; GNU Emacs is free software: you can redistribute it and/or modify
+;; it under the terms of the GNU General Public License as published by
+;; the Free Software Foundation, either version 3 of the License, or
+;; (at your option) any later version.
+
+;; GNU Emacs is distributed in the hope that it will be useful,
+;; but WITHOUT ANY WARRANTY; without even the implied warranty of
+;; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+;; GNU General Public License for more details.
+
+;; You should have received a copy of the GNU General Public License
+;; along with GNU Emacs.  If not, see <https://www.gnu.org/licenses/>.
+
+;;; Commentary:
+
+;; These benchmarks run `json-rpc-connection' against replay-server,
+;; which stands in for a language server by replaying traces, and
+;; measure the throughput, the latency of each message from when the
+;; server writes it to when the callback gets it, and how long the
+;; main thread is kept from running meanwhile.  See README for how to
+;; run them.
+
+;;; Code:
+
+(require 'cl-lib)
+
+(defconst json-rpc-bench-directory
+  (file-name-directory (or load-file-name buffer-file-name)))
+
+(defvar json-rpc-bench-server
+  (expand-file-name "replay-server" json-rpc-bench-directory)
+  "The replay server program.")
+
+(defvar json-rpc-bench-tick 0.005
+  "Seconds the main thread sleeps between checks for stalls.")
+
+(defun json-rpc-bench-write-trace (file records)
+  "Write RECORDS to FILE as a trace for the replay server.
+Each record is either a message from the server, as a Lisp object to
+serialize, or the symbol `client', which stands for a message from
+the client.  The timestamps are all zero."
+  (with-temp-buffer
+    (set-buffer-multibyte nil)
+    (dolist (record records)
+      (let ((body (if (eq record 'client) ""
+                    (encode-coding-string (json-serialize record) 'utf-8))))
+        (insert (format "%s 0 %d\n" (if (eq record 'client) "C" "S")
+                        (length body))
+                body "\n")))
+    (let ((coding-system-for-write 'binary))
+      (write-region nil nil file nil 'silent))))
+
+(defun json-rpc-bench-notification (method params)
+  "Return a notification of METHOD with PARAMS, stamped by the server."
+  `(:jsonrpc "2.0" :method ,method :sent "@SENT@" :params ,params))
+
+(defun json-rpc-bench-diagnostic (i)
+  `(:range (:start (:line ,i :character 4) :end (:line ,i :character 12))
+    :severity 2 :source "bench" :code ,(format "W%04d" i)
+    :message ,(format "Unused variable `v%d' in function body" i)))
+
+(defun json-rpc-bench-completion-item (i)
+  `(:label ,(format "candidate-%d" i) :kind 3 :sortText ,(format "%06d" i)
+    :detail "(int count, const char *name) -> bool"
+    :textEdit (:range (:start (:line 10 :character 2)
+                       :end (:line 10 :character 6))
+               :newText ,(format "candidate-%d" i))))
+
+(defvar json-rpc-bench-workloads
+  `((small
+     . ,(lambda ()
+          (cl-loop for i below 20000
+                   collect (json-rpc-bench-notification
+                            "$/progress"
+                            `(:token 1 :value (:kind "report"
+                                               :percentage ,(% i 100)))))))
+    (diagnostics
+     . ,(lambda ()
+          (cl-loop for i below 500
+                   collect (json-rpc-bench-notification
+                            "textDocument/publishDiagnostics"
+                            `(:uri ,(format "file:///src/file%d.c" i)
+                              :diagnostics
+                              ,(vconcat (mapcar #'json-rpc-bench-diagnostic
+                                                (number-sequence 0 49))))))))
+    (completion
+     . ,(lambda ()
+          (cl-loop for i below 50
+                   collect (json-rpc-bench-notification
+                            "$/completion"
+                            `(:isIncomplete :false
+                              :items
+                              ,(vconcat
+                                (mapcar #'json-rpc-bench-completion-item
+                                        (number-sequence 0 1999))))))))
+    (ping-pong
+     . ,(lambda ()
+          (cdr (cl-loop for i below 2000
+                        append (list 'client
+                                     (json-rpc-bench-notification
+                                      "$/ping" `(:n ,i))))))))
+  "Alist of workloads.
+Each value is either a function returning the records of a trace, as
+passed to `json-rpc-bench-write-trace', or the name of a trace file,
+such as one recorded by the replay server.  The client answers each
+message of the `ping-pong' workload; for the others, the server does
+not wait for the messages from the client that the trace has.")
+
+(defvar json-rpc-bench-configurations
+  '((blocking thread)
+    (reader thread :reader-thread t)
+    (writer thread :reader-thread t :writer-thread t)
+    (lazy thread :reader-thread t :lazy t)
+    (shared thread :reader-thread shared)
+    (dispatch dispatch :reader-thread t))
+  "Alist of ways to run connections.
+Each element is (NAME MODE . ARGS).  ARGS are passed to
+`json-rpc-connection'.  If MODE is `thread', `json-rpc' runs in a
+thread of its own; if it is `dispatch', the messages are dispatched
+by `json-rpc-set-callback' while the main thread waits for input.")
+
+(defvar json-rpc-bench--traces nil
+  "Alist of the trace files already written for each workload.")
+
+(defun json-rpc-bench-trace (workload)
+  "Return the name of a trace file for WORKLOAD."
+  (or (cdr (assq workload json-rpc-bench--traces))
+      (let ((source (cdr (assq workload json-rpc-bench-workloads))))
+        (and (stringp source) source))
+      (let ((file (make-temp-file (format "json-rpc-%s-" workload)
+                                  nil ".trace")))
+        (json-rpc-bench-write-trace
+         file (funcall (cdr (assq workload json-rpc-bench-workloads))))
+        (push (cons workload file) json-rpc-bench--traces)
+        file)))
+
+(defun json-rpc-bench-percentiles (values)
+  "Return the median, 90th and 99th percentiles and maximum of VALUES."
+  (if (null values)
+      (list 0 0 0 0)
+    (let* ((sorted (vconcat (sort values #'<)))
+           (n (length sorted)))
+      (mapcar (lambda (p) (aref sorted (floor (* p (1- n)))))
+              '(0.5 0.9 0.99 1.0)))))
+
+(cl-defun json-rpc-bench-run (workload configuration &key rate)
+  "Run WORKLOAD with CONFIGURATION and return the results as a plist.
+WORKLOAD is a key of `json-rpc-bench-workloads' and CONFIGURATION one
+of `json-rpc-bench-configurations'.  If RATE is non-nil, the server
+writes that many messages per second instead of as fast as it can.
+
+The results have the properties `:messages', `:seconds', `:latency'
+and `:stall', the latter two being lists of percentiles as returned
+by `json-rpc-bench-percentiles', in seconds, `:gcs' and `:gc-seconds'
+for garbage collection, and `:stats', as returned by `json-rpc-stats'."
+  (let* ((trace (json-rpc-bench-trace workload))
+         (answer (eq workload 'ping-pong))
+         (mode (cadr configuration))
+         (connection (apply #'json-rpc-connection json-rpc-bench-server
+                            `(,@(and (not answer) '("-i"))
+                              ,@(and rate
+                                     (list "-r" (number-to-string rate)))
+                              ,trace :stats t ,@(cddr configuration))))
+         (messages 0)
+         (latencies nil)
+         (stalls nil)
+         (done nil)
+         (callback
+          (lambda (message _error finished)
+            (if finished
+                (setq done t)
+              ;; Only the messages the server stamped have a latency.
+              (let ((sent (if (json-rpc-message-p message)
+                              (json-rpc-get message "sent")
+                            (gethash "sent" message))))
+                (when (numberp sent)
+                  (push (- (float-time) (/ sent 1e6)) latencies)))
+              (setq messages (1+ messages))
+              (when answer
+                (json-rpc-send connection '(:jsonrpc "2.0"
+                                            :method "$/pong"))))))
+         (gcs gcs-done)
+         (gc-start gc-elapsed)
+         (start (float-time)))
+    (if (eq mode 'dispatch)
+        (json-rpc-set-callback connection callback)
+      (make-thread (lambda () (json-rpc connection callback))
+               "json-rpc-bench"))
+    ;; The main thread only measures how late it gets to run.
+    (while (not done)
+      (let ((before (float-time)))
+        (if (eq mode 'dispatch)
+            (accept-process-output nil json-rpc-bench-tick)
+          (sleep-for json-rpc-bench-tick))
+        (push (max 0 (- (float-time) before json-rpc-bench-tick)) stalls)))
+    (list :messages messages
+          :seconds (- (float-time) start)
+          :latency (json-rpc-bench-percentiles latencies)
+          :stall (json-rpc-bench-percentiles stalls)
+          :gcs (- gcs-done gcs)
+          :gc-seconds (- gc-elapsed gc-start)
+          :stats (json-rpc-stats connection))))
+
+(defun json-rpc-bench-report (workload name results)
+  "Print a line of RESULTS of WORKLOAD with the configuration NAME."
+  (let ((ms (lambda (seconds) (* 1000 seconds)))
+        (seconds (plist-get results :seconds)))
+    (princ
+     (apply #'format
+            (concat "%-12s %-9s %9.0f %7.1f"
+                    " %7.2f %7.2f %7.2f %8.2f"
+                    " %7.2f %8.2f %4d\n")
+            workload name
+            (/ (plist-get results :messages) seconds)
+            (/ (plist-get (plist-get results :stats) :bytes-in)
+               seconds 1048576.0)
+            (append (mapcar ms (plist-get results :latency))
+                    (mapcar ms (cddr (plist-get results :stall)))
+                    (list (plist-get results :gcs)))))))
+
+(defun json-rpc-bench-batch ()
+  "Run the benchmarks and print the results.
+Use this only with -batch.  The remaining command-line arguments can
+name the workloads and configurations to run, which default to all
+of them, and `rate=N' makes the server write N messages per second."
+  (let ((workloads nil) (configurations nil) (rate nil))
+    (dolist (arg command-line-args-left)
+      (cond
+       ((string-prefix-p "rate=" arg)
+        (setq rate (string-to-number (substring arg 5))))
+       ((assq (intern arg) json-rpc-bench-workloads)
+        (push (intern arg) workloads))
+       ((assq (intern arg) json-rpc-bench-configurations)
+        (push (assq (intern arg) json-rpc-bench-configurations)
+              configurations))
+       (t (error "Unknown workload or configuration: %s" arg))))
+    (setq command-line-args-left nil)
+    (setq workloads (or (nreverse workloads)
+                        (mapcar #'car json-rpc-bench-workloads)))
+    (setq configurations (or (nreverse configurations)
+                             json-rpc-bench-configurations))
+    (princ (format "%-12s %-9s %9s %7s %7s %7s %7s %8s %7s %8s %4s\n"
+                   "workload" "config" "msgs/s" "MiB/s"
+                   "p50 ms" "p90 ms" "p99 ms" "max ms"
+                   "stall99" "stallmax" "gcs"))
+    (unwind-protect
+        (dolist (workload workloads)
+          (dolist (configuration configurations)
+            (garbage-collect)
+            (json-rpc-bench-report
+             workload (car configuration)
+             (json-rpc-bench-run workload configuration :rate rate))))
+      (dolist (trace json-rpc-bench--traces)
+        (delete-file (cdr trace))))))
+
+;;; json-rpc-benchmarks.el ends here
@@ -0,0 +1,446 @@
+/* Stand-in json-rpc server replaying captured traffic.
+
+Copyright (C) 2022 Free Software Foundation, Inc.
+
+This file is part of GNU Emacs.
+
+GNU Emacs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or (at
+your option) any later version.
+
+GNU Emacs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with GNU Emacs.  If not, see <https://www.gnu.org/licenses/>.  */
+
+/* Usage:
+
+     replay-server [-i] [-r RATE] [-s SPEED] [-n COUNT] TRACE
+     replay-server -w TRACE PROGRAM [ARG]...
+
+   The first form replays TRACE, writing the messages it sent as the
+   server to stdout with LSP framing, and reading one framed message
+   from stdin wherever the trace has one from the client.  By default
+   messages are written as fast as possible.  With -r, the server's
+   messages are written at RATE messages per second on a fixed
+   schedule, whether or not the client keeps up.  With -s, the delays
+   recorded in the trace are kept, divided by SPEED; a delay that
+   follows a message from the client counts from when it was read.
+   With -n, the trace is replayed COUNT times.  With -i, the messages
+   from the client in the trace are ignored instead of waited for.
+   The server exits at the end of the trace, or when stdin is closed
+   while it waits for the client.
+
+   In the server's messages, each "@SENT@" (with the quotes) is
+   replaced by the time at which the message is written, as a number
+   of microseconds since the epoch, so that clients can measure
+   latencies.  Nothing else is rewritten: in particular, replayed
+   responses keep their recorded ids.
+
+   The second form runs PROGRAM with ARGS as a real server, passing
+   everything through, and records the messages exchanged in TRACE.
+
+   A trace is a sequence of records, each made of a line "DIR TIME
+   LENGTH", where DIR is S for a message from the server and C for
+   one from the client, TIME is a number of microseconds since the
+   start of the recording and LENGTH the number of bytes of the
+   message, followed by the message itself and a newline.  */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static char const *program_name;
+
+static void
+fatal (char const *message, char const *arg)
+{
+  fprintf (stderr, "%s: %s%s%s\n", program_name, message,
+	   arg ? ": " : "", arg ? arg : "");
+  exit (EXIT_FAILURE);
+}
+
+static void *
+xrealloc (void *p, size_t size)
+{
+  p = realloc (p, size);
+  if (!p)
+    fatal ("memory exhausted", NULL);
+  return p;
+}
+
+static uint64_t
+now_us (clockid_t clock)
+{
+  struct timespec ts;
+  clock_gettime (clock, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+sleep_until (uint64_t when)
+{
+  uint64_t now = now_us (CLOCK_MONOTONIC);
+  if (when > now)
+    {
+      struct timespec ts = { .tv_sec = (when - now) / 1000000,
+			     .tv_nsec = (when - now) % 1000000 * 1000 };
+      while (nanosleep (&ts, &ts) != 0 && errno == EINTR)
+	continue;
+    }
+}
+
+static void
+write_all (int fd, char const *data, size_t size)
+{
+  while (size > 0)
+    {
+      ssize_t n = write (fd, data, size);
+      if (n < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  /* The client went away.  */
+	  exit (EXIT_SUCCESS);
+	}
+      data += n;
+      size -= n;
+    }
+}
+
+static void
+write_frame (int fd, char const *body, size_t length)
+{
+  char header[64];
+  int n = sprintf (header, "Content-Length: %zu\r\n\r\n", length);
+  write_all (fd, header, n);
+  write_all (fd, body, length);
+}
+
+/* Bytes read from a stream, split into framed messages.  */
+
+struct framer
+{
+  char *data;
+  size_t size, start, end;
+};
+
+/* Append the N bytes at DATA to F.  */
+
+static void
+framer_append (struct framer *f, char const *data, size_t n)
+{
+  if (f->start == f->end)
+    f->start = f->end = 0;
+  if (f->size - f->end < n)
+    {
+      memmove (f->data, f->data + f->start, f->end - f->start);
+      f->end -= f->start;
+      f->start = 0;
+      while (f->size - f->end < n)
+	f->size = f->size ? 2 * f->size : 65536;
+      f->data = xrealloc (f->data, f->size);
+    }
+  memcpy (f->data + f->end, data, n);
+  f->end += n;
+}
+
+/* Read from FD into BUFFER of SIZE bytes.  Return the number of bytes
+   read, or 0 at end of file.  */
+
+static size_t
+read_some (int fd, char *buffer, size_t size)
+{
+  ssize_t n;
+  while ((n = read (fd, buffer, size)) < 0 && errno == EINTR)
+    continue;
+  return n < 0 ? 0 : n;
+}
+
+/* Store in *BODY and *LENGTH the next complete message in F and
+   return true, or return false if there is none yet.  */
+
+static bool
+framer_next (struct framer *f, char **body, size_t *length)
+{
+  char *start = f->data + f->start;
+  size_t available = f->end - f->start;
+  char *end = memmem (start, available, "\r\n\r\n", 4);
+  if (!end)
+    return false;
+  size_t content_length = 0;
+  for (char *line = start; line < end; )
+    {
+      char *eol = memmem (line, end + 2 - line, "\r\n", 2);
+      if (eol - line > 15 && strncasecmp (line, "Content-Length:", 15) == 0)
+	content_length = strtoul (line + 15, NULL, 10);
+      line = eol + 2;
+    }
+  size_t header_length = end + 4 - start;
+  if (available - header_length < content_length)
+    return false;
+  *body = end + 4;
+  *length = content_length;
+  f->start += header_length + content_length;
+  return true;
+}
+
+struct record
+{
+  char direction;
+  uint64_t time;
+  char *body;
+  size_t length;
+};
+
+static struct record *
+read_trace (char const *file, size_t *count)
+{
+  FILE *stream = fopen (file, "r");
+  if (!stream)
+    fatal (strerror (errno), file);
+  struct record *records = NULL;
+  size_t n = 0, allocated = 0;
+  char direction;
+  unsigned long long time;
+  size_t length;
+  int scanned;
+  while ((scanned = fscanf (stream, " %c %llu %zu", &direction, &time,
+			    &length)) == 3)
+    {
+      if ((direction != 'S' && direction != 'C') || getc (stream) != '\n')
+	fatal ("malformed trace", file);
+      if (n == allocated)
+	{
+	  allocated = allocated ? 2 * allocated : 1024;
+	  records = xrealloc (records, allocated * sizeof *records);
+	}
+      char *body = xrealloc (NULL, length + 1);
+      if (fread (body, 1, length, stream) != length)
+	fatal ("truncated trace", file);
+      body[length] = '\0';
+      records[n++] = (struct record) { direction, time, body, length };
+    }
+  if (scanned != EOF)
+    fatal ("malformed trace", file);
+  fclose (stream);
+  *count = n;
+  return records;
+}
+
+/* Write BODY of LENGTH bytes with each "@SENT@" replaced by the
+   current time.  */
+
+static void
+send_stamped (char const *body, size_t length)
+{
+  static char const stamp[] = "\"@SENT@\"";
+  if (!memmem (body, length, stamp, sizeof stamp - 1))
+    {
+      write_frame (STDOUT_FILENO, body, length);
+      return;
+    }
+  static char *buffer;
+  static size_t buffer_size;
+  if (buffer_size < 3 * length + 32)
+    {
+      buffer_size = 3 * length + 32;
+      buffer = xrealloc (buffer, buffer_size);
+    }
+  char time[32];
+  int time_length = sprintf (time, "%llu",
+			     (unsigned long long) now_us (CLOCK_REALTIME));
+  size_t out = 0;
+  for (char const *p = body, *end = body + length; p < end; )
+    {
+      char const *next = memmem (p, end - p, stamp, sizeof stamp - 1);
+      size_t n = (next ? next : end) - p;
+      memcpy (buffer + out, p, n);
+      out += n;
+      if (!next)
+	break;
+      memcpy (buffer + out, time, time_length);
+      out += time_length;
+      p = next + sizeof stamp - 1;
+    }
+  write_frame (STDOUT_FILENO, buffer, out);
+}
+
+static int
+replay (char const *file, bool ignore_client, double rate, double speed,
+	long repeat)
+{
+  size_t count;
+  struct record *records = read_trace (file, &count);
+  struct framer input = { NULL, 0, 0, 0 };
+  static char buffer[65536];
+  uint64_t start = now_us (CLOCK_MONOTONIC);
+  uint64_t sent = 0;
+
+  for (long i = 0; i < repeat; i++)
+    {
+      /* The point in time of the trace corresponding to ANCHOR.  */
+      uint64_t anchor = now_us (CLOCK_MONOTONIC);
+      uint64_t anchor_time = count > 0 ? records[0].time : 0;
+      for (size_t j = 0; j < count; j++)
+	{
+	  struct record *r = &records[j];
+	  if (r->direction == 'C' && ignore_client)
+	    continue;
+	  if (r->direction == 'C')
+	    {
+	      char *body;
+	      size_t length;
+	      while (!framer_next (&input, &body, &length))
+		{
+		  size_t n = read_some (STDIN_FILENO, buffer, sizeof buffer);
+		  if (n == 0)
+		    return EXIT_SUCCESS;
+		  framer_append (&input, buffer, n);
+		}
+	      anchor = now_us (CLOCK_MONOTONIC);
+	      anchor_time = r->time;
+	      continue;
+	    }
+	  if (rate > 0)
+	    sleep_until (start + sent * 1e6 / rate);
+	  else if (speed > 0 && r->time > anchor_time)
+	    sleep_until (anchor + (r->time - anchor_time) / speed);
+	  send_stamped (r->body, r->length);
+	  sent++;
+	}
+    }
+  return EXIT_SUCCESS;
+}
+
+static void
+append_record (FILE *trace, char direction, uint64_t start,
+	       char const *body, size_t length)
+{
+  fprintf (trace, "%c %llu %zu\n", direction,
+	   (unsigned long long) (now_us (CLOCK_MONOTONIC) - start), length);
+  fwrite (body, 1, length, trace);
+  putc ('\n', trace);
+}
+
+static int
+record (char const *file, char **argv)
+{
+  FILE *trace = fopen (file, "w");
+  if (!trace)
+    fatal (strerror (errno), file);
+  int to_server[2], from_server[2];
+  if (pipe (to_server) != 0 || pipe (from_server) != 0)
+    fatal (strerror (errno), "pipe");
+  pid_t pid = fork ();
+  if (pid < 0)
+    fatal (strerror (errno), "fork");
+  if (pid == 0)
+    {
+      dup2 (to_server[0], STDIN_FILENO);
+      dup2 (from_server[1], STDOUT_FILENO);
+      close (to_server[0]);
+      close (to_server[1]);
+      close (from_server[0]);
+      close (from_server[1]);
+      execvp (argv[0], argv);
+      fatal (strerror (errno), argv[0]);
+    }
+  close (to_server[0]);
+  close (from_server[1]);
+
+  uint64_t start = now_us (CLOCK_MONOTONIC);
+  struct framer framers[2] = { { NULL, 0, 0, 0 }, { NULL, 0, 0, 0 } };
+  struct pollfd fds[2] = { { STDIN_FILENO, POLLIN, 0 },
+			   { from_server[0], POLLIN, 0 } };
+  static char buffer[65536];
+  while (fds[1].fd >= 0)
+    {
+      if (poll (fds, 2, -1) < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  fatal (strerror (errno), "poll");
+	}
+      for (int i = 0; i < 2; i++)
+	if (fds[i].fd >= 0 && fds[i].revents != 0)
+	  {
+	    size_t n = read_some (fds[i].fd, buffer, sizeof buffer);
+	    if (n == 0)
+	      {
+		/* Let the server see the client's end of file.  */
+		if (i == 0)
+		  close (to_server[1]);
+		fds[i].fd = -1;
+		continue;
+	      }
+	    write_all (i == 0 ? to_server[1] : STDOUT_FILENO, buffer, n);
+	    framer_append (&framers[i], buffer, n);
+	    char *body;
+	    size_t length;
+	    while (framer_next (&framers[i], &body, &length))
+	      append_record (trace, i == 0 ? 'C' : 'S', start, body, length);
+	  }
+    }
+  fclose (trace);
+  int status;
+  waitpid (pid, &status, 0);
+  return WIFEXITED (status) ? WEXITSTATUS (status) : EXIT_FAILURE;
+}
+
+int
+main (int argc, char **argv)
+{
+  program_name = argv[0];
+  signal (SIGPIPE, SIG_IGN);
+  double rate = 0, speed = 0;
+  long repeat = 1;
+  bool ignore_client = false;
+  char const *record_file = NULL;
+  int c;
+  while ((c = getopt (argc, argv, "+ir:s:n:w:")) != -1)
+    switch (c)
+      {
+      case 'i':
+	ignore_client = true;
+	break;
+      case 'r':
+	rate = strtod (optarg, NULL);
+	break;
+      case 's':
+	speed = strtod (optarg, NULL);
+	break;
+      case 'n':
+	repeat = strtol (optarg, NULL, 10);
+	break;
+      case 'w':
+	record_file = optarg;
+	break;
+      default:
+	return EXIT_FAILURE;
+      }
+  if (record_file)
+    {
+      if (optind == argc)
+	fatal ("no server to record", NULL);
+      return record (record_file, argv + optind);
+    }
+  if (optind + 1 != argc)
+    fatal ("usage: replay-server [-i] [-r RATE] [-s SPEED] [-n COUNT] TRACE",
+	   NULL);
+  return replay (argv[optind], ignore_client, rate, speed, repeat);
+}
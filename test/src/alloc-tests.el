@@ -59,4 +59,189 @@ aset-nbytes-change
       (aset s 0 c)
       (should (equal s (make-string 1 c))))))
 
+;; Marking used to recurse on the C stack for each level of nesting.
+(ert-deftest garbage-collect-deep-nesting ()
+  (let ((x nil))
+    (dotimes (i 1000000)
+      (setq x (if (zerop (% i 2)) (vector x) (list x (make-symbol "s")))))
+    (garbage-collect)
+    (dotimes (_ 1000000)
+      (setq x (if (vectorp x) (aref x 0) (car x))))
+    (should-not x)))
+
+;; Cons and float blocks are swept lazily, after the collection that
+;; marked them, and the counts `garbage-collect' returns come from
+;; their mark bits.
+(ert-deftest garbage-collect-lazy-sweep ()
+  (let ((used (lambda (type stats) (nth 2 (assq type stats))))
+        (live nil)
+        before after)
+    (garbage-collect)
+    (setq before (garbage-collect))
+    (dotimes (i 100000)
+      (push (float i) live))
+    ;; Allocating garbage takes conses from unswept blocks.
+    (dotimes (_ 300000)
+      (cons nil nil))
+    ;; Leaving `save-restriction' frees a cons that the collection in
+    ;; its body marked, most likely before its block is swept.
+    (with-temp-buffer
+      (insert "abc")
+      (narrow-to-region 1 3)
+      (dotimes (_ 20)
+        (save-restriction
+          (narrow-to-region 2 3)
+          (garbage-collect))
+        (dotimes (_ 10000)
+          (cons nil nil))))
+    (setq after (garbage-collect))
+    (dolist (type '(conses floats))
+      (let ((delta (- (funcall used type after) (funcall used type before))))
+        (should (<= 100000 delta (+ 100000 2000)))))
+    (should (= (length live) 100000))
+    (should (cl-loop for x in live for i downfrom 99999
+                     always (= x i)))
+    (setq live nil)
+    (dotimes (_ 300000)
+      (cons nil nil))
+    (setq after (garbage-collect))
+    (dolist (type '(conses floats))
+      (should (< (abs (- (funcall used type after) (funcall used type before)))
+                 2000)))))
+
+;; Objects set aside for the marking threads must all survive.
+(ert-deftest garbage-collect-parallel-mark ()
+  (let* ((gc-mark-threads 4)
+         (make (lambda (make depth)
+                 (if (zerop depth)
+                     (list 1.5 (string ?a depth) (make-symbol "s"))
+                   (let ((table (make-hash-table :test #'equal)))
+                     (puthash "k" (funcall make make (1- depth)) table)
+                     (vector (funcall make make (1- depth))
+                             (record 'r (funcall make make (1- depth)))
+                             table)))))
+         (data (funcall make make 8))
+         (copy (copy-tree data t)))
+    (dotimes (i 5)
+      (make-list 100000 i)
+      (garbage-collect))
+    (should (equal (prin1-to-string data) (prin1-to-string copy)))))
+
+;; Minor collections must keep the young objects that old ones refer to.
+(ert-deftest garbage-collect-minor ()
+  (skip-unless (boundp 'gc-minor-collections))
+  (let* ((gc-cons-threshold 100000)
+         (gc-minor-collections 8)
+         (list (make-list 1000 nil))
+         (vector (make-vector 1000 nil))
+         (symbol (make-symbol "s"))
+         (gcs gcs-done))
+    ;; Make them old.
+    (garbage-collect)
+    (dotimes (i 1000)
+      (setcar (nthcdr i list) (list i (float i)))
+      (aset vector i (cons i (float i)))
+      (put symbol i (list (number-to-string i))))
+    (while (< gcs-done (+ gcs 6))
+      (make-list 1000 nil))
+    (dotimes (i 1000)
+      (should (equal (nth i list) (list i (float i))))
+      (should (equal (aref vector i) (cons i (float i))))
+      (should (equal (get symbol i) (list (number-to-string i)))))))
+
+;; Objects that Lisp code moves around between the slices of an
+;; incremental collection must survive it.
+(ert-deftest garbage-collect-incremental ()
+  (skip-unless (boundp 'gc-incremental-slice))
+  (let* ((gc-cons-threshold 200000)
+         (gc-incremental-slice 0.0001)
+         (make (lambda (n)
+                 (list n (float n) (propertize (number-to-string n) 'n n)
+                       (vector (make-symbol (number-to-string n))))))
+         (valid (lambda (x)
+                  (or (null x)
+                      (let ((n (car x)))
+                        (and (eql (nth 1 x) (float n))
+                             (equal (nth 2 x) (number-to-string n))
+                             (eq (get-text-property 0 'n (nth 2 x)) n)
+                             (equal (symbol-name (aref (nth 3 x) 0))
+                                    (number-to-string n)))))))
+         (list (make-list 100 nil))
+         (vector (make-vector 100 nil))
+         (table (make-hash-table))
+         (weak (make-hash-table :weakness 'key))
+         (symbol (make-symbol "s"))
+         (gcs gcs-done))
+    (garbage-collect)
+    (while (< gcs-done (+ gcs 20))
+      (dotimes (_ 100)
+        (let ((i (random 100))
+              (j (random 100)))
+          ;; Move objects from where marking may not have looked yet
+          ;; to where it may have, and make new ones.
+          (setcar (nthcdr i list) (aref vector j))
+          (aset vector j (gethash i table))
+          (puthash i (get symbol j) table)
+          (put symbol j (funcall make (+ i j)))
+          (puthash (funcall make i) t weak)))
+      (when (zerop (random 50))
+        (garbage-collect))
+      (make-list 500 nil))
+    (dotimes (i 100)
+      (should (funcall valid (nth i list)))
+      (should (funcall valid (aref vector i)))
+      (should (funcall valid (gethash i table)))
+      (should (funcall valid (get symbol i))))
+    (garbage-collect)
+    (should (< (hash-table-count weak) 100))))
+
+;; Going idle after a command that consed enough collects garbage, but
+;; only if `gc-idle-fraction' asks for it.
+(ert-deftest garbage-collect-idle ()
+  (skip-unless (and (not (memq system-type '(windows-nt ms-dos)))
+                    (executable-find "sh")))
+  (dolist (fraction '(nil 0.5))
+    (let* ((file (make-temp-file "alloc-tests"))
+           (form
+            `(progn
+               (defvar alloc-tests--gcs nil)
+               (setq gc-idle-fraction ,fraction)
+               (add-hook
+                'post-command-hook
+                (lambda ()
+                  (unless alloc-tests--gcs
+                    (setq gc-cons-threshold 20000000)
+                    (garbage-collect)
+                    (setq alloc-tests--gcs gcs-done)
+                    ;; More than half of the threshold, but not all.
+                    (make-list 800000 nil)
+                    (run-with-idle-timer
+                     0.5 nil
+                     (lambda ()
+                       (write-region (number-to-string
+                                      (- gcs-done alloc-tests--gcs))
+                                     nil ,file)
+                       (kill-emacs))))))))
+           (process-environment (cons "TERM=xterm" process-environment))
+           (process
+            (make-process
+             :name "alloc-tests" :connection-type 'pty :noquery t
+             :command
+             (list "sh" "-c" "stty rows 24 cols 80; exec \"$@\"" "sh"
+                   (expand-file-name invocation-name invocation-directory)
+                   "-Q" "-nw" "--eval" (prin1-to-string form)))))
+      (unwind-protect
+          (progn
+            (sleep-for 1)
+            (process-send-string process "x")
+            (with-timeout (30 (ert-fail "Emacs did not exit"))
+              (while (process-live-p process)
+                (accept-process-output process 0.1)))
+            (should (equal (with-temp-buffer
+                             (insert-file-contents file)
+                             (buffer-string))
+                           (if fraction "1" "0"))))
+        (delete-process process)
+        (delete-file file)))))
+
 ;;; alloc-tests.el ends here
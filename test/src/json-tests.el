@@ -30,6 +30,10 @@
 (declare-function json-insert "json.c" (object &rest args))
 (declare-function json-parse-string "json.c" (string &rest args))
 (declare-function json-parse-buffer "json.c" (&rest args))
+(declare-function json-rpc-connection "json.c" (&rest args))
+(declare-function json-rpc "json.c" (connection callback &rest args))
+(declare-function json-rpc-send "json.c" (connection message &rest args))
+(declare-function json-rpc-send-queue-depth "json.c" (connection))
 
 (define-error 'json-tests--error "JSON test error")
 
@@ -146,6 +150,58 @@ json-parse-string/object
     (should (equal (json-parse-string input :object-type 'plist)
                    '(:abc [9 :false] :def :null)))))
 
+;; Objects with many keys find duplicates differently from small ones.
+(ert-deftest json-parse-string/object-many-keys ()
+  (skip-unless (fboundp 'json-parse-string))
+  (let ((input (concat "{"
+                       (mapconcat (lambda (i) (format "\"k%d\":%d" i i))
+                                  (number-sequence 0 39) ",")
+                       ",\"k3\":\"last\"}")))
+    (let ((alist (json-parse-string input :object-type 'alist)))
+      (should (equal (length alist) 40))
+      (should (equal (nth 3 alist) '(k3 . "last")))
+      (should (equal (nth 39 alist) '(k39 . 39))))
+    (should (equal (gethash "k3" (json-parse-string input)) "last"))))
+
+(ert-deftest json-parse-string/non-ascii-keys ()
+  (skip-unless (fboundp 'json-parse-string))
+  (let ((input "{\"αβ\":1,\"\\u00e9\":2}"))
+    (should (equal (json-parse-string input :object-type 'alist)
+                   '((αβ . 1) (é . 2))))
+    (should (equal (json-parse-string input :object-type 'plist)
+                   '(:αβ 1 :é 2)))
+    (should (eq (car (json-parse-string input :object-type 'plist))
+                (intern ":αβ")))))
+
+(ert-deftest json-parse-string/key-cache ()
+  "Check that cached object keys follow the obarray."
+  (skip-unless (fboundp 'json-parse-string))
+  (let* ((input "{\"json-tests--key\":1}")
+         (key (caar (json-parse-string input :object-type 'alist))))
+    (should (eq key (intern-soft "json-tests--key")))
+    (should (eq (caar (json-parse-string input :object-type 'alist)) key))
+    (should (unintern key obarray))
+    (let ((new-key (caar (json-parse-string input :object-type 'alist))))
+      (should-not (eq new-key key))
+      (should (eq new-key (intern-soft "json-tests--key")))
+      (unintern new-key obarray))
+    (let* ((obarray (obarray-make))
+           (other-key (caar (json-parse-string input :object-type 'alist))))
+      (should (eq other-key (intern-soft "json-tests--key" obarray))))
+    (should-not (intern-soft "json-tests--key"))
+    (should (eq (car (json-parse-string input :object-type 'plist))
+                (intern ":json-tests--key")))
+    (unintern ":json-tests--key" obarray)))
+
+(ert-deftest json-parse-string/number ()
+  (skip-unless (fboundp 'json-parse-string))
+  (should (equal (json-parse-string "[0, -0, 12, -7, 1.5, -2e3, 1E-2]")
+                 [0 0 12 -7 1.5 -2000.0 0.01]))
+  (should (equal (json-parse-string "[999999999999999999, -123456789012345678901]")
+                 [999999999999999999 -123456789012345678901]))
+  (dolist (input '("[01]" "[1.]" "[.5]" "[-]" "[1e]" "[+1]" "[1e999]"))
+    (should-error (json-parse-string input) :type 'json-parse-error)))
+
 (ert-deftest json-parse-string/array ()
   (skip-unless (fboundp 'json-parse-string))
   (let ((input "[\"a\", 1, [\"b\", 2]]"))
@@ -166,6 +222,22 @@ json-parse-string/string
   ;; FIXME: Is this the right behavior?
   (should (equal (json-parse-string "[\"\u00C4\xC3\x84\"]") ["\u00C4\u00C4"])))
 
+(ert-deftest json-parse-string/long-strings ()
+  "Check strings long enough for the vectorized scanner, with special
+characters at every position."
+  (skip-unless (fboundp 'json-parse-string))
+  (dotimes (len 70)
+    (dotimes (pos len)
+      (dolist (special '("\"" "\\" "\n" "é" "\U0001F600" "/"))
+        (let ((string (concat (make-string pos ?a) special
+                              (make-string (- len pos 1) ?b))))
+          (should (equal (json-parse-string (json-serialize (vector string)))
+                         (vector string)))))
+      (should-error (json-parse-string
+                     (concat "[\"" (make-string pos ?a) "\x01"
+                             (make-string (- len pos 1) ?b) "\"]"))
+                    :type 'json-parse-error))))
+
 (ert-deftest json-serialize/string ()
   (skip-unless (fboundp 'json-serialize))
   (should (equal (json-serialize ["foo"]) "[\"foo\"]"))
@@ -246,6 +318,18 @@ json-parse-buffer/trailing
     (should-not (bobp))
     (should (looking-at-p (rx " [456]" eos)))))
 
+(ert-deftest json-parse-buffer/gap ()
+  (skip-unless (fboundp 'json-parse-buffer))
+  (with-temp-buffer
+    (insert "x {\"a\": [1, \"é\"]} y")
+    ;; Put the gap in the middle of the value.
+    (goto-char 8)
+    (insert "  ")
+    (goto-char 3)
+    (should (equal (json-parse-buffer :object-type 'alist)
+                   '((a . [1 "é"]))))
+    (should (looking-at-p (rx " y" eos)))))
+
 (ert-deftest json-parse-with-custom-null-and-false-objects ()
   (skip-unless (and (fboundp 'json-serialize)
                     (fboundp 'json-parse-string)))
@@ -336,5 +420,709 @@ json-serialize/wrong-hash-key-type
     (puthash 1 2 table)
     (should-error (json-serialize table) :type 'wrong-type-argument)))
 
+;;; JSON-RPC
+
+(defvar json-tests--rpc-connection-args nil
+  "Extra arguments passed to `json-rpc-connection'.")
+
+(defun json-tests--rpc-messages (script &rest args)
+  "Run SCRIPT as a JSON-RPC server and return what it sent.
+SCRIPT is passed to sh(1) and should print LSP-framed messages.
+ARGS are passed to `json-rpc'.  Parse errors are returned as
+\(error ERROR)."
+  (let ((connection (apply #'json-rpc-connection "sh" "-c" script
+                           json-tests--rpc-connection-args))
+        (messages nil))
+    (apply #'json-rpc connection
+           (lambda (message error _done)
+             (cond (message (push message messages))
+                   (error (push (list 'error error) messages))))
+           args)
+    (nreverse messages)))
+
+(ert-deftest json-rpc/framing ()
+  (skip-unless (fboundp 'json-rpc-connection))
+  ;; Several messages in one write, with extra headers and
+  ;; case-insensitive header names.
+  (should (equal (json-tests--rpc-messages
+                  (concat "printf 'Content-Length: 7\r\n"
+                          "Content-Type: application/vscode-jsonrpc;"
+                          " charset=utf-8\r\n\r\n{\"a\":1}"
+                          "content-length:7\r\n\r\n[1,2,3]'")
+                  :object-type 'plist)
+                 '((:a 1) [1 2 3])))
+  ;; Headers and bodies split across writes.
+  (should (equal (json-tests--rpc-messages
+                  (concat "printf 'Content-Len'; sleep 0.1;"
+                          "printf 'gth: 9\r\n\r'; sleep 0.1;"
+                          "printf '\n{\"b\":'; sleep 0.1;"
+                          "printf '\"x\"}'")
+                  :object-type 'alist)
+                 '(((b . "x")))))
+  ;; A body larger than the receive buffer.
+  (let ((big (make-string 100000 ?a)))
+    (should (equal (json-tests--rpc-messages
+                    (format "printf 'Content-Length: %d\r\n\r\n\"%s\"'"
+                            (+ 2 (length big)) big))
+                   (list big))))
+  ;; Header blocks without a Content-Length are skipped.
+  (should (equal (json-tests--rpc-messages
+                  (concat "printf 'X-Junk: 1\r\n\r\n"
+                          "Content-Length: 4\r\n\r\nnull'"))
+                 '(:null))))
+
+(ert-deftest json-rpc/reader-thread ()
+  (skip-unless (fboundp 'json-rpc-connection))
+  (let ((json-tests--rpc-connection-args '(:reader-thread t)))
+    (should (equal (json-tests--rpc-messages
+                    (concat "printf 'Content-Length: 7\r\n\r\n{\"a\":1}"
+                            "Content-Length: 3\r\n\r\n[1,'")
+                    :object-type 'plist)
+                   '((:a 1) (error (json-end-of-file
+                                    "unexpected end of input"
+                                    "<buffer>" 1 3 3)))))
+    ;; More messages than fit in the queue at once.
+    (should (equal (json-tests--rpc-messages
+                    (concat "i=0; while [ $i -lt 3000 ]; do"
+                            " printf 'Content-Length: %d\r\n\r\n%d' ${#i} $i;"
+                            " i=$((i+1)); done"))
+                   (number-sequence 0 2999))))
+  (should-error (json-rpc-connection "true" :no-such-option t)))
+
+(ert-deftest json-rpc/shared-reader ()
+  (skip-unless (fboundp 'json-rpc-connection))
+  (let ((json-tests--rpc-connection-args '(:reader-thread shared)))
+    (should (equal (json-tests--rpc-messages
+                    (concat "printf 'Content-Length: 7\r\n\r\n{\"a\":1}"
+                            "Content-Len'; sleep 0.1;"
+                            "printf 'gth: 3\r\n\r\n[1,'")
+                    :object-type 'plist)
+                   '((:a 1) (error (json-end-of-file
+                                    "unexpected end of input"
+                                    "<buffer>" 1 3 3))))))
+  ;; Several servers sending more messages than fit in their queues
+  ;; before any of them is drained.
+  (let* ((script (concat "printf 'oops' >&2; i=0; while [ $i -lt 3000 ]; do"
+                         " printf 'Content-Length: %d\r\n\r\n%d' ${#i} $i;"
+                         " i=$((i+1)); done"))
+         (connections (mapcar (lambda (_)
+                                (json-rpc-connection "sh" "-c" script
+                                                     :reader-thread 'shared))
+                              '(1 2 3))))
+    (sleep-for 0.5)
+    (dolist (connection connections)
+      (let ((messages nil))
+        (json-rpc connection
+                  (lambda (message _error _done)
+                    (when message (push message messages))))
+        (should (equal (nreverse messages) (number-sequence 0 2999)))
+        (should (equal (json-rpc-stderr connection) "oops")))))
+  (let ((connection (json-rpc-connection "sleep" "5" :reader-thread 'shared))
+        (start (float-time)))
+    (should (json-rpc-alive-p connection))
+    (json-rpc-shutdown connection)
+    (json-rpc connection #'ignore)
+    (should (< (- (float-time) start) 4))))
+
+(ert-deftest json-rpc/set-callback ()
+  (skip-unless (fboundp 'json-rpc-connection))
+  (dolist (reader-thread '(t shared))
+    (let* ((received nil)
+           (done 0)
+           (script (concat "for i in 1 2 3; do"
+                           " printf 'Content-Length: 1\r\n\r\n%d' $i;"
+                           " sleep 0.1; done"))
+           (connections
+            (list (json-rpc-connection "sh" "-c" script
+                                       :reader-thread reader-thread)
+                  (json-rpc-connection "sh" "-c" script
+                                       :reader-thread reader-thread)))
+           ;; Serve only one message per wakeup.
+           (json-rpc-dispatch-budget 0))
+      (dolist (connection connections)
+        (json-rpc-set-callback connection
+                               (lambda (message _error finished)
+                                 (if finished
+                                     (setq done (1+ done))
+                                   (push message received)))))
+      (should-error (json-rpc (car connections) #'ignore))
+      (should (accept-process-output nil 5))
+      (with-timeout (10 (ert-fail "Connections not finished"))
+        (while (< done 2)
+          (accept-process-output nil 0.1)))
+      (should (equal (sort received #'<) '(1 1 2 2 3 3)))
+      (dolist (connection connections)
+        (should-not (json-rpc-alive-p connection)))))
+  (let ((connection (json-rpc-connection "true")))
+    (should-error (json-rpc-set-callback connection #'ignore))
+    (json-rpc connection #'ignore)))
+
+(ert-deftest json-rpc/set-callback-nested-wait ()
+  (skip-unless (fboundp 'json-rpc-connection))
+  ;; Callbacks that wait for process output themselves, while the
+  ;; server sends the rest and hangs up.
+  (dolist (reader-thread '(t shared))
+    (let* ((received nil)
+           (done 0)
+           (script (concat "for i in 1 2 3 4 5; do"
+                           " printf 'Content-Length: 1\r\n\r\n%d' $i;"
+                           " done"))
+           (connection (json-rpc-connection "sh" "-c" script
+                                             :reader-thread reader-thread)))
+      (json-rpc-set-callback connection
+                             (lambda (message _error finished)
+                               (if finished
+                                   (setq done (1+ done))
+                                 (push message received)
+                                 (accept-process-output nil 0.05))))
+      (with-timeout (10 (ert-fail "Connection not finished"))
+        (while (= done 0)
+          (accept-process-output nil 0.1)))
+      (accept-process-output nil 0.2)
+      (should (equal (nreverse received) '(1 2 3 4 5)))
+      (should (= done 1))
+      (should-not (json-rpc-alive-p connection)))))
+
+(ert-deftest json-rpc/set-callback-accept-process-output ()
+  (skip-unless (fboundp 'json-rpc-connection))
+  (let* ((received nil)
+         (done nil)
+         (quiet (json-rpc-connection "sleep" "10" :reader-thread t))
+         (connection (json-rpc-connection
+                      "sh" "-c" (concat "sleep 0.2;"
+                                        " printf 'Content-Length: 1\r\n\r\n1';"
+                                        " sleep 1")
+                      :reader-thread t)))
+    (should-error (accept-process-output connection 0.1))
+    (json-rpc-set-callback quiet #'ignore)
+    (json-rpc-set-callback connection
+                           (lambda (message _error finished)
+                             (if finished
+                                 (setq done t)
+                               (push message received)
+                               (should-error
+                                (accept-process-output connection 0.1)))))
+    ;; Waiting for one connection is not ended by another.
+    (should-not (accept-process-output quiet 0.5))
+    (should (equal received '(1)))
+    (should-not done)
+    (should (accept-process-output connection 5))
+    (should done)
+    (json-rpc-set-callback quiet nil)
+    (json-rpc-shutdown quiet)
+    (json-rpc quiet #'ignore)))
+
+(ert-deftest json-rpc/socket ()
+  (skip-unless (fboundp 'json-rpc-connection))
+  (let* ((dir (make-temp-file "json-rpc" t))
+         (socket (expand-file-name "socket" dir))
+         ;; Servers that echo back what they get, then hang up.
+         (echo (lambda (process string)
+                 (process-send-string process string)
+                 (delete-process process)))
+         (servers (list (make-network-process
+                         :name "json-rpc-local" :server t :family 'local
+                         :service socket :filter echo)
+                        (make-network-process
+                         :name "json-rpc-tcp" :server t :family 'ipv4
+                         :host 'local :service t :filter echo))))
+    (unwind-protect
+        (dolist (spec (list (list :socket socket)
+                            (list :host "127.0.0.1"
+                                  :port (process-contact (cadr servers)
+                                                         :service))))
+          (dolist (reader-thread '(t shared))
+            (let ((connection (apply #'json-rpc-connection
+                                     :reader-thread reader-thread spec))
+                  (received nil)
+                  (done nil))
+              (json-rpc-set-callback connection
+                                     (lambda (message _error finished)
+                                       (if finished
+                                           (setq done t)
+                                         (push message received)))
+                                     :object-type 'plist)
+              (json-rpc-send connection '(:id 1 :params [1 2]))
+              (with-timeout (10 (ert-fail "Connection not finished"))
+                (while (not done)
+                  (accept-process-output nil 0.1)))
+              (should (equal received '((:id 1 :params [1 2]))))
+              (should (equal (json-rpc-stderr connection) "")))))
+      (mapc #'delete-process servers)
+      (delete-directory dir t)))
+  (should-error (json-rpc-connection :socket "/nonexistent/socket")
+                :type 'file-error)
+  (should-error (json-rpc-connection "true" :socket "socket"))
+  (should-error (json-rpc-connection :host "localhost")))
+
+(ert-deftest json-rpc/spawn-options ()
+  (skip-unless (fboundp 'json-rpc-connection))
+  (let* ((dir (file-name-as-directory (make-temp-file "json-rpc" t)))
+         (script (concat "g=$(cut -d' ' -f5 /proc/$$/stat 2>/dev/null);"
+                         " v=\"[\\\"$JSON_TESTS_A\\\",\\\"${HOME-unset}\\\","
+                         "\\\"$(pwd)\\\",\\\"$g\\\"]\";"
+                         " printf 'Content-Length: %d\r\n\r\n%s' ${#v} \"$v\""))
+         (connection (json-rpc-connection "sh" "-c" script
+                                          :environment '("JSON_TESTS_A=x=y"
+                                                         "HOME")
+                                          :directory dir
+                                          :process-group t))
+         (pid (json-rpc-pid connection))
+         (received nil))
+    (unwind-protect
+        (json-rpc connection
+                  (lambda (message _error _done)
+                    (when message (push message received))))
+      (delete-directory dir))
+    (pcase-let ((`([,a ,home ,cwd ,group]) received))
+      (should (equal a "x=y"))
+      (should (equal home "unset"))
+      (should (equal (file-truename (file-name-as-directory cwd))
+                     (file-truename dir)))
+      (unless (equal group "")
+        (should (equal group (number-to-string pid))))))
+  (should-error (json-rpc-connection "/nonexistent/program")
+                :type 'file-error)
+  (should-error (json-rpc-connection "true" :environment '(1))
+                :type 'wrong-type-argument))
+
+(ert-deftest json-rpc/batch ()
+  (skip-unless (fboundp 'json-rpc-connection))
+  (let ((json-tests--rpc-connection-args '(:reader-thread t))
+        (script (concat "for i in 1 2 3 4 5; do"
+                        " printf 'Content-Length: 1\r\n\r\n%d' $i; done;"
+                        " printf 'Content-Length: 1\r\n\r\n['")))
+    (should (equal (json-tests--rpc-messages script
+                                             :batch-size 2
+                                             :batch-latency 10)
+                   '([1 2] [3 4] [5]
+                     (error (json-end-of-file
+                             "unexpected end of input"
+                             "<buffer>" 1 1 1)))))
+    (should (equal (json-tests--rpc-messages script
+                                             :batch-size 100
+                                             :batch-latency 10)
+                   '([1 2 3 4 5]
+                     (error (json-end-of-file
+                             "unexpected end of input"
+                             "<buffer>" 1 1 1))))))
+  (let ((connection (json-rpc-connection "true")))
+    (should-error (json-rpc connection #'ignore :batch-size 10))
+    (json-rpc connection #'ignore)))
+
+(ert-deftest json-rpc/lazy ()
+  (skip-unless (fboundp 'json-rpc-connection))
+  (let* ((body (concat "{\"id\":1,\"result\":{\"items\":[1,{\"x\":null},"
+                       "\"é\"],\"a\\u00e9\":true,\"aé\":false}}"))
+         (script (concat (format "printf 'Content-Length: %d\r\n\r\n%%s' '%s';"
+                                 (string-bytes body) body)
+                         "printf 'Content-Length: 3\r\n\r\n[1,'"))
+         (json-tests--rpc-connection-args '(:lazy t)))
+    (dolist (reader-thread '(nil t))
+      (let* ((json-tests--rpc-connection-args
+              (append json-tests--rpc-connection-args
+                      (list :reader-thread reader-thread)))
+             (received (json-tests--rpc-messages script))
+             (message (car received)))
+        (should (json-rpc-message-p message))
+        (should (equal (json-rpc-get message "id") 1))
+        (should (equal (json-rpc-get message "result" "items" 2) "é"))
+        (should (equal (json-rpc-get message "result" "items" 1
+                                     :object-type 'plist)
+                       '(:x :null)))
+        (should (equal (json-rpc-get message "result" "items"
+                                     :object-type 'alist :array-type 'list)
+                       '(1 ((x . :null)) "é")))
+        ;; The last of duplicate keys wins, whether escaped or not.
+        (should (equal (json-rpc-get message "result" "aé") :false))
+        (should-not (json-rpc-get message "result" "items" 3))
+        (should-not (json-rpc-get message "id" "x"))
+        (should (equal (json-rpc-get message :object-type 'alist)
+                       '((id . 1)
+                         (result . ((items . [1 ((x . :null)) "é"])
+                                    (aé . :false))))))
+        (should-error (json-rpc-get message "id" -1)
+                      :type 'wrong-type-argument)
+        (should (equal (cadr received)
+                       '(error (json-end-of-file "unexpected end of input"
+                                                 "<buffer>" 1 3 3)))))))
+  (should-not (json-rpc-message-p [1]))
+  (should-error (json-rpc-get [1]) :type 'wrong-type-argument))
+
+(ert-deftest json-rpc/stderr ()
+  (skip-unless (fboundp 'json-rpc-connection))
+  (let ((script (concat "printf 'abcdefghijklm' >&2; printf 'nopqrstuvwxyz' >&2;"
+                        " sleep 0.2; printf 'Content-Length: 1\r\n\r\n1'")))
+    (dolist (reader-thread '(nil t))
+      (let ((connection (json-rpc-connection "sh" "-c" script
+                                              :reader-thread reader-thread
+                                              :stderr-size 10))
+            (chunks nil)
+            (messages nil))
+        (json-rpc connection
+                  (lambda (message _error _done)
+                    (when message (push message messages)))
+                  :stderr-function (lambda (chunk) (push chunk chunks)))
+        (should (equal messages '(1)))
+        ;; Output that did not fit in the buffer before it was passed
+        ;; on is lost.
+        (should (string-suffix-p "qrstuvwxyz"
+                                 (apply #'concat (nreverse chunks))))
+        (should (equal (json-rpc-stderr connection) "qrstuvwxyz")))))
+  (let ((connection (json-rpc-connection "sh" "-c" "echo 'ünï' >&2")))
+    (json-rpc connection #'ignore)
+    (should (equal (json-rpc-stderr connection) "ünï\n")))
+  (should-error (json-rpc-connection "true" :stderr-size -1)
+                :type 'wrong-type-argument))
+
+(ert-deftest json-rpc/send-serialization ()
+  (skip-unless (fboundp 'json-rpc-connection))
+  (let* ((table (make-hash-table :test #'equal))
+         (sent (list `(:a 1 :b "x" :a 2 :c [,table []] :d nil)
+                     '((a . "quote\" backslash\\ slash/ \n\t\b\f\r\1\37")
+                       (b . "αβγ 😀") (a . 3) (c . :false) (d . t))
+                     (vector 1.0 -0.0 1e20 1.5e-7 0.1 -12345678901234
+                             most-negative-fixnum :null "")
+                     table
+                     "a string"))
+         (received nil)
+         connection)
+    (puthash "k" "v" table)
+    (puthash "nested" '(:x [1 2 (:y nil)]) table)
+    ;; The server echoes back exactly what we send, which is what
+    ;; `json-serialize' returns.
+    (setq connection (json-rpc-connection
+                      "head" "-c"
+                      (number-to-string (json-tests--rpc-framed-size sent))
+                      :reader-thread t))
+    (dolist (message sent)
+      (json-rpc-send connection message))
+    (json-rpc connection
+              (lambda (message _error _done)
+                (when message (push message received)))
+              :object-type 'alist)
+    (should (equal (nreverse received)
+                   (mapcar (lambda (message)
+                             (json-parse-string (json-serialize message)
+                                                :object-type 'alist))
+                           sent)))
+    (let ((eq-table (make-hash-table :test #'eq)))
+      (puthash (string ?a) 1 eq-table)
+      (puthash (string ?a) 2 eq-table)
+      (should-error (json-rpc-send connection eq-table)
+                    :type 'wrong-type-argument))
+    (should-error (json-rpc-send connection '(:a foo))
+                  :type 'wrong-type-argument)
+    (should-error (json-rpc-send connection `((,(intern "a\0b") . 1))))))
+
+(ert-deftest json-rpc/send-serialization-reused-buffer ()
+  (skip-unless (fboundp 'json-rpc-connection))
+  ;; Large messages are serialized into the buffer the previous one
+  ;; left, which small messages eventually shrink again.
+  (let* ((big (list :method "textDocument/didOpen"
+                    :params (list :text (make-string (* 2 1024 1024) ?x))))
+         (small (lambda (i) (list :method "ping" :params (vector i))))
+         (sent (append (list big (list :a 1))
+                       (mapcar small (number-sequence 1 70))
+                       (list big (funcall small 0))))
+         (connection (json-rpc-connection
+                      "head" "-c"
+                      (number-to-string (json-tests--rpc-framed-size sent))
+                      :reader-thread t))
+         (received nil))
+    (dolist (message sent)
+      (json-rpc-send connection message))
+    (json-rpc connection
+              (lambda (message _error _done)
+                (when message (push message received)))
+              :object-type 'plist)
+    (should (equal (nreverse received) sent))))
+
+(defun json-tests--rpc-framed-size (messages)
+  "Return the number of bytes `json-rpc-send' writes for MESSAGES."
+  (apply #'+
+         (mapcar
+          (lambda (message)
+            (let ((bytes (string-bytes (json-serialize message))))
+              (+ bytes (length (format "Content-Length: %d\r\n\r\n" bytes)))))
+          messages)))
+
+(ert-deftest json-rpc/send ()
+  (skip-unless (fboundp 'json-rpc-connection))
+  (let* ((sent (list '(:jsonrpc "2.0" :method "ping")
+                     (vector (make-string 300000 ?x) "αβγ" 1.5 :null)
+                     '(:params (:text "tiny"))))
+         (size (json-tests--rpc-framed-size sent))
+         ;; The server echoes back exactly what we send.
+         (connection (json-rpc-connection "head" "-c" (number-to-string size)
+                                          :reader-thread t))
+         (received nil))
+    (dolist (message sent)
+      (json-rpc-send connection message))
+    (json-rpc connection
+              (lambda (message _error _done)
+                (when message (push message received)))
+              :object-type 'plist)
+    (should (equal (nreverse received) sent))))
+
+(ert-deftest json-rpc/send-failure ()
+  (skip-unless (fboundp 'json-rpc-connection))
+  (let ((connection (json-rpc-connection "true")))
+    (unwind-protect
+        (progn
+          ;; Sending fails once the server has exited.
+          (should-error (with-timeout (10)
+                          (while t
+                            (json-rpc-send connection '(:method "ping"))
+                            (sleep-for 0.01)))))
+      (json-rpc-shutdown connection)
+      (json-rpc connection #'ignore))))
+
+(ert-deftest json-rpc/stats ()
+  (skip-unless (fboundp 'json-rpc-connection))
+  (let ((connection (json-rpc-connection
+                     "sh" "-c" (json-tests--rpc-echo-server 3)
+                     :reader-thread t :writer-thread t :stats t))
+        (received 0))
+    (dotimes (i 3)
+      (json-rpc-send connection `(:method "echo" :params [,i])))
+    (json-rpc connection
+              (lambda (_message _error done)
+                (unless done (setq received (1+ received)))))
+    (should (= received 3))
+    (let ((stats (json-rpc-stats connection t)))
+      (should (= (plist-get stats :messages-in) 3))
+      (should (= (plist-get stats :messages-out) 3))
+      (should (= (plist-get stats :bytes-in) (plist-get stats :bytes-out)))
+      (should (> (plist-get stats :outbox-messages-high-water) 0))
+      (dolist (timing '(:frame :parse :queue-wait :convert :callback
+                        :serialize :write))
+        (let ((timing (plist-get stats timing)))
+          (should (= (plist-get timing :count) 3))
+          (should (>= (plist-get timing :max) 0.0))
+          (should (= (apply #'+ (append (plist-get timing :histogram) nil))
+                     3)))))
+    (should (= (plist-get (json-rpc-stats connection) :messages-in) 0)))
+  (let ((connection (json-rpc-connection "true")))
+    (unwind-protect
+        (should-not (json-rpc-stats connection))
+      (json-rpc-shutdown connection)
+      (json-rpc connection #'ignore))))
+
+(defun json-tests--rpc-echo-server (count &optional respond)
+  "Return a script echoing back the first COUNT framed messages it reads.
+If RESPOND is non-nil, their \"method\" members are renamed to
+\"result\", which turns requests into responses."
+  (format (concat "i=0; while [ $i -lt %d ]; do read -r header;"
+                  " n=${header#*: }; n=${n%%?}; read -r _;"
+                  " body=$(head -c $n"
+                  (if respond " | sed 's/\"method\":/\"result\":/'" "")
+                  ");"
+                  " printf 'Content-Length: %%d\r\n\r\n%%s' ${#body} \"$body\";"
+                  " i=$((i+1)); done")
+          count))
+
+(ert-deftest json-rpc/request ()
+  (skip-unless (fboundp 'json-rpc-connection))
+  (dolist (args '(() (:reader-thread t) (:reader-thread t :lazy t)))
+    (let* ((connection (apply #'json-rpc-connection
+                              "sh" "-c" (json-tests--rpc-echo-server 5)
+                              args))
+           (responses nil)
+           (others nil)
+           (id1 (json-rpc-request connection '(:result 1)
+                                  (lambda (response error)
+                                    (push (list 1 response error)
+                                          responses))))
+           (id2 (json-rpc-request connection '(:result 2)
+                                  (lambda (response _error)
+                                    (push (list 2 response) responses)))))
+      (should (natnump id1))
+      (should (= id2 (1+ id1)))
+      (should (json-rpc-cancel connection id2))
+      (should-not (json-rpc-cancel connection id2))
+      ;; A request from the server is not a response, even with an id.
+      (json-rpc-send connection `(:id ,id1 :method "ping"))
+      (json-rpc-send connection '(:method "last"))
+      (json-rpc connection
+                (lambda (message _error done)
+                  (unless done
+                    (when (json-rpc-message-p message)
+                      (setq message (json-rpc-get message "method")))
+                    (push message others)))
+                :object-type 'plist)
+      (when (json-rpc-message-p (nth 1 (car responses)))
+        (setf (nth 1 (car responses))
+              (json-rpc-get (nth 1 (car responses)) "result")))
+      (should (member responses `(((1 (:result 1 :id ,id1) nil))
+                                  ((1 1 nil)))))
+      (should (equal (mapcar (lambda (message)
+                               (if (stringp message) message
+                                 (plist-get message :method)))
+                             others)
+                     '("last" "ping" "$/cancelRequest")))))
+  (let ((connection (json-rpc-connection "true")))
+    (should-error (json-rpc-request connection [1 2] #'ignore))
+    (json-rpc connection #'ignore)))
+
+(ert-deftest json-rpc/supersede ()
+  (skip-unless (fboundp 'json-rpc-connection))
+  (let ((hover (lambda (uri)
+                 `(:method "textDocument/hover"
+                   :params (:textDocument (:uri ,uri)))))
+        (big (make-string 2000000 ?x)))
+    ;; A request still in the outbox is taken back.  The big message
+    ;; keeps the writer thread busy until the server starts reading.
+    (let* ((connection (json-rpc-connection
+                        "sh" "-c" (concat "sleep 1;"
+                                          (json-tests--rpc-echo-server 4 t))
+                        :reader-thread t :writer-thread t
+                        :supersede '("textDocument/hover")))
+           (answered nil)
+           (others nil))
+      (json-rpc-send connection big)
+      (dolist (uri '("file:///a" "file:///a" "file:///b"))
+        (json-rpc-request connection (funcall hover uri)
+                          (lambda (response _error)
+                            (push (plist-get response :id) answered))))
+      (json-rpc-send connection '(:method "last"))
+      (json-rpc connection
+                (lambda (message _error done)
+                  (unless done
+                    (push (if (stringp message) message
+                            (plist-get message :result))
+                          others)))
+                :object-type 'plist)
+      (should (= (length answered) 2))
+      (should (= (apply #'- answered) 1))
+      (should (equal others (list "last" big))))
+    ;; A request already sent is cancelled.
+    (let* ((connection (json-rpc-connection
+                        "sh" "-c" (json-tests--rpc-echo-server 4 t)
+                        :supersede '("textDocument/hover")))
+           (answered nil)
+           (others nil)
+           (first (json-rpc-request connection (funcall hover "file:///a")
+                                    (lambda (_response _error)
+                                      (push 'first answered))))
+           (second (json-rpc-request connection (funcall hover "file:///a")
+                                     (lambda (_response _error)
+                                       (push 'second answered)))))
+      (json-rpc-send connection '(:method "last"))
+      (json-rpc connection
+                (lambda (message _error done)
+                  (unless done (push message others)))
+                :object-type 'plist)
+      (should (equal answered '(second)))
+      (should (equal others
+                     `((:result "last")
+                       (:jsonrpc "2.0" :result "$/cancelRequest"
+                        :params (:id ,first)))))
+      (should-not (json-rpc-cancel connection second)))))
+
+(ert-deftest json-rpc/coalesce-changes ()
+  (skip-unless (fboundp 'json-rpc-connection))
+  (let ((change (lambda (uri version &optional full)
+                  `(:method "textDocument/didChange"
+                    :params (:textDocument (:uri ,uri :version ,version)
+                             :contentChanges
+                             [,(if full `(:text ,(format "v%d" version))
+                                 `(:range (:start (:line 0 :character 0)
+                                           :end (:line 0 :character 0))
+                                   :text ,(format "v%d" version)))]))))
+        (big (make-string 2000000 ?x)))
+    ;; Changes queued while the server is not reading are merged as
+    ;; long as they follow one another.
+    (let* ((connection (json-rpc-connection
+                        "sh" "-c" (concat "sleep 1;"
+                                          (json-tests--rpc-echo-server 5))
+                        :reader-thread t :writer-thread t
+                        :coalesce-changes t))
+           (received nil))
+      (json-rpc-send connection big)
+      (dolist (args '(("a" 2) ("a" 3) ("a" 4) ("b" 1) ("a" 5) ("a" 6 t)))
+        (json-rpc-send connection (apply change args)))
+      (json-rpc-send connection '(:method "last"))
+      (should (equal (car (json-rpc-send-queue-depth connection)) 5))
+      (json-rpc connection
+                (lambda (message _error done)
+                  (unless done (push message received)))
+                :object-type 'plist :array-type 'list)
+      (should (equal (mapcar (lambda (message)
+                               (if (stringp message) message
+                                 (let ((params (plist-get message :params)))
+                                   (list (plist-get message :method)
+                                         (plist-get (plist-get params
+                                                               :textDocument)
+                                                    :version)
+                                         (mapcar (lambda (change)
+                                                   (plist-get change :text))
+                                                 (plist-get
+                                                  params :contentChanges))))))
+                             (nreverse received))
+                     `(,big
+                       ("textDocument/didChange" 4 ("v2" "v3" "v4"))
+                       ("textDocument/didChange" 1 ("v1"))
+                       ("textDocument/didChange" 6 ("v6"))
+                       ("last" nil nil)))))
+    ;; An idle writer thread holds a change back for the next ones.
+    (let* ((connection (json-rpc-connection
+                        "sh" "-c" (json-tests--rpc-echo-server 2)
+                        :reader-thread t :writer-thread t
+                        :coalesce-changes 0.5))
+           (received nil))
+      (json-rpc-send connection (funcall change "a" 1))
+      (json-rpc-send connection (funcall change "a" 2))
+      (json-rpc-send connection '(:method "last"))
+      (json-rpc connection
+                (lambda (message _error done)
+                  (unless done (push message received)))
+                :object-type 'plist)
+      (should (equal (length (plist-get (plist-get (cadr received) :params)
+                                        :contentChanges))
+                     2))))
+  (should-error (json-rpc-connection "true" :coalesce-changes t)))
+
+(ert-deftest json-rpc/writer-thread ()
+  (skip-unless (fboundp 'json-rpc-connection))
+  (let* ((sent (list (make-string 2000000 ?x) '(:id 1)))
+         ;; The server does not read anything for a while, then echoes
+         ;; back exactly what we send.
+         (connection (json-rpc-connection
+                      "sh" "-c" (format "sleep 2; head -c %d"
+                                        (json-tests--rpc-framed-size sent))
+                      :reader-thread t
+                      :writer-thread t
+                      :send-high-water 1000))
+         (start (float-time))
+         (received nil))
+    (should-not (json-rpc-send connection (car sent)))
+    (should-not (json-rpc-send connection (cadr sent)))
+    (should (< (- (float-time) start) 1))
+    (should (equal (json-rpc-send-queue-depth connection)
+                   (cons 2 (json-tests--rpc-framed-size sent))))
+    (json-rpc connection
+              (lambda (message _error _done)
+                (when message (push message received)))
+              :object-type 'plist)
+    (should (equal (nreverse received) sent)))
+  (let ((connection (json-rpc-connection "true")))
+    (should-not (json-rpc-send-queue-depth connection))
+    (json-rpc connection #'ignore)))
+
+(ert-deftest json-rpc/writer-thread-shutdown ()
+  (skip-unless (fboundp 'json-rpc-connection))
+  ;; The server never reads, so the writer thread is stuck sending
+  ;; when the connection is shut down.
+  (let ((connection (json-rpc-connection "sleep" "10"
+                                         :reader-thread t
+                                         :writer-thread t))
+        (start (float-time)))
+    (dotimes (_ 4)
+      (json-rpc-send connection (make-string 2000000 ?x)))
+    (json-rpc-shutdown connection)
+    (json-rpc connection #'ignore)
+    (should (< (- (float-time) start) 5))))
+
 (provide 'json-tests)
 ;;; json-tests.el ends here